@@ -0,0 +1,23 @@
+/*
+*	Shared declarations for the smallprofiler benchmarks.
+*/
+
+#ifndef _PROFILER_BENCH_
+#define _PROFILER_BENCH_
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BENCH_BARRIER() _ReadWriteBarrier()
+#else
+#define BENCH_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+/* Cycles spent running `iterations` empty start/stop pairs with PROFILER_DISABLE defined */
+uint64_t bench_disabled_pairs(int iterations);
+
+/* The coroutine check, in its own file since it needs C++20 */
+int bench_check_coroutine(double tolerance);
+
+#endif //_PROFILER_BENCH_
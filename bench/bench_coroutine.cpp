@@ -0,0 +1,186 @@
+/*
+*	The coroutine check of smallprofiler_bench, built with C++20 only.
+*/
+
+#include "smallprofiler_coroutine.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <coroutine>
+#include <thread>
+
+/* Runs eagerly and is destroyed when the body returns */
+struct bench_task
+{
+	struct promise_type : profiler_coroutine_promise
+	{
+		bench_task get_return_object()
+		{
+			return bench_task();
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void()
+		{
+		}
+
+		void unhandled_exception()
+		{
+		}
+	};
+};
+
+/* Suspends the coroutine until another thread takes the handle and resumes it */
+struct bench_handoff
+{
+	std::atomic<void*> handle{ nullptr };
+
+	bool await_ready()
+	{
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> coroutine)
+	{
+		handle.store(coroutine.address(), std::memory_order_release);
+	}
+
+	void await_resume()
+	{
+	}
+
+	std::coroutine_handle<> take()
+	{
+		void* address;
+		while ((address = handle.exchange(nullptr, std::memory_order_acquire)) == nullptr)
+			std::this_thread::yield();
+
+		return std::coroutine_handle<>::from_address(address);
+	}
+};
+
+static void bench_coroutine_spin(double seconds)
+{
+	uint64_t cycles = (uint64_t)(seconds * (double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+	uint64_t start = get_cycles();
+
+	while (get_cycles() - start < cycles)
+		BENCH_BARRIER();
+}
+
+static bench_task bench_coroutine_request(bench_handoff& handoff)
+{
+	profiler_co_start(co_request);
+	bench_coroutine_spin(0.002);
+
+	co_await handoff;
+
+	/* Now on the thread that resumed it */
+	profiler_start(co_inner);
+	bench_coroutine_spin(0.001);
+	profiler_stop(co_inner);
+}
+
+static int bench_coroutine_find(const char* name)
+{
+	int i;
+	for (i = 0; i < PROFILER_NODES_MAX; i++)
+	{
+		if (profiler_nodes[i].is_setup && strcmp(profiler_nodes[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int bench_coroutine_parent(const char* name, const char* parent)
+{
+	int id = bench_coroutine_find(name);
+	int ok = id >= 0 && profiler_nodes[id].parent_id == bench_coroutine_find(parent);
+
+	printf("%-24s parent %-24s %s\n", name, parent, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static int bench_coroutine_seconds(const char* what, uint64_t cycles, double expected, double tolerance)
+{
+	double seconds = (double)cycles / ((double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+	int ok = seconds >= expected * (1.0 - tolerance) && seconds <= expected * (1.0 + tolerance);
+
+	printf("%-24s %10.6f expected %10.6f %s\n", what, seconds, expected, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int bench_check_coroutine(double tolerance)
+{
+	const int requests = 10;
+
+	profiler_reset();
+
+	int i;
+	for (i = 0; i < requests; i++)
+	{
+		bench_handoff handoff;
+
+		profiler_start(co_caller);
+		bench_coroutine_request(handoff);
+
+		/* The caller's scope is the parent again once the coroutine suspended */
+		profiler_start(co_caller_after);
+		profiler_stop(co_caller_after);
+		profiler_stop(co_caller);
+
+		std::thread resumer([&handoff]()
+		{
+			bench_coroutine_spin(0.004);
+
+			profiler_start(co_resumer);
+			handoff.take().resume();
+
+			profiler_start(co_resumer_after);
+			profiler_stop(co_resumer_after);
+			profiler_stop(co_resumer);
+		});
+		resumer.join();
+	}
+
+	/* Sums the tables into profiler_nodes */
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int ok = 1;
+	ok &= bench_coroutine_parent("co_request", "co_caller");
+	ok &= bench_coroutine_parent("co_inner", "co_request");
+	ok &= bench_coroutine_parent("co_caller_after", "co_caller");
+	ok &= bench_coroutine_parent("co_resumer_after", "co_resumer");
+
+	int id = bench_coroutine_find("co_request");
+	if (!ok || id < 0)
+		return 0;
+
+	int calls = profiler_nodes[id].calls == (uint64_t)requests;
+	printf("%-24s %10d calls %s\n", "co_request", (int)profiler_nodes[id].calls, calls ? "ok" : "FAILED");
+	ok &= calls;
+
+	/* Running 2 ms before the suspension and 1 ms after it, suspended at least while the resumer spins */
+	ok &= bench_coroutine_seconds("co_request active", profiler_nodes[id].total_cycles, requests * 0.003, tolerance);
+
+	double suspended = (double)profiler_nodes[id].suspended_cycles / ((double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+	int waited = suspended >= requests * 0.004 * (1.0 - tolerance);
+	printf("%-24s %10.6f at least %10.6f %s\n", "co_request suspended", suspended, requests * 0.004, waited ? "ok" : "FAILED");
+	ok &= waited;
+
+	return ok;
+}
@@ -0,0 +1,26 @@
+/*
+*	Disabled-mode half of smallprofiler_bench.
+*
+*	This translation unit is compiled with PROFILER_DISABLE so that the same
+*	loop as in smallprofiler_bench.cpp can be measured with the profiler macros
+*	expanded to nothing.
+*/
+
+#define PROFILER_DISABLE
+#include "smallprofiler.h"
+#include "bench.h"
+
+uint64_t bench_disabled_pairs(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(bench_disabled);
+		BENCH_BARRIER();
+		profiler_stop(bench_disabled);
+	}
+
+	return get_cycles() - cycles_start;
+}
@@ -0,0 +1,83 @@
+/*
+*	Strict C check of smallprofiler.
+*
+*	Compiled with -std=c99 and no compiler extensions, so the implementation
+*	and the snapshot and trace readers must not rely on declarations that only
+*	the GNU modes make visible. Profiles a nested scope and checks its calls in
+*	a snapshot, and with PROFILER_TRACE records the calls to a trace as well.
+*/
+
+#define PROFILER_DEFINE
+#define PROFILER_SNAPSHOT_DEFINE
+#define PROFILER_TRACE_DEFINE
+#include "smallprofiler.h"
+
+#include <stdio.h>
+
+int main(void)
+{
+	const int iterations = 1000;
+	int ok = 1;
+
+	profiler_initialize();
+
+#ifdef PROFILER_TRACE
+	const char* filename = "smallprofiler_strict_c.sptrace";
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 1;
+	}
+#endif
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(strict_outer);
+		profiler_start(strict_inner);
+		profiler_stop(strict_inner);
+		profiler_stop(strict_outer);
+	}
+
+#ifdef PROFILER_TRACE
+	profiler_trace_end();
+
+	struct profiler_trace trace;
+	int trace_ok = profiler_trace_open(&trace, filename);
+	printf("%-40s %s\n", "trace opens", trace_ok ? "ok" : "FAILED");
+	ok &= trace_ok;
+
+	if (trace_ok)
+		profiler_trace_close(&trace);
+
+	remove(filename);
+#endif
+
+	size_t size = 0;
+	void* data = profiler_get_snapshot(&size);
+
+	struct profiler_snapshot snapshot;
+	if (!data || !profiler_snapshot_open_memory(&snapshot, data, size))
+	{
+		printf("could not get a snapshot FAILED\n");
+		profiler_free_snapshot(data);
+		return 1;
+	}
+
+	uint32_t n;
+	for (n = 0; n < profiler_snapshot_node_count(&snapshot); n++)
+	{
+		struct profiler_snapshot_node node = profiler_snapshot_get_node(&snapshot, n);
+		int counted = node.calls == (uint64_t)iterations;
+
+		printf("%-40s %" PRIu64 " calls %s\n", profiler_snapshot_name(&snapshot, n), node.calls, counted ? "ok" : "FAILED");
+		ok &= counted;
+	}
+
+	ok &= profiler_snapshot_node_count(&snapshot) == 2;
+
+	profiler_snapshot_close(&snapshot);
+	profiler_free_snapshot(data);
+
+	return ok ? 0 : 1;
+}
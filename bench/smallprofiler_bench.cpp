@@ -0,0 +1,2816 @@
+/*
+*	smallprofiler_bench
+*
+*	Measures the cost of an empty profiler_start/profiler_stop pair in CPU cycles
+*	across clock backends, nesting depths, thread counts, cold and warm node
+*	tables and disabled mode.
+*
+*	Every measurement is written as one JSON object per line (JSON Lines) so the
+*	output can be stored and compared from release to release:
+*
+*		smallprofiler_bench [--iterations N] [--threads N] [--output file]
+*
+*	cycles_per_pair is the median over BENCH_REPEATS runs with the cost of the
+*	empty benchmark loop subtracted.
+*
+*	With --check the benchmark instead runs one of the regression checks that
+*	are registered with ctest and exits with a non-zero status on failure:
+*
+*		--check accuracy	nested busy-loops of known duration must be reported
+*							at least that long and at most as long as measured
+*							around them, within --tolerance (relative, default
+*							0.05), so preemption can not fail it
+*		--check threads		--threads threads running nested scopes must count
+*							every call and add up to between what they spun for
+*							and what each thread measured around its scopes
+*		--check overhead	the median warm start/stop pair must cost at most
+*							--max-cycles cycles (default 250)
+*		--check scaling		the cycles per pair of up to --threads threads, at
+*							most one per hardware thread, must stay within
+*							--tolerance of one thread
+*		--check snapshot	a snapshot written with profiler_dump_snapshot must
+*							read back with the same tree, cycles and calls, and
+*							corrupted snapshots must not open
+*		--check budget		threads, scopes and trace events beyond a memory
+*							budget must be dropped and every one counted, for
+*							every trace policy when built with PROFILER_TRACE
+*		--check trace		a trace recorded by --threads threads must read back
+*							with every block, every begin paired with its end and
+*							as many pairs as calls (needs PROFILER_TRACE)
+*		--check ring		a ring trace too small for the events of --threads
+*							threads must read back before and after it ends,
+*							with the newest blocks (needs PROFILER_TRACE)
+*		--check pool		rounds of --threads short-lived threads must reuse
+*							the blocks of earlier rounds and leave every event
+*							in the trace when they exit (needs PROFILER_TRACE)
+*		--check cpus		rounds of --threads short-lived threads must count
+*							every call in at most one table per CPU (needs
+*							PROFILER_PER_CPU)
+*		--check migrations	calls moved to another CPU must be counted as
+*							migrations and calls pinned to one must not, on
+*							Linux with two CPUs (needs PROFILER_RDTSCP)
+*		--check async		async scopes ended on another thread than they
+*							began on must count their latency under the scope
+*							they began in, and pair up by flow in the trace
+*							when built with PROFILER_TRACE
+*		--check tasks		tasks run by the worker that enqueued them and
+*							tasks stolen by another must count their queue
+*							wait, execution and steals apart, with the wait
+*							p99 when built with PROFILER_HISTOGRAMS
+*		--check locks		a lock held by one thread while another waits for
+*							it must count the contended wait, the holds and
+*							the scope that held it, for std::mutex and, with
+*							C++17, std::shared_mutex
+*		--check blocked		a scope waiting for a condition variable must count
+*							the wait as blocked, for itself and the scopes
+*							above it, and rank below a busy scope in the results,
+*							where fully blocked scopes and ties are listed too
+*		--check io			file and socket calls must count their bytes and
+*							syncs for the scope they are made in and their
+*							time as blocked above it, and failed calls must
+*							keep their errno (not on Windows)
+*		--check coroutine	a coroutine scope resumed on another thread must
+*							count only its running time, its suspended time
+*							apart and be the parent on both threads (needs C++20)
+*		--check fibers		scopes of fibers switched on one thread must time
+*							only their own fiber and its waits, under their own
+*							parents and on trace tracks of their own (needs
+*							PROFILER_FIBERS and PROFILER_TRACE, not on Windows)
+*
+*	Built with PROFILER_TRACE (smallprofiler_bench_trace) the benchmark also
+*	measures pairs while a trace is being recorded.
+*/
+
+#define PROFILER_DEFINE
+#define PROFILER_SNAPSHOT_DEFINE
+#define PROFILER_TRACE_DEFINE
+#include "smallprofiler.h"
+#include "smallprofiler_mutex.h"
+#include "smallprofiler_io.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(PROFILER_RDTSCP) && defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(PROFILER_FIBERS) && !defined(_WIN32)
+#include <ucontext.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* std::shared_mutex for the locks check, from C++17 */
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <shared_mutex>
+#define BENCH_SHARED_MUTEX
+#endif
+
+#ifndef SMALLPROFILER_VERSION
+#define SMALLPROFILER_VERSION "unknown"
+#endif
+
+#define BENCH_REPEATS 15
+#define BENCH_COLD_SAMPLES 1000
+
+static FILE* bench_output = NULL;
+
+typedef uint64_t (*bench_loop)(int iterations);
+
+static uint64_t bench_empty_loop(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+		BENCH_BARRIER();
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_pairs_depth_1(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(bench_depth_1);
+		BENCH_BARRIER();
+		profiler_stop(bench_depth_1);
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_pairs_depth_2(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(bench_depth_2_0);
+		profiler_start(bench_depth_2_1);
+		BENCH_BARRIER();
+		profiler_stop(bench_depth_2_1);
+		profiler_stop(bench_depth_2_0);
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_pairs_depth_4(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(bench_depth_4_0);
+		profiler_start(bench_depth_4_1);
+		profiler_start(bench_depth_4_2);
+		profiler_start(bench_depth_4_3);
+		BENCH_BARRIER();
+		profiler_stop(bench_depth_4_3);
+		profiler_stop(bench_depth_4_2);
+		profiler_stop(bench_depth_4_1);
+		profiler_stop(bench_depth_4_0);
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_pairs_depth_8(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(bench_depth_8_0);
+		profiler_start(bench_depth_8_1);
+		profiler_start(bench_depth_8_2);
+		profiler_start(bench_depth_8_3);
+		profiler_start(bench_depth_8_4);
+		profiler_start(bench_depth_8_5);
+		profiler_start(bench_depth_8_6);
+		profiler_start(bench_depth_8_7);
+		BENCH_BARRIER();
+		profiler_stop(bench_depth_8_7);
+		profiler_stop(bench_depth_8_6);
+		profiler_stop(bench_depth_8_5);
+		profiler_stop(bench_depth_8_4);
+		profiler_stop(bench_depth_8_3);
+		profiler_stop(bench_depth_8_2);
+		profiler_stop(bench_depth_8_1);
+		profiler_stop(bench_depth_8_0);
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_clock_cycles(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		volatile uint64_t cycles = get_cycles();
+		(void)cycles;
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_clock_milliseconds(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		volatile unsigned long milliseconds = get_milliseconds();
+		(void)milliseconds;
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static uint64_t bench_clock_steady(int iterations)
+{
+	uint64_t cycles_start = get_cycles();
+
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		volatile int64_t ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+		(void)ticks;
+	}
+
+	return get_cycles() - cycles_start;
+}
+
+static double bench_median(std::vector<double> samples)
+{
+	std::sort(samples.begin(), samples.end());
+	return samples[samples.size() / 2];
+}
+
+/* Median cycles per operation over BENCH_REPEATS runs, minus the empty loop */
+static double bench_measure(bench_loop loop, int iterations, int operations_per_iteration, double* min_out)
+{
+	std::vector<double> samples;
+
+	int i;
+	for (i = 0; i < BENCH_REPEATS; i++)
+	{
+		double cycles_loop = (double)bench_empty_loop(iterations);
+		double cycles = (double)loop(iterations) - cycles_loop;
+		samples.push_back(std::max(cycles, 0.0) / ((double)iterations * operations_per_iteration));
+	}
+
+	if (min_out)
+		*min_out = *std::min_element(samples.begin(), samples.end());
+
+	return bench_median(samples);
+}
+
+static void bench_emit(const char* bench, const char* clock, const char* mode, const char* table,
+					   int depth, int threads, int iterations, double cycles_median, double cycles_min)
+{
+	fprintf(bench_output,
+			"{\"bench\":\"%s\",\"clock\":\"%s\",\"mode\":\"%s\",\"table\":\"%s\","
+			"\"depth\":%d,\"threads\":%d,\"iterations\":%d,"
+			"\"cycles_per_pair\":%.2f,\"cycles_per_pair_min\":%.2f}\n",
+			bench, clock, mode, table, depth, threads, iterations, cycles_median, cycles_min);
+}
+
+static void bench_clocks(int iterations)
+{
+	struct { const char* name; bench_loop loop; } clocks[] =
+	{
+		{ "rdtsc", bench_clock_cycles },
+		{ "milliseconds", bench_clock_milliseconds },
+		{ "steady_clock", bench_clock_steady },
+	};
+
+	for (size_t i = 0; i < sizeof(clocks) / sizeof(clocks[0]); i++)
+	{
+		double cycles_min = 0.0;
+		double cycles = bench_measure(clocks[i].loop, iterations, 1, &cycles_min);
+
+		fprintf(bench_output,
+				"{\"bench\":\"clock_read\",\"clock\":\"%s\",\"iterations\":%d,"
+				"\"cycles_per_read\":%.2f,\"cycles_per_read_min\":%.2f}\n",
+				clocks[i].name, iterations, cycles, cycles_min);
+	}
+}
+
+static void bench_depths(int iterations)
+{
+	struct { int depth; bench_loop loop; } depths[] =
+	{
+		{ 1, bench_pairs_depth_1 },
+		{ 2, bench_pairs_depth_2 },
+		{ 4, bench_pairs_depth_4 },
+		{ 8, bench_pairs_depth_8 },
+	};
+
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+	{
+		double cycles_min = 0.0;
+		double cycles = bench_measure(depths[i].loop, iterations, depths[i].depth, &cycles_min);
+		bench_emit("pair", "rdtsc", "enabled", "warm", depths[i].depth, 1, iterations, cycles, cycles_min);
+	}
+}
+
+/* First start/stop pair after profiler_reset(), which includes the node setup */
+static void bench_cold()
+{
+	std::vector<double> samples;
+	std::vector<double> overhead;
+
+	int i;
+	for (i = 0; i < BENCH_COLD_SAMPLES; i++)
+	{
+		uint64_t cycles_start = get_cycles();
+		BENCH_BARRIER();
+		overhead.push_back((double)(get_cycles() - cycles_start));
+	}
+
+	for (i = 0; i < BENCH_COLD_SAMPLES; i++)
+	{
+		profiler_reset();
+
+		uint64_t cycles_start = get_cycles();
+		profiler_start(bench_cold);
+		BENCH_BARRIER();
+		profiler_stop(bench_cold);
+		samples.push_back((double)(get_cycles() - cycles_start));
+	}
+
+	double cycles_overhead = bench_median(overhead);
+	double cycles = std::max(bench_median(samples) - cycles_overhead, 0.0);
+	double cycles_min = std::max(*std::min_element(samples.begin(), samples.end()) - cycles_overhead, 0.0);
+
+	bench_emit("pair", "rdtsc", "enabled", "cold", 1, 1, BENCH_COLD_SAMPLES, cycles, cycles_min);
+}
+
+static void bench_disabled(int iterations)
+{
+	double cycles_min = 0.0;
+	double cycles = bench_measure(bench_disabled_pairs, iterations, 1, &cycles_min);
+	bench_emit("pair", "rdtsc", "disabled", "warm", 1, 1, iterations, cycles, cycles_min);
+}
+
+/* Median and fastest cycles per warm pair of `threads` threads running at the same time */
+static double bench_threads_measure(int iterations, int threads, double* min_out)
+{
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<double> samples(threads);
+	std::vector<std::thread> workers;
+
+	int i;
+	for (i = 0; i < threads; i++)
+	{
+		workers.emplace_back([&, i]()
+		{
+			ready++;
+			while (!go)
+				std::this_thread::yield();
+
+			double cycles_loop = (double)bench_empty_loop(iterations);
+			double cycles = (double)bench_pairs_depth_1(iterations) - cycles_loop;
+			samples[i] = std::max(cycles, 0.0) / iterations;
+		});
+	}
+
+	while (ready != threads)
+		std::this_thread::yield();
+
+	go = true;
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	if (min_out)
+		*min_out = *std::min_element(samples.begin(), samples.end());
+
+	return bench_median(samples);
+}
+
+/*
+*	All threads hit the same call site and therefore the same node, so this
+*	shows whether the per-thread tables keep the threads out of each other's way.
+*/
+static void bench_threads(int iterations, int max_threads)
+{
+	int threads;
+	for (threads = 1; threads <= max_threads; threads *= 2)
+	{
+		double cycles_min = 0.0;
+		double cycles = bench_threads_measure(iterations, threads, &cycles_min);
+
+		bench_emit("pair", "rdtsc", "enabled", "warm", 1, threads, iterations, cycles, cycles_min);
+	}
+}
+
+#ifdef PROFILER_TRACE
+/* Warm pairs while a trace is recorded, including handing full blocks to the flusher */
+static void bench_trace(int iterations)
+{
+	const char* filename = "smallprofiler_bench.sptrace";
+
+	if (!profiler_trace_begin(filename))
+		return;
+
+	double cycles_min = 0.0;
+	double cycles = bench_measure(bench_pairs_depth_1, iterations, 1, &cycles_min);
+
+	profiler_trace_end();
+	remove(filename);
+
+	bench_emit("pair", "rdtsc", "trace", "warm", 1, 1, iterations, cycles, cycles_min);
+}
+#endif
+
+static double bench_seconds(uint64_t cycles)
+{
+	return (double)cycles / ((double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+}
+
+/* Busy-wait for a wall clock duration that does not depend on the profiler's calibration */
+static void bench_spin(double seconds)
+{
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() +
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+	while (std::chrono::steady_clock::now() < end)
+		;
+}
+
+static int bench_find_node(const char* name)
+{
+	int i;
+	for (i = 0; i < PROFILER_NODES_MAX; i++)
+	{
+		if (profiler_nodes[i].is_setup && strcmp(profiler_nodes[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static uint64_t bench_self_cycles(int id)
+{
+	uint64_t cycles = profiler_nodes[id].total_cycles;
+
+	int i;
+	for (i = 0; i < PROFILER_NODES_MAX; i++)
+	{
+		if (profiler_nodes[i].is_setup && profiler_nodes[i].parent_id == id)
+			cycles -= profiler_nodes[i].total_cycles;
+	}
+
+	return cycles;
+}
+
+static int bench_check_value(const char* what, double value, double expected, double tolerance)
+{
+	int ok = value >= expected * (1.0 - tolerance) && value <= expected * (1.0 + tolerance);
+
+	printf("%-24s %10.6f expected %10.6f %s\n", what, value, expected, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/* For times that preemption can only make longer, on machines with fewer cores than threads */
+static int bench_check_at_least(const char* what, double value, double expected, double tolerance)
+{
+	int ok = value >= expected * (1.0 - tolerance);
+
+	printf("%-24s %10.6f at least %10.6f %s\n", what, value, expected, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/* For times that preemption can make longer: no less than what the scope spun for, no more than the cycles measured around it */
+static int bench_check_between(const char* what, double value, double expected, double measured, double tolerance)
+{
+	int ok = value >= expected * (1.0 - tolerance) && value <= measured * (1.0 + tolerance);
+
+	printf("%-24s %10.6f expected %10.6f to %10.6f %s\n", what, value, expected, measured, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static int bench_check_parent(const char* name, const char* parent)
+{
+	int id = bench_find_node(name);
+	int parent_id = parent ? bench_find_node(parent) : -1;
+	int ok = id != -1 && profiler_nodes[id].parent_id == parent_id;
+
+	printf("%-24s parent %-24s %s\n", name, parent ? parent : "(none)", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static int bench_check_accuracy(double tolerance)
+{
+	const int repeats = 3;
+
+	/* Cycles around every scope, in the order of expected below */
+	uint64_t measured[4] = { 0, 0, 0, 0 };
+
+	profiler_reset();
+
+	int i;
+	for (i = 0; i < repeats; i++)
+	{
+		uint64_t outer_start = get_cycles();
+		profiler_start(check_outer);
+		bench_spin(0.010);
+
+		uint64_t inner_a_start = get_cycles();
+		profiler_start(check_inner_a);
+		bench_spin(0.020);
+		profiler_stop(check_inner_a);
+		measured[1] += get_cycles() - inner_a_start;
+
+		uint64_t inner_b_start = get_cycles();
+		profiler_start(check_inner_b);
+		bench_spin(0.005);
+
+		uint64_t leaf_start = get_cycles();
+		profiler_start(check_leaf);
+		bench_spin(0.005);
+		profiler_stop(check_leaf);
+		measured[3] += get_cycles() - leaf_start;
+
+		profiler_stop(check_inner_b);
+		measured[2] += get_cycles() - inner_b_start;
+
+		profiler_stop(check_outer);
+		measured[0] += get_cycles() - outer_start;
+	}
+
+	profiler_collect();
+
+	int ok = 1;
+	ok &= bench_check_parent("check_outer", NULL);
+	ok &= bench_check_parent("check_inner_a", "check_outer");
+	ok &= bench_check_parent("check_inner_b", "check_outer");
+	ok &= bench_check_parent("check_leaf", "check_inner_b");
+
+	if (!ok)
+		return 0;
+
+	struct { const char* name; double inclusive; double self; } expected[] =
+	{
+		{ "check_outer", 0.040, 0.010 },
+		{ "check_inner_a", 0.020, 0.020 },
+		{ "check_inner_b", 0.010, 0.005 },
+		{ "check_leaf", 0.005, 0.005 },
+	};
+
+	for (size_t j = 0; j < sizeof(expected) / sizeof(expected[0]); j++)
+	{
+		int id = bench_find_node(expected[j].name);
+		char what[64];
+
+		snprintf(what, sizeof(what), "%s inclusive", expected[j].name);
+		ok &= bench_check_between(what, bench_seconds(profiler_nodes[id].total_cycles), repeats * expected[j].inclusive, bench_seconds(measured[j]), tolerance);
+
+		/* Bounded above through the inclusive times of the node and its children */
+		snprintf(what, sizeof(what), "%s self", expected[j].name);
+		ok &= bench_check_at_least(what, bench_seconds(bench_self_cycles(id)), repeats * expected[j].self, tolerance);
+	}
+
+	return ok;
+}
+
+static void bench_check_threads_worker(int iterations, uint64_t* cycles_outer, uint64_t* cycles_inner)
+{
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		uint64_t cycles_start = get_cycles();
+		profiler_start(check_thread_outer);
+
+		uint64_t cycles_inner_start = get_cycles();
+		profiler_start(check_thread_inner);
+		bench_spin(0.00002);
+		profiler_stop(check_thread_inner);
+		*cycles_inner += get_cycles() - cycles_inner_start;
+
+		bench_spin(0.00002);
+		profiler_stop(check_thread_outer);
+		*cycles_outer += get_cycles() - cycles_start;
+	}
+}
+
+static int bench_check_threads(int threads, double tolerance)
+{
+	const int iterations = 200;
+
+	std::vector<uint64_t> cycles_outer(threads);
+	std::vector<uint64_t> cycles_inner(threads);
+	std::vector<std::thread> workers;
+
+	profiler_reset();
+
+	int i;
+	for (i = 0; i < threads; i++)
+		workers.emplace_back(bench_check_threads_worker, iterations, &cycles_outer[i], &cycles_inner[i]);
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	profiler_collect();
+
+	int ok = 1;
+	ok &= bench_check_parent("check_thread_outer", NULL);
+	ok &= bench_check_parent("check_thread_inner", "check_thread_outer");
+
+	if (!ok)
+		return 0;
+
+	uint64_t measured_outer = 0;
+	uint64_t measured_inner = 0;
+
+	for (i = 0; i < threads; i++)
+	{
+		measured_outer += cycles_outer[i];
+		measured_inner += cycles_inner[i];
+	}
+
+	int outer = bench_find_node("check_thread_outer");
+	int inner = bench_find_node("check_thread_inner");
+
+	ok &= bench_check_between("check_thread_outer", bench_seconds(profiler_nodes[outer].total_cycles),
+							  threads * iterations * 0.00004, bench_seconds(measured_outer), tolerance);
+	ok &= bench_check_between("check_thread_inner", bench_seconds(profiler_nodes[inner].total_cycles),
+							  threads * iterations * 0.00002, bench_seconds(measured_inner), tolerance);
+
+	/* Exact, a lost update shows up here even when the times hide it */
+	uint64_t calls = (uint64_t)threads * iterations;
+	int counted = profiler_nodes[outer].calls == calls && profiler_nodes[inner].calls == calls;
+	printf("%-24s %10" PRIu64 " expected %10" PRIu64 " %s\n", "check_thread calls", profiler_nodes[outer].calls, calls, counted ? "ok" : "FAILED");
+	ok &= counted;
+
+	return ok;
+}
+
+#ifdef PROFILER_PER_CPU
+static void bench_check_cpus_worker(int iterations)
+{
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(check_cpu_pair);
+		profiler_stop(check_cpu_pair);
+	}
+}
+
+/* Rounds of short-lived threads count every call and leave no more tables than there are CPUs */
+static int bench_check_cpus(int threads)
+{
+	const int rounds = 64;
+	const int iterations = 1000;
+
+	profiler_reset();
+
+	int round;
+	for (round = 0; round < rounds; round++)
+	{
+		std::vector<std::thread> workers;
+
+		int i;
+		for (i = 0; i < threads; i++)
+			workers.emplace_back(bench_check_cpus_worker, iterations);
+
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	profiler_collect();
+
+	int id = bench_find_node("check_cpu_pair");
+	uint64_t calls = id >= 0 ? profiler_nodes[id].calls : 0;
+	uint64_t expected = (uint64_t)rounds * threads * iterations;
+
+	int ok = calls == expected;
+	printf("%-40s %" PRIu64 " calls of %" PRIu64 " %s\n", "calls of short-lived threads", calls, expected, ok ? "ok" : "FAILED");
+
+	int tables = 0;
+	int cpu;
+	for (cpu = 0; cpu < PROFILER_CPUS_MAX; cpu++)
+		tables += profiler_cpus[cpu] != NULL;
+
+	int hardware = std::max((int)std::thread::hardware_concurrency(), 1);
+	int bounded = tables <= hardware;
+
+	printf("%-40s %d tables for %d threads on %d CPUs %s\n", "tables per CPU", tables, rounds * threads, hardware, bounded ? "ok" : "FAILED");
+	ok &= bounded;
+
+	return ok;
+}
+#endif
+
+#ifdef PROFILER_RDTSCP
+#ifdef __linux__
+static int bench_pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+#endif
+
+/* Calls moved from one CPU to another by changing the affinity in the middle are migrations, calls pinned to one CPU are not */
+static int bench_check_migrations()
+{
+	const int calls = 100;
+
+	profiler_reset();
+
+	int moved = 0;
+	int i;
+
+#ifdef __linux__
+	cpu_set_t allowed;
+	int cpus[2] = { -1, -1 };
+	int found = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		for (i = 0; i < CPU_SETSIZE && found < 2; i++)
+		{
+			if (CPU_ISSET(i, &allowed))
+				cpus[found++] = i;
+		}
+	}
+
+	if (found == 2 && bench_pin(cpus[0]))
+	{
+		for (i = 0; i < calls; i++)
+		{
+			profiler_start(check_pinned);
+			bench_spin(0.00001);
+			profiler_stop(check_pinned);
+		}
+
+		for (i = 0; i < calls; i++)
+		{
+			bench_pin(cpus[0]);
+			profiler_start(check_migrated);
+			moved += bench_pin(cpus[1]);
+			profiler_stop(check_migrated);
+		}
+
+		sched_setaffinity(0, sizeof(allowed), &allowed);
+	}
+	else
+#endif
+	{
+		for (i = 0; i < calls; i++)
+		{
+			profiler_start(check_pinned);
+			bench_spin(0.00001);
+			profiler_stop(check_pinned);
+		}
+	}
+
+	profiler_collect();
+
+	int pinned = bench_find_node("check_pinned");
+	int ok = pinned >= 0 && profiler_nodes[pinned].calls == (uint64_t)calls && profiler_nodes[pinned].migrations == 0;
+	printf("%-40s %" PRIu64 " migrations %s\n", "calls on one CPU", pinned >= 0 ? profiler_nodes[pinned].migrations : 0, ok ? "ok" : "FAILED");
+
+	if (!moved)
+	{
+		printf("%-40s skipped, needs two CPUs ok\n", "calls moved to another CPU");
+		return ok;
+	}
+
+	int migrated = bench_find_node("check_migrated");
+	int counted = migrated >= 0 && profiler_nodes[migrated].migrations == (uint64_t)moved;
+	printf("%-40s %" PRIu64 " migrations of %d %s\n", "calls moved to another CPU", migrated >= 0 ? profiler_nodes[migrated].migrations : 0, moved, counted ? "ok" : "FAILED");
+	ok &= counted;
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int flagged = strstr(results, "migrated 100.0%") != NULL;
+	printf("%-40s %s\n", "migrations flagged in the results", flagged ? "ok" : "FAILED");
+	ok &= flagged;
+
+	return ok;
+}
+#endif
+
+static int bench_check_overhead(int iterations, double max_cycles)
+{
+	double cycles_min = 0.0;
+	double cycles = bench_measure(bench_pairs_depth_1, iterations, 1, &cycles_min);
+	int ok = cycles <= max_cycles;
+
+	printf("cycles per pair %.2f (min %.2f), limit %.2f %s\n", cycles, cycles_min, max_cycles, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/*
+*	Pairs must cost as much with every core busy as with one thread: per-thread
+*	state that shared cache lines would make them slower as threads are added.
+*	Only as many threads as there are hardware threads are measured, the best of
+*	BENCH_REPEATS runs each to leave out runs that were interrupted. Every run
+*	of a thread count follows a run of one thread, which is the reference, so
+*	a machine that slows down for a while slows down both.
+*/
+static int bench_check_scaling(int iterations, int max_threads, double tolerance)
+{
+	int hardware = (int)std::thread::hardware_concurrency();
+	int limit = std::min(max_threads, std::max(hardware, 1));
+	int ok = 1;
+
+	/* Powers of two and every hardware thread */
+	std::vector<int> counts;
+	int threads;
+	for (threads = 1; threads < limit; threads *= 2)
+		counts.push_back(threads);
+
+	counts.push_back(limit);
+
+	for (int count : counts)
+	{
+		double best = 0.0;
+		double single = 0.0;
+
+		int repeat;
+		for (repeat = 0; repeat < BENCH_REPEATS; repeat++)
+		{
+			double cycles_single = bench_threads_measure(iterations, 1, NULL);
+			double cycles = count == 1 ? cycles_single : bench_threads_measure(iterations, count, NULL);
+
+			single = repeat ? std::min(single, cycles_single) : cycles_single;
+			best = repeat ? std::min(best, cycles) : cycles;
+		}
+
+		int flat = best <= single * (1.0 + tolerance) + 1.0;
+		printf("%-40s %d threads %.2f cycles per pair, %.2f with one %s\n", "pairs scale with threads", count, best, single, flat ? "ok" : "FAILED");
+		ok &= flat;
+	}
+
+	return ok;
+}
+
+static int bench_check_snapshot_node(const struct profiler_snapshot* snapshot, const char* path, const char* name, const char* parent, uint64_t calls)
+{
+	int64_t index = profiler_snapshot_find(snapshot, path);
+	int id = bench_find_node(name);
+
+	if (index < 0 || id < 0)
+	{
+		printf("%-40s missing FAILED\n", path);
+		return 0;
+	}
+
+	struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, (uint32_t)index);
+	int ok = node.total_cycles == profiler_nodes[id].total_cycles &&
+			 node.calls == calls &&
+			 profiler_snapshot_self_cycles(snapshot, (uint32_t)index) == bench_self_cycles(id) &&
+			 (parent ? node.parent == profiler_snapshot_find(snapshot, parent) : node.parent == -1);
+
+	const uint64_t* histogram = profiler_snapshot_histogram(snapshot, (uint32_t)index);
+	if (histogram)
+	{
+		uint64_t histogram_calls = 0;
+
+		uint32_t i;
+		for (i = 0; i < snapshot->header->histogram_buckets; i++)
+			histogram_calls += histogram[i];
+
+#ifdef PROFILER_HISTOGRAMS_SKIP_MIGRATED
+		ok &= histogram_calls == calls - node.migrations;
+#else
+		ok &= histogram_calls == calls;
+#endif
+	}
+
+	printf("%-40s %" PRIu64 " cycles %" PRIu64 " calls %s\n", path, node.total_cycles, node.calls, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/* Snapshots whose sections or nodes point outside of them must not open */
+static int bench_check_snapshot_corrupt()
+{
+	size_t size = 0;
+	void* data = profiler_get_snapshot(&size);
+	if (!data)
+	{
+		printf("could not get a snapshot FAILED\n");
+		return 0;
+	}
+
+	std::vector<uint8_t> valid((uint8_t*)data, (uint8_t*)data + size);
+	profiler_free_snapshot(data);
+
+	struct profiler_snapshot snapshot;
+	int ok = profiler_snapshot_open_memory(&snapshot, valid.data(), valid.size());
+	printf("%-40s %s\n", "valid snapshot opens", ok ? "ok" : "FAILED");
+
+	if (!ok)
+		return 0;
+
+	const struct profiler_snapshot_header header = profiler_snapshot_get_header(&snapshot);
+	profiler_snapshot_close(&snapshot);
+
+	struct { const char* name; size_t offset; uint64_t value; size_t bytes; } corruptions[] =
+	{
+		{ "subtree past the nodes", header.node_table_offset + offsetof(struct profiler_snapshot_node, subtree_end), 0x7fffffff, 4 },
+		{ "subtree ending at itself", header.node_table_offset + offsetof(struct profiler_snapshot_node, subtree_end), 0, 4 },
+		{ "parent after the node", header.node_table_offset + offsetof(struct profiler_snapshot_node, parent), 2, 4 },
+		{ "name past the strings", header.node_table_offset + offsetof(struct profiler_snapshot_node, name_offset), header.string_table_size, 4 },
+		{ "root below the top", header.node_table_offset + offsetof(struct profiler_snapshot_node, depth), 1, 4 },
+		{ "depth out of range", header.node_table_offset + header.node_size + offsetof(struct profiler_snapshot_node, depth), 0xffffffff, 4 },
+		{ "unterminated strings", header.string_table_offset + header.string_table_size - 1, 'x', 1 },
+		{ "node table overflowing", offsetof(struct profiler_snapshot_header, node_table_offset), UINT64_MAX - 8, 8 },
+		{ "node count overflowing", offsetof(struct profiler_snapshot_header, node_count), 0xffffffff, 4 },
+	};
+
+	for (size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++)
+	{
+		std::vector<uint8_t> corrupt = valid;
+		memcpy(corrupt.data() + corruptions[i].offset, &corruptions[i].value, corruptions[i].bytes);
+
+		int rejected = !profiler_snapshot_open_memory(&snapshot, corrupt.data(), corrupt.size());
+		printf("%-40s %s\n", corruptions[i].name, rejected ? "rejected ok" : "FAILED");
+		ok &= rejected;
+	}
+
+	return ok;
+}
+
+static int bench_check_snapshot()
+{
+	const int repeats = 10;
+	const char* filename = "smallprofiler_check.spsnap";
+
+	profiler_reset();
+
+	int i;
+	for (i = 0; i < repeats; i++)
+	{
+		profiler_start(snapshot_outer);
+
+		profiler_start(snapshot_inner_a);
+		bench_spin(0.0002);
+		profiler_stop(snapshot_inner_a);
+
+		profiler_start(snapshot_inner_b);
+		profiler_start(snapshot_leaf);
+		bench_spin(0.0001);
+		profiler_stop(snapshot_leaf);
+		profiler_stop(snapshot_inner_b);
+
+		profiler_stop(snapshot_outer);
+	}
+
+	profiler_dump_snapshot(filename);
+	profiler_collect();
+
+	struct profiler_snapshot snapshot;
+	if (!profiler_snapshot_open(&snapshot, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	int ok = profiler_snapshot_node_count(&snapshot) == 4;
+	ok &= bench_check_snapshot_node(&snapshot, "snapshot_outer", "snapshot_outer", NULL, repeats);
+	ok &= bench_check_snapshot_node(&snapshot, "snapshot_outer;snapshot_inner_a", "snapshot_inner_a", "snapshot_outer", repeats);
+	ok &= bench_check_snapshot_node(&snapshot, "snapshot_outer;snapshot_inner_b", "snapshot_inner_b", "snapshot_outer", repeats);
+	ok &= bench_check_snapshot_node(&snapshot, "snapshot_outer;snapshot_inner_b;snapshot_leaf", "snapshot_leaf", "snapshot_outer;snapshot_inner_b", repeats);
+
+	/* inner_a spins twice as long as inner_b, so it must come first */
+	ok &= profiler_snapshot_find(&snapshot, "snapshot_outer;snapshot_inner_a") < profiler_snapshot_find(&snapshot, "snapshot_outer;snapshot_inner_b");
+
+	profiler_snapshot_close(&snapshot);
+	remove(filename);
+
+	ok &= bench_check_snapshot_corrupt();
+
+	return ok;
+}
+
+#ifdef PROFILER_TRACE
+static void bench_check_trace_worker(int iterations)
+{
+	int i;
+	for (i = 0; i < iterations; i++)
+	{
+		profiler_start(trace_outer);
+		profiler_start(trace_inner);
+		BENCH_BARRIER();
+		profiler_stop(trace_inner);
+		profiler_stop(trace_outer);
+	}
+}
+
+static int bench_check_trace(int threads)
+{
+	/* Enough events for several blocks per thread, every iteration packs into at least 8 bytes */
+	const int iterations = 4 * PROFILER_TRACE_BLOCK_SIZE / 8;
+	const char* filename = "smallprofiler_check.sptrace";
+
+	profiler_reset();
+
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+
+	std::vector<std::thread> workers;
+
+	int i;
+	for (i = 0; i < threads; i++)
+		workers.emplace_back(bench_check_trace_worker, iterations);
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	profiler_trace_end();
+	profiler_collect();
+
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	int ids[2] = { bench_find_node("trace_outer"), bench_find_node("trace_inner") };
+	const char* names[2] = { "trace_outer", "trace_inner" };
+
+	int ok = ids[0] >= 0 && ids[1] >= 0;
+
+	for (i = 0; ok && i < 2; i++)
+	{
+		const char* name = profiler_trace_name(&trace, (uint32_t)ids[i]);
+		ok &= name && strcmp(name, names[i]) == 0;
+	}
+
+	/* Per thread: the next block expected, the open scopes, the last timestamp and the index entries expected */
+	std::vector<uint32_t> next_sequence;
+	std::vector<std::vector<struct profiler_trace_open_scope>> stacks;
+	std::vector<uint64_t> last_cycles;
+	std::vector<std::vector<struct profiler_trace_index_entry>> entries;
+	std::vector<std::vector<struct profiler_trace_open_scope>> entry_stacks;
+	std::vector<uint64_t> pairs(profiler_trace_name_count(&trace), 0);
+	uint64_t blocks = 0;
+	uint64_t compressed_blocks = 0;
+	uint64_t events_bytes = 0;
+	uint64_t events_raw_bytes = 0;
+	uint64_t events_count = 0;
+	int ordered = 1;
+
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	uint64_t offset = profiler_trace_first_chunk(&trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while ((chunk = profiler_trace_chunk_at(&trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			if (chunk->thread >= next_sequence.size())
+			{
+				next_sequence.resize(chunk->thread + 1, 0);
+				stacks.resize(chunk->thread + 1);
+				last_cycles.resize(chunk->thread + 1, 0);
+				entries.resize(chunk->thread + 1);
+				entry_stacks.resize(chunk->thread + 1);
+			}
+
+			ordered &= chunk->type == PROFILER_TRACE_CHUNK_PACKED && chunk->sequence == next_sequence[chunk->thread]++;
+			blocks++;
+			events_bytes += chunk->size;
+			events_raw_bytes += chunk->codec == PROFILER_TRACE_CODEC_LZ ? chunk->raw_size : chunk->size;
+			events_count += chunk->count;
+			compressed_blocks += chunk->codec == PROFILER_TRACE_CODEC_LZ;
+
+			std::vector<struct profiler_trace_open_scope>& stack = stacks[chunk->thread];
+
+			struct profiler_trace_index_entry entry = { chunk->first_cycles, chunk->last_cycles, offset, 0, (uint32_t)stack.size() };
+			entries[chunk->thread].push_back(entry);
+			entry_stacks[chunk->thread].insert(entry_stacks[chunk->thread].end(), stack.begin(), stack.end());
+
+			struct profiler_trace_event event = { 0, 0, 0, 0 };
+			uint32_t decoded = 0;
+
+			ordered &= profiler_trace_chunk_decoder(&trace, chunk, &decoder);
+
+			while (ordered && profiler_trace_decoder_next(&decoder, &event))
+			{
+				ordered &= event.cycles >= last_cycles[chunk->thread];
+				last_cycles[chunk->thread] = event.cycles;
+				decoded++;
+
+				if (event.type == PROFILER_TRACE_EVENT_BEGIN)
+				{
+					struct profiler_trace_open_scope open = { event.cycles, event.id, 0 };
+					stack.push_back(open);
+				}
+				else
+				{
+					ordered &= !stack.empty() && stack.back().id == event.id && event.id < pairs.size();
+					if (!ordered)
+						break;
+
+					stack.pop_back();
+					pairs[event.id]++;
+				}
+			}
+
+			ordered &= decoded == chunk->count && event.cycles == chunk->last_cycles;
+		}
+
+		offset = profiler_trace_chunk_next(&trace, chunk, offset);
+	}
+
+	for (const std::vector<struct profiler_trace_open_scope>& stack : stacks)
+		ordered &= stack.empty();
+
+	printf("%-40s %" PRIu64 " blocks from %d threads %s\n", "blocks in sequence, events nested", blocks, (int)stacks.size(), ordered ? "ok" : "FAILED");
+	ok &= ordered && (int)stacks.size() == threads;
+
+	profiler_trace_decoder_free(&decoder);
+
+	/* Half of an unpacked profiler_trace_event or less */
+	double bytes_per_event = events_count ? (double)events_raw_bytes / (double)events_count : 0.0;
+	int packed = events_count && bytes_per_event <= PROFILER_TRACE_EVENT_RECORD_SIZE / 2;
+
+	printf("%-40s %.2f bytes per event %s\n", "events packed", bytes_per_event, packed ? "ok" : "FAILED");
+	ok &= packed;
+
+	/* The same two scopes over and over compress well */
+	int compressed = PROFILER_TRACE_CODEC == PROFILER_TRACE_CODEC_NONE || (compressed_blocks > 0 && events_bytes < events_raw_bytes);
+
+	printf("%-40s %" PRIu64 " of %" PRIu64 " blocks, %.2f bytes per event %s\n", "blocks compressed", compressed_blocks, blocks,
+		   events_count ? (double)events_bytes / (double)events_count : 0.0, compressed ? "ok" : "FAILED");
+	ok &= compressed;
+
+	for (i = 0; ok && i < 2; i++)
+	{
+		uint64_t expected = (uint64_t)threads * iterations;
+		int pairs_ok = pairs[ids[i]] == expected && profiler_nodes[ids[i]].calls == expected;
+
+		printf("%-40s %" PRIu64 " pairs %" PRIu64 " calls %s\n", names[i], pairs[ids[i]], profiler_nodes[ids[i]].calls, pairs_ok ? "ok" : "FAILED");
+		ok &= pairs_ok;
+	}
+
+	/* The index has every block of every thread, with the scopes that were open when it began */
+	int indexed = profiler_trace_index_thread_count(&trace) == entries.size();
+	uint32_t slot;
+
+	for (slot = 0; indexed && slot < profiler_trace_index_thread_count(&trace); slot++)
+	{
+		const struct profiler_trace_index_thread* thread = profiler_trace_index_thread(&trace, slot);
+		const struct profiler_trace_index_entry* index_entries = profiler_trace_index_entries(&trace, thread);
+
+		indexed &= thread->thread == slot && thread->entry_count == entries[slot].size();
+
+		uint32_t e;
+		size_t stack_offset = 0;
+		for (e = 0; indexed && e < thread->entry_count; e++)
+		{
+			const struct profiler_trace_index_entry& expected = entries[slot][e];
+			const struct profiler_trace_open_scope* open = profiler_trace_index_stack(&trace, &index_entries[e]);
+
+			indexed &= index_entries[e].first_cycles == expected.first_cycles && index_entries[e].last_cycles == expected.last_cycles &&
+					   index_entries[e].chunk_offset == expected.chunk_offset && index_entries[e].stack_depth == expected.stack_depth && open;
+
+			uint32_t depth;
+			for (depth = 0; indexed && depth < expected.stack_depth; depth++)
+			{
+				const struct profiler_trace_open_scope& scope = entry_stacks[slot][stack_offset + depth];
+				indexed &= open[depth].id == scope.id && open[depth].cycles == scope.cycles;
+			}
+
+			stack_offset += expected.stack_depth;
+
+			/* Seeking to the first event of a block lands on it, unless the previous block ends on the same timestamp */
+			if (indexed && (e == 0 || index_entries[e - 1].last_cycles < expected.first_cycles))
+				indexed &= profiler_trace_index_find(&trace, thread, expected.first_cycles) == e;
+		}
+	}
+
+	printf("%-40s %u threads %s\n", "time index matches the blocks", profiler_trace_index_thread_count(&trace), indexed ? "ok" : "FAILED");
+	ok &= indexed;
+
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	return ok;
+}
+
+/*
+*	Decode every ring slot of `trace`, checking timestamps, counting pairs and
+*	the blocks every thread recorded; returns the number of slots, -1 if one is damaged
+*/
+static int bench_check_ring_slots(const struct profiler_trace* trace, struct profiler_trace_decoder* decoder, std::vector<uint64_t>& pairs, std::vector<uint32_t>& recorded)
+{
+	int slots = 0;
+	uint64_t offset = profiler_trace_first_chunk(trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while ((chunk = profiler_trace_chunk_at(trace, offset)) != NULL)
+	{
+		if (chunk->type == PROFILER_TRACE_CHUNK_RING)
+		{
+			struct profiler_trace_event event = { chunk->first_cycles, 0, 0, 0 };
+			uint64_t previous = chunk->first_cycles;
+			uint32_t decoded = 0;
+
+			if (!profiler_trace_chunk_decoder(trace, chunk, decoder))
+				return -1;
+
+			while (profiler_trace_decoder_next(decoder, &event))
+			{
+				if (event.cycles < previous)
+					return -1;
+
+				if (event.type == PROFILER_TRACE_EVENT_END && event.id < pairs.size())
+					pairs[event.id]++;
+
+				previous = event.cycles;
+				decoded++;
+			}
+
+			/* Counts are only known once the trace has ended */
+			if (chunk->count && (decoded != chunk->count || event.cycles != chunk->last_cycles))
+				return -1;
+
+			if (chunk->thread >= recorded.size())
+				recorded.resize(chunk->thread + 1, 0);
+
+			recorded[chunk->thread] = std::max(recorded[chunk->thread], chunk->sequence + 1);
+			slots++;
+		}
+		else if (chunk->type != PROFILER_TRACE_CHUNK_FREE)
+		{
+			break;
+		}
+
+		offset = profiler_trace_chunk_next(trace, chunk, offset);
+	}
+
+	return slots;
+}
+
+static int bench_check_trace_ring(int threads)
+{
+	/* Far more blocks than slots, so the ring wraps several times */
+	const int iterations = 4 * PROFILER_TRACE_BLOCK_SIZE / 8;
+	const int slots = 2 * threads;
+	const char* filename = "smallprofiler_check_ring.sptrace";
+	uint64_t size = sizeof(struct profiler_trace_header) + (uint64_t)slots * (sizeof(struct profiler_trace_chunk) + sizeof(struct profiler_trace_block));
+
+	profiler_reset();
+
+	if (!profiler_trace_begin_ring(filename, size))
+	{
+		printf("could not map %s FAILED\n", filename);
+		return 0;
+	}
+
+	std::vector<std::thread> workers;
+
+	int i;
+	for (i = 0; i < threads; i++)
+		workers.emplace_back(bench_check_trace_worker, iterations);
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	/* Not ended yet, as if the process had crashed: the slots must read back already */
+	struct profiler_trace trace;
+	std::vector<uint64_t> pairs(PROFILER_NODES_MAX, 0);
+	std::vector<uint32_t> recorded;
+	int live = 0;
+
+	if (profiler_trace_open(&trace, filename))
+	{
+		live = trace.header->names_offset == 0 ? bench_check_ring_slots(&trace, &decoder, pairs, recorded) : -1;
+		profiler_trace_close(&trace);
+	}
+
+	printf("%-40s %d slots %s\n", "ring readable before the end", live, live > 0 ? "ok" : "FAILED");
+	int ok = live > 0;
+
+	profiler_trace_end();
+	profiler_collect();
+
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		profiler_trace_decoder_free(&decoder);
+		return 0;
+	}
+
+	int ids[2] = { bench_find_node("trace_outer"), bench_find_node("trace_inner") };
+	const char* names[2] = { "trace_outer", "trace_inner" };
+
+	ok &= ids[0] >= 0 && ids[1] >= 0;
+
+	for (i = 0; ok && i < 2; i++)
+	{
+		const char* name = profiler_trace_name(&trace, (uint32_t)ids[i]);
+		ok &= name && strcmp(name, names[i]) == 0;
+	}
+
+	std::fill(pairs.begin(), pairs.end(), 0);
+	recorded.clear();
+
+	int ended = bench_check_ring_slots(&trace, &decoder, pairs, recorded);
+	uint64_t blocks = 0;
+
+	for (uint32_t count : recorded)
+		blocks += count;
+
+	int wrapped = ended > 0 && ended <= slots && blocks > (uint64_t)ended;
+
+	printf("%-40s %d of %d slots for %" PRIu64 " blocks %s\n", "ring wrapped, slots decode", ended, slots, blocks, wrapped ? "ok" : "FAILED");
+	ok &= wrapped;
+
+	uint32_t indexed = 0;
+	uint32_t slot;
+	for (slot = 0; slot < profiler_trace_index_thread_count(&trace); slot++)
+		indexed += profiler_trace_index_thread(&trace, slot)->entry_count;
+
+	printf("%-40s %u entries %s\n", "time index has every slot", indexed, (int)indexed == ended ? "ok" : "FAILED");
+	ok &= (int)indexed == ended;
+
+	/* The oldest blocks are overwritten, what is left is a part of the calls */
+	for (i = 0; ok && i < 2; i++)
+	{
+		uint64_t calls = profiler_nodes[ids[i]].calls;
+		int pairs_ok = pairs[ids[i]] > 0 && pairs[ids[i]] < calls;
+
+		printf("%-40s %" PRIu64 " pairs %" PRIu64 " calls %s\n", names[i], pairs[ids[i]], calls, pairs_ok ? "ok" : "FAILED");
+		ok &= pairs_ok;
+	}
+
+	profiler_trace_decoder_free(&decoder);
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	return ok;
+}
+#endif
+
+/* Scopes with ids of their own, the same name for all of them */
+template <int N>
+static void bench_budget_scopes()
+{
+	profiler_start(budget_scope);
+	profiler_stop(budget_scope);
+
+	bench_budget_scopes<N - 1>();
+}
+
+template <>
+void bench_budget_scopes<0>()
+{
+}
+
+static void bench_check_budget_worker()
+{
+	profiler_start(budget_worker);
+	profiler_stop(budget_worker);
+}
+
+#ifdef PROFILER_TRACE
+/* Decode every events chunk of `trace`, counting the events and the ends of every scope; returns 0 if a chunk is damaged */
+static int bench_count_trace_events(const struct profiler_trace* trace, std::vector<uint64_t>& pairs, uint64_t* events)
+{
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	uint64_t offset = profiler_trace_first_chunk(trace);
+	const struct profiler_trace_chunk* chunk;
+	int decoded = 1;
+
+	while (decoded && (chunk = profiler_trace_chunk_at(trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			struct profiler_trace_event event;
+
+			decoded &= profiler_trace_chunk_decoder(trace, chunk, &decoder);
+			while (decoded && profiler_trace_decoder_next(&decoder, &event))
+			{
+				if (event.type == PROFILER_TRACE_EVENT_END && event.id < pairs.size())
+					pairs[event.id]++;
+
+				(*events)++;
+			}
+		}
+
+		offset = profiler_trace_chunk_next(trace, chunk, offset);
+	}
+
+	profiler_trace_decoder_free(&decoder);
+	return decoded;
+}
+
+/* Trace from one thread with room for a single block, every event must be in the trace or counted as dropped */
+static int bench_check_budget_trace(int policy, const char* name)
+{
+	const int iterations = 16 * PROFILER_TRACE_BLOCK_SIZE / 8;
+	const char* filename = "smallprofiler_check_budget.sptrace";
+
+	struct profiler_budget budget = { 0, 0, sizeof(struct profiler_trace_block), policy };
+	profiler_initialize_budget(&budget);
+
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+
+	bench_check_trace_worker(iterations);
+
+	profiler_trace_end();
+
+	struct profiler_dropped dropped;
+	profiler_get_dropped(&dropped);
+
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	std::vector<uint64_t> pairs(PROFILER_NODES_MAX, 0);
+	uint64_t events = 0;
+	int decoded = bench_count_trace_events(&trace, pairs, &events);
+
+	uint64_t written = profiler_trace_dropped_events(&trace);
+	uint64_t expected = 4 * (uint64_t)iterations;
+	int ok = decoded && dropped.events > 0 && written == dropped.events && events + written == expected;
+
+	printf("%-40s %" PRIu64 " events %" PRIu64 " dropped of %" PRIu64 " %s\n", name, events, written, expected, ok ? "ok" : "FAILED");
+
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	return ok;
+}
+#endif
+
+#ifdef PROFILER_TRACE
+/* Rounds of short-lived threads that each record less than a block, the blocks of every round must be reused by the next */
+static int bench_check_trace_pool(int threads)
+{
+	const int rounds = 32;
+	const int iterations = PROFILER_TRACE_BLOCK_SIZE / 64;
+	const char* filename = "smallprofiler_check_pool.sptrace";
+
+	profiler_reset();
+
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+
+	int round;
+	for (round = 0; round < rounds; round++)
+	{
+		std::vector<std::thread> workers;
+
+		int i;
+		for (i = 0; i < threads; i++)
+			workers.emplace_back(bench_check_trace_worker, iterations);
+
+		for (std::thread& worker : workers)
+			worker.join();
+
+		/* Until the background threads have written what the threads left when they exited */
+		int waited;
+		for (waited = 0; waited < 5000 && profiler_atomic_load_u64(&profiler_budget_trace_used) != 0; waited++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	profiler_trace_end();
+	profiler_collect();
+
+	/* A node only takes the blocks of other nodes once none are left to carve */
+	int blocks = profiler_trace_pool_fresh;
+	int reused = blocks <= threads * profiler_numa_node_count();
+
+	printf("%-40s %d blocks for %d threads %s\n", "blocks reused by later threads", blocks, rounds * threads, reused ? "ok" : "FAILED");
+	int ok = reused;
+
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	std::vector<uint64_t> pairs(PROFILER_NODES_MAX, 0);
+	uint64_t events = 0;
+	int decoded = bench_count_trace_events(&trace, pairs, &events);
+
+	int ids[2] = { bench_find_node("trace_outer"), bench_find_node("trace_inner") };
+	const char* names[2] = { "trace_outer", "trace_inner" };
+
+	ok &= decoded && ids[0] >= 0 && ids[1] >= 0;
+
+	/* Every thread exited before the trace ended, so its last block was handed over when it did */
+	int i;
+	for (i = 0; ok && i < 2; i++)
+	{
+		uint64_t expected = (uint64_t)rounds * threads * iterations;
+		int pairs_ok = pairs[ids[i]] == expected;
+
+		printf("%-40s %" PRIu64 " pairs of %" PRIu64 " %s\n", names[i], pairs[ids[i]], expected, pairs_ok ? "ok" : "FAILED");
+		ok &= pairs_ok;
+	}
+
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	return ok;
+}
+#endif
+
+#if defined(PROFILER_FIBERS) && defined(PROFILER_TRACE) && !defined(_WIN32)
+/* A fiber on a stack of its own, run by the thread's own context as the scheduler */
+struct bench_fiber
+{
+	ucontext_t context;
+	struct profiler_fiber profiler;
+	std::vector<char> stack;
+};
+
+static ucontext_t bench_fiber_scheduler;
+static bench_fiber* bench_fiber_running = NULL;
+
+static void bench_fiber_run(bench_fiber* fiber)
+{
+	bench_fiber_running = fiber;
+	profiler_fiber_switch(NULL, &fiber->profiler);
+	swapcontext(&bench_fiber_scheduler, &fiber->context);
+}
+
+static void bench_fiber_yield()
+{
+	bench_fiber* fiber = bench_fiber_running;
+	profiler_fiber_switch(&fiber->profiler, NULL);
+	swapcontext(&fiber->context, &bench_fiber_scheduler);
+}
+
+/* Both yield in the middle of a scope and once more at the end, they are never run again after that. Fiber a yields in a wait, which ends as soon as it runs again, and fiber b waits while a's is open */
+static void bench_fiber_a()
+{
+	profiler_start(fiber_a);
+	bench_spin(0.002);
+	profiler_wait_begin();
+	bench_fiber_yield();
+	profiler_wait_end();
+	bench_spin(0.002);
+	profiler_stop(fiber_a);
+
+	bench_fiber_yield();
+}
+
+static void bench_fiber_b()
+{
+	profiler_start(fiber_b);
+	bench_spin(0.001);
+	profiler_wait_begin();
+	bench_spin(0.001);
+	profiler_wait_end();
+	bench_fiber_yield();
+
+	profiler_start(fiber_b_inner);
+	bench_spin(0.002);
+	profiler_stop(fiber_b_inner);
+	profiler_stop(fiber_b);
+
+	bench_fiber_yield();
+}
+
+static void bench_fiber_create(bench_fiber* fiber, void (*function)())
+{
+	memset(&fiber->profiler, 0, sizeof(fiber->profiler));
+	fiber->stack.assign(256 * 1024, 0);
+
+	getcontext(&fiber->context);
+	fiber->context.uc_stack.ss_sp = fiber->stack.data();
+	fiber->context.uc_stack.ss_size = fiber->stack.size();
+	fiber->context.uc_link = NULL;
+	makecontext(&fiber->context, function, 0);
+}
+
+/* Scopes of two fibers interleaved on one thread must time only their own fiber, under their own parents and on tracks of their own */
+static int bench_check_fibers(double tolerance)
+{
+	const int rounds = 5;
+	const char* filename = "smallprofiler_check_fibers.sptrace";
+
+	profiler_reset();
+
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+
+	static bench_fiber fibers[2];
+
+	int round;
+	for (round = 0; round < rounds; round++)
+	{
+		/* The fibers of the last round are still switched out with their blocks when the trace ends */
+		if (round > 0)
+		{
+			profiler_fiber_end(&fibers[0].profiler);
+			profiler_fiber_end(&fibers[1].profiler);
+		}
+
+		bench_fiber_create(&fibers[0], bench_fiber_a);
+		bench_fiber_create(&fibers[1], bench_fiber_b);
+
+		profiler_start(fiber_scheduler);
+		bench_fiber_run(&fibers[0]);
+		bench_fiber_run(&fibers[1]);
+		bench_spin(0.003);
+		bench_fiber_run(&fibers[0]);
+		bench_fiber_run(&fibers[1]);
+		profiler_stop(fiber_scheduler);
+	}
+
+	profiler_trace_end();
+	profiler_fiber_end(&fibers[0].profiler);
+	profiler_fiber_end(&fibers[1].profiler);
+	profiler_collect();
+
+	int ok = 1;
+	ok &= bench_check_parent("fiber_scheduler", NULL);
+	ok &= bench_check_parent("fiber_a", NULL);
+	ok &= bench_check_parent("fiber_b", NULL);
+	ok &= bench_check_parent("fiber_b_inner", "fiber_b");
+
+	if (!ok)
+		return 0;
+
+	struct { const char* name; double seconds; } expected[] =
+	{
+		{ "fiber_scheduler", 0.003 },
+		{ "fiber_a", 0.004 },
+		{ "fiber_b", 0.004 },
+		{ "fiber_b_inner", 0.002 },
+	};
+
+	for (size_t j = 0; j < sizeof(expected) / sizeof(expected[0]); j++)
+		ok &= bench_check_value(expected[j].name, bench_seconds(profiler_nodes[bench_find_node(expected[j].name)].total_cycles), rounds * expected[j].seconds, tolerance);
+
+	/* Every fiber waits on its own: a was not blocked while it ran, b's wait counted for b alone */
+	double blocked_a = bench_seconds(profiler_nodes[bench_find_node("fiber_a")].blocked_cycles);
+	double blocked_b = bench_seconds(profiler_nodes[bench_find_node("fiber_b")].blocked_cycles);
+	double blocked_scheduler = bench_seconds(profiler_nodes[bench_find_node("fiber_scheduler")].blocked_cycles);
+
+	int waits = blocked_a < rounds * 0.001 * tolerance && blocked_scheduler == 0.0;
+	printf("%-24s a %10.6f scheduler %10.6f %s\n", "fiber blocked", blocked_a, blocked_scheduler, waits ? "ok" : "FAILED");
+	ok &= waits;
+	ok &= bench_check_value("fiber_b blocked", blocked_b, rounds * 0.001, tolerance);
+
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	/* The context every scope runs in: the scheduler, fiber a or fiber b */
+	std::vector<int> contexts(profiler_trace_name_count(&trace), -1);
+	contexts[bench_find_node("fiber_scheduler")] = 0;
+	contexts[bench_find_node("fiber_a")] = 1;
+	contexts[bench_find_node("fiber_b")] = 2;
+	contexts[bench_find_node("fiber_b_inner")] = 2;
+
+	/* Per track: the context of its scopes, the open scopes and the pairs */
+	std::vector<int> track_contexts;
+	std::vector<std::vector<uint32_t>> stacks;
+	std::vector<uint64_t> pairs;
+	int nested = 1;
+
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	uint64_t offset = profiler_trace_first_chunk(&trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while (nested && (chunk = profiler_trace_chunk_at(&trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			if (chunk->thread >= track_contexts.size())
+			{
+				track_contexts.resize(chunk->thread + 1, -1);
+				stacks.resize(chunk->thread + 1);
+				pairs.resize(chunk->thread + 1, 0);
+			}
+
+			struct profiler_trace_event event;
+			nested &= profiler_trace_chunk_decoder(&trace, chunk, &decoder);
+
+			while (nested && profiler_trace_decoder_next(&decoder, &event))
+			{
+				int context = event.id < contexts.size() ? contexts[event.id] : -1;
+				std::vector<uint32_t>& stack = stacks[chunk->thread];
+
+				nested &= context >= 0 && (track_contexts[chunk->thread] == -1 || track_contexts[chunk->thread] == context);
+				track_contexts[chunk->thread] = context;
+
+				if (event.type == PROFILER_TRACE_EVENT_BEGIN)
+				{
+					stack.push_back(event.id);
+				}
+				else
+				{
+					nested &= !stack.empty() && stack.back() == event.id;
+					if (nested)
+						stack.pop_back();
+					pairs[chunk->thread]++;
+				}
+			}
+		}
+
+		offset = profiler_trace_chunk_next(&trace, chunk, offset);
+	}
+
+	profiler_trace_decoder_free(&decoder);
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	/* One track for the scheduler and one for every fiber, each with all of its pairs */
+	int tracks[3] = { 0, 0, 0 };
+	uint64_t context_pairs[3] = { 0, 0, 0 };
+
+	for (size_t track = 0; nested && track < track_contexts.size(); track++)
+	{
+		nested &= stacks[track].empty();
+		if (track_contexts[track] >= 0)
+		{
+			tracks[track_contexts[track]]++;
+			context_pairs[track_contexts[track]] += pairs[track];
+		}
+	}
+
+	printf("%-40s %s\n", "scopes nested on the track of their fiber", nested ? "ok" : "FAILED");
+	ok &= nested;
+
+	int separate = tracks[0] == 1 && tracks[1] == rounds && tracks[2] == rounds &&
+		context_pairs[0] == (uint64_t)rounds && context_pairs[1] == (uint64_t)rounds && context_pairs[2] == 2 * (uint64_t)rounds;
+
+	printf("%-40s %d, %d and %d tracks %s\n", "scheduler and fiber tracks", tracks[0], tracks[1], tracks[2], separate ? "ok" : "FAILED");
+	ok &= separate;
+
+	return ok;
+}
+#endif
+
+/* Async scopes begun on one thread and ended on another must count their latency under the scope they began in */
+static int bench_check_async(double tolerance)
+{
+	const int requests = 10;
+	const double latency = 0.004;
+#ifdef PROFILER_TRACE
+	const char* filename = "smallprofiler_check_async.sptrace";
+#endif
+
+	profiler_reset();
+
+#ifdef PROFILER_TRACE
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+#endif
+
+	struct profiler_async pending[requests];
+	std::atomic<int> begun(0);
+	std::atomic<int> ended(0);
+
+	/* Ends every request the latency after it began */
+	std::thread completer([&]()
+	{
+		int i;
+		for (i = 0; i < requests; i++)
+		{
+			while (begun.load(std::memory_order_acquire) <= i)
+				std::this_thread::yield();
+
+			bench_spin(latency);
+			profiler_async_end(&pending[i]);
+			ended.store(i + 1, std::memory_order_release);
+		}
+	});
+
+	int i;
+	for (i = 0; i < requests; i++)
+	{
+		profiler_start(async_caller);
+		profiler_async_begin(async_request, &pending[i]);
+
+		/* The caller's scope stays the parent after the async scope began */
+		profiler_start(async_caller_after);
+		profiler_stop(async_caller_after);
+		profiler_stop(async_caller);
+
+		begun.store(i + 1, std::memory_order_release);
+
+		/* One request in flight at a time, so each one waits only for the spin */
+		while (ended.load(std::memory_order_acquire) <= i)
+			std::this_thread::yield();
+	}
+
+	completer.join();
+
+#ifdef PROFILER_TRACE
+	profiler_trace_end();
+#endif
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int ok = 1;
+	ok &= bench_check_parent("async_caller", NULL);
+	ok &= bench_check_parent("async_request", "async_caller");
+	ok &= bench_check_parent("async_caller_after", "async_caller");
+
+	int id = bench_find_node("async_request");
+	if (!ok || id < 0)
+		return 0;
+
+	int calls = profiler_nodes[id].calls == (uint64_t)requests;
+	printf("%-24s %10d calls %s\n", "async_request", (int)profiler_nodes[id].calls, calls ? "ok" : "FAILED");
+	ok &= calls;
+
+	ok &= bench_check_value("async_request latency", bench_seconds(profiler_nodes[id].total_cycles) / requests, latency, tolerance);
+
+	int reported = strstr(results, " : latency ") != NULL;
+	printf("%-24s %s\n", "latency in the results", reported ? "ok" : "FAILED");
+	ok &= reported;
+
+#ifdef PROFILER_TRACE
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	/* Per flow: the track and time of its begin and of its end */
+	struct bench_flow { uint32_t begin_thread; uint32_t end_thread; uint64_t begin_cycles; uint64_t end_cycles; int begins; int ends; };
+	std::vector<bench_flow> flows;
+	int paired = 1;
+
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	uint64_t offset = profiler_trace_first_chunk(&trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while (paired && (chunk = profiler_trace_chunk_at(&trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			struct profiler_trace_event event;
+			paired &= profiler_trace_chunk_decoder(&trace, chunk, &decoder);
+
+			while (paired && profiler_trace_decoder_next(&decoder, &event))
+			{
+				if (event.type != PROFILER_TRACE_EVENT_ASYNC_BEGIN && event.type != PROFILER_TRACE_EVENT_ASYNC_END)
+					continue;
+
+				paired &= event.id == (uint32_t)id && event.flow > 0 && event.flow <= (uint64_t)requests;
+				if (!paired)
+					break;
+
+				if (event.flow > flows.size())
+					flows.resize(event.flow, bench_flow());
+
+				bench_flow& flow = flows[event.flow - 1];
+				if (event.type == PROFILER_TRACE_EVENT_ASYNC_BEGIN)
+				{
+					flow.begin_thread = chunk->thread;
+					flow.begin_cycles = event.cycles;
+					flow.begins++;
+				}
+				else
+				{
+					flow.end_thread = chunk->thread;
+					flow.end_cycles = event.cycles;
+					flow.ends++;
+				}
+			}
+		}
+
+		offset = profiler_trace_chunk_next(&trace, chunk, offset);
+	}
+
+	profiler_trace_decoder_free(&decoder);
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	paired &= flows.size() == (size_t)requests;
+	for (const bench_flow& flow : flows)
+	{
+		paired &= flow.begins == 1 && flow.ends == 1 && flow.begin_thread != flow.end_thread &&
+			flow.end_cycles >= flow.begin_cycles;
+	}
+
+	printf("%-40s %zu flows of %d %s\n", "async begins paired with ends", flows.size(), requests, paired ? "ok" : "FAILED");
+	ok &= paired;
+#endif
+
+	return ok;
+}
+
+/* Tasks one worker runs itself and tasks another worker steals from it must count their queue wait, execution and steals apart */
+static int bench_check_tasks(double tolerance)
+{
+	const int tasks = 10;
+	const double wait = 0.002;
+	const double execution = 0.002;
+#ifdef PROFILER_TRACE
+	const char* filename = "smallprofiler_check_tasks.sptrace";
+#endif
+
+	profiler_reset();
+
+#ifdef PROFILER_TRACE
+	if (!profiler_trace_begin(filename))
+	{
+		printf("could not write %s FAILED\n", filename);
+		return 0;
+	}
+#endif
+
+	struct profiler_task stolen[tasks];
+	std::atomic<int> enqueued(0);
+	std::atomic<int> completed(0);
+
+	std::thread thief([&]()
+	{
+		profiler_start(task_thief);
+
+		int i;
+		for (i = 0; i < tasks; i++)
+		{
+			while (enqueued.load(std::memory_order_acquire) <= i)
+				std::this_thread::yield();
+
+			bench_spin(wait);
+			profiler_task_dequeue(&stolen[i]);
+			bench_spin(execution);
+			profiler_task_complete(&stolen[i]);
+
+			completed.store(i + 1, std::memory_order_release);
+		}
+
+		profiler_stop(task_thief);
+	});
+
+	profiler_start(task_owner);
+
+	int i;
+	for (i = 0; i < tasks; i++)
+	{
+		/* One stolen task queued at a time, so each one waits only for the spin */
+		profiler_task_enqueue(task_stolen, &stolen[i]);
+		enqueued.store(i + 1, std::memory_order_release);
+
+		while (completed.load(std::memory_order_acquire) <= i)
+			std::this_thread::yield();
+	}
+
+	thief.join();
+
+	for (i = 0; i < tasks; i++)
+	{
+		struct profiler_task local;
+		profiler_task_enqueue(task_local, &local);
+		bench_spin(wait);
+		profiler_task_dequeue(&local);
+
+		profiler_start(task_local_inner);
+		bench_spin(execution);
+		profiler_stop(task_local_inner);
+
+		profiler_task_complete(&local);
+	}
+
+	profiler_stop(task_owner);
+
+#ifdef PROFILER_TRACE
+	profiler_trace_end();
+#endif
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int ok = 1;
+	ok &= bench_check_parent("task_stolen", "task_thief");
+	ok &= bench_check_parent("task_local", "task_owner");
+	ok &= bench_check_parent("task_local_inner", "task_local");
+
+	if (!ok)
+		return 0;
+
+	const char* names[2] = { "task_stolen", "task_local" };
+	int ids[2] = { bench_find_node("task_stolen"), bench_find_node("task_local") };
+
+	int j;
+	for (j = 0; j < 2; j++)
+	{
+		const struct profiler_node* node = &profiler_nodes[ids[j]];
+		char what[64];
+
+		uint64_t steals = j == 0 ? tasks : 0;
+		int counted = node->calls == (uint64_t)tasks && node->steals == steals;
+		printf("%-24s %10d calls %4d steals %s\n", names[j], (int)node->calls, (int)node->steals, counted ? "ok" : "FAILED");
+		ok &= counted;
+
+		/* Both spin on the wall clock, a thread preempted in the middle only takes longer, and a stolen task also waits for the thief to wake up */
+		snprintf(what, sizeof(what), "%s execution", names[j]);
+		ok &= bench_check_at_least(what, bench_seconds(node->total_cycles) / tasks, execution, tolerance);
+
+		snprintf(what, sizeof(what), "%s wait", names[j]);
+		ok &= bench_check_at_least(what, bench_seconds(node->wait_cycles) / tasks, wait, tolerance);
+
+#ifdef PROFILER_HISTOGRAMS
+		/* The upper end of the log2 bucket of the longest waits */
+		if (j == 1)
+			ok &= bench_check_at_least("task_local wait p99", bench_seconds(profiler_percentile(ids[j], offsetof(struct profiler_thread_node, wait_histogram), 99)), wait, tolerance);
+#endif
+	}
+
+#ifdef PROFILER_HISTOGRAMS
+	int reported = strstr(results, " : wait p99 ") != NULL && strstr(results, " : steals 10") != NULL;
+#else
+	int reported = strstr(results, " : wait ") != NULL && strstr(results, " : steals 10") != NULL;
+#endif
+	printf("%-24s %s\n", "wait and steals in the results", reported ? "ok" : "FAILED");
+	ok &= reported;
+
+#ifdef PROFILER_TRACE
+	struct profiler_trace trace;
+	if (!profiler_trace_open(&trace, filename))
+	{
+		printf("could not open %s FAILED\n", filename);
+		return 0;
+	}
+
+	/* Per track: the executions of each task type that ended on it */
+	std::vector<uint64_t> executions[2];
+	int decoded = 1;
+
+	static struct profiler_trace_decoder decoder;
+	profiler_trace_decoder_create(&decoder);
+
+	uint64_t offset = profiler_trace_first_chunk(&trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while (decoded && (chunk = profiler_trace_chunk_at(&trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			struct profiler_trace_event event;
+			decoded &= profiler_trace_chunk_decoder(&trace, chunk, &decoder);
+
+			while (decoded && profiler_trace_decoder_next(&decoder, &event))
+			{
+				for (j = 0; j < 2; j++)
+				{
+					if (event.type != PROFILER_TRACE_EVENT_END || event.id != (uint32_t)ids[j])
+						continue;
+
+					if (chunk->thread >= executions[j].size())
+						executions[j].resize(chunk->thread + 1, 0);
+					executions[j][chunk->thread]++;
+				}
+			}
+		}
+
+		offset = profiler_trace_chunk_next(&trace, chunk, offset);
+	}
+
+	profiler_trace_decoder_free(&decoder);
+	profiler_trace_close(&trace);
+	remove(filename);
+
+	/* Every execution on the track of the worker that ran it, the two workers on tracks of their own */
+	size_t tracks[2] = { 0, 0 };
+	for (j = 0; decoded && j < 2; j++)
+	{
+		size_t track = std::find(executions[j].begin(), executions[j].end(), (uint64_t)tasks) - executions[j].begin();
+		decoded &= track < executions[j].size();
+		tracks[j] = track;
+	}
+
+	decoded &= tracks[0] != tracks[1];
+	printf("%-40s %s\n", "executions on the track of their worker", decoded ? "ok" : "FAILED");
+	ok &= decoded;
+#endif
+
+	return ok;
+}
+
+/* A lock held by one thread while another waits for it must count the contended wait, the holds and the scope that held it */
+static int bench_check_locks(double tolerance)
+{
+	const int rounds = 10;
+	const double hold = 0.002;
+
+	profiler_reset();
+
+	static profiler_mutex<std::mutex> mutex("check_lock");
+	std::atomic<int> held(0);
+	std::atomic<int> taken(0);
+
+	/* The holder sleeps while it holds the lock, so the waiter runs and finds it taken even on one CPU */
+	std::thread holder([&]()
+	{
+		int i;
+		for (i = 0; i < rounds; i++)
+		{
+			while (taken.load(std::memory_order_acquire) < i)
+				std::this_thread::yield();
+
+			profiler_start(lock_holder);
+			mutex.lock();
+			held.store(i + 1, std::memory_order_release);
+			std::this_thread::sleep_for(std::chrono::duration<double>(hold));
+			mutex.unlock();
+			profiler_stop(lock_holder);
+		}
+	});
+
+	int i;
+	for (i = 0; i < rounds; i++)
+	{
+		while (held.load(std::memory_order_acquire) <= i)
+			std::this_thread::yield();
+
+		profiler_start(lock_waiter);
+		mutex.lock();
+		mutex.unlock();
+		profiler_stop(lock_waiter);
+
+		taken.store(i + 1, std::memory_order_release);
+	}
+
+	holder.join();
+
+#ifdef BENCH_SHARED_MUTEX
+	/* Readers together, then a writer that has to wait for the last of them */
+	static profiler_shared_mutex<std::shared_mutex> shared_mutex("check_shared_lock");
+	std::atomic<int> readers(0);
+
+	std::thread reader([&]()
+	{
+		std::shared_lock<profiler_shared_mutex<std::shared_mutex>> guard(shared_mutex);
+		readers.store(1, std::memory_order_release);
+		std::this_thread::sleep_for(std::chrono::duration<double>(hold));
+	});
+
+	while (readers.load(std::memory_order_acquire) == 0)
+		std::this_thread::yield();
+
+	{
+		std::shared_lock<profiler_shared_mutex<std::shared_mutex>> shared(shared_mutex);
+	}
+	{
+		std::lock_guard<profiler_shared_mutex<std::shared_mutex>> exclusive(shared_mutex);
+	}
+
+	reader.join();
+#endif
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int ok = 1;
+	ok &= bench_check_parent("check_lock", NULL);
+
+	int id = bench_find_node("check_lock");
+	int holder_id = bench_find_node("lock_holder");
+	int waiter_id = bench_find_node("lock_waiter");
+
+	if (!ok || holder_id < 0 || waiter_id < 0)
+		return 0;
+
+	const struct profiler_node* node = &profiler_nodes[id];
+
+	/* Every acquisition of the waiter had to wait, none of the holder's */
+	int counted = node->calls == 2 * (uint64_t)rounds && node->contentions == (uint64_t)rounds;
+	printf("%-24s %10d calls %4d contended %s\n", "check_lock", (int)node->calls, (int)node->contentions, counted ? "ok" : "FAILED");
+	ok &= counted;
+
+	double held_seconds = bench_seconds(node->total_cycles) / rounds;
+	int held_long = held_seconds >= hold * (1.0 - tolerance);
+	printf("%-24s %10.6f at least %10.6f %s\n", "check_lock hold", held_seconds, hold, held_long ? "ok" : "FAILED");
+	ok &= held_long;
+
+	/* The waiter comes in while the holder sleeps, so it waits for about the rest of the hold and to be woken up */
+	double waited = bench_seconds(node->wait_cycles) / rounds;
+	int waited_ok = waited > 0.0 && waited <= 2.0 * held_seconds;
+	printf("%-24s %10.6f at most  %10.6f %s\n", "check_lock wait", waited, 2.0 * held_seconds, waited_ok ? "ok" : "FAILED");
+	ok &= waited_ok;
+
+	int blamed = profiler_nodes[holder_id].blocking_cycles == node->wait_cycles && profiler_nodes[waiter_id].blocking_cycles == 0;
+	printf("%-24s %10.6f blocking %s\n", "lock_holder", bench_seconds(profiler_nodes[holder_id].blocking_cycles), blamed ? "ok" : "FAILED");
+	ok &= blamed;
+
+#ifdef PROFILER_HISTOGRAMS
+	double hold_p99 = bench_seconds(profiler_percentile(id, offsetof(struct profiler_thread_node, histogram), 99));
+	int bucketed = hold_p99 >= hold * (1.0 - tolerance);
+	printf("%-24s %10.6f at least %10.6f %s\n", "check_lock hold p99", hold_p99, hold, bucketed ? "ok" : "FAILED");
+	ok &= bucketed;
+
+	int reported = strstr(results, " : contended ") != NULL && strstr(results, " : hold p99 ") != NULL && strstr(results, " : blocking ") != NULL;
+#else
+	int reported = strstr(results, " : contended ") != NULL && strstr(results, " : blocking ") != NULL;
+#endif
+	printf("%-24s %s\n", "locks in the results", reported ? "ok" : "FAILED");
+	ok &= reported;
+
+#ifdef BENCH_SHARED_MUTEX
+	/* Only the writer's hold is timed, and only the writer waited */
+	int shared_id = bench_find_node("check_shared_lock");
+	int shared = shared_id >= 0 && profiler_nodes[shared_id].calls == 1 && profiler_nodes[shared_id].contentions == 1;
+	printf("%-24s %10d calls %4d contended %s\n", "check_shared_lock", shared_id >= 0 ? (int)profiler_nodes[shared_id].calls : 0,
+		   shared_id >= 0 ? (int)profiler_nodes[shared_id].contentions : 0, shared ? "ok" : "FAILED");
+	ok &= shared;
+#endif
+
+	return ok;
+}
+
+/* Replace what the tables counted for node `id` with exact cycles, so that ranks can tie */
+static void bench_set_node_cycles(int id, uint64_t total_cycles, uint64_t blocked_cycles)
+{
+	struct profiler_thread_node* nodes;
+	int first = 1;
+
+	for (nodes = profiler_tables_next(NULL); nodes; nodes = profiler_tables_next(nodes))
+	{
+		nodes[id].total_cycles = first ? total_cycles : 0;
+		nodes[id].blocked_cycles = first ? blocked_cycles : 0;
+		nodes[id].calls = first ? 1 : 0;
+		first = 0;
+	}
+}
+
+/* A scope blocked all the time, its subtree and siblings that tie must all be listed, ties in the order they were set up */
+static int bench_check_blocked_ranks()
+{
+	profiler_reset();
+
+	profiler_start(rank_parent);
+	{
+		profiler_start(rank_blocked);
+		profiler_start(rank_blocked_child);
+		profiler_stop(rank_blocked_child);
+		profiler_stop(rank_blocked);
+	}
+	{
+		profiler_start(rank_tie_a);
+		profiler_stop(rank_tie_a);
+	}
+	{
+		profiler_start(rank_tie_b);
+		profiler_stop(rank_tie_b);
+	}
+	profiler_stop(rank_parent);
+
+	int ids[4] = { bench_find_node("rank_blocked"), bench_find_node("rank_blocked_child"), bench_find_node("rank_tie_a"), bench_find_node("rank_tie_b") };
+	if (ids[0] < 0 || ids[1] < 0 || ids[2] < 0 || ids[3] < 0)
+	{
+		printf("rank scopes not found FAILED\n");
+		return 0;
+	}
+
+	bench_set_node_cycles(ids[0], 1000000, 1000000);
+	bench_set_node_cycles(ids[1], 1000, 1000);
+	bench_set_node_cycles(ids[2], 500000, 0);
+	bench_set_node_cycles(ids[3], 500000, 0);
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	const char* blocked = strstr(results, "rank_blocked ");
+	const char* child = strstr(results, "rank_blocked_child");
+	const char* tie_a = strstr(results, "rank_tie_a");
+	const char* tie_b = strstr(results, "rank_tie_b");
+
+	int listed = blocked && child;
+	printf("%-24s %s\n", "fully blocked listed", listed ? "ok" : "FAILED");
+
+	int tied = tie_a && tie_b && tie_a < tie_b && (!blocked || tie_b < blocked);
+	printf("%-24s %s\n", "ties listed in order", tied ? "ok" : "FAILED");
+
+	return listed && tied;
+}
+
+/* A scope blocked in a wait must count the wait as blocked, for itself and the scopes above it, and rank below a busy one */
+static int bench_check_blocked(double tolerance)
+{
+	const int rounds = 5;
+	const double busy = 0.002;
+	const double idle = 0.006;
+
+	profiler_reset();
+
+	std::mutex mutex;
+	std::condition_variable ready;
+
+	int i;
+	for (i = 0; i < rounds; i++)
+	{
+		profiler_start(blocked_outer);
+
+		profiler_start(blocked_busy);
+		bench_spin(busy);
+		profiler_stop(blocked_busy);
+
+		/* Woken by another thread after the idle time */
+		profiler_start(blocked_idle);
+		bool woken = false;
+		std::thread notifier([&]()
+		{
+			std::this_thread::sleep_for(std::chrono::duration<double>(idle));
+
+			std::lock_guard<std::mutex> guard(mutex);
+			woken = true;
+			ready.notify_one();
+		});
+
+		{
+			std::unique_lock<std::mutex> guard(mutex);
+			profiler_blocked([&] { ready.wait(guard, [&] { return woken; }); });
+		}
+
+		notifier.join();
+		profiler_stop(blocked_idle);
+
+		profiler_stop(blocked_outer);
+	}
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int outer = bench_find_node("blocked_outer");
+	int busy_id = bench_find_node("blocked_busy");
+	int idle_id = bench_find_node("blocked_idle");
+
+	int ok = outer >= 0 && busy_id >= 0 && idle_id >= 0;
+	if (!ok)
+	{
+		printf("blocked scopes not found FAILED\n");
+		return 0;
+	}
+
+	double idle_blocked = bench_seconds(profiler_nodes[idle_id].blocked_cycles);
+	int waited = idle_blocked >= rounds * idle * (1.0 - tolerance) && profiler_nodes[idle_id].blocked_cycles <= profiler_nodes[idle_id].total_cycles;
+	printf("%-24s %10.6f at least %10.6f %s\n", "blocked_idle blocked", idle_blocked, rounds * idle, waited ? "ok" : "FAILED");
+	ok &= waited;
+
+	int running = profiler_nodes[busy_id].blocked_cycles == 0;
+	printf("%-24s %10.6f blocked %s\n", "blocked_busy", bench_seconds(profiler_nodes[busy_id].blocked_cycles), running ? "ok" : "FAILED");
+	ok &= running;
+
+	int inherited = profiler_nodes[outer].blocked_cycles == profiler_nodes[idle_id].blocked_cycles;
+	printf("%-24s %10.6f blocked %s\n", "blocked_outer", bench_seconds(profiler_nodes[outer].blocked_cycles), inherited ? "ok" : "FAILED");
+	ok &= inherited;
+
+	/* The busy scope has less time in all but runs more, so it comes first */
+	const char* busy_line = strstr(results, "blocked_busy");
+	const char* idle_line = strstr(results, "blocked_idle");
+	int ranked = busy_line && idle_line && busy_line < idle_line && strstr(idle_line, " : blocked ") != NULL;
+	printf("%-24s %s\n", "ranked by running time", ranked ? "ok" : "FAILED");
+	ok &= ranked;
+
+	size_t size = 0;
+	void* data = profiler_get_snapshot(&size);
+	struct profiler_snapshot snapshot;
+	int kept = 0;
+
+	if (data && profiler_snapshot_open_memory(&snapshot, data, size))
+	{
+		int64_t index = profiler_snapshot_find(&snapshot, "blocked_outer;blocked_idle");
+		kept = index >= 0 && profiler_snapshot_get_node(&snapshot, (uint32_t)index).blocked_cycles == profiler_nodes[idle_id].blocked_cycles;
+		profiler_snapshot_close(&snapshot);
+	}
+
+	profiler_free_snapshot(data);
+
+	printf("%-24s %s\n", "blocked in the snapshot", kept ? "ok" : "FAILED");
+	ok &= kept;
+
+	ok &= bench_check_blocked_ranks();
+
+	return ok;
+}
+
+#ifndef _WIN32
+static int bench_check_io_node(const char* name, uint64_t calls, uint64_t bytes, uint64_t syncs)
+{
+	int id = bench_find_node(name);
+	int ok = id >= 0 &&
+		profiler_nodes[id].io_calls == calls &&
+		profiler_nodes[id].io_bytes == bytes &&
+		profiler_nodes[id].syncs == syncs;
+
+	printf("%-24s %6d calls %8d bytes %4d syncs %s\n", name,
+		id >= 0 ? (int)profiler_nodes[id].io_calls : -1,
+		id >= 0 ? (int)profiler_nodes[id].io_bytes : -1,
+		id >= 0 ? (int)profiler_nodes[id].syncs : -1,
+		ok ? "ok" : "FAILED");
+	return ok;
+}
+
+/* I/O calls must count their bytes and syncs for the scope they are made in, and their time as blocked for the scopes above it */
+static int bench_check_io()
+{
+	const int small_writes = 100;
+	const size_t small_size = 16;
+
+	char buffer[4096];
+	memset(buffer, 'x', sizeof(buffer));
+
+	FILE* file = tmpfile();
+	int sockets[2];
+	if (!file || socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+	{
+		printf("could not open a file and a socket pair FAILED\n");
+		return 0;
+	}
+
+	int fd = fileno(file);
+
+	profiler_reset();
+
+	{
+		profiler_start(io_outer);
+
+		{
+			profiler_start(io_small);
+			int i;
+			for (i = 0; i < small_writes; i++)
+				profiler_write(fd, buffer, small_size);
+			profiler_stop(io_small);
+		}
+
+		{
+			profiler_start(io_batched);
+			profiler_pwrite(fd, buffer, small_writes * small_size, 0);
+			profiler_fsync(fd);
+			profiler_stop(io_batched);
+		}
+
+		{
+			profiler_start(io_read_back);
+			profiler_pread(fd, buffer, sizeof(buffer), 0);
+			profiler_stop(io_read_back);
+		}
+
+		{
+			profiler_start(io_socket);
+			profiler_send(sockets[0], buffer, 64, 0);
+			profiler_recv(sockets[1], buffer, sizeof(buffer), 0);
+			profiler_stop(io_socket);
+		}
+
+		profiler_stop(io_outer);
+	}
+
+	/* The first call of a thread sets up the profiler for it, the caller must still see the errno of the call */
+	int kept_errno = 0;
+	std::thread fresh([&]()
+	{
+		errno = 0;
+		int bad_file = profiler_read(-1, buffer, 1) < 0 && errno == EBADF;
+
+		errno = 0;
+		int would_block = profiler_recv(sockets[1], buffer, sizeof(buffer), MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+		kept_errno = bad_file && would_block;
+	});
+	fresh.join();
+
+	printf("%-24s %s\n", "errno of failed calls", kept_errno ? "ok" : "FAILED");
+
+	fclose(file);
+	close(sockets[0]);
+	close(sockets[1]);
+
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	int ok = kept_errno;
+	ok &= bench_check_io_node("io_small", small_writes, small_writes * small_size, 0);
+	ok &= bench_check_io_node("io_batched", 1, small_writes * small_size, 1);
+	ok &= bench_check_io_node("io_read_back", 1, small_writes * small_size, 0);
+	ok &= bench_check_io_node("io_socket", 2, 128, 0);
+	ok &= bench_check_io_node("io_outer", 0, 0, 0);
+
+	if (!ok)
+		return 0;
+
+	/* The scope above the calls waited for all of them */
+	uint64_t io_cycles = 0;
+	const char* names[] = { "io_small", "io_batched", "io_read_back", "io_socket" };
+	int i;
+	for (i = 0; i < 4; i++)
+	{
+		int id = bench_find_node(names[i]);
+		io_cycles += profiler_nodes[id].io_cycles + profiler_nodes[id].sync_cycles;
+	}
+
+	int outer = bench_find_node("io_outer");
+	int blocked = profiler_nodes[outer].blocked_cycles == io_cycles;
+	printf("%-24s %10.6f blocked %s\n", "io_outer", bench_seconds(profiler_nodes[outer].blocked_cycles), blocked ? "ok" : "FAILED");
+	ok &= blocked;
+
+	const char* small_line = strstr(results, "io_small");
+	int reported = small_line && strstr(small_line, " : io bytes/call 16 ") != NULL && strstr(results, " : syncs 1 ") != NULL;
+	printf("%-24s %s\n", "bytes per call and syncs", reported ? "ok" : "FAILED");
+	ok &= reported;
+
+	size_t size = 0;
+	void* data = profiler_get_snapshot(&size);
+	struct profiler_snapshot snapshot;
+	int kept = 0;
+
+	if (data && profiler_snapshot_open_memory(&snapshot, data, size))
+	{
+		int64_t index = profiler_snapshot_find(&snapshot, "io_outer;io_batched");
+		if (index >= 0)
+		{
+			struct profiler_snapshot_node node = profiler_snapshot_get_node(&snapshot, (uint32_t)index);
+			kept = node.io_calls == 1 && node.io_bytes == small_writes * small_size && node.syncs == 1;
+		}
+		profiler_snapshot_close(&snapshot);
+	}
+
+	profiler_free_snapshot(data);
+
+	printf("%-24s %s\n", "io in the snapshot", kept ? "ok" : "FAILED");
+	ok &= kept;
+
+	return ok;
+}
+#endif
+
+static int bench_check_budget()
+{
+	/* Room for the table of this thread and one more */
+	struct profiler_budget budget = { 0, 2 * PROFILER_THREAD_BYTES, 0, PROFILER_BUDGET_DROP_NEWEST };
+	profiler_initialize_budget(&budget);
+
+	bench_check_budget_worker();
+
+	/* Nothing dropped yet, which the report says too */
+	static char results[64 * 1024];
+	profiler_get_results(results);
+
+	const char* none = "Dropped: 0 calls of scopes beyond PROFILER_NODES_MAX, 0 threads, 0 trace events\n";
+	int complete = strncmp(results, none, strlen(none)) == 0;
+	printf("%-40s %s\n", "no drops in the results", complete ? "ok" : "FAILED");
+
+	std::thread first(bench_check_budget_worker);
+	first.join();
+
+	std::thread second(bench_check_budget_worker);
+	second.join();
+
+	struct profiler_dropped dropped;
+	profiler_get_dropped(&dropped);
+
+	int ok = dropped.threads == 1;
+	printf("%-40s %" PRIu64 " threads %s\n", "threads over the budget dropped", dropped.threads, ok ? "ok" : "FAILED");
+	ok &= complete;
+
+#ifdef PROFILER_TRACE
+	ok &= bench_check_budget_trace(PROFILER_BUDGET_DROP_NEWEST, "trace budget, drop newest");
+	ok &= bench_check_budget_trace(PROFILER_BUDGET_OVERWRITE_OLDEST, "trace budget, overwrite oldest");
+	ok &= bench_check_budget_trace(PROFILER_BUDGET_AGGREGATE_ONLY, "trace budget, aggregate only");
+#endif
+
+	/* Last, the scopes past PROFILER_NODES_MAX are not recorded, only counted */
+	profiler_reset();
+
+	int id_begin = profiler_current_id;
+	bench_budget_scopes<300>();
+	int id_end = profiler_current_id;
+
+	uint64_t expected_calls = (uint64_t)(id_end - std::max(id_begin, PROFILER_NODES_MAX));
+	profiler_get_dropped(&dropped);
+
+	int counted = dropped.threads == 1 && dropped.calls == expected_calls && dropped.events == 0;
+	printf("%-40s %" PRIu64 " calls %s\n", "calls beyond the node table counted", dropped.calls, counted ? "ok" : "FAILED");
+	ok &= counted;
+
+	profiler_get_results(results);
+
+	char line[256];
+	snprintf(line, sizeof(line), "Dropped: %" PRIu64 " calls of scopes beyond PROFILER_NODES_MAX, %" PRIu64 " threads, %" PRIu64 " trace events\n",
+			dropped.calls, dropped.threads, dropped.events);
+	int reported = strncmp(results, line, strlen(line)) == 0;
+
+	size_t size = 0;
+	void* data = profiler_get_snapshot(&size);
+	struct profiler_snapshot snapshot;
+
+	if (data && profiler_snapshot_open_memory(&snapshot, data, size))
+	{
+		struct profiler_snapshot_header header = profiler_snapshot_get_header(&snapshot);
+		reported &= header.dropped_calls == dropped.calls && header.dropped_threads == dropped.threads && header.dropped_events == dropped.events;
+		profiler_snapshot_close(&snapshot);
+	}
+	else
+	{
+		reported = 0;
+	}
+
+	profiler_free_snapshot(data);
+
+	printf("%-40s %s\n", "drops in the results and the snapshot", reported ? "ok" : "FAILED");
+	ok &= reported;
+
+	return ok;
+}
+
+static void bench_usage()
+{
+	fprintf(stderr,
+			"usage: smallprofiler_bench [--iterations N] [--threads N] [--output file]\n"
+			"       smallprofiler_bench --check accuracy|threads|overhead|scaling|snapshot|budget|async|tasks|locks|blocked|io|coroutine|cpus|migrations|fibers|trace|ring|pool [--tolerance X] [--max-cycles N] [--threads N]\n");
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = 100000;
+	int max_threads = 64;
+	const char* output = NULL;
+	const char* check = NULL;
+	double tolerance = 0.05;
+	double max_cycles = 250.0;
+
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+			iterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			output = argv[++i];
+		else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc)
+			check = argv[++i];
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+			tolerance = atof(argv[++i]);
+		else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc)
+			max_cycles = atof(argv[++i]);
+		else
+		{
+			bench_usage();
+			return 1;
+		}
+	}
+
+	if (iterations <= 0 || max_threads <= 0)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	if (check)
+	{
+		profiler_initialize();
+
+		int ok;
+		if (strcmp(check, "accuracy") == 0)
+			ok = bench_check_accuracy(tolerance);
+		else if (strcmp(check, "threads") == 0)
+			ok = bench_check_threads(std::min(max_threads, 16), tolerance);
+		else if (strcmp(check, "overhead") == 0)
+			ok = bench_check_overhead(iterations, max_cycles);
+		else if (strcmp(check, "scaling") == 0)
+			ok = bench_check_scaling(iterations, max_threads, tolerance);
+		else if (strcmp(check, "snapshot") == 0)
+			ok = bench_check_snapshot();
+		else if (strcmp(check, "budget") == 0)
+			ok = bench_check_budget();
+		else if (strcmp(check, "async") == 0)
+			ok = bench_check_async(tolerance);
+		else if (strcmp(check, "tasks") == 0)
+			ok = bench_check_tasks(tolerance);
+		else if (strcmp(check, "locks") == 0)
+			ok = bench_check_locks(tolerance);
+		else if (strcmp(check, "blocked") == 0)
+			ok = bench_check_blocked(tolerance);
+#ifndef _WIN32
+		else if (strcmp(check, "io") == 0)
+			ok = bench_check_io();
+#endif
+#ifdef BENCH_COROUTINE
+		else if (strcmp(check, "coroutine") == 0)
+			ok = bench_check_coroutine(tolerance);
+#endif
+#ifdef PROFILER_RDTSCP
+		else if (strcmp(check, "migrations") == 0)
+			ok = bench_check_migrations();
+#endif
+#ifdef PROFILER_PER_CPU
+		else if (strcmp(check, "cpus") == 0)
+			ok = bench_check_cpus(std::min(max_threads, 16));
+#endif
+#ifdef PROFILER_TRACE
+		else if (strcmp(check, "trace") == 0)
+			ok = bench_check_trace(std::min(max_threads, 16));
+		else if (strcmp(check, "ring") == 0)
+			ok = bench_check_trace_ring(std::min(max_threads, 16));
+		else if (strcmp(check, "pool") == 0)
+			ok = bench_check_trace_pool(std::min(max_threads, 16));
+#endif
+#if defined(PROFILER_FIBERS) && defined(PROFILER_TRACE) && !defined(_WIN32)
+		else if (strcmp(check, "fibers") == 0)
+			ok = bench_check_fibers(tolerance);
+#endif
+		else
+		{
+			bench_usage();
+			return 1;
+		}
+
+		return ok ? 0 : 1;
+	}
+
+	bench_output = output ? fopen(output, "w") : stdout;
+	if (!bench_output)
+	{
+		fprintf(stderr, "smallprofiler_bench: could not open %s\n", output);
+		return 1;
+	}
+
+	profiler_initialize();
+
+	fprintf(bench_output,
+			"{\"bench\":\"info\",\"version\":\"%s\",\"cycles_per_second\":%.0f}\n",
+			SMALLPROFILER_VERSION,
+			(double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+
+	bench_clocks(iterations);
+	bench_depths(iterations);
+	bench_cold();
+	bench_disabled(iterations);
+	bench_threads(iterations, max_threads);
+#ifdef PROFILER_TRACE
+	bench_trace(iterations);
+#endif
+
+	if (bench_output != stdout)
+		fclose(bench_output);
+
+	return 0;
+}
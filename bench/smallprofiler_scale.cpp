@@ -0,0 +1,302 @@
+/*
+*	smallprofiler_scale
+*
+*	Builds synthetic scope trees directly in the node table and measures how
+*	long report generation (text and binary snapshot) takes and how much memory
+*	it needs as the tree grows:
+*
+*		smallprofiler_scale [--sizes 10000,100000,1000000] [--threads 1,16]
+*							[--shapes deep,wide,tree] [--budget seconds] [--dir path]
+*
+*	Shapes:
+*		deep	a single chain, every node is the parent of the next one
+*		wide	one root with every other node as its direct child
+*		tree	a balanced tree with a fan-out of SCALE_FANOUT
+*
+*	The cycles of every node are split over --threads per-thread tables, like
+*	they would be when the same scopes run on several threads.
+*
+*	Every case runs in its own process (on POSIX) so that peak_rss_kb belongs
+*	to that case alone, and a case that runs longer than --budget seconds is
+*	reported with "status":"timeout" instead of stalling the whole run.
+*	Results are written as one JSON object per line.
+*/
+
+#define PROFILER_NODES_MAX (1 << 20)
+#define PROFILER_DEFINE
+#include "smallprofiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define SCALE_FANOUT 8
+#define SCALE_LINE_MAXLEN (PROFILER_NAME_MAXLEN * 2 + 64)
+
+struct scale_case
+{
+	const char* shape;
+	int nodes;
+	int threads;
+	const char* operation;
+};
+
+static std::string scale_dir = ".";
+
+static long scale_peak_rss_kb()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#endif
+}
+
+static int scale_parent(const char* shape, int id)
+{
+	if (id == 0)
+		return -1;
+
+	if (strcmp(shape, "deep") == 0)
+		return id - 1;
+	else if (strcmp(shape, "wide") == 0)
+		return 0;
+	else
+		return (id - 1) / SCALE_FANOUT;
+}
+
+/* Fill the node table and the per-thread tables with a consistent tree, children always have higher ids than their parent */
+static void scale_build(const char* shape, int nodes, int threads)
+{
+	std::vector<uint64_t> cycles(nodes);
+	uint64_t random = 0x9E3779B97F4A7C15ull;
+
+	int i;
+	for (i = 0; i < nodes; i++)
+	{
+		snprintf(profiler_nodes[i].name, PROFILER_NAME_MAXLEN, "node_%d", i);
+		profiler_nodes[i].parent_id = scale_parent(shape, i);
+		profiler_nodes[i].is_setup = 1;
+
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		cycles[i] = 1000 + random % 1000000;
+	}
+
+	profiler_nodes_used = nodes;
+
+	for (i = nodes - 1; i > 0; i--)
+		cycles[profiler_nodes[i].parent_id] += cycles[i];
+
+	std::vector<std::thread> workers;
+	for (i = 0; i < threads; i++)
+	{
+		workers.emplace_back([&, i]()
+		{
+			struct profiler_thread* thread = profiler_thread_get();
+
+			int j;
+			for (j = 0; j < nodes; j++)
+				thread->nodes[j].total_cycles = cycles[j] / threads + (i == 0 ? cycles[j] % threads : 0);
+		});
+	}
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+static size_t scale_run(const scale_case& c)
+{
+	if (strcmp(c.operation, "get_results") == 0)
+	{
+		char* buffer = (char*)malloc((size_t)(c.nodes + 2) * SCALE_LINE_MAXLEN);
+		profiler_get_results(buffer);
+		size_t length = strlen(buffer);
+		free(buffer);
+		return length;
+	}
+	else
+	{
+		std::string filename = scale_dir + "/smallprofiler_scale_dump";
+
+		if (strcmp(c.operation, "dump_snapshot") == 0)
+			profiler_dump_snapshot(filename.c_str());
+		else
+			profiler_dump_file(filename.c_str());
+
+		FILE* file = fopen(filename.c_str(), "rb");
+		if (!file)
+			return 0;
+
+		fseek(file, 0, SEEK_END);
+		size_t length = (size_t)ftell(file);
+		fclose(file);
+		remove(filename.c_str());
+		return length;
+	}
+}
+
+static void scale_case_run(const scale_case& c)
+{
+	scale_build(c.shape, c.nodes, c.threads);
+	long setup_rss_kb = scale_peak_rss_kb();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t output_bytes = scale_run(c);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("{\"bench\":\"scale\",\"shape\":\"%s\",\"nodes\":%d,\"threads\":%d,\"operation\":\"%s\","
+		   "\"status\":\"ok\",\"seconds\":%.6f,\"output_bytes\":%zu,\"setup_rss_kb\":%ld,\"peak_rss_kb\":%ld}\n",
+		   c.shape, c.nodes, c.threads, c.operation, seconds, output_bytes, setup_rss_kb, scale_peak_rss_kb());
+	fflush(stdout);
+}
+
+static void scale_case_emit_failure(const scale_case& c, const char* status)
+{
+	printf("{\"bench\":\"scale\",\"shape\":\"%s\",\"nodes\":%d,\"threads\":%d,\"operation\":\"%s\",\"status\":\"%s\"}\n",
+		   c.shape, c.nodes, c.threads, c.operation, status);
+	fflush(stdout);
+}
+
+static void scale_case_fork(const scale_case& c, int budget)
+{
+#ifdef _WIN32
+	(void)budget;
+	scale_case_run(c);
+	profiler_reset();
+#else
+	fflush(stdout);
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		alarm((unsigned)budget);
+		scale_case_run(c);
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+
+	if (WIFSIGNALED(status))
+		scale_case_emit_failure(c, WTERMSIG(status) == SIGALRM ? "timeout" : "crashed");
+	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		scale_case_emit_failure(c, "failed");
+#endif
+}
+
+static std::vector<std::string> scale_split(const char* list)
+{
+	std::vector<std::string> items;
+	std::string item;
+
+	for (const char* c = list; ; c++)
+	{
+		if (*c == ',' || *c == '\0')
+		{
+			if (!item.empty())
+				items.push_back(item);
+
+			item.clear();
+
+			if (*c == '\0')
+				break;
+		}
+		else
+		{
+			item += *c;
+		}
+	}
+
+	return items;
+}
+
+static void scale_usage()
+{
+	fprintf(stderr,
+			"usage: smallprofiler_scale [--sizes 10000,100000,1000000] [--threads 1,16]\n"
+			"                           [--shapes deep,wide,tree] [--budget seconds] [--dir path]\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* sizes = "10000,100000,1000000";
+	const char* threads = "1,16";
+	const char* shapes = "deep,wide,tree";
+	int budget = 10;
+
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+			sizes = argv[++i];
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = argv[++i];
+		else if (strcmp(argv[i], "--shapes") == 0 && i + 1 < argc)
+			shapes = argv[++i];
+		else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+			budget = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+			scale_dir = argv[++i];
+		else
+		{
+			scale_usage();
+			return 1;
+		}
+	}
+
+	const char* operations[] = { "get_results", "dump_file", "dump_snapshot" };
+
+	profiler_initialize();
+
+	for (const std::string& shape : scale_split(shapes))
+	{
+		if (shape != "deep" && shape != "wide" && shape != "tree")
+		{
+			fprintf(stderr, "smallprofiler_scale: unknown shape %s\n", shape.c_str());
+			return 1;
+		}
+
+		for (const std::string& size : scale_split(sizes))
+		{
+			int nodes = atoi(size.c_str());
+			if (nodes <= 0 || nodes > PROFILER_NODES_MAX)
+			{
+				fprintf(stderr, "smallprofiler_scale: sizes must be between 1 and %d\n", PROFILER_NODES_MAX);
+				return 1;
+			}
+
+			for (const std::string& thread_count : scale_split(threads))
+			{
+				for (const char* operation : operations)
+				{
+					scale_case c = { shape.c_str(), nodes, atoi(thread_count.c_str()), operation };
+					if (c.threads <= 0)
+					{
+						scale_usage();
+						return 1;
+					}
+
+					scale_case_fork(c, budget);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -1 +1,6 @@
-include("${CMAKE_CURRENT_LIST_DIR}/smallprofilerTargets.cmake")
\ No newline at end of file
+include(CMakeFindDependencyMacro)
+
+# Builds with SMALLPROFILER_TRACE link Threads::Threads, the other builds do not mind finding it
+find_dependency(Threads)
+
+include("${CMAKE_CURRENT_LIST_DIR}/smallprofilerTargets.cmake")
@@ -27,6 +27,13 @@
 *	#define PROFILER_DEFINE
 *	#include "smallprofiler.h"
 *
+*	in exactly one source file, or build the compiled library with the CMake option
+*	SMALLPROFILER_BUILD_LIBRARY and link smallprofiler without defining PROFILER_DEFINE.
+*	Either way files that just use profiler_start and profiler_stop only include
+*	<stddef.h> and <stdint.h> (and the intrinsics header on Windows), plus the
+*	declarations of smallprofiler_trace.h and <string.h> with PROFILER_TRACE. The
+*	pair stays inline so the hot path costs the same in both modes.
+*
 *	call profiler_initialize() on startup. This function will measure the performance
 *	of your cpu for PROFILER_MEASURE_MILLISECONDS milliseconds. This measurement is
 *	later used to convert the total cycle count to seconds.
@@ -38,273 +45,3999 @@
 *
 *	Call profiler_dump_file(const char* filename) to dump a performance log to file
 *	Call profiler_dump_console() to dump a performance log to console
+*	Call profiler_dump_snapshot(const char* filename) to write a binary snapshot that
+*	can be read with smallprofiler_snapshot.h, or profiler_get_snapshot(size_t* size)
+*	to get the same bytes in memory (release them with profiler_free_snapshot, NULL
+*	when they can't be allocated).
+*
+*	Call profiler_initialize_budget(const struct profiler_budget* budget) instead
+*	of profiler_initialize() to bound the memory the profiler allocates. What does
+*	not fit is dropped, counted by profiler_get_dropped and reported.
 *
 *	You can define PROFILER_DISABLE to disable all macros and functions to remove
 *	all profiler overhead.
 *
+*	profiler_start/profiler_stop may be called from any number of threads. Every
+*	thread accumulates its cycles in its own table, the tables are summed when a
+*	report is generated. profiler_reset() must not run concurrently with
+*	profiler_start/profiler_stop.
+*
+*	Build options, defined in every file or with the CMake option:
+*
+*	PROFILER_HISTOGRAMS  SMALLPROFILER_HISTOGRAMS  log2 histogram of the cycles per call
+*	PROFILER_TRACE       SMALLPROFILER_TRACE       record every start and stop as an event
+*	PROFILER_RDTSCP      SMALLPROFILER_RDTSCP      read the clock with rdtscp, count migrations
+*	PROFILER_PER_CPU     SMALLPROFILER_PER_CPU     one node table per CPU instead of per thread
+*	PROFILER_FIBERS      SMALLPROFILER_FIBERS      pause the scopes of fibers switched out
+*
+*	Coroutines, locks and I/O are profiled with the wrappers of
+*	smallprofiler_coroutine.h, smallprofiler_mutex.h and smallprofiler_io.h; async
+*	scopes, thread pool tasks and blocking waits with the profiler_async_,
+*	profiler_task_ and profiler_wait_ functions below. README.md describes every
+*	feature.
+*
 *	Author: Johan Yngman (johan.yngman@gmail.com)
 */
 
 #ifndef _PROFILER_
 #define _PROFILER_
 
+/* The implementation uses mmap flags, syscall, usleep, fseeko, ftruncate and fileno, which strict C modes hide (-std=c99 or c11) */
+#if defined(PROFILER_DEFINE) && !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
+
+#ifdef PROFILER_DEFINE
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(PROFILER_PER_CPU) && defined(__linux__) && defined(__GLIBC__)
+#include <sched.h>
+#if !defined(__cplusplus) && !defined(_GNU_SOURCE)
+/* Only declared by <sched.h> with _GNU_SOURCE, which C++ compilers define */
+extern int sched_getcpu(void);
+#endif
+#endif
+
+#if defined(PROFILER_TRACE) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#include "smallprofiler_snapshot.h"
+#endif // PROFILER_DEFINE
+
+#ifdef PROFILER_TRACE
+#include "smallprofiler_trace.h"
+#endif
+
+#ifdef _WIN32
+#ifdef __MINGW32__
+#include <x86intrin.h>
+#else
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(PROFILER_DEFINE) && defined(PROFILER_LIBRARY) && !defined(PROFILER_EXPORTS)
+#error "PROFILER_DEFINE must not be defined when linking the compiled smallprofiler library"
+#endif
+
+#if defined(PROFILER_SHARED) && defined(_WIN32)
+#ifdef PROFILER_EXPORTS
+#define PROFILER_API __declspec(dllexport)
+#else
+#define PROFILER_API __declspec(dllimport)
+#endif
+#elif defined(PROFILER_SHARED) && defined(__GNUC__)
+#define PROFILER_API __attribute__((visibility("default")))
+#else
+#define PROFILER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PROFILER_NODES_MAX
 #define PROFILER_NODES_MAX 256
+#endif
 #define PROFILER_NAME_MAXLEN 256
 #define PROFILER_BUFFER_SIZE 16384
 #define PROFILER_MEASURE_MILLISECONDS 100
 #define PROFILER_MEASURE_SECONDS ((float)PROFILER_MEASURE_MILLISECONDS / 1000.0f)
+#define PROFILER_HISTOGRAM_BUCKETS 64
+#ifndef PROFILER_TRACE_BLOCK_SIZE
+#define PROFILER_TRACE_BLOCK_SIZE 65536
+#endif
+#define PROFILER_TRACE_BLOCK_BYTES (PROFILER_TRACE_BLOCK_SIZE - 32)
+/* Most trace blocks in memory at once, the address space for them is reserved up front */
+#ifndef PROFILER_TRACE_POOL_BLOCKS
+#if UINTPTR_MAX == 0xffffffff
+#define PROFILER_TRACE_POOL_BLOCKS 1024
+#else
+#define PROFILER_TRACE_POOL_BLOCKS 16384
+#endif
+#endif
+#ifdef PROFILER_TRACE_HUGEPAGES
+#define PROFILER_TRACE_POOL_ALIGN (2 * 1024 * 1024)
+#else
+#define PROFILER_TRACE_POOL_ALIGN 4096
+#endif
+/* Longest packed event: a 10 byte tag, a 5 byte type, a 3 byte dictionary index, a 5 byte id and a 10 byte flow */
+#define PROFILER_TRACE_EVENT_BYTES_MAX 34
+#define PROFILER_TRACE_FLUSH_MILLISECONDS 10
+/* NUMA nodes told apart, threads on higher nodes count as the last one */
+#ifndef PROFILER_NUMA_NODES_MAX
+#define PROFILER_NUMA_NODES_MAX 8
+#endif
+/* Share of migrated calls from which a report flags a node with PROFILER_RDTSCP */
+#ifndef PROFILER_MIGRATIONS_PERCENT
+#define PROFILER_MIGRATIONS_PERCENT 1
+#endif
+/* CPUs with a table of their own with PROFILER_PER_CPU, higher ones share one more table */
+#ifndef PROFILER_CPUS_MAX
+#define PROFILER_CPUS_MAX 1024
+#endif
+#ifndef PROFILER_TRACE_CODEC
+#define PROFILER_TRACE_CODEC PROFILER_TRACE_CODEC_LZ
+#endif
+
+#define PROFILER_BUDGET_DROP_NEWEST 0
+#define PROFILER_BUDGET_OVERWRITE_OLDEST 1
+#define PROFILER_BUDGET_AGGREGATE_ONLY 2
+
+/* Memory limits for profiler_initialize_budget in bytes, 0 for no limit */
+struct profiler_budget
+{
+	uint64_t total_bytes;
+
+	/* Per-thread node tables of PROFILER_THREAD_BYTES each, a thread whose table does not fit is not profiled */
+	uint64_t thread_bytes;
+
+	/* Trace blocks being filled or waiting to be written */
+	uint64_t trace_bytes;
+
+	/* What happens to trace events when trace_bytes or total_bytes is used up */
+	int trace_policy;
+};
+
+/* What the profiler could not record */
+struct profiler_dropped
+{
+	/* Calls of scopes beyond PROFILER_NODES_MAX */
+	uint64_t calls;
+
+	/* Threads without a node table, none of their calls are counted */
+	uint64_t threads;
+
+	/* Trace events of the threads that have a table */
+	uint64_t events;
+};
+
+#define PROFILER_COROUTINE_IDLE 0
+#define PROFILER_COROUTINE_RUNNING 1
+#define PROFILER_COROUTINE_SUSPENDED 2
+
+/* A scope that is only timed while its coroutine runs, zero-initialize it before profiler_coroutine_begin */
+struct profiler_coroutine
+{
+	int id;
+	int state;
+
+	/* Parent of the thread the coroutine runs on before it last resumed, given back when it suspends */
+	int outer_parent;
+
+	/* Start of the current run or suspension */
+	uint64_t cycles_start;
+	uint64_t active_cycles;
+	uint64_t suspended_cycles;
+};
+
+/* A scope that may end on another thread than it began on, filled in by profiler_async_begin */
+struct profiler_async
+{
+	int id;
+	uint64_t cycles_start;
+
+	/* Pairs the begin and end events in traces */
+	uint64_t flow;
+};
+
+/* A task of a thread pool, filled in by profiler_task_enqueue and handed to the worker along with the task */
+struct profiler_task
+{
+	int id;
+	const char* name;
+
+	/* The thread that enqueued it, a worker on another thread stole it */
+	const void* thread;
+	uint64_t cycles_enqueued;
+
+	/* Start of the execution, on the worker */
+	uint64_t cycles_start;
+	uint32_t cpu;
+};
+
+/* A lock timed under its name, set up by profiler_lock_init and kept next to the lock */
+struct profiler_lock
+{
+	int id;
+
+	/* Kept for setting the node up again after profiler_reset */
+	const char* name;
+
+	/* The scope that last held it exclusively, -1 while readers hold it */
+	volatile int holder;
+	uint64_t cycles_acquired;
+};
+
+struct profiler_trace_block;
+
+/* What a fiber's scopes need while another fiber runs on its thread, zero-initialize it before its first profiler_fiber_switch */
+struct profiler_fiber
+{
+	int is_setup;
+	int current_parent;
+
+	/* Cycles the fiber was switched out for since it first ran, and when it last was */
+	uint64_t paused_cycles;
+	uint64_t cycles_switched;
+
+	/* A profiler_wait_begin of the fiber that has not ended yet, on the clock of the fiber */
+	uint64_t blocked_start;
+	int blocked_depth;
+#ifdef PROFILER_TRACE
+	/* The track of the fiber in traces, kept while it is switched out */
+	struct profiler_trace_block* volatile trace_block;
+	int trace_index;
+	int trace_session;
+	int trace_sequence;
+	uint64_t trace_cycles;
+	int trace_dictionary_count;
+	uint16_t trace_dictionary[PROFILER_NODES_MAX];
+
+	/* Fibers that have run, so the blocks they keep are written when a trace ends */
+	struct profiler_fiber* trace_next;
+	struct profiler_fiber* trace_previous;
+#endif
+};
 
 #ifdef PROFILER_DISABLE
 #define profiler_initialize()
+#define profiler_initialize_budget(budget)
+#define profiler_get_dropped(dropped)
 #define profiler_reset()
 #define profiler_get_results(buffer)
 #define profiler_dump_file(filename)
 #define profiler_dump_console()
+#define profiler_dump_snapshot(filename)
+#define profiler_get_snapshot(size) ((void*)0)
+#define profiler_free_snapshot(snapshot)
+#define profiler_trace_begin(filename) 0
+#define profiler_trace_begin_ring(filename, size) 0
+#define profiler_trace_end()
+#define profiler_coroutine_begin(coroutine, id, name) ((void)(coroutine))
+#define profiler_coroutine_suspend(coroutine) ((void)(coroutine))
+#define profiler_coroutine_resume(coroutine) ((void)(coroutine))
+#define profiler_coroutine_end(coroutine) ((void)(coroutine))
+#define profiler_fiber_switch(from, to) ((void)(from), (void)(to))
+#define profiler_fiber_end(fiber) ((void)(fiber))
+#define profiler_lock_init(lock, name) ((void)(lock), (void)(name))
+#define profiler_lock_wait_begin() 0
+#define profiler_lock_acquired(lock, cycles_wait) ((void)(lock), (void)(cycles_wait))
+#define profiler_lock_acquired_shared(lock, cycles_wait) ((void)(lock), (void)(cycles_wait))
+#define profiler_lock_release(lock) ((void)(lock))
+#define profiler_wait_begin()
+#define profiler_wait_end()
+#define profiler_io_begin() 0
+#define profiler_io_end(cycles_start, bytes) ((void)(cycles_start), (void)(bytes))
+#define profiler_io_sync_end(cycles_start) ((void)(cycles_start))
 #else
-void _profiler_initialize();
-void _profiler_reset();
-void _profiler_get_results(char* buffer);
-void _profiler_dump_file(const char* filename);
-void _profiler_dump_console();
-void _profiler_node_setup(int id, const char* name);
+PROFILER_API void _profiler_initialize();
+PROFILER_API void _profiler_initialize_budget(const struct profiler_budget* budget);
+PROFILER_API void _profiler_get_dropped(struct profiler_dropped* dropped);
+PROFILER_API void _profiler_reset();
+PROFILER_API void _profiler_get_results(char* buffer);
+PROFILER_API void _profiler_dump_file(const char* filename);
+PROFILER_API void _profiler_dump_console();
+PROFILER_API void _profiler_node_setup(int id, const char* name);
+PROFILER_API void _profiler_dump_snapshot(const char* filename);
+PROFILER_API void* _profiler_get_snapshot(size_t* size);
+PROFILER_API void _profiler_free_snapshot(void* snapshot);
+PROFILER_API void _profiler_coroutine_begin(struct profiler_coroutine* coroutine, int id, const char* name);
+PROFILER_API void _profiler_coroutine_suspend(struct profiler_coroutine* coroutine);
+PROFILER_API void _profiler_coroutine_resume(struct profiler_coroutine* coroutine);
+PROFILER_API void _profiler_coroutine_end(struct profiler_coroutine* coroutine);
+PROFILER_API void _profiler_async_begin(struct profiler_async* async, int id, const char* name);
+PROFILER_API void _profiler_async_end(struct profiler_async* async);
+PROFILER_API void _profiler_task_enqueue(struct profiler_task* task, int id, const char* name);
+PROFILER_API void _profiler_task_wait(struct profiler_task* task);
+PROFILER_API void _profiler_lock_init(struct profiler_lock* lock, const char* name);
+PROFILER_API void _profiler_lock_acquired(struct profiler_lock* lock, uint64_t cycles_wait, int shared);
+PROFILER_API void _profiler_lock_release(struct profiler_lock* lock);
+PROFILER_API void _profiler_wait_begin();
+PROFILER_API void _profiler_wait_end();
+PROFILER_API void _profiler_io_end(uint64_t cycles_start, uint64_t bytes, int sync);
 
 #define profiler_initialize()			_profiler_initialize()
+#define profiler_initialize_budget(budget)	_profiler_initialize_budget(budget)
+#define profiler_get_dropped(dropped)	_profiler_get_dropped(dropped)
 #define profiler_reset()				_profiler_reset()
 #define profiler_get_results(buffer)	_profiler_get_results(buffer)
 #define profiler_dump_file(filename)	_profiler_dump_file(filename)
 #define profiler_dump_console()			_profiler_dump_console()
-#endif // PROFILER_DISABLE
+#define profiler_dump_snapshot(filename)	_profiler_dump_snapshot(filename)
+#define profiler_get_snapshot(size)		_profiler_get_snapshot(size)
+#define profiler_free_snapshot(snapshot)	_profiler_free_snapshot(snapshot)
+#define profiler_coroutine_begin(coroutine, id, name)	_profiler_coroutine_begin(coroutine, id, name)
+#define profiler_coroutine_suspend(coroutine)	_profiler_coroutine_suspend(coroutine)
+#define profiler_coroutine_resume(coroutine)	_profiler_coroutine_resume(coroutine)
+#define profiler_coroutine_end(coroutine)	_profiler_coroutine_end(coroutine)
+#define profiler_lock_init(lock, name)	_profiler_lock_init(lock, name)
+#define profiler_lock_wait_begin()		get_cycles()
+#define profiler_lock_acquired(lock, cycles_wait)	_profiler_lock_acquired(lock, cycles_wait, 0)
+#define profiler_lock_acquired_shared(lock, cycles_wait)	_profiler_lock_acquired(lock, cycles_wait, 1)
+#define profiler_lock_release(lock)		_profiler_lock_release(lock)
+#define profiler_wait_begin()			_profiler_wait_begin()
+#define profiler_wait_end()				_profiler_wait_end()
+#define profiler_io_begin()				get_cycles()
+#define profiler_io_end(cycles_start, bytes)	_profiler_io_end(cycles_start, bytes, 0)
+#define profiler_io_sync_end(cycles_start)	_profiler_io_end(cycles_start, 0, 1)
 
-#ifdef _WIN32
-#include <Windows.h>
+#ifdef PROFILER_FIBERS
+PROFILER_API void _profiler_fiber_switch(struct profiler_fiber* from, struct profiler_fiber* to);
+PROFILER_API void _profiler_fiber_end(struct profiler_fiber* fiber);
 
-#ifdef __MINGW32__
-#include <x86intrin.h>
+#define profiler_fiber_switch(from, to)	_profiler_fiber_switch(from, to)
+#define profiler_fiber_end(fiber)		_profiler_fiber_end(fiber)
 #else
-#include <intrin.h>
+#define profiler_fiber_switch(from, to) ((void)(from), (void)(to))
+#define profiler_fiber_end(fiber) ((void)(fiber))
 #endif
-static uint64_t get_cycles()
-{
-	return __rdtsc();
-}
-static unsigned long get_milliseconds()
-{
-	LARGE_INTEGER timestamp;
-	LARGE_INTEGER frequency;
 
-	QueryPerformanceCounter(&timestamp);
-	QueryPerformanceFrequency(&frequency);
+#ifdef PROFILER_TRACE
+PROFILER_API int _profiler_trace_begin(const char* filename);
+PROFILER_API int _profiler_trace_begin_ring(const char* filename, uint64_t size);
+PROFILER_API void _profiler_trace_end();
 
-	return (unsigned long)(timestamp.QuadPart / (frequency.QuadPart / 1000));
+#define profiler_trace_begin(filename)	_profiler_trace_begin(filename)
+#define profiler_trace_begin_ring(filename, size)	_profiler_trace_begin_ring(filename, size)
+#define profiler_trace_end()			_profiler_trace_end()
+#else
+#define profiler_trace_begin(filename) 0
+#define profiler_trace_begin_ring(filename, size) 0
+#define profiler_trace_end()
+#endif
+#endif // PROFILER_DISABLE
+
+#ifdef _WIN32
+static inline uint64_t get_cycles()
+{
+	return __rdtsc();
 }
 #else
-#include <sys/time.h>
-static uint64_t get_cycles()
+static inline uint64_t get_cycles()
 {
 	unsigned int lo, hi;
 	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
 	return ((uint64_t)hi << 32) | lo;
 }
-static unsigned long get_milliseconds()
-{
-	struct timeval time; 
-	gettimeofday(&time, NULL);
-	unsigned long milliseconds = time.tv_sec * 1000LL + time.tv_usec / 1000;
-	return milliseconds;
-}
 #endif
 
-struct profiler_node
+#ifdef PROFILER_RDTSCP
+/* Cycles and the TSC_AUX of the CPU they were read on, unlike rdtsc it waits for earlier instructions */
+#ifdef _WIN32
+static inline uint64_t get_cycles_cpu(uint32_t* cpu)
 {
-	char name[PROFILER_NAME_MAXLEN];
-	uint64_t total_cycles;
-	int parent_id;
-	char is_setup;
-};
-
-#ifdef PROFILER_DEFINE
-int profiler_current_id = 0;
-int profiler_current_parent = -1;
-struct profiler_node profiler_nodes[PROFILER_NODES_MAX];
+	unsigned int aux;
+	uint64_t cycles = __rdtscp(&aux);
+	*cpu = aux;
+	return cycles;
+}
+#else
+static inline uint64_t get_cycles_cpu(uint32_t* cpu)
+{
+	unsigned int lo, hi, aux;
+	__asm__ __volatile__ ("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+	*cpu = aux;
+	return ((uint64_t)hi << 32) | lo;
+}
+#endif
+#endif
 
-static uint64_t profiler_cycles_measure = 0;
-static char buffer[PROFILER_BUFFER_SIZE];
+#if defined(_MSC_VER)
+#define PROFILER_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__)
+#define PROFILER_NOINLINE __attribute__((noinline))
+#else
+#define PROFILER_NOINLINE
+#endif
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable: 4996)
+#if defined(_MSC_VER)
+#define PROFILER_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define PROFILER_THREAD_LOCAL __thread
+#else
+#define PROFILER_THREAD_LOCAL _Thread_local
 #endif
 
-void _profiler_initialize()
+/*
+*	Atomics used by the profiler. Counters have a single writer (the owning
+*	thread), so relaxed loads and stores are enough and compile to plain moves.
+*/
+#if defined(_MSC_VER) && !defined(__clang__)
+static inline int profiler_atomic_load_int(const volatile int* value)
 {
-	profiler_reset();
-
-	unsigned long milliseconds = get_milliseconds();
-	uint64_t cycles_start = get_cycles();
-
-	while (get_milliseconds() - milliseconds < PROFILER_MEASURE_MILLISECONDS)
-		;
-
-	profiler_cycles_measure = get_cycles() - cycles_start;
+	return *value;
+}
+static inline void profiler_atomic_store_int(volatile int* value, int desired)
+{
+	*value = desired;
+}
+static inline int profiler_atomic_add_int(volatile int* value, int add)
+{
+	return _InterlockedExchangeAdd((volatile long*)value, add);
+}
+static inline uint64_t profiler_atomic_load_u64(const volatile uint64_t* value)
+{
+	return *value;
+}
+static inline uint64_t profiler_atomic_add_u64(volatile uint64_t* value, uint64_t add)
+{
+	return (uint64_t)_InterlockedExchangeAdd64((volatile long long*)value, (long long)add);
+}
+static inline void profiler_atomic_store_u64(volatile uint64_t* value, uint64_t desired)
+{
+	*value = desired;
+}
+static inline int profiler_atomic_cas_int(volatile int* value, int expected, int desired)
+{
+	return _InterlockedCompareExchange((volatile long*)value, desired, expected) == expected;
+}
+static inline uint64_t profiler_atomic_load_acquire_u64(const volatile uint64_t* value)
+{
+	return (uint64_t)_InterlockedCompareExchange64((volatile long long*)value, 0, 0);
+}
+static inline int profiler_atomic_cas_u64(volatile uint64_t* value, uint64_t expected, uint64_t desired)
+{
+	return (uint64_t)_InterlockedCompareExchange64((volatile long long*)value, (long long)desired, (long long)expected) == expected;
+}
+static inline void* profiler_atomic_load_ptr(void* const volatile* value)
+{
+	return *value;
+}
+static inline void profiler_atomic_store_ptr(void* volatile* value, void* desired)
+{
+	*value = desired;
+}
+static inline int profiler_atomic_cas_ptr(void* volatile* value, void* expected, void* desired)
+{
+	return _InterlockedCompareExchangePointer(value, desired, expected) == expected;
+}
+static inline void* profiler_atomic_exchange_ptr(void* volatile* value, void* desired)
+{
+	return _InterlockedExchangePointer(value, desired);
+}
+#else
+static inline int profiler_atomic_load_int(const volatile int* value)
+{
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+static inline void profiler_atomic_store_int(volatile int* value, int desired)
+{
+	__atomic_store_n(value, desired, __ATOMIC_RELEASE);
+}
+static inline int profiler_atomic_add_int(volatile int* value, int add)
+{
+	return __atomic_fetch_add(value, add, __ATOMIC_RELAXED);
 }
+static inline uint64_t profiler_atomic_load_u64(const volatile uint64_t* value)
+{
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+static inline uint64_t profiler_atomic_add_u64(volatile uint64_t* value, uint64_t add)
+{
+	return __atomic_fetch_add(value, add, __ATOMIC_RELAXED);
+}
+static inline void profiler_atomic_store_u64(volatile uint64_t* value, uint64_t desired)
+{
+	__atomic_store_n(value, desired, __ATOMIC_RELAXED);
+}
+static inline int profiler_atomic_cas_int(volatile int* value, int expected, int desired)
+{
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+static inline uint64_t profiler_atomic_load_acquire_u64(const volatile uint64_t* value)
+{
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+static inline int profiler_atomic_cas_u64(volatile uint64_t* value, uint64_t expected, uint64_t desired)
+{
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+static inline void* profiler_atomic_load_ptr(void* const volatile* value)
+{
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+static inline void profiler_atomic_store_ptr(void* volatile* value, void* desired)
+{
+	__atomic_store_n(value, desired, __ATOMIC_RELEASE);
+}
+static inline int profiler_atomic_cas_ptr(void* volatile* value, void* expected, void* desired)
+{
+	return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+static inline void* profiler_atomic_exchange_ptr(void* volatile* value, void* desired)
+{
+	return __atomic_exchange_n(value, desired, __ATOMIC_ACQ_REL);
+}
+#endif
 
-void _profiler_reset()
+#if defined(_MSC_VER) && !defined(__clang__)
+static inline int profiler_log2(uint64_t value)
 {
-	int i;
-	for (i = 0; i < PROFILER_NODES_MAX; i++)
-	{
-		profiler_nodes[i].total_cycles = 0;
-		profiler_nodes[i].parent_id = -1;
-		profiler_nodes[i].is_setup = 0;
-		strncpy(profiler_nodes[i].name, "", 1);
-	}
+	unsigned long index;
+	_BitScanReverse64(&index, value | 1);
+	return (int)index;
+}
+#else
+static inline int profiler_log2(uint64_t value)
+{
+	return 63 - __builtin_clzll(value | 1);
 }
+#endif
 
-void _profiler_dump_file(const char* filename)
+/* Add to a counter that only the calling thread writes to */
+static inline void profiler_counter_add(volatile uint64_t* counter, uint64_t value)
 {
-	profiler_get_results(buffer);
-	FILE* file = fopen(filename, "w");
-	fputs(buffer, file);
-	fclose(file);
+	profiler_atomic_store_u64(counter, profiler_atomic_load_u64(counter) + value);
 }
 
-static void profiler_get_results_sorted(char* buffer, int parent_id, float seconds_total, int level)
+struct profiler_node
 {
-	char buffer_name[PROFILER_NAME_MAXLEN];
+	char name[PROFILER_NAME_MAXLEN];
+	uint64_t total_cycles;
+	uint64_t calls;
 
-	uint64_t max_cycles_ceil = UINT64_MAX;
+	/* Calls that ended on another CPU than they began on, only counted with PROFILER_RDTSCP */
+	uint64_t migrations;
 
-	int i;
-	for (i = 0; i < PROFILER_NODES_MAX; i++)
-	{
-		uint64_t max_cycles = 0;
-		int max_index = -1;
+	/* Cycles coroutine scopes spent suspended, not part of total_cycles */
+	uint64_t suspended_cycles;
+	int parent_id;
+	int is_setup;
 
-		int j;
-		for (j = 0; j < PROFILER_NODES_MAX; j++)
-		{
-			if (profiler_nodes[j].parent_id == parent_id)
-			{
-				if (profiler_nodes[j].total_cycles > max_cycles &&
-					profiler_nodes[j].total_cycles < max_cycles_ceil)
-				{
-					max_cycles = profiler_nodes[j].total_cycles;
-					max_index = j;
-				}
-			}
-		}
+	/* Begun with profiler_async_begin, its cycles are the latency from begin to end wherever they ran */
+	int is_async;
 
-		max_cycles_ceil = max_cycles;
+	/* Tasks of a thread pool: their cycles are the execution, the time they were queued and the steals apart */
+	uint64_t wait_cycles;
+	uint64_t steals;
+	int is_task;
 
-		if (max_index != -1)
-		{
-			strncpy(buffer_name, "", 1);
+	/* Locks: their cycles are the time they were held and their wait_cycles the contended waits */
+	uint64_t contentions;
+	int is_lock;
 
-			int j;
-			for (j = 0; j < level; j++)
-				strcat(buffer_name, "    ");
+	/* Cycles other threads waited for locks this scope held */
+	uint64_t blocking_cycles;
 
-			strcat(buffer_name, profiler_nodes[max_index].name);
+	/* Cycles of total_cycles the thread was blocked in profiler_wait_begin/end or on a lock, the rest is running time */
+	uint64_t blocked_cycles;
 
-			int parent_id = profiler_nodes[max_index].parent_id;
-			float seconds = (float)profiler_nodes[max_index].total_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
-			float seconds_parent = 0.0f;
+	/* I/O calls the scope made, the bytes they moved and their cycles, and the syncs apart */
+	uint64_t io_calls;
+	uint64_t io_bytes;
+	uint64_t io_cycles;
+	uint64_t syncs;
+	uint64_t sync_cycles;
+};
 
-			if (parent_id == -1)
-			{
-				seconds_parent = seconds;
-				seconds_total = seconds;
-			}
-			else
-			{
-				seconds_parent = (float)profiler_nodes[parent_id].total_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+struct profiler_thread_node
+{
+	uint64_t total_cycles;
+	uint64_t calls;
+	uint64_t suspended_cycles;
+	uint64_t wait_cycles;
+	uint64_t steals;
+	uint64_t contentions;
+	uint64_t blocking_cycles;
+	uint64_t blocked_cycles;
+	uint64_t io_calls;
+	uint64_t io_bytes;
+	uint64_t io_cycles;
+	uint64_t syncs;
+	uint64_t sync_cycles;
+#ifdef PROFILER_RDTSCP
+	uint64_t migrations;
+#endif
+#ifdef PROFILER_HISTOGRAMS
+	uint64_t histogram[PROFILER_HISTOGRAM_BUCKETS];
+	uint64_t wait_histogram[PROFILER_HISTOGRAM_BUCKETS];
+	uint64_t io_histogram[PROFILER_HISTOGRAM_BUCKETS];
+#endif
+};
+
+#ifdef PROFILER_TRACE
+#if PROFILER_NODES_MAX > PROFILER_TRACE_DICTIONARY_MAX
+#error PROFILER_NODES_MAX is larger than a trace chunk dictionary
+#endif
+
+/* Packed events of one thread, written to the trace as one chunk when full. The header has the layout of profiler_trace_ring_block */
+struct profiler_trace_block
+{
+	struct profiler_trace_block* next;
+#if UINTPTR_MAX == 0xffffffff
+	uint32_t next_padding;
+#endif
+	int session;
+	int thread;
+	int sequence;
+	volatile int size;
+	uint64_t first_cycles;
+	uint8_t data[PROFILER_TRACE_BLOCK_BYTES];
+};
+#endif
+
+struct profiler_thread
+{
+#ifndef PROFILER_PER_CPU
+	struct profiler_thread_node nodes[PROFILER_NODES_MAX];
+#endif
+	int current_parent;
+#ifdef PROFILER_FIBERS
+	/* Cycles the running fiber was switched out for, left out of the cycles of its scopes */
+	uint64_t fiber_paused;
+#endif
+	struct profiler_thread* next;
+
+	/* Calls of scopes beyond PROFILER_NODES_MAX */
+	volatile uint64_t dropped_calls;
+
+	/* Start of the outermost profiler_wait_begin that has not ended, and how many are open */
+	uint64_t blocked_start;
+	int blocked_depth;
+
+	/* NUMA node the thread started on, its trace blocks come from and are written on that node */
+	int numa_node;
+#ifdef PROFILER_TRACE
+	volatile uint64_t trace_dropped;
+	struct profiler_trace_block* volatile trace_block;
+	int trace_index;
+	int trace_session;
+	int trace_sequence;
+
+	/* Timestamp of the last event and the dictionary index + 1 of every scope id in the current block */
+	uint64_t trace_cycles;
+	int trace_dictionary_count;
+	uint16_t trace_dictionary[PROFILER_NODES_MAX];
+#endif
+#ifdef PROFILER_FIBERS
+	/* The thread's own context, saved while a fiber runs on it */
+	struct profiler_fiber fiber_thread;
+#endif
+};
+
+#ifdef PROFILER_PER_CPU
+/* The node table of one CPU, only written by the threads running on it */
+struct profiler_cpu
+{
+	struct profiler_thread_node nodes[PROFILER_NODES_MAX];
+	struct profiler_cpu* next;
+};
+
+/* Every CPU's table takes whole pages of its own, a thread's state only needs cache lines of its own */
+#define PROFILER_CPU_BYTES ((sizeof(struct profiler_cpu) + 4095) & ~(size_t)4095)
+#define PROFILER_THREAD_BYTES ((sizeof(struct profiler_thread) + 63) & ~(size_t)63)
+#else
+/* Every thread's state takes whole pages of its own, so threads never write to the same cache line */
+#define PROFILER_THREAD_BYTES ((sizeof(struct profiler_thread) + 4095) & ~(size_t)4095)
+#endif
+
+extern PROFILER_API volatile int profiler_current_id;
+extern PROFILER_API uint64_t profiler_cycles_measure;
+extern PROFILER_API struct profiler_node profiler_nodes[PROFILER_NODES_MAX];
+
+#if defined(_WIN32) && defined(PROFILER_SHARED)
+/* Thread locals can not be imported from a DLL */
+PROFILER_API struct profiler_thread* _profiler_thread_current();
+#else
+extern PROFILER_API PROFILER_THREAD_LOCAL struct profiler_thread* profiler_thread_current;
+#endif
+
+#ifdef PROFILER_TRACE
+/* Number of the trace being recorded, 0 when no trace is */
+extern PROFILER_API volatile int profiler_trace_session;
+#endif
+
+#ifdef PROFILER_PER_CPU
+/* Table of every CPU below PROFILER_CPUS_MAX, created by the first thread that runs on it */
+extern PROFILER_API struct profiler_cpu* volatile profiler_cpus[PROFILER_CPUS_MAX];
+#endif
+
+#ifndef PROFILER_DISABLE
+PROFILER_API struct profiler_thread* _profiler_thread_create();
+PROFILER_API void _profiler_scope_dropped();
+
+static inline struct profiler_thread* profiler_thread_get()
+{
+#if defined(_WIN32) && defined(PROFILER_SHARED)
+	struct profiler_thread* thread = _profiler_thread_current();
+#else
+	struct profiler_thread* thread = profiler_thread_current;
+#endif
+	if (!thread)
+		thread = _profiler_thread_create();
+
+	return thread;
+}
+
+#ifdef PROFILER_PER_CPU
+PROFILER_API struct profiler_cpu* _profiler_cpu_create(int cpu);
+PROFILER_API struct profiler_cpu* _profiler_cpu_fallback();
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__)
+#define PROFILER_RSEQ
+
+/* Registered by the C library for every thread, 0 in __rseq_size when it did not or is too old to say */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+/* The start of struct rseq from <linux/rseq.h> */
+struct profiler_rseq
+{
+	volatile uint32_t cpu_id_start;
+	volatile uint32_t cpu_id;
+	volatile uint64_t rseq_cs;
+	volatile uint32_t flags;
+};
+
+static inline struct profiler_rseq* profiler_rseq_get()
+{
+	if (!&__rseq_size || !__rseq_size)
+		return NULL;
+
+	char* thread_pointer;
+	__asm__ ("movq %%fs:0, %0" : "=r"(thread_pointer));
+	return (struct profiler_rseq*)(thread_pointer + __rseq_offset);
+}
+
+/* Add to a counter of the table of `cpu` with a plain add, returns 0 without adding if the thread no longer runs on `cpu` */
+static inline int profiler_rseq_add(struct profiler_rseq* rseq, uint32_t cpu, volatile uint64_t* counter, uint64_t value)
+{
+	/* The descriptor tells the kernel to restart at 4 if the thread is preempted or moved between 1 and 2, the add at the end is the commit */
+	__asm__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %[rseq_cs]\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %[cpu_id]\n\t"
+		"jnz %l[abort]\n\t"
+		"addq %[value], %[counter]\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		/* The abort handler is preceded by the signature the C library registered */
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long 0x53053053\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rseq_cs] "m"(rseq->rseq_cs), [cpu_id] "m"(rseq->cpu_id), [cpu] "r"(cpu), [counter] "m"(*counter), [value] "r"(value)
+		: "memory", "cc", "rax"
+		: abort);
+	return 1;
+abort:
+	return 0;
+}
+#endif
+
+/* The table for atomic adds of profiler_cpu_counter_add, looked up once for all the counters of a call, or NULL where restartable sequences add to the table of the CPU */
+static inline struct profiler_cpu* profiler_cpu_counter_table()
+{
+#ifdef PROFILER_RSEQ
+	if (profiler_rseq_get())
+		return NULL;
+#endif
+	return _profiler_cpu_fallback();
+}
+
+/* Add to the counter at `offset` in the table of the CPU the calling thread runs on, or atomically in `table` from profiler_cpu_counter_table */
+static inline void profiler_cpu_counter_add(struct profiler_cpu* table, size_t offset, uint64_t value)
+{
+	if (table)
+	{
+		profiler_atomic_add_u64((volatile uint64_t*)((char*)table + offset), value);
+		return;
+	}
+
+#ifdef PROFILER_RSEQ
+	struct profiler_rseq* rseq = profiler_rseq_get();
+	while (rseq)
+	{
+		uint32_t cpu = rseq->cpu_id;
+		if (cpu >= PROFILER_CPUS_MAX)
+			break;
+
+		struct profiler_cpu* cpu_table = (struct profiler_cpu*)profiler_atomic_load_ptr((void* const volatile*)&profiler_cpus[cpu]);
+		if (!cpu_table && !(cpu_table = _profiler_cpu_create((int)cpu)))
+			break;
+
+		if (profiler_rseq_add(rseq, cpu, (volatile uint64_t*)((char*)cpu_table + offset), value))
+			return;
+	}
+#endif
+
+	profiler_atomic_add_u64((volatile uint64_t*)((char*)_profiler_cpu_fallback() + offset), value);
+}
+#endif
+
+#ifdef PROFILER_TRACE
+PROFILER_API struct profiler_trace_block* _profiler_trace_block_next(struct profiler_thread* thread, uint64_t cycles);
+
+static inline uint8_t* profiler_trace_put_varint(uint8_t* out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+/* `flow` is only written for the async event types */
+static inline void profiler_trace_record(struct profiler_thread* thread, int id, uint64_t cycles, uint32_t type, uint64_t flow)
+{
+	int session = profiler_atomic_load_int(&profiler_trace_session);
+	if (!session)
+		return;
+
+	struct profiler_trace_block* block = thread->trace_block;
+	if (!block || block->session != session || block->size > PROFILER_TRACE_BLOCK_BYTES - PROFILER_TRACE_EVENT_BYTES_MAX)
+	{
+		block = _profiler_trace_block_next(thread, cycles);
+		if (!block)
+			return;
+	}
+
+	int64_t delta = (int64_t)(cycles - thread->trace_cycles);
+	uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+	thread->trace_cycles = cycles;
+
+	uint8_t* out = profiler_trace_put_varint(block->data + block->size, zigzag << 2 | (type < 3 ? type : 3));
+	if (type >= 3)
+		out = profiler_trace_put_varint(out, type);
+
+	int index = thread->trace_dictionary[id];
+	if (index)
+	{
+		out = profiler_trace_put_varint(out, (uint64_t)(index - 1));
+	}
+	else
+	{
+		index = thread->trace_dictionary_count++;
+		thread->trace_dictionary[id] = (uint16_t)(index + 1);
+		out = profiler_trace_put_varint(out, (uint64_t)index);
+		out = profiler_trace_put_varint(out, (uint64_t)id);
+	}
+
+	if (type == PROFILER_TRACE_EVENT_ASYNC_BEGIN || type == PROFILER_TRACE_EVENT_ASYNC_END)
+		out = profiler_trace_put_varint(out, flow);
+
+	/* Publishes the event to profiler_trace_end, which reads partially filled blocks */
+	profiler_atomic_store_int(&block->size, (int)(out - block->data));
+}
+#endif
+#endif
+
+#ifdef PROFILER_DEFINE
+volatile int profiler_current_id = 0;
+struct profiler_node profiler_nodes[PROFILER_NODES_MAX];
+PROFILER_THREAD_LOCAL struct profiler_thread* profiler_thread_current = NULL;
+
+#if defined(_WIN32) && defined(PROFILER_SHARED)
+struct profiler_thread* _profiler_thread_current()
+{
+	return profiler_thread_current;
+}
+#endif
+
+static struct profiler_thread* volatile profiler_threads = NULL;
+static volatile int profiler_setup_lock = 0;
+
+/* When the counts were last reset, for the rates in the reports */
+static uint64_t profiler_cycles_reset = 0;
+
+/* One past the highest node id that has been set up, reports never look further */
+static volatile int profiler_nodes_used = 0;
+
+/* Limits of profiler_initialize_budget and the bytes charged against them */
+static struct profiler_budget profiler_budget_limits;
+static volatile uint64_t profiler_budget_used = 0;
+static volatile uint64_t profiler_budget_thread_used = 0;
+
+static volatile int profiler_dropped_threads = 0;
+
+/* Shared by every thread over the budget, nothing reads its counts */
+static struct profiler_thread profiler_thread_dropped;
+
+#ifdef PROFILER_PER_CPU
+struct profiler_cpu* volatile profiler_cpus[PROFILER_CPUS_MAX];
+
+/* Added to atomically by CPUs beyond PROFILER_CPUS_MAX and wherever the CPU is not known, always the last table */
+static struct profiler_cpu profiler_cpu_shared;
+static struct profiler_cpu* volatile profiler_cpu_tables = &profiler_cpu_shared;
+#endif
+
+/* The table after `nodes`, or the first with NULL: one per thread or with PROFILER_PER_CPU one per CPU */
+static struct profiler_thread_node* profiler_tables_next(struct profiler_thread_node* nodes)
+{
+#ifdef PROFILER_PER_CPU
+	struct profiler_cpu* table = nodes ? ((struct profiler_cpu*)nodes)->next : (struct profiler_cpu*)profiler_atomic_load_ptr((void* const volatile*)&profiler_cpu_tables);
+#else
+	struct profiler_thread* table = nodes ? ((struct profiler_thread*)nodes)->next : (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+#endif
+	return table ? table->nodes : NULL;
+}
+
+uint64_t profiler_cycles_measure = 0;
+
+/* Reports are written either to a FILE or appended to a caller supplied buffer */
+struct profiler_output
+{
+	FILE* file;
+	char* buffer;
+	size_t length;
+};
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4996)
+#endif
+
+#ifdef _WIN32
+static unsigned long get_milliseconds()
+{
+	LARGE_INTEGER timestamp;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&timestamp);
+	QueryPerformanceFrequency(&frequency);
+
+	return (unsigned long)(timestamp.QuadPart / (frequency.QuadPart / 1000));
+}
+#else
+static unsigned long get_milliseconds()
+{
+	struct timeval time; 
+	gettimeofday(&time, NULL);
+	unsigned long milliseconds = time.tv_sec * 1000LL + time.tv_usec / 1000;
+	return milliseconds;
+}
+#endif
+
+void _profiler_initialize()
+{
+	profiler_reset();
+
+	unsigned long milliseconds = get_milliseconds();
+	uint64_t cycles_start = get_cycles();
+
+	while (get_milliseconds() - milliseconds < PROFILER_MEASURE_MILLISECONDS)
+		;
+
+	profiler_cycles_measure = get_cycles() - cycles_start;
+}
+
+void _profiler_initialize_budget(const struct profiler_budget* budget)
+{
+	profiler_budget_limits = *budget;
+	_profiler_initialize();
+}
+
+/* Charge `bytes` to a subsystem and the total, returns 0 and charges nothing if a limit would be exceeded */
+static int profiler_budget_charge(volatile uint64_t* used, uint64_t limit, uint64_t bytes)
+{
+	/* Threads that keep asking while over the budget only read the counts */
+	if ((profiler_budget_limits.total_bytes && profiler_atomic_load_u64(&profiler_budget_used) + bytes > profiler_budget_limits.total_bytes) ||
+		(limit && profiler_atomic_load_u64(used) + bytes > limit))
+	{
+		return 0;
+	}
+
+	uint64_t total = profiler_atomic_add_u64(&profiler_budget_used, bytes) + bytes;
+	uint64_t subsystem = profiler_atomic_add_u64(used, bytes) + bytes;
+
+	if ((profiler_budget_limits.total_bytes && total > profiler_budget_limits.total_bytes) || (limit && subsystem > limit))
+	{
+		profiler_atomic_add_u64(&profiler_budget_used, 0 - bytes);
+		profiler_atomic_add_u64(used, 0 - bytes);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void profiler_budget_release(volatile uint64_t* used, uint64_t bytes)
+{
+	profiler_atomic_add_u64(&profiler_budget_used, 0 - bytes);
+	profiler_atomic_add_u64(used, 0 - bytes);
+}
+
+void _profiler_scope_dropped()
+{
+	struct profiler_thread* thread = profiler_thread_get();
+	profiler_atomic_add_u64(&thread->dropped_calls, 1);
+}
+
+void _profiler_get_dropped(struct profiler_dropped* dropped)
+{
+	memset(dropped, 0, sizeof(*dropped));
+	dropped->threads = (uint64_t)profiler_atomic_load_int(&profiler_dropped_threads);
+
+	struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	for (; thread; thread = thread->next)
+	{
+		dropped->calls += profiler_atomic_load_u64(&thread->dropped_calls);
+#ifdef PROFILER_TRACE
+		dropped->events += profiler_atomic_load_u64(&thread->trace_dropped);
+#endif
+	}
+}
+
+void _profiler_reset()
+{
+	int i;
+	for (i = 0; i < PROFILER_NODES_MAX; i++)
+	{
+		profiler_nodes[i].total_cycles = 0;
+		profiler_nodes[i].calls = 0;
+		profiler_nodes[i].migrations = 0;
+		profiler_nodes[i].suspended_cycles = 0;
+		profiler_nodes[i].parent_id = -1;
+		profiler_nodes[i].is_async = 0;
+		profiler_nodes[i].wait_cycles = 0;
+		profiler_nodes[i].steals = 0;
+		profiler_nodes[i].is_task = 0;
+		profiler_nodes[i].contentions = 0;
+		profiler_nodes[i].is_lock = 0;
+		profiler_nodes[i].blocking_cycles = 0;
+		profiler_nodes[i].blocked_cycles = 0;
+		profiler_nodes[i].io_calls = 0;
+		profiler_nodes[i].io_bytes = 0;
+		profiler_nodes[i].io_cycles = 0;
+		profiler_nodes[i].syncs = 0;
+		profiler_nodes[i].sync_cycles = 0;
+		profiler_atomic_store_int(&profiler_nodes[i].is_setup, 0);
+		strncpy(profiler_nodes[i].name, "", 1);
+	}
+
+	profiler_atomic_store_int(&profiler_nodes_used, 0);
+	profiler_cycles_reset = get_cycles();
+
+	struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	for (; thread; thread = thread->next)
+	{
+		profiler_atomic_store_u64(&thread->dropped_calls, 0);
+#ifdef PROFILER_TRACE
+		profiler_atomic_store_u64(&thread->trace_dropped, 0);
+#endif
+	}
+
+	struct profiler_thread_node* nodes;
+	for (nodes = profiler_tables_next(NULL); nodes; nodes = profiler_tables_next(nodes))
+	{
+		for (i = 0; i < PROFILER_NODES_MAX; i++)
+		{
+			profiler_atomic_store_u64(&nodes[i].total_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].calls, 0);
+			profiler_atomic_store_u64(&nodes[i].suspended_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].wait_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].steals, 0);
+			profiler_atomic_store_u64(&nodes[i].contentions, 0);
+			profiler_atomic_store_u64(&nodes[i].blocking_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].blocked_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].io_calls, 0);
+			profiler_atomic_store_u64(&nodes[i].io_bytes, 0);
+			profiler_atomic_store_u64(&nodes[i].io_cycles, 0);
+			profiler_atomic_store_u64(&nodes[i].syncs, 0);
+			profiler_atomic_store_u64(&nodes[i].sync_cycles, 0);
+#ifdef PROFILER_RDTSCP
+			profiler_atomic_store_u64(&nodes[i].migrations, 0);
+#endif
+#ifdef PROFILER_HISTOGRAMS
+			int j;
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+			{
+				profiler_atomic_store_u64(&nodes[i].histogram[j], 0);
+				profiler_atomic_store_u64(&nodes[i].wait_histogram[j], 0);
+				profiler_atomic_store_u64(&nodes[i].io_histogram[j], 0);
 			}
+#endif
+		}
+	}
+}
+
+/* Sum the per-thread or per-CPU tables into profiler_nodes */
+static void profiler_collect()
+{
+	int nodes_used = profiler_atomic_load_int(&profiler_nodes_used);
+
+	int i;
+	for (i = 0; i < nodes_used; i++)
+	{
+		profiler_nodes[i].total_cycles = 0;
+		profiler_nodes[i].calls = 0;
+		profiler_nodes[i].migrations = 0;
+		profiler_nodes[i].suspended_cycles = 0;
+		profiler_nodes[i].wait_cycles = 0;
+		profiler_nodes[i].steals = 0;
+		profiler_nodes[i].contentions = 0;
+		profiler_nodes[i].blocking_cycles = 0;
+		profiler_nodes[i].blocked_cycles = 0;
+		profiler_nodes[i].io_calls = 0;
+		profiler_nodes[i].io_bytes = 0;
+		profiler_nodes[i].io_cycles = 0;
+		profiler_nodes[i].syncs = 0;
+		profiler_nodes[i].sync_cycles = 0;
+	}
+
+	struct profiler_thread_node* nodes;
+	for (nodes = profiler_tables_next(NULL); nodes; nodes = profiler_tables_next(nodes))
+	{
+		for (i = 0; i < nodes_used; i++)
+		{
+			profiler_nodes[i].total_cycles += profiler_atomic_load_u64(&nodes[i].total_cycles);
+			profiler_nodes[i].calls += profiler_atomic_load_u64(&nodes[i].calls);
+			profiler_nodes[i].suspended_cycles += profiler_atomic_load_u64(&nodes[i].suspended_cycles);
+			profiler_nodes[i].wait_cycles += profiler_atomic_load_u64(&nodes[i].wait_cycles);
+			profiler_nodes[i].steals += profiler_atomic_load_u64(&nodes[i].steals);
+			profiler_nodes[i].contentions += profiler_atomic_load_u64(&nodes[i].contentions);
+			profiler_nodes[i].blocking_cycles += profiler_atomic_load_u64(&nodes[i].blocking_cycles);
+			profiler_nodes[i].blocked_cycles += profiler_atomic_load_u64(&nodes[i].blocked_cycles);
+			profiler_nodes[i].io_calls += profiler_atomic_load_u64(&nodes[i].io_calls);
+			profiler_nodes[i].io_bytes += profiler_atomic_load_u64(&nodes[i].io_bytes);
+			profiler_nodes[i].io_cycles += profiler_atomic_load_u64(&nodes[i].io_cycles);
+			profiler_nodes[i].syncs += profiler_atomic_load_u64(&nodes[i].syncs);
+			profiler_nodes[i].sync_cycles += profiler_atomic_load_u64(&nodes[i].sync_cycles);
+#ifdef PROFILER_RDTSCP
+			profiler_nodes[i].migrations += profiler_atomic_load_u64(&nodes[i].migrations);
+#endif
+		}
+	}
+}
+
+static void profiler_output_printf(struct profiler_output* output, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	if (output->file)
+		vfprintf(output->file, format, args);
+	else
+		output->length += vsprintf(output->buffer + output->length, format, args);
+
+	va_end(args);
+}
+
+#ifdef PROFILER_HISTOGRAMS
+/* The cycles that `percent` percent of the calls in the histogram at `histogram` (the offset in the node) took at most, the upper end of their log2 bucket */
+static uint64_t profiler_percentile(int id, size_t histogram, int percent)
+{
+	uint64_t buckets[PROFILER_HISTOGRAM_BUCKETS] = { 0 };
+	uint64_t calls = 0;
+
+	struct profiler_thread_node* nodes;
+	for (nodes = profiler_tables_next(NULL); nodes; nodes = profiler_tables_next(nodes))
+	{
+		volatile uint64_t* counts = (volatile uint64_t*)((char*)&nodes[id] + histogram);
+
+		int j;
+		for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+		{
+			buckets[j] += profiler_atomic_load_u64(&counts[j]);
+			calls += profiler_atomic_load_u64(&counts[j]);
+		}
+	}
+
+	uint64_t below = 0;
+
+	int j;
+	for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS - 1; j++)
+	{
+		below += buckets[j];
+		if (below * 100 >= calls * (uint64_t)percent)
+			break;
+	}
+
+	return j + 1 < 64 ? ((uint64_t)1 << (j + 1)) - 1 : UINT64_MAX;
+}
+#endif
+
+static uint64_t profiler_running_cycles(int id)
+{
+	uint64_t blocked_cycles = profiler_nodes[id].blocked_cycles;
+	return profiler_nodes[id].total_cycles > blocked_cycles ? profiler_nodes[id].total_cycles - blocked_cycles : 0;
+}
+
+/* Whether node `a` is listed before its sibling `b`: more running time first, then more cycles, then the node set up first */
+static int profiler_ranks_before(int a, int b)
+{
+	uint64_t running_a = profiler_running_cycles(a);
+	uint64_t running_b = profiler_running_cycles(b);
+
+	if (running_a != running_b)
+		return running_a > running_b;
+
+	if (profiler_nodes[a].total_cycles != profiler_nodes[b].total_cycles)
+		return profiler_nodes[a].total_cycles > profiler_nodes[b].total_cycles;
+
+	return a < b;
+}
+
+static void profiler_get_results_sorted(struct profiler_output* output, int parent_id, float seconds_total, int level)
+{
+	char buffer_name[PROFILER_NAME_MAXLEN * 2];
+
+	int previous_index = -1;
+	int nodes_used = profiler_atomic_load_int(&profiler_nodes_used);
+
+	int i;
+	for (i = 0; i < nodes_used; i++)
+	{
+		int max_index = -1;
+
+		int j;
+		/* Ranked by running time, so scopes that spend their time blocked do not crowd out the busy ones; every node has its own rank, so ties and fully blocked scopes are listed too */
+		for (j = 0; j < nodes_used; j++)
+		{
+			/* Nodes that never ended have nothing to show */
+			if (profiler_nodes[j].parent_id != parent_id || (!profiler_nodes[j].calls && !profiler_nodes[j].total_cycles))
+				continue;
+
+			if ((previous_index == -1 || profiler_ranks_before(previous_index, j)) &&
+				(max_index == -1 || profiler_ranks_before(j, max_index)))
+				max_index = j;
+		}
+
+		previous_index = max_index;
+
+		if (max_index != -1)
+		{
+			int indent = level * 4 < PROFILER_NAME_MAXLEN ? level * 4 : PROFILER_NAME_MAXLEN - 1;
+			memset(buffer_name, ' ', indent);
+			strncpy(buffer_name + indent, profiler_nodes[max_index].name, PROFILER_NAME_MAXLEN);
+			buffer_name[sizeof(buffer_name) - 1] = '\0';
+
+			int parent_id = profiler_nodes[max_index].parent_id;
+			float seconds = (float)profiler_nodes[max_index].total_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+			float seconds_parent = 0.0f;
+
+			if (parent_id == -1)
+			{
+				seconds_parent = seconds;
+				seconds_total = seconds;
+			}
+			else
+			{
+				seconds_parent = (float)profiler_nodes[parent_id].total_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+			}
+
+			float percent_total = 100.0f * (seconds / seconds_total);
+			float percent_local = 100.0f * (seconds / seconds_parent);
+
+			profiler_output_printf(output,
+					"%-40s%-7.2f : %-7.2f : %f : %" PRIu64, 
+					buffer_name,
+					percent_total,
+					percent_local,
+					seconds, 
+					profiler_nodes[max_index].total_cycles);
+
+			/* Async scopes, whose seconds add up the latencies of all their calls */
+			if (profiler_nodes[max_index].is_async && profiler_nodes[max_index].calls)
+				profiler_output_printf(output, " : latency %f", seconds / (float)profiler_nodes[max_index].calls);
+
+			/* Tasks, whose seconds are only their execution */
+			if (profiler_nodes[max_index].is_task && profiler_nodes[max_index].calls)
+			{
+				float seconds_wait = (float)profiler_nodes[max_index].wait_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+				profiler_output_printf(output, " : wait %f", seconds_wait / (float)profiler_nodes[max_index].calls);
+#ifdef PROFILER_HISTOGRAMS
+				profiler_output_printf(output, " : wait p99 %f", (float)profiler_percentile(max_index, offsetof(struct profiler_thread_node, wait_histogram), 99) / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+#endif
+				if (profiler_nodes[max_index].steals)
+					profiler_output_printf(output, " : steals %" PRIu64, profiler_nodes[max_index].steals);
+			}
+
+			/* Locks, whose seconds are the time they were held */
+			if (profiler_nodes[max_index].is_lock)
+			{
+				float seconds_counted = (float)(get_cycles() - profiler_cycles_reset) / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+				profiler_output_printf(output, " : contended %.1f/s", (float)profiler_nodes[max_index].contentions / seconds_counted);
+#ifdef PROFILER_HISTOGRAMS
+				if (profiler_nodes[max_index].contentions)
+					profiler_output_printf(output, " : wait p99 %f", (float)profiler_percentile(max_index, offsetof(struct profiler_thread_node, wait_histogram), 99) / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+				if (profiler_nodes[max_index].calls)
+					profiler_output_printf(output, " : hold p99 %f", (float)profiler_percentile(max_index, offsetof(struct profiler_thread_node, histogram), 99) / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+#else
+				if (profiler_nodes[max_index].contentions)
+					profiler_output_printf(output, " : wait %f", (float)profiler_nodes[max_index].wait_cycles / (float)profiler_nodes[max_index].contentions / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+#endif
+			}
+
+			/* Scopes that waited, their seconds include the time they were blocked */
+			if (profiler_nodes[max_index].blocked_cycles)
+				profiler_output_printf(output, " : blocked %f", (float)profiler_nodes[max_index].blocked_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+
+			/* Scopes that did I/O, the bytes per call show unbatched I/O */
+			if (profiler_nodes[max_index].io_calls)
+			{
+				float seconds_io = (float)profiler_nodes[max_index].io_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+				profiler_output_printf(output, " : io calls %" PRIu64, profiler_nodes[max_index].io_calls);
+				profiler_output_printf(output, " : io bytes/call %.0f", (float)profiler_nodes[max_index].io_bytes / (float)profiler_nodes[max_index].io_calls);
+				if (seconds_io > 0.0f)
+					profiler_output_printf(output, " : io %.1f MB/s", (float)profiler_nodes[max_index].io_bytes / seconds_io / 1e6f);
+#ifdef PROFILER_HISTOGRAMS
+				profiler_output_printf(output, " : io p99 %f", (float)profiler_percentile(max_index, offsetof(struct profiler_thread_node, io_histogram), 99) / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+#else
+				profiler_output_printf(output, " : io latency %f", seconds_io / (float)profiler_nodes[max_index].io_calls);
+#endif
+			}
+
+			if (profiler_nodes[max_index].syncs)
+				profiler_output_printf(output, " : syncs %" PRIu64 " : sync %f", profiler_nodes[max_index].syncs,
+					(float)profiler_nodes[max_index].sync_cycles / (float)profiler_nodes[max_index].syncs / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+
+			/* Scopes that held a lock other threads waited for */
+			if (profiler_nodes[max_index].blocking_cycles)
+				profiler_output_printf(output, " : blocking %f", (float)profiler_nodes[max_index].blocking_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+
+			/* Coroutine scopes, whose seconds are only the time they ran */
+			if (profiler_nodes[max_index].suspended_cycles)
+				profiler_output_printf(output, " : suspended %f", (float)profiler_nodes[max_index].suspended_cycles / ((float)profiler_cycles_measure / PROFILER_MEASURE_SECONDS));
+
+#ifdef PROFILER_RDTSCP
+			uint64_t migrations = profiler_nodes[max_index].migrations;
+			if (migrations && migrations * 100 >= profiler_nodes[max_index].calls * PROFILER_MIGRATIONS_PERCENT)
+				profiler_output_printf(output, " : migrated %.1f%%", 100.0 * (double)migrations / (double)profiler_nodes[max_index].calls);
+#endif
+
+			profiler_output_printf(output, "\n");
+
+			profiler_get_results_sorted(output, max_index, seconds_total, level + 1);
+		}
+		else
+		{
+			return;
+		}
+	}
+}
+
+static void profiler_write_results(struct profiler_output* output)
+{
+	profiler_collect();
+
+	struct profiler_dropped dropped;
+	_profiler_get_dropped(&dropped);
+
+	/* In every report, zeros included, so a partial report is never taken for a complete one */
+	profiler_output_printf(output, "Dropped: %" PRIu64 " calls of scopes beyond PROFILER_NODES_MAX, %" PRIu64 " threads, %" PRIu64 " trace events\n",
+			dropped.calls, dropped.threads, dropped.events);
+
+	profiler_output_printf(output,
+			"%-40s%s : %s : %-8s : %s\n", 
+			"Name",
+			"%-total",
+			"%-local",
+			"Seconds", 
+			"CPU Cycles");
+
+	profiler_output_printf(output, "----------------------------------------------------------------------------------\n");
+	profiler_get_results_sorted(output, -1, 0.0f, 0);
+}
+
+void _profiler_get_results(char* buffer)
+{
+	struct profiler_output output = { NULL, buffer, 0 };
+	buffer[0] = '\0';
+	profiler_write_results(&output);
+}
+
+void _profiler_dump_file(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return;
+
+	struct profiler_output output = { file, NULL, 0 };
+	profiler_write_results(&output);
+	fclose(file);
+}
+
+void _profiler_dump_console()
+{
+	struct profiler_output output = { stdout, NULL, 0 };
+	profiler_write_results(&output);
+}
+
+struct profiler_snapshot_entry
+{
+	uint64_t total_cycles;
+	int id;
+};
+
+static int profiler_snapshot_entry_compare(const void* a, const void* b)
+{
+	const struct profiler_snapshot_entry* entry_a = (const struct profiler_snapshot_entry*)a;
+	const struct profiler_snapshot_entry* entry_b = (const struct profiler_snapshot_entry*)b;
+
+	if (entry_a->total_cycles != entry_b->total_cycles)
+		return entry_a->total_cycles > entry_b->total_cycles ? -1 : 1;
+
+	return entry_a->id - entry_b->id;
+}
+
+static size_t profiler_align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+/* Lays out the snapshot of the first nodes_used nodes in the scratch arrays of _profiler_get_snapshot, NULL when it can't be allocated */
+static uint8_t* profiler_snapshot_build(int nodes_used, int* group_begin, struct profiler_snapshot_entry* entries,
+										int* order, int* index_of, uint32_t* subtree_size, int* stack, size_t* size)
+{
+	size_t strings_size = 0;
+
+	int i;
+	for (i = 0; i < nodes_used; i++)
+	{
+		int parent_id = profiler_nodes[i].parent_id;
+		if (parent_id >= 0 && !profiler_nodes[parent_id].is_setup)
+			parent_id = -1;
+
+		index_of[i] = parent_id;
+
+		if (profiler_nodes[i].is_setup)
+		{
+			group_begin[parent_id + 2]++;
+			strings_size += strlen(profiler_nodes[i].name) + 1;
+		}
+	}
+
+	for (i = 0; i <= nodes_used; i++)
+		group_begin[i + 1] += group_begin[i];
+
+	for (i = 0; i < nodes_used; i++)
+	{
+		if (profiler_nodes[i].is_setup)
+		{
+			struct profiler_snapshot_entry* entry = &entries[group_begin[index_of[i] + 1]++];
+			entry->total_cycles = profiler_nodes[i].total_cycles;
+			entry->id = i;
+		}
+	}
+
+	/* group_begin[slot + 1] is now the end of the slot, shift back to get the beginnings */
+	for (i = nodes_used; i >= 0; i--)
+		group_begin[i + 1] = group_begin[i];
+	group_begin[0] = 0;
+
+	for (i = 0; i <= nodes_used; i++)
+		qsort(entries + group_begin[i], group_begin[i + 1] - group_begin[i], sizeof(struct profiler_snapshot_entry), profiler_snapshot_entry_compare);
+
+	/* Depth-first order without recursion, so deep trees can't overflow the stack */
+	int stack_size = 0;
+	uint32_t order_size = 0;
+
+	for (i = group_begin[1] - 1; i >= group_begin[0]; i--)
+		stack[stack_size++] = entries[i].id;
+
+	while (stack_size > 0)
+	{
+		int id = stack[--stack_size];
+		index_of[id] = (int)order_size;
+		order[order_size++] = id;
+
+		int j;
+		for (j = group_begin[id + 2] - 1; j >= group_begin[id + 1]; j--)
+			stack[stack_size++] = entries[j].id;
+	}
+
+	for (i = (int)order_size - 1; i >= 0; i--)
+	{
+		subtree_size[i] = 1;
+
+		int j;
+		for (j = group_begin[order[i] + 2] - 1; j >= group_begin[order[i] + 1]; j--)
+			subtree_size[i] += subtree_size[index_of[entries[j].id]];
+	}
+
+	uint32_t thread_count = 0;
+	struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	for (; thread; thread = thread->next)
+		thread_count++;
+
+#ifdef PROFILER_HISTOGRAMS
+	uint32_t histogram_buckets = PROFILER_HISTOGRAM_BUCKETS;
+#else
+	uint32_t histogram_buckets = 0;
+#endif
+
+	size_t node_table_offset = profiler_align8(sizeof(struct profiler_snapshot_header));
+	size_t string_table_offset = node_table_offset + (size_t)order_size * sizeof(struct profiler_snapshot_node);
+	size_t histogram_offset = profiler_align8(string_table_offset + strings_size);
+	size_t snapshot_size = histogram_offset + (size_t)order_size * histogram_buckets * sizeof(uint64_t);
+
+	uint8_t* snapshot = (uint8_t*)calloc(1, snapshot_size);
+	if (!snapshot)
+		return NULL;
+
+	struct profiler_snapshot_header* header = (struct profiler_snapshot_header*)snapshot;
+	memcpy(header->magic, PROFILER_SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->version = PROFILER_SNAPSHOT_VERSION;
+	header->header_size = sizeof(struct profiler_snapshot_header);
+#ifdef PROFILER_RDTSCP
+	header->clock_source = PROFILER_CLOCK_RDTSCP;
+#else
+	header->clock_source = PROFILER_CLOCK_RDTSC;
+#endif
+	header->node_size = sizeof(struct profiler_snapshot_node);
+	header->cycles_per_second = (uint64_t)((double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+	header->node_count = order_size;
+	header->histogram_buckets = histogram_buckets;
+	header->thread_count = thread_count;
+	header->node_table_offset = node_table_offset;
+	header->string_table_offset = string_table_offset;
+	header->string_table_size = strings_size;
+	header->histogram_offset = histogram_offset;
+	header->size = snapshot_size;
+
+	struct profiler_dropped dropped;
+	_profiler_get_dropped(&dropped);
+	header->dropped_calls = dropped.calls;
+	header->dropped_threads = dropped.threads;
+	header->dropped_events = dropped.events;
+
+	struct profiler_snapshot_node* nodes = (struct profiler_snapshot_node*)(snapshot + node_table_offset);
+	char* strings = (char*)(snapshot + string_table_offset);
+	size_t name_offset = 0;
+
+	uint32_t n;
+	for (n = 0; n < order_size; n++)
+	{
+		int id = order[n];
+		int parent_id = profiler_nodes[id].parent_id;
+		size_t name_length = strlen(profiler_nodes[id].name) + 1;
+
+		nodes[n].total_cycles = profiler_nodes[id].total_cycles;
+		nodes[n].calls = profiler_nodes[id].calls;
+		nodes[n].parent = parent_id >= 0 && profiler_nodes[parent_id].is_setup ? index_of[parent_id] : -1;
+		nodes[n].name_offset = (uint32_t)name_offset;
+		nodes[n].depth = nodes[n].parent >= 0 ? nodes[nodes[n].parent].depth + 1 : 0;
+		nodes[n].subtree_end = n + subtree_size[n];
+		nodes[n].migrations = profiler_nodes[id].migrations;
+		nodes[n].suspended_cycles = profiler_nodes[id].suspended_cycles;
+		nodes[n].blocked_cycles = profiler_nodes[id].blocked_cycles;
+		nodes[n].io_calls = profiler_nodes[id].io_calls;
+		nodes[n].io_bytes = profiler_nodes[id].io_bytes;
+		nodes[n].io_cycles = profiler_nodes[id].io_cycles;
+		nodes[n].syncs = profiler_nodes[id].syncs;
+		nodes[n].sync_cycles = profiler_nodes[id].sync_cycles;
+
+		memcpy(strings + name_offset, profiler_nodes[id].name, name_length);
+		name_offset += name_length;
+	}
+
+#ifdef PROFILER_HISTOGRAMS
+	uint64_t* histograms = (uint64_t*)(snapshot + histogram_offset);
+
+	struct profiler_thread_node* table;
+	for (table = profiler_tables_next(NULL); table; table = profiler_tables_next(table))
+	{
+		for (n = 0; n < order_size; n++)
+		{
+			int j;
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+				histograms[(size_t)n * PROFILER_HISTOGRAM_BUCKETS + j] += profiler_atomic_load_u64(&table[order[n]].histogram[j]);
+		}
+	}
+#endif
+
+	*size = snapshot_size;
+	return snapshot;
+}
+
+void* _profiler_get_snapshot(size_t* size)
+{
+	profiler_collect();
+
+	int nodes_used = profiler_atomic_load_int(&profiler_nodes_used);
+
+	/* Children grouped by parent, slot 0 holds the roots and slot id + 1 the children of id */
+	int* group_begin = (int*)calloc(nodes_used + 2, sizeof(int));
+	struct profiler_snapshot_entry* entries = (struct profiler_snapshot_entry*)malloc((nodes_used + 1) * sizeof(struct profiler_snapshot_entry));
+	int* order = (int*)malloc((nodes_used + 1) * sizeof(int));
+	int* index_of = (int*)malloc((nodes_used + 1) * sizeof(int));
+	uint32_t* subtree_size = (uint32_t*)malloc((nodes_used + 1) * sizeof(uint32_t));
+	int* stack = (int*)malloc((nodes_used + 1) * sizeof(int));
+
+	uint8_t* snapshot = NULL;
+	*size = 0;
+
+	if (group_begin && entries && order && index_of && subtree_size && stack)
+		snapshot = profiler_snapshot_build(nodes_used, group_begin, entries, order, index_of, subtree_size, stack, size);
+
+	free(stack);
+	free(subtree_size);
+	free(index_of);
+	free(order);
+	free(entries);
+	free(group_begin);
+
+	return snapshot;
+}
+
+void _profiler_free_snapshot(void* snapshot)
+{
+	free(snapshot);
+}
+
+void _profiler_dump_snapshot(const char* filename)
+{
+	size_t size;
+	void* snapshot = profiler_get_snapshot(&size);
+	if (!snapshot)
+		return;
+
+	FILE* file = fopen(filename, "wb");
+	if (file)
+	{
+		fwrite(snapshot, 1, size, file);
+		fclose(file);
+	}
+
+	profiler_free_snapshot(snapshot);
+}
+
+void _profiler_node_setup(int id, const char* name)
+{
+	while (!profiler_atomic_cas_int(&profiler_setup_lock, 0, 1))
+		;
+
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+	{
+		strncpy(profiler_nodes[id].name, name, PROFILER_NAME_MAXLEN - 1);
+		profiler_nodes[id].name[PROFILER_NAME_MAXLEN - 1] = '\0';
+		profiler_nodes[id].parent_id = profiler_thread_get()->current_parent;
+		profiler_atomic_store_int(&profiler_nodes[id].is_setup, 1);
+
+		if (id >= profiler_nodes_used)
+			profiler_atomic_store_int(&profiler_nodes_used, id + 1);
+	}
+
+	profiler_atomic_store_int(&profiler_setup_lock, 0);
+}
+
+#ifdef PROFILER_TRACE
+volatile int profiler_trace_session = 0;
+
+/* Flows handed out to async scopes, so every pair of their events in a trace is told apart */
+static volatile uint64_t profiler_async_flows = 0;
+
+static int profiler_trace_last_session = 0;
+static volatile int profiler_trace_thread_count = 0;
+static volatile int profiler_trace_stop = 0;
+
+/* Full blocks waiting for the flusher of the NUMA node of their thread, pushed by any thread */
+static struct profiler_trace_block* volatile profiler_trace_queues[PROFILER_NUMA_NODES_MAX];
+
+/* Bytes of blocks in memory, set when PROFILER_BUDGET_AGGREGATE_ONLY stops recording and the drops before this trace */
+static volatile uint64_t profiler_budget_trace_used = 0;
+static volatile int profiler_trace_degraded = 0;
+static uint64_t profiler_trace_dropped_base = 0;
+
+static FILE* profiler_trace_file = NULL;
+static struct profiler_trace_header profiler_trace_file_header;
+static uint64_t profiler_trace_offset = 0;
+
+/* One flusher per NUMA node, taking turns to write chunks to the file */
+#ifdef _WIN32
+static HANDLE profiler_trace_flushers[PROFILER_NUMA_NODES_MAX];
+#else
+static pthread_t profiler_trace_flushers[PROFILER_NUMA_NODES_MAX];
+#endif
+static int profiler_trace_flusher_count = 0;
+static int profiler_trace_flusher_session = 0;
+static volatile int profiler_trace_write_lock = 0;
+
+/*
+*	Ring file of profiler_trace_begin_ring. The whole file is mapped and every
+*	slot is a chunk header followed by a block that one thread fills in place.
+*	A slot is owned by at most one thread and full slots are taken again in
+*	turn. The mapping of the last ring stays reserved until the next trace
+*	begins, so threads still writing to it when it ends write to dropped memory.
+*/
+static uint8_t* profiler_trace_ring = NULL;
+static uint64_t profiler_trace_ring_size = 0;
+static volatile int profiler_trace_ring_slots = 0;
+static volatile int profiler_trace_ring_cursor = 0;
+static volatile int* profiler_trace_ring_owners = NULL;
+
+#define PROFILER_TRACE_RING_FIRST ((sizeof(struct profiler_trace_header) + 7) & ~(size_t)7)
+#define PROFILER_TRACE_RING_STRIDE (sizeof(struct profiler_trace_chunk) + sizeof(struct profiler_trace_block))
+
+/* Slots are read as a chunk header and a profiler_trace_ring_block */
+typedef char profiler_trace_block_layout[offsetof(struct profiler_trace_block, data) == sizeof(struct profiler_trace_ring_block) ? 1 : -1];
+
+#ifdef PROFILER_FIBERS
+/* Every fiber that has run and not ended, so the blocks of switched out fibers are found like those of threads */
+static struct profiler_fiber* profiler_trace_fibers = NULL;
+static volatile int profiler_trace_fibers_lock = 0;
+
+static void profiler_trace_fibers_acquire()
+{
+	while (!profiler_atomic_cas_int(&profiler_trace_fibers_lock, 0, 1))
+		;
+}
+
+static void profiler_trace_fibers_release()
+{
+	profiler_atomic_store_int(&profiler_trace_fibers_lock, 0);
+}
+
+static void profiler_trace_fiber_add(struct profiler_fiber* fiber)
+{
+	profiler_trace_fibers_acquire();
+
+	fiber->trace_previous = NULL;
+	fiber->trace_next = profiler_trace_fibers;
+	if (fiber->trace_next)
+		fiber->trace_next->trace_previous = fiber;
+	profiler_trace_fibers = fiber;
+
+	profiler_trace_fibers_release();
+}
+
+static void profiler_trace_fiber_remove(struct profiler_fiber* fiber)
+{
+	profiler_trace_fibers_acquire();
+
+	if (fiber->trace_previous)
+		fiber->trace_previous->trace_next = fiber->trace_next;
+	else
+		profiler_trace_fibers = fiber->trace_next;
+	if (fiber->trace_next)
+		fiber->trace_next->trace_previous = fiber->trace_previous;
+
+	profiler_trace_fibers_release();
+}
+#endif
+
+static void profiler_trace_write(const void* data, size_t size)
+{
+	fwrite(data, 1, size, profiler_trace_file);
+	profiler_trace_offset += size;
+}
+
+/* A chunk with no thread, time range or codec */
+static void profiler_trace_chunk_init(struct profiler_trace_chunk* chunk, uint32_t type, uint32_t count, uint64_t size)
+{
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->type = type;
+	chunk->count = count;
+	chunk->size = size;
+}
+
+/* Write `chunk` and its chunk->size bytes of payload */
+static void profiler_trace_write_chunk(const struct profiler_trace_chunk* chunk, const void* payload)
+{
+	static const char padding[8] = { 0 };
+
+	profiler_trace_write(chunk, sizeof(*chunk));
+	profiler_trace_write(payload, (size_t)chunk->size);
+	profiler_trace_write(padding, (size_t)((8 - chunk->size % 8) % 8));
+}
+
+/*
+*	Time index, built while the blocks are written. Every written block is
+*	replayed against a per-thread stack of open scopes, and the stack as it was
+*	when the block began is stored with the block's entry. Only the flusher and
+*	profiler_trace_end write blocks, never at the same time.
+*/
+struct profiler_trace_index_state
+{
+	struct profiler_trace_open_scope* stack;
+	uint32_t stack_depth;
+	uint32_t stack_capacity;
+
+	struct profiler_trace_index_entry* entries;
+	uint32_t entry_count;
+	uint32_t entry_capacity;
+};
+
+static struct profiler_trace_index_state* profiler_trace_index_states = NULL;
+static uint32_t profiler_trace_index_state_count = 0;
+static struct profiler_trace_open_scope* profiler_trace_index_stacks = NULL;
+static uint32_t profiler_trace_index_stack_count = 0;
+static uint32_t profiler_trace_index_stack_capacity = 0;
+static int profiler_trace_index_lost = 0;
+
+static int profiler_trace_index_reserve(void** data, uint32_t* capacity, uint32_t needed, size_t size)
+{
+	if (needed <= *capacity)
+		return 1;
+
+	uint32_t grown = *capacity ? *capacity * 2 : 64;
+	while (grown < needed)
+		grown *= 2;
+
+	void* resized = realloc(*data, (size_t)grown * size);
+	if (!resized)
+		return 0;
+
+	*data = resized;
+	*capacity = grown;
+	return 1;
+}
+
+static void profiler_trace_index_reset()
+{
+	uint32_t i;
+	for (i = 0; i < profiler_trace_index_state_count; i++)
+	{
+		free(profiler_trace_index_states[i].stack);
+		free(profiler_trace_index_states[i].entries);
+	}
+
+	free(profiler_trace_index_states);
+	free(profiler_trace_index_stacks);
+
+	profiler_trace_index_states = NULL;
+	profiler_trace_index_state_count = 0;
+	profiler_trace_index_stacks = NULL;
+	profiler_trace_index_stack_count = 0;
+	profiler_trace_index_stack_capacity = 0;
+	profiler_trace_index_lost = 0;
+}
+
+/* Add the entry of a block that is written at `chunk_offset`, NULL if the index is lost */
+static struct profiler_trace_index_state* profiler_trace_index_add(const struct profiler_trace_block* block, uint64_t chunk_offset)
+{
+	if (profiler_trace_index_lost)
+		return NULL;
+
+	uint32_t thread = (uint32_t)block->thread;
+
+	if (thread >= profiler_trace_index_state_count)
+	{
+		struct profiler_trace_index_state* states = (struct profiler_trace_index_state*)realloc(profiler_trace_index_states, ((size_t)thread + 1) * sizeof(*states));
+		if (!states)
+		{
+			profiler_trace_index_lost = 1;
+			return NULL;
+		}
+
+		memset(states + profiler_trace_index_state_count, 0, (thread + 1 - profiler_trace_index_state_count) * sizeof(*states));
+		profiler_trace_index_states = states;
+		profiler_trace_index_state_count = thread + 1;
+	}
+
+	struct profiler_trace_index_state* state = &profiler_trace_index_states[thread];
+
+	if (!profiler_trace_index_reserve((void**)&state->entries, &state->entry_capacity, state->entry_count + 1, sizeof(struct profiler_trace_index_entry)) ||
+		!profiler_trace_index_reserve((void**)&profiler_trace_index_stacks, &profiler_trace_index_stack_capacity, profiler_trace_index_stack_count + state->stack_depth, sizeof(struct profiler_trace_open_scope)))
+	{
+		profiler_trace_index_lost = 1;
+		return NULL;
+	}
+
+	struct profiler_trace_index_entry* entry = &state->entries[state->entry_count++];
+	entry->first_cycles = block->first_cycles;
+	entry->last_cycles = block->first_cycles;
+	entry->chunk_offset = chunk_offset;
+	entry->stack_index = profiler_trace_index_stack_count;
+	entry->stack_depth = state->stack_depth;
+
+	memcpy(profiler_trace_index_stacks + profiler_trace_index_stack_count, state->stack, state->stack_depth * sizeof(struct profiler_trace_open_scope));
+	profiler_trace_index_stack_count += state->stack_depth;
+
+	return state;
+}
+
+/* Replay one event of the block last added to the state of its thread */
+static void profiler_trace_index_event(struct profiler_trace_index_state* state, const struct profiler_trace_event* event)
+{
+	state->entries[state->entry_count - 1].last_cycles = event->cycles;
+
+	if (event->type == PROFILER_TRACE_EVENT_BEGIN)
+	{
+		if (!profiler_trace_index_reserve((void**)&state->stack, &state->stack_capacity, state->stack_depth + 1, sizeof(struct profiler_trace_open_scope)))
+		{
+			profiler_trace_index_lost = 1;
+			return;
+		}
+
+		struct profiler_trace_open_scope* open = &state->stack[state->stack_depth++];
+		open->cycles = event->cycles;
+		open->id = event->id;
+		open->reserved = 0;
+	}
+	else if (event->type == PROFILER_TRACE_EVENT_END)
+	{
+		/* Pops to the innermost scope of the same id, an end without one is ignored */
+		uint32_t depth = state->stack_depth;
+		while (depth > 0 && state->stack[depth - 1].id != event->id)
+			depth--;
+
+		if (depth > 0)
+			state->stack_depth = depth - 1;
+	}
+}
+
+/* Write the index chunk, returns its offset or 0 if the index was lost */
+static uint64_t profiler_trace_index_write()
+{
+	if (profiler_trace_index_lost)
+		return 0;
+
+	uint32_t thread_count = 0;
+	uint64_t entry_count = 0;
+
+	uint32_t i;
+	for (i = 0; i < profiler_trace_index_state_count; i++)
+	{
+		if (profiler_trace_index_states[i].entry_count)
+		{
+			thread_count++;
+			entry_count += profiler_trace_index_states[i].entry_count;
+		}
+	}
+
+	uint64_t threads_size = sizeof(struct profiler_trace_index) + (uint64_t)thread_count * sizeof(struct profiler_trace_index_thread);
+	uint64_t stacks_offset = threads_size + entry_count * sizeof(struct profiler_trace_index_entry);
+	uint64_t size = stacks_offset + (uint64_t)profiler_trace_index_stack_count * sizeof(struct profiler_trace_open_scope);
+
+	uint8_t* payload = (uint8_t*)malloc((size_t)size);
+	if (!payload)
+		return 0;
+
+	struct profiler_trace_index* index = (struct profiler_trace_index*)payload;
+	struct profiler_trace_index_thread* threads = (struct profiler_trace_index_thread*)(index + 1);
+	uint64_t entries_offset = threads_size;
+
+	index->thread_count = thread_count;
+	index->stack_count = profiler_trace_index_stack_count;
+	index->stacks_offset = stacks_offset;
+
+	for (i = 0; i < profiler_trace_index_state_count; i++)
+	{
+		const struct profiler_trace_index_state* state = &profiler_trace_index_states[i];
+		if (!state->entry_count)
+			continue;
+
+		threads->thread = i;
+		threads->entry_count = state->entry_count;
+		threads->entries_offset = entries_offset;
+		threads++;
+
+		memcpy(payload + entries_offset, state->entries, state->entry_count * sizeof(struct profiler_trace_index_entry));
+		entries_offset += state->entry_count * sizeof(struct profiler_trace_index_entry);
+	}
+
+	if (profiler_trace_index_stack_count)
+		memcpy(payload + stacks_offset, profiler_trace_index_stacks, profiler_trace_index_stack_count * sizeof(struct profiler_trace_open_scope));
+
+	struct profiler_trace_chunk chunk;
+	profiler_trace_chunk_init(&chunk, PROFILER_TRACE_CHUNK_INDEX, thread_count, size);
+
+	uint64_t offset = profiler_trace_offset;
+	profiler_trace_write_chunk(&chunk, payload);
+	free(payload);
+
+	return offset;
+}
+
+/* Only used under profiler_trace_write_lock, too large for the stack of some threads */
+static struct profiler_trace_decoder profiler_trace_block_decoder;
+
+/* Memory to compress a block in, every flusher has its own */
+struct profiler_trace_scratch
+{
+#if PROFILER_TRACE_CODEC == PROFILER_TRACE_CODEC_LZ
+	uint8_t compressed[PROFILER_TRACE_LZ_BOUND(PROFILER_TRACE_BLOCK_BYTES)];
+	uint32_t table[1 << PROFILER_TRACE_LZ_HASH_BITS];
+#else
+	int unused;
+#endif
+};
+
+/* Used by the thread that begins and ends traces */
+static struct profiler_trace_scratch profiler_trace_block_scratch;
+
+/*
+*	Pool of the blocks of every thread. Blocks are carved in order out of one
+*	range of address space, reserved when the first block is needed, so a block
+*	is known by its index and its pages are only backed once it is first used.
+*	Free blocks form a lock-free stack: the head holds the index + 1 of the top
+*	block and a tag that every push changes, so a pop that read the head before
+*	the same block was popped and pushed again fails its CAS. Blocks are never
+*	given back to the system, a thread that starts reuses the blocks of the
+*	threads that exited.
+*
+*	Every NUMA node has its own stack. A block belongs to the node of the thread
+*	that first used it, which is where its pages are, and goes back to that
+*	node's stack; only when a node has no free block and none is left to carve
+*	does a thread take one from another node.
+*/
+struct profiler_trace_pool_stack
+{
+	volatile uint64_t head;
+	uint8_t padding[56];
+};
+
+static uint8_t* volatile profiler_trace_pool = NULL;
+static volatile int profiler_trace_pool_fresh = 0;
+static struct profiler_trace_pool_stack profiler_trace_pool_stacks[PROFILER_NUMA_NODES_MAX];
+static volatile int profiler_trace_pool_next[PROFILER_TRACE_POOL_BLOCKS];
+static uint8_t profiler_trace_pool_node[PROFILER_TRACE_POOL_BLOCKS];
+
+#define PROFILER_TRACE_POOL_BYTES ((size_t)PROFILER_TRACE_POOL_BLOCKS * sizeof(struct profiler_trace_block))
+
+static uint8_t* profiler_trace_pool_reserve()
+{
+	uint8_t* pool = (uint8_t*)profiler_atomic_load_ptr((void* const volatile*)&profiler_trace_pool);
+	if (pool)
+		return pool;
+
+	size_t size = PROFILER_TRACE_POOL_BYTES + PROFILER_TRACE_POOL_ALIGN;
+
+#ifdef _WIN32
+	uint8_t* reserved = (uint8_t*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	uint8_t* reserved = mapping == MAP_FAILED ? NULL : (uint8_t*)mapping;
+#endif
+
+	if (!reserved)
+		return NULL;
+
+	pool = (uint8_t*)(((uintptr_t)reserved + PROFILER_TRACE_POOL_ALIGN - 1) & ~(uintptr_t)(PROFILER_TRACE_POOL_ALIGN - 1));
+
+#if defined(PROFILER_TRACE_HUGEPAGES) && defined(MADV_HUGEPAGE)
+	madvise(pool, PROFILER_TRACE_POOL_BYTES, MADV_HUGEPAGE);
+#endif
+
+	if (profiler_atomic_cas_ptr((void* volatile*)&profiler_trace_pool, NULL, pool))
+		return pool;
+
+	/* Another thread reserved it first */
+#ifdef _WIN32
+	VirtualFree(reserved, 0, MEM_RELEASE);
+#else
+	munmap(reserved, size);
+#endif
+
+	return (uint8_t*)profiler_atomic_load_ptr((void* const volatile*)&profiler_trace_pool);
+}
+
+static struct profiler_trace_block* profiler_trace_pool_pop(uint8_t* pool, int node)
+{
+	volatile uint64_t* stack = &profiler_trace_pool_stacks[node].head;
+
+	for (;;)
+	{
+		uint64_t head = profiler_atomic_load_acquire_u64(stack);
+		uint32_t top = (uint32_t)head;
+
+		if (!top)
+			return NULL;
+
+		uint64_t next = (head & 0xffffffff00000000ull) | (uint32_t)profiler_atomic_load_int(&profiler_trace_pool_next[top - 1]);
+
+		if (profiler_atomic_cas_u64(stack, head, next))
+			return (struct profiler_trace_block*)(pool + (size_t)(top - 1) * sizeof(struct profiler_trace_block));
+	}
+}
+
+/* A free block of `node`, a block never used before or a free block of another node, NULL when all PROFILER_TRACE_POOL_BLOCKS are in use */
+static struct profiler_trace_block* profiler_trace_pool_take(int node)
+{
+	uint8_t* pool = profiler_trace_pool_reserve();
+	if (!pool)
+		return NULL;
+
+	struct profiler_trace_block* block = profiler_trace_pool_pop(pool, node);
+	if (block)
+		return block;
+
+	/* Past the end the count only goes back down to the end, so every index below it is taken once */
+	int index = profiler_atomic_add_int(&profiler_trace_pool_fresh, 1);
+	if (index < PROFILER_TRACE_POOL_BLOCKS)
+	{
+		uint8_t* fresh = pool + (size_t)index * sizeof(struct profiler_trace_block);
+
+#ifdef _WIN32
+		if (!VirtualAlloc(fresh, sizeof(struct profiler_trace_block), MEM_COMMIT, PAGE_READWRITE))
+			return NULL;
+#endif
+
+		profiler_trace_pool_node[index] = (uint8_t)node;
+		return (struct profiler_trace_block*)fresh;
+	}
+
+	profiler_atomic_add_int(&profiler_trace_pool_fresh, -1);
+
+	int other;
+	for (other = 0; other < PROFILER_NUMA_NODES_MAX && !block; other++)
+	{
+		if (other != node)
+			block = profiler_trace_pool_pop(pool, other);
+	}
+
+	return block;
+}
+
+static void profiler_trace_pool_give(struct profiler_trace_block* block)
+{
+	uint8_t* pool = (uint8_t*)profiler_atomic_load_ptr((void* const volatile*)&profiler_trace_pool);
+	uint32_t index = (uint32_t)(((uint8_t*)block - pool) / sizeof(struct profiler_trace_block));
+	volatile uint64_t* stack = &profiler_trace_pool_stacks[profiler_trace_pool_node[index]].head;
+	uint64_t head;
+
+	do
+	{
+		head = profiler_atomic_load_acquire_u64(stack);
+		profiler_atomic_store_int(&profiler_trace_pool_next[index], (int)(uint32_t)head);
+	}
+	while (!profiler_atomic_cas_u64(stack, head, (((head >> 32) + 1) << 32) | (index + 1)));
+}
+
+/* Return a block to the pool and its bytes to the trace budget */
+static void profiler_trace_block_free(struct profiler_trace_block* block)
+{
+	profiler_trace_pool_give(block);
+	profiler_budget_release(&profiler_budget_trace_used, sizeof(struct profiler_trace_block));
+}
+
+/* Decode the first `size` bytes of a block for its event count and last timestamp, indexing it as the chunk at `chunk_offset` */
+static uint32_t profiler_trace_scan_block(const struct profiler_trace_block* block, int size, uint64_t chunk_offset, uint64_t* last_cycles)
+{
+	*last_cycles = block->first_cycles;
+
+	if (size <= 0)
+		return 0;
+
+	struct profiler_trace_index_state* state = profiler_trace_index_add(block, chunk_offset);
+	struct profiler_trace_decoder* decoder = &profiler_trace_block_decoder;
+	struct profiler_trace_event event;
+	uint32_t count = 0;
+
+	profiler_trace_decoder_init(decoder, PROFILER_TRACE_CHUNK_PACKED, block->data, (uint64_t)size, UINT32_MAX, block->first_cycles);
+
+	while (profiler_trace_decoder_next(decoder, &event))
+	{
+		if (state && !profiler_trace_index_lost)
+			profiler_trace_index_event(state, &event);
+
+		*last_cycles = event.cycles;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+*	Write the first `size` bytes of a block, decoding them for the event count
+*	and the index and compressing them with PROFILER_TRACE_CODEC. Blocks that
+*	do not get smaller are written as they are.
+*/
+static void profiler_trace_write_block(const struct profiler_trace_block* block, int size, struct profiler_trace_scratch* scratch)
+{
+	if (size <= 0)
+		return;
+
+	struct profiler_trace_chunk chunk;
+	profiler_trace_chunk_init(&chunk, PROFILER_TRACE_CHUNK_PACKED, 0, (uint64_t)size);
+	chunk.thread = (uint32_t)block->thread;
+	chunk.sequence = (uint32_t)block->sequence;
+	chunk.first_cycles = block->first_cycles;
+
+	const uint8_t* payload = block->data;
+
+#if PROFILER_TRACE_CODEC == PROFILER_TRACE_CODEC_LZ
+	uint64_t compressed = scratch ? profiler_trace_lz_compress(block->data, (uint64_t)size, scratch->compressed, scratch->table) : (uint64_t)size;
+	if (compressed < (uint64_t)size)
+	{
+		chunk.codec = PROFILER_TRACE_CODEC_LZ;
+		chunk.raw_size = (uint32_t)size;
+		chunk.size = compressed;
+		payload = scratch->compressed;
+	}
+#else
+	(void)scratch;
+#endif
+
+	/* The flushers of all nodes append to one file and one index */
+	while (!profiler_atomic_cas_int(&profiler_trace_write_lock, 0, 1))
+		;
+
+	chunk.count = profiler_trace_scan_block(block, size, profiler_trace_offset, &chunk.last_cycles);
+	profiler_trace_write_chunk(&chunk, payload);
+
+	profiler_atomic_store_int(&profiler_trace_write_lock, 0);
+}
+
+/* Write the queued blocks of `node` that belong to `session` in the order they were queued and return every queued block to the pool */
+static void profiler_trace_flush_queue(int node, int session, struct profiler_trace_scratch* scratch)
+{
+	struct profiler_trace_block* blocks = (struct profiler_trace_block*)profiler_atomic_exchange_ptr((void* volatile*)&profiler_trace_queues[node], NULL);
+	struct profiler_trace_block* ordered = NULL;
+
+	while (blocks)
+	{
+		struct profiler_trace_block* next = blocks->next;
+		blocks->next = ordered;
+		ordered = blocks;
+		blocks = next;
+	}
+
+	while (ordered)
+	{
+		struct profiler_trace_block* next = ordered->next;
+
+		if (ordered->session == session && profiler_trace_file)
+			profiler_trace_write_block(ordered, ordered->size, scratch);
+
+		profiler_trace_block_free(ordered);
+		ordered = next;
+	}
+}
+
+static void profiler_trace_flush_queues(int session)
+{
+	int node;
+	for (node = 0; node < PROFILER_NUMA_NODES_MAX; node++)
+		profiler_trace_flush_queue(node, session, &profiler_trace_block_scratch);
+}
+
+#ifdef __linux__
+/* Set the bits of a sysfs list of ranges such as "0-3,8-11" in `mask`, returns the highest + 1 or 0 if it can not be read */
+static int profiler_numa_read_list(const char* path, uint64_t* mask, int bits)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	char list[1024];
+	size_t length = fread(list, 1, sizeof(list) - 1, file);
+	list[length] = 0;
+	fclose(file);
+
+	int end = 0;
+	int first = -1;
+	int value = 0;
+	int digits = 0;
+	size_t i;
+
+	for (i = 0; i <= length; i++)
+	{
+		if (list[i] >= '0' && list[i] <= '9')
+		{
+			value = value * 10 + (list[i] - '0');
+			digits++;
+			continue;
+		}
+
+		if (!digits)
+			continue;
+
+		if (list[i] == '-')
+		{
+			first = value;
+		}
+		else
+		{
+			int bit;
+			for (bit = first >= 0 ? first : value; bit <= value && bit < bits; bit++)
+				mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+
+			end = value + 1 > end ? value + 1 : end;
+			first = -1;
+		}
+
+		value = 0;
+		digits = 0;
+	}
+
+	return end;
+}
+#endif
+
+/* Number of NUMA nodes with a flusher of their own */
+static int profiler_numa_node_count()
+{
+#if defined(_WIN32)
+	ULONG highest = 0;
+	int count = GetNumaHighestNodeNumber(&highest) ? (int)highest + 1 : 1;
+#elif defined(__linux__)
+	uint64_t nodes[PROFILER_NUMA_NODES_MAX / 64 + 1] = { 0 };
+	int count = profiler_numa_read_list("/sys/devices/system/node/online", nodes, PROFILER_NUMA_NODES_MAX);
+#else
+	int count = 1;
+#endif
+
+	return count < 1 ? 1 : (count > PROFILER_NUMA_NODES_MAX ? PROFILER_NUMA_NODES_MAX : count);
+}
+
+/* Keep the calling thread on the CPUs of `node`, so what it allocates and reads is local */
+static void profiler_numa_bind(int node)
+{
+#if defined(_WIN32)
+	GROUP_AFFINITY affinity;
+	if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+#elif defined(__linux__) && defined(SYS_sched_setaffinity)
+	uint64_t cpus[1024 / 64] = { 0 };
+	char path[64];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (profiler_numa_read_list(path, cpus, 1024))
+		syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus);
+#else
+	(void)node;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI profiler_trace_flusher_main(LPVOID argument)
+#else
+static void* profiler_trace_flusher_main(void* argument)
+#endif
+{
+	int node = (int)(intptr_t)argument;
+	int session = profiler_trace_flusher_session;
+
+	if (profiler_trace_flusher_count > 1)
+		profiler_numa_bind(node);
+
+	/* Allocated once bound, so it is on the node too; without it blocks are written uncompressed */
+	struct profiler_trace_scratch* scratch = (struct profiler_trace_scratch*)malloc(sizeof(struct profiler_trace_scratch));
+
+	while (!profiler_atomic_load_int(&profiler_trace_stop))
+	{
+		profiler_trace_flush_queue(node, session, scratch);
+
+#ifdef _WIN32
+		Sleep(PROFILER_TRACE_FLUSH_MILLISECONDS);
+#else
+		usleep(PROFILER_TRACE_FLUSH_MILLISECONDS * 1000);
+#endif
+	}
+
+	free(scratch);
+	return 0;
+}
+
+/* Stop and wait for the first `count` flushers */
+static void profiler_trace_flushers_join(int count)
+{
+	profiler_atomic_store_int(&profiler_trace_stop, 1);
+
+	int node;
+	for (node = 0; node < count; node++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(profiler_trace_flushers[node], INFINITE);
+		CloseHandle(profiler_trace_flushers[node]);
+#else
+		pthread_join(profiler_trace_flushers[node], NULL);
+#endif
+	}
+}
+
+static int profiler_trace_ring_contains(const struct profiler_trace_block* block)
+{
+	return profiler_trace_ring && (const uint8_t*)block >= profiler_trace_ring && (const uint8_t*)block < profiler_trace_ring + profiler_trace_ring_size;
+}
+
+static struct profiler_trace_chunk* profiler_trace_ring_chunk(int slot)
+{
+	return (struct profiler_trace_chunk*)(profiler_trace_ring + PROFILER_TRACE_RING_FIRST + (size_t)slot * PROFILER_TRACE_RING_STRIDE);
+}
+
+static int profiler_trace_ring_slot(const struct profiler_trace_block* block)
+{
+	return (int)(((const uint8_t*)block - profiler_trace_ring - PROFILER_TRACE_RING_FIRST) / PROFILER_TRACE_RING_STRIDE);
+}
+
+/* Give back the full slot of `thread` and take the next one, NULL if every slot is being filled */
+static struct profiler_trace_block* profiler_trace_ring_take(struct profiler_thread* thread, struct profiler_trace_block* block, int slots)
+{
+	profiler_atomic_store_ptr((void* volatile*)&thread->trace_block, NULL);
+
+	/* A full slot stays in the ring as it is, a block left over from an earlier trace in memory is freed */
+	if (profiler_trace_ring_contains(block))
+	{
+		profiler_atomic_store_int(&profiler_trace_ring_owners[profiler_trace_ring_slot(block)], 0);
+	}
+	else if (block)
+	{
+		profiler_trace_block_free(block);
+	}
+
+	/* The slots are taken in turn, so the oldest one is overwritten unless another thread is still filling it */
+	int attempt;
+	for (attempt = 0; attempt < slots; attempt++)
+	{
+		int slot = (int)((unsigned int)profiler_atomic_add_int(&profiler_trace_ring_cursor, 1) % (unsigned int)slots);
+
+		if (profiler_atomic_cas_int(&profiler_trace_ring_owners[slot], 0, 1))
+		{
+			struct profiler_trace_chunk* chunk = profiler_trace_ring_chunk(slot);
+
+			/* Marked free while it is rewritten, a crash in between leaves a slot that readers skip */
+			profiler_atomic_store_int((volatile int*)&chunk->type, PROFILER_TRACE_CHUNK_FREE);
+			return (struct profiler_trace_block*)(chunk + 1);
+		}
+	}
+
+	return NULL;
+}
+
+/* Publish a slot taken by profiler_trace_ring_take once its block is set up */
+static void profiler_trace_ring_commit(struct profiler_trace_block* block)
+{
+	struct profiler_trace_chunk* chunk = (struct profiler_trace_chunk*)block - 1;
+
+	chunk->thread = (uint32_t)block->thread;
+	chunk->sequence = (uint32_t)block->sequence;
+	chunk->count = 0;
+	chunk->first_cycles = block->first_cycles;
+	chunk->last_cycles = 0;
+
+	profiler_atomic_store_int((volatile int*)&chunk->type, PROFILER_TRACE_CHUNK_RING);
+}
+
+static const uint8_t* profiler_trace_read_varint(const uint8_t* data, const uint8_t* end, uint64_t* value)
+{
+	uint64_t result = 0;
+	int shift;
+
+	for (shift = 0; data < end; shift += 7)
+	{
+		uint8_t byte = *data++;
+		result |= shift < 64 ? (uint64_t)(byte & 0x7f) << shift : 0;
+
+		if (!(byte & 0x80))
+			break;
+	}
+
+	*value = result;
+	return data;
+}
+
+/* Number of packed events in the first `size` bytes of a block, read without a dictionary */
+static uint64_t profiler_trace_count_events(const uint8_t* data, int size)
+{
+	const uint8_t* end = data + size;
+	uint64_t count = 0;
+	uint64_t dictionary_count = 0;
+	uint64_t value;
+
+	while (data < end)
+	{
+		/* The tag and the type if the tag does not hold it */
+		data = profiler_trace_read_varint(data, end, &value);
+		if ((value & 3) == 3)
+			data = profiler_trace_read_varint(data, end, &value);
+
+		/* The dictionary index, followed by the scope id when it is a new one */
+		data = profiler_trace_read_varint(data, end, &value);
+		if (value == dictionary_count)
+		{
+			data = profiler_trace_read_varint(data, end, &value);
+			dictionary_count++;
+		}
+
+		count++;
+	}
+
+	return count;
+}
+
+/* Queue a block of `thread` for the flusher of its node, which writes the blocks of a thread in order */
+static void profiler_trace_queue_push(struct profiler_thread* thread, struct profiler_trace_block* block)
+{
+	struct profiler_trace_block* volatile* queue = &profiler_trace_queues[thread->numa_node];
+
+	do
+	{
+		block->next = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)queue);
+	}
+	while (!profiler_atomic_cas_ptr((void* volatile*)queue, block->next, block));
+}
+
+/*
+*	A new block within the trace budget. Over the budget, by trace_policy, the
+*	thread drops events until the flusher has freed enough blocks, records over
+*	its full `block` or stops every thread from recording until the trace ends.
+*/
+static struct profiler_trace_block* profiler_trace_block_allocate(struct profiler_thread* thread, struct profiler_trace_block* block)
+{
+	if (profiler_atomic_load_int(&profiler_trace_degraded))
+		return NULL;
+
+	if (profiler_budget_charge(&profiler_budget_trace_used, profiler_budget_limits.trace_bytes, sizeof(struct profiler_trace_block)))
+	{
+		struct profiler_trace_block* next = profiler_trace_pool_take(thread->numa_node);
+		if (!next)
+			profiler_budget_release(&profiler_budget_trace_used, sizeof(struct profiler_trace_block));
+
+		return next;
+	}
+
+	if (profiler_budget_limits.trace_policy == PROFILER_BUDGET_OVERWRITE_OLDEST && block)
+	{
+		profiler_counter_add(&thread->trace_dropped, profiler_trace_count_events(block->data, block->size));
+		return block;
+	}
+
+	if (profiler_budget_limits.trace_policy == PROFILER_BUDGET_AGGREGATE_ONLY)
+		profiler_atomic_store_int(&profiler_trace_degraded, 1);
+
+	return NULL;
+}
+
+/* Events recorded by the threads that have a table but not stored in any trace */
+static uint64_t profiler_trace_dropped_total()
+{
+	uint64_t dropped = 0;
+
+	struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	for (; thread; thread = thread->next)
+		dropped += profiler_atomic_load_u64(&thread->trace_dropped);
+
+	return dropped;
+}
+
+struct profiler_trace_block* _profiler_trace_block_next(struct profiler_thread* thread, uint64_t cycles)
+{
+	int session = profiler_atomic_load_int(&profiler_trace_session);
+	if (!session || thread == &profiler_thread_dropped)
+		return NULL;
+
+	if (thread->trace_session != session)
+	{
+		thread->trace_session = session;
+		thread->trace_sequence = 0;
+	}
+
+	struct profiler_trace_block* block = thread->trace_block;
+	struct profiler_trace_block* next = NULL;
+
+	if (block && block->session == session && block->size <= PROFILER_TRACE_BLOCK_BYTES - PROFILER_TRACE_EVENT_BYTES_MAX)
+		return block;
+
+	int ring_slots = profiler_atomic_load_int(&profiler_trace_ring_slots);
+
+	if (ring_slots)
+	{
+		next = profiler_trace_ring_take(thread, block, ring_slots);
+	}
+	else
+	{
+		/* Slots of a ring that has ended belong to nobody */
+		if (profiler_trace_ring_contains(block))
+			block = NULL;
+
+		/* A block left over from an earlier trace is reused, a full one is handed to the flusher */
+		if (block && block->session != session)
+			next = block;
+		else
+			next = profiler_trace_block_allocate(thread, block);
+	}
+
+	if (!next)
+	{
+		/* A full block is still written, only the events that do not fit are lost */
+		if (!ring_slots && block && block->session == session)
+		{
+			profiler_atomic_store_ptr((void* volatile*)&thread->trace_block, NULL);
+			profiler_trace_queue_push(thread, block);
+		}
+
+		profiler_counter_add(&thread->trace_dropped, 1);
+		return NULL;
+	}
+
+	profiler_atomic_store_int(&next->session, session);
+	profiler_atomic_store_int(&next->size, 0);
+	next->first_cycles = cycles;
+	next->thread = thread->trace_index;
+	next->sequence = thread->trace_sequence++;
+	next->next = NULL;
+
+	/* Every block starts a new dictionary and its first event has no delta */
+	memset(thread->trace_dictionary, 0, sizeof(thread->trace_dictionary));
+	thread->trace_dictionary_count = 0;
+	thread->trace_cycles = cycles;
+
+	if (ring_slots)
+		profiler_trace_ring_commit(next);
+
+	/* Swap before queueing, so profiler_trace_end never sees a block the flusher may free */
+	profiler_atomic_store_ptr((void* volatile*)&thread->trace_block, next);
+
+	if (!ring_slots && block && block != next)
+		profiler_trace_queue_push(thread, block);
+
+	return next;
+}
+
+static void profiler_trace_header_init()
+{
+	struct profiler_trace_header* header = &profiler_trace_file_header;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, PROFILER_TRACE_MAGIC, sizeof(header->magic));
+	header->version = PROFILER_TRACE_VERSION;
+	header->header_size = sizeof(struct profiler_trace_header);
+#ifdef PROFILER_RDTSCP
+	header->clock_source = PROFILER_CLOCK_RDTSCP;
+#else
+	header->clock_source = PROFILER_CLOCK_RDTSC;
+#endif
+	header->chunk_header_size = sizeof(struct profiler_trace_chunk);
+	header->cycles_per_second = (uint64_t)((double)profiler_cycles_measure / PROFILER_MEASURE_SECONDS);
+	header->start_cycles = get_cycles();
+}
+
+static int profiler_trace_next_session()
+{
+	int session = ++profiler_trace_last_session;
+	if (session <= 0)
+		session = profiler_trace_last_session = 1;
+
+	return session;
+}
+
+/* Unmap the ring of the last trace, threads that still point into it start a new block */
+static void profiler_trace_ring_release()
+{
+	if (!profiler_trace_ring)
+		return;
+
+	struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	for (; thread; thread = thread->next)
+	{
+		struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)&thread->trace_block);
+
+		if (profiler_trace_ring_contains(block))
+			profiler_atomic_cas_ptr((void* volatile*)&thread->trace_block, block, NULL);
+	}
+
+#ifdef PROFILER_FIBERS
+	profiler_trace_fibers_acquire();
+
+	struct profiler_fiber* fiber;
+	for (fiber = profiler_trace_fibers; fiber; fiber = fiber->trace_next)
+	{
+		struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)&fiber->trace_block);
+
+		if (profiler_trace_ring_contains(block))
+			profiler_atomic_cas_ptr((void* volatile*)&fiber->trace_block, block, NULL);
+	}
+
+	profiler_trace_fibers_release();
+#endif
+
+#ifndef _WIN32
+	munmap(profiler_trace_ring, (size_t)profiler_trace_ring_size);
+#endif
+	free((void*)profiler_trace_ring_owners);
+
+	profiler_trace_ring = NULL;
+	profiler_trace_ring_size = 0;
+	profiler_trace_ring_owners = NULL;
+}
+
+#ifndef _WIN32
+static int profiler_trace_ring_compare(const void* a, const void* b)
+{
+	const struct profiler_trace_block* first = (const struct profiler_trace_block*)(profiler_trace_ring_chunk(*(const int*)a) + 1);
+	const struct profiler_trace_block* second = (const struct profiler_trace_block*)(profiler_trace_ring_chunk(*(const int*)b) + 1);
+
+	if (first->thread != second->thread)
+		return first->thread < second->thread ? -1 : 1;
+
+	return first->sequence < second->sequence ? -1 : first->sequence > second->sequence;
+}
+
+/*
+*	Fill in the event count and the last timestamp of every slot of `session`
+*	and index the slots in sequence per thread, then detach the ring from the
+*	file. The slots stay where they are and the rest of the trace follows them.
+*/
+static void profiler_trace_ring_end(int session)
+{
+	int slots = profiler_atomic_load_int(&profiler_trace_ring_slots);
+	int* order = (int*)malloc((size_t)slots * sizeof(int));
+	int count = 0;
+	int slot;
+
+	if (!order)
+		profiler_trace_index_lost = 1;
+
+	for (slot = 0; order && slot < slots; slot++)
+	{
+		struct profiler_trace_chunk* chunk = profiler_trace_ring_chunk(slot);
+		struct profiler_trace_block* block = (struct profiler_trace_block*)(chunk + 1);
+
+		if (profiler_atomic_load_int((volatile int*)&chunk->type) == PROFILER_TRACE_CHUNK_RING && block->session == session)
+			order[count++] = slot;
+	}
+
+	if (order)
+		qsort(order, (size_t)count, sizeof(int), profiler_trace_ring_compare);
+
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		struct profiler_trace_chunk* chunk = profiler_trace_ring_chunk(order[i]);
+		struct profiler_trace_block* block = (struct profiler_trace_block*)(chunk + 1);
+		const struct profiler_trace_block* previous = i > 0 ? (const struct profiler_trace_block*)(profiler_trace_ring_chunk(order[i - 1]) + 1) : NULL;
+
+		/* Overwritten slots leave gaps, the scopes that were open after one are unknown */
+		if (previous && previous->thread == block->thread && previous->sequence + 1 != block->sequence && (uint32_t)block->thread < profiler_trace_index_state_count)
+			profiler_trace_index_states[block->thread].stack_depth = 0;
+
+		uint64_t last_cycles;
+		chunk->count = profiler_trace_scan_block(block, profiler_atomic_load_int(&block->size), (uint64_t)((uint8_t*)chunk - profiler_trace_ring), &last_cycles);
+		chunk->last_cycles = last_cycles;
+	}
+
+	free(order);
+
+	/* Threads that have not seen the trace end write to anonymous memory from now on */
+	mmap(profiler_trace_ring, (size_t)profiler_trace_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	profiler_atomic_store_int(&profiler_trace_ring_slots, 0);
+
+	fseeko(profiler_trace_file, (off_t)profiler_trace_offset, SEEK_SET);
+}
+#endif
+
+int _profiler_trace_begin_ring(const char* filename, uint64_t size)
+{
+#ifdef _WIN32
+	(void)filename;
+	(void)size;
+	return 0;
+#else
+	if (profiler_trace_file || size < PROFILER_TRACE_RING_FIRST + PROFILER_TRACE_RING_STRIDE)
+		return 0;
+
+	uint64_t slots = (size - PROFILER_TRACE_RING_FIRST) / PROFILER_TRACE_RING_STRIDE;
+	if (slots > 0x7fffffff)
+		slots = 0x7fffffff;
+
+	uint64_t mapped_size = PROFILER_TRACE_RING_FIRST + slots * PROFILER_TRACE_RING_STRIDE;
+
+	FILE* file = fopen(filename, "w+b");
+	if (!file)
+		return 0;
+
+	volatile int* owners = (volatile int*)calloc((size_t)slots, sizeof(int));
+	void* mapping = MAP_FAILED;
+
+	if (owners && ftruncate(fileno(file), (off_t)mapped_size) == 0)
+		mapping = mmap(NULL, (size_t)mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+
+	if (mapping == MAP_FAILED)
+	{
+		free((void*)owners);
+		fclose(file);
+		return 0;
+	}
+
+	profiler_trace_flush_queues(0);
+	profiler_trace_ring_release();
+
+	profiler_trace_header_init();
+	memcpy(mapping, &profiler_trace_file_header, sizeof(profiler_trace_file_header));
+
+	profiler_trace_ring = (uint8_t*)mapping;
+	profiler_trace_ring_size = mapped_size;
+	profiler_trace_ring_owners = owners;
+	profiler_trace_ring_cursor = 0;
+
+	/* Every slot starts free and as large as a block, so the slots can be walked as chunks before they are used */
+	int slot;
+	for (slot = 0; slot < (int)slots; slot++)
+		profiler_trace_chunk_init(profiler_trace_ring_chunk(slot), PROFILER_TRACE_CHUNK_FREE, 0, sizeof(struct profiler_trace_block));
+
+	profiler_trace_file = file;
+	profiler_trace_offset = mapped_size;
+	profiler_trace_index_reset();
+
+	profiler_atomic_store_int(&profiler_trace_degraded, 0);
+	profiler_trace_dropped_base = profiler_trace_dropped_total();
+
+	profiler_atomic_store_int(&profiler_trace_ring_slots, (int)slots);
+	profiler_atomic_store_int(&profiler_trace_session, profiler_trace_next_session());
+	return 1;
+#endif
+}
+
+int _profiler_trace_begin(const char* filename)
+{
+	if (profiler_trace_file)
+		return 0;
+
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return 0;
+
+	/* Blocks queued after the last trace ended */
+	profiler_trace_flush_queues(0);
+	profiler_trace_ring_release();
+
+	profiler_trace_header_init();
+
+	profiler_trace_file = file;
+	profiler_trace_offset = 0;
+	profiler_trace_write(&profiler_trace_file_header, sizeof(profiler_trace_file_header));
+	profiler_trace_index_reset();
+
+	profiler_atomic_store_int(&profiler_trace_degraded, 0);
+	profiler_trace_dropped_base = profiler_trace_dropped_total();
+
+	int session = profiler_trace_next_session();
+
+	profiler_atomic_store_int(&profiler_trace_stop, 0);
+	profiler_trace_flusher_session = session;
+	profiler_trace_flusher_count = profiler_numa_node_count();
+
+	int started;
+	for (started = 0; started < profiler_trace_flusher_count; started++)
+	{
+#ifdef _WIN32
+		profiler_trace_flushers[started] = CreateThread(NULL, 0, profiler_trace_flusher_main, (LPVOID)(intptr_t)started, 0, NULL);
+		if (!profiler_trace_flushers[started])
+			break;
+#else
+		if (pthread_create(&profiler_trace_flushers[started], NULL, profiler_trace_flusher_main, (void*)(intptr_t)started) != 0)
+			break;
+#endif
+	}
+
+	if (started < profiler_trace_flusher_count)
+	{
+		profiler_trace_flushers_join(started);
+		fclose(file);
+		profiler_trace_file = NULL;
+		return 0;
+	}
+
+	profiler_atomic_store_int(&profiler_trace_session, session);
+	return 1;
+}
+
+void _profiler_trace_end()
+{
+	if (!profiler_trace_file)
+		return;
+
+	int session = profiler_atomic_load_int(&profiler_trace_session);
+	profiler_atomic_store_int(&profiler_trace_session, 0);
+
+#ifndef _WIN32
+	if (profiler_atomic_load_int(&profiler_trace_ring_slots))
+		profiler_trace_ring_end(session);
+	else
+#endif
+	{
+		profiler_trace_flushers_join(profiler_trace_flusher_count);
+		profiler_trace_flush_queues(session);
+
+		/* Partially filled blocks stay with their threads and are reused by the next trace */
+		struct profiler_thread* thread = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+		for (; thread; thread = thread->next)
+		{
+			struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)&thread->trace_block);
+
+			if (block && profiler_atomic_load_int(&block->session) == session)
+				profiler_trace_write_block(block, profiler_atomic_load_int(&block->size), &profiler_trace_block_scratch);
+		}
+
+#ifdef PROFILER_FIBERS
+		/* And with the fibers that are switched out */
+		profiler_trace_fibers_acquire();
+
+		struct profiler_fiber* fiber;
+		for (fiber = profiler_trace_fibers; fiber; fiber = fiber->trace_next)
+		{
+			struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)&fiber->trace_block);
+
+			if (block && profiler_atomic_load_int(&block->session) == session)
+				profiler_trace_write_block(block, profiler_atomic_load_int(&block->size), &profiler_trace_block_scratch);
+		}
+
+		profiler_trace_fibers_release();
+#endif
+	}
+
+	/* Names table: the records, then the names of the scopes that are set up */
+	int nodes_used = profiler_atomic_load_int(&profiler_nodes_used);
+	size_t records_size = sizeof(struct profiler_trace_names) + (size_t)nodes_used * sizeof(struct profiler_trace_name);
+	size_t strings_size = 0;
+
+	int i;
+	for (i = 0; i < nodes_used; i++)
+	{
+		if (profiler_atomic_load_int(&profiler_nodes[i].is_setup))
+			strings_size += strlen(profiler_nodes[i].name) + 1;
+	}
+
+	uint8_t* names = (uint8_t*)calloc(1, records_size + strings_size);
+	struct profiler_trace_names* table = (struct profiler_trace_names*)names;
+	struct profiler_trace_name* records = (struct profiler_trace_name*)(table + 1);
+	size_t name_offset = 0;
+
+	table->count = (uint32_t)nodes_used;
+
+	for (i = 0; i < nodes_used; i++)
+	{
+		records[i].parent = profiler_nodes[i].parent_id;
+		records[i].name_offset = UINT32_MAX;
+
+		if (profiler_atomic_load_int(&profiler_nodes[i].is_setup))
+		{
+			size_t name_length = strlen(profiler_nodes[i].name) + 1;
+			memcpy(names + records_size + name_offset, profiler_nodes[i].name, name_length);
+			records[i].name_offset = (uint32_t)name_offset;
+			name_offset += name_length;
+		}
+	}
+
+	struct profiler_trace_chunk chunk;
+	profiler_trace_chunk_init(&chunk, PROFILER_TRACE_CHUNK_NAMES, (uint32_t)nodes_used, records_size + strings_size);
+
+	uint64_t names_offset = profiler_trace_offset;
+	profiler_trace_write_chunk(&chunk, names);
+	free(names);
+
+	uint64_t index_offset = profiler_trace_index_write();
+	profiler_trace_index_reset();
+
+	/* Only now is the trace complete, so the header is patched last */
+	profiler_trace_file_header.names_offset = names_offset;
+	profiler_trace_file_header.index_offset = index_offset;
+	profiler_trace_file_header.thread_count = (uint32_t)profiler_atomic_load_int(&profiler_trace_thread_count);
+
+	/* profiler_reset clears the counts, then every drop is from this trace */
+	uint64_t dropped = profiler_trace_dropped_total();
+	profiler_trace_file_header.dropped_events = dropped >= profiler_trace_dropped_base ? dropped - profiler_trace_dropped_base : dropped;
+
+	fseek(profiler_trace_file, 0, SEEK_SET);
+	fwrite(&profiler_trace_file_header, sizeof(profiler_trace_file_header), 1, profiler_trace_file);
+	fclose(profiler_trace_file);
+	profiler_trace_file = NULL;
+}
+/*
+*	Called when a thread exits or a fiber ends: a partially filled block of the
+*	current trace is handed to the flusher like a full one, any other block
+*	goes back to the pool and a ring slot is given up, so none of them outlive
+*	the thread or fiber.
+*/
+static void profiler_trace_block_abandon(struct profiler_thread* thread, struct profiler_trace_block* block)
+{
+	if (!block)
+		return;
+
+	if (profiler_trace_ring_contains(block))
+	{
+		if (profiler_atomic_load_int(&profiler_trace_ring_slots))
+			profiler_atomic_store_int(&profiler_trace_ring_owners[profiler_trace_ring_slot(block)], 0);
+	}
+	else if (block->session == profiler_atomic_load_int(&profiler_trace_session) && profiler_atomic_load_int(&block->size) > 0)
+	{
+		profiler_trace_queue_push(thread, block);
+	}
+	else
+	{
+		profiler_trace_block_free(block);
+	}
+}
+
+static void profiler_trace_thread_exit(struct profiler_thread* thread)
+{
+	profiler_trace_block_abandon(thread, (struct profiler_trace_block*)profiler_atomic_exchange_ptr((void* volatile*)&thread->trace_block, NULL));
+
+#ifdef PROFILER_FIBERS
+	/* The thread's own context goes with it, and its block if the thread exits while a fiber runs on it */
+	if (thread->fiber_thread.is_setup)
+	{
+		profiler_trace_fiber_remove(&thread->fiber_thread);
+		thread->fiber_thread.is_setup = 0;
+		profiler_trace_block_abandon(thread, (struct profiler_trace_block*)profiler_atomic_exchange_ptr((void* volatile*)&thread->fiber_thread.trace_block, NULL));
+	}
+#endif
+}
+
+#ifdef _WIN32
+static DWORD profiler_trace_exit_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE profiler_trace_exit_once = INIT_ONCE_STATIC_INIT;
+
+static void WINAPI profiler_trace_exit_callback(void* thread)
+{
+	if (thread)
+		profiler_trace_thread_exit((struct profiler_thread*)thread);
+}
+
+static BOOL CALLBACK profiler_trace_exit_key_create(PINIT_ONCE once, void* parameter, void** context)
+{
+	(void)once;
+	(void)parameter;
+	(void)context;
+
+	profiler_trace_exit_key = FlsAlloc(profiler_trace_exit_callback);
+	return TRUE;
+}
+
+static void profiler_trace_thread_watch(struct profiler_thread* thread)
+{
+	InitOnceExecuteOnce(&profiler_trace_exit_once, profiler_trace_exit_key_create, NULL, NULL);
+
+	if (profiler_trace_exit_key != FLS_OUT_OF_INDEXES)
+		FlsSetValue(profiler_trace_exit_key, thread);
+}
+#else
+static pthread_key_t profiler_trace_exit_key;
+static pthread_once_t profiler_trace_exit_once = PTHREAD_ONCE_INIT;
+static int profiler_trace_exit_key_valid = 0;
+
+static void profiler_trace_exit_callback(void* thread)
+{
+	profiler_trace_thread_exit((struct profiler_thread*)thread);
+}
+
+static void profiler_trace_exit_key_create()
+{
+	profiler_trace_exit_key_valid = pthread_key_create(&profiler_trace_exit_key, profiler_trace_exit_callback) == 0;
+}
+
+static void profiler_trace_thread_watch(struct profiler_thread* thread)
+{
+	pthread_once(&profiler_trace_exit_once, profiler_trace_exit_key_create);
+
+	if (profiler_trace_exit_key_valid)
+		pthread_setspecific(profiler_trace_exit_key, thread);
+}
+#endif
+#endif
+
+/* NUMA node of the CPU the calling thread runs on, 0 where that is not known */
+static int profiler_numa_node()
+{
+#if defined(_WIN32)
+	PROCESSOR_NUMBER processor;
+	USHORT node = 0;
+
+	GetCurrentProcessorNumberEx(&processor);
+	if (!GetNumaProcessorNodeEx(&processor, &node))
+		return 0;
+#elif defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu = 0;
+	unsigned int node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+#else
+	int node = 0;
+#endif
+
+	return (int)node < PROFILER_NUMA_NODES_MAX ? (int)node : PROFILER_NUMA_NODES_MAX - 1;
+}
+
+#ifdef PROFILER_PER_CPU
+/* Zeroed cache lines for the state of the calling thread, never freed like the pages of per-thread tables */
+static struct profiler_thread* profiler_thread_allocate()
+{
+	char* allocation = (char*)calloc(1, PROFILER_THREAD_BYTES + 63);
+	if (!allocation)
+		return NULL;
+
+	return (struct profiler_thread*)(((uintptr_t)allocation + 63) & ~(uintptr_t)63);
+}
+
+struct profiler_cpu* _profiler_cpu_create(int cpu)
+{
+	/* First touched by a thread running on the CPU, so placed on its NUMA node */
+#ifdef _WIN32
+	struct profiler_cpu* table = (struct profiler_cpu*)VirtualAlloc(NULL, PROFILER_CPU_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* mapping = mmap(NULL, PROFILER_CPU_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	struct profiler_cpu* table = mapping == MAP_FAILED ? NULL : (struct profiler_cpu*)mapping;
+#endif
+	if (!table)
+		return NULL;
+
+	if (!profiler_atomic_cas_ptr((void* volatile*)&profiler_cpus[cpu], NULL, table))
+	{
+#ifdef _WIN32
+		VirtualFree(table, 0, MEM_RELEASE);
+#else
+		munmap(table, PROFILER_CPU_BYTES);
+#endif
+		return (struct profiler_cpu*)profiler_atomic_load_ptr((void* const volatile*)&profiler_cpus[cpu]);
+	}
+
+	do
+	{
+		table->next = (struct profiler_cpu*)profiler_atomic_load_ptr((void* const volatile*)&profiler_cpu_tables);
+	}
+	while (!profiler_atomic_cas_ptr((void* volatile*)&profiler_cpu_tables, table->next, table));
+
+	return table;
+}
+
+/* Table for an atomic add: the shared one where restartable sequences add to the others, else the one of the CPU the thread was last seen on */
+struct profiler_cpu* _profiler_cpu_fallback()
+{
+#ifdef PROFILER_RSEQ
+	if (profiler_rseq_get())
+		return &profiler_cpu_shared;
+#endif
+
+#if defined(_WIN32)
+	unsigned int cpu = (unsigned int)GetCurrentProcessorNumber();
+#elif defined(__linux__) && defined(__GLIBC__)
+	/* Read from the vDSO or restartable sequences, without a system call */
+	int current = sched_getcpu();
+	unsigned int cpu = current < 0 ? PROFILER_CPUS_MAX : (unsigned int)current;
+#elif defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu = 0;
+	if (syscall(SYS_getcpu, &cpu, NULL, NULL) != 0)
+		return &profiler_cpu_shared;
+#else
+	unsigned int cpu = PROFILER_CPUS_MAX;
+#endif
+	if (cpu >= PROFILER_CPUS_MAX)
+		return &profiler_cpu_shared;
+
+	struct profiler_cpu* table = (struct profiler_cpu*)profiler_atomic_load_ptr((void* const volatile*)&profiler_cpus[cpu]);
+	if (!table)
+		table = _profiler_cpu_create((int)cpu);
+
+	return table ? table : &profiler_cpu_shared;
+}
+#else
+/* Zeroed pages for the state of the calling thread, first touched and so placed on its NUMA node by the thread itself */
+static struct profiler_thread* profiler_thread_allocate()
+{
+#ifdef _WIN32
+	return (struct profiler_thread*)VirtualAlloc(NULL, PROFILER_THREAD_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* mapping = mmap(NULL, PROFILER_THREAD_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return mapping == MAP_FAILED ? NULL : (struct profiler_thread*)mapping;
+#endif
+}
+#endif
+
+struct profiler_thread* _profiler_thread_create()
+{
+	struct profiler_thread* thread = NULL;
+
+	if (profiler_budget_charge(&profiler_budget_thread_used, profiler_budget_limits.thread_bytes, PROFILER_THREAD_BYTES))
+	{
+		thread = profiler_thread_allocate();
+		if (!thread)
+			profiler_budget_release(&profiler_budget_thread_used, PROFILER_THREAD_BYTES);
+	}
+
+	if (!thread)
+	{
+		profiler_atomic_add_int(&profiler_dropped_threads, 1);
+		profiler_thread_current = &profiler_thread_dropped;
+		return &profiler_thread_dropped;
+	}
+
+	thread->current_parent = -1;
+	thread->numa_node = profiler_numa_node();
+#ifdef PROFILER_TRACE
+	thread->trace_index = profiler_atomic_add_int(&profiler_trace_thread_count, 1);
+#endif
+
+	do
+	{
+		thread->next = (struct profiler_thread*)profiler_atomic_load_ptr((void* const volatile*)&profiler_threads);
+	}
+	while (!profiler_atomic_cas_ptr((void* volatile*)&profiler_threads, thread->next, thread));
+
+#ifdef PROFILER_TRACE
+	profiler_trace_thread_watch(thread);
+#endif
+
+	profiler_thread_current = thread;
+	return thread;
+}
+
+/* Out of line, so no thread local is read from a copy the compiler kept across a suspension */
+void PROFILER_NOINLINE _profiler_coroutine_begin(struct profiler_coroutine* coroutine, int id, const char* name)
+{
+	if (id >= PROFILER_NODES_MAX)
+	{
+		_profiler_scope_dropped();
+		return;
+	}
+
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+		_profiler_node_setup(id, name);
+
+	struct profiler_thread* thread = profiler_thread_get();
+
+	coroutine->id = id;
+	coroutine->state = PROFILER_COROUTINE_RUNNING;
+	coroutine->outer_parent = thread->current_parent;
+	coroutine->active_cycles = 0;
+	coroutine->suspended_cycles = 0;
+	coroutine->cycles_start = get_cycles();
+	thread->current_parent = id;
+
+#ifdef PROFILER_TRACE
+	profiler_trace_record(thread, id, coroutine->cycles_start, PROFILER_TRACE_EVENT_BEGIN, 0);
+#endif
+}
+
+void PROFILER_NOINLINE _profiler_coroutine_suspend(struct profiler_coroutine* coroutine)
+{
+	if (coroutine->state != PROFILER_COROUTINE_RUNNING)
+		return;
+
+	uint64_t cycles = get_cycles();
+	struct profiler_thread* thread = profiler_thread_get();
+
+	coroutine->active_cycles += cycles - coroutine->cycles_start;
+	coroutine->cycles_start = cycles;
+	coroutine->state = PROFILER_COROUTINE_SUSPENDED;
+	thread->current_parent = coroutine->outer_parent;
+
+#ifdef PROFILER_TRACE
+	profiler_trace_record(thread, coroutine->id, cycles, PROFILER_TRACE_EVENT_END, 0);
+#endif
+}
 
-			float percent_total = 100.0f * (seconds / seconds_total);
-			float percent_local = 100.0f * (seconds / seconds_parent);
+void PROFILER_NOINLINE _profiler_coroutine_resume(struct profiler_coroutine* coroutine)
+{
+	if (coroutine->state != PROFILER_COROUTINE_SUSPENDED)
+		return;
 
-			sprintf(buffer + strlen(buffer), 
-					"%-40s%-7.2f : %-7.2f : %f : %" PRIu64 "\n", 
-					buffer_name,
-					percent_total,
-					percent_local,
-					seconds, 
-					profiler_nodes[max_index].total_cycles);
+	uint64_t cycles = get_cycles();
+	struct profiler_thread* thread = profiler_thread_get();
 
-			profiler_get_results_sorted(buffer, max_index, seconds_total, level + 1);
-		}
-		else
+	coroutine->suspended_cycles += cycles - coroutine->cycles_start;
+	coroutine->cycles_start = cycles;
+	coroutine->state = PROFILER_COROUTINE_RUNNING;
+	coroutine->outer_parent = thread->current_parent;
+	thread->current_parent = coroutine->id;
+
+#ifdef PROFILER_TRACE
+	profiler_trace_record(thread, coroutine->id, cycles, PROFILER_TRACE_EVENT_BEGIN, 0);
+#endif
+}
+
+void PROFILER_NOINLINE _profiler_coroutine_end(struct profiler_coroutine* coroutine)
+{
+	if (coroutine->state == PROFILER_COROUTINE_IDLE)
+		return;
+
+	_profiler_coroutine_suspend(coroutine);
+	coroutine->state = PROFILER_COROUTINE_IDLE;
+
+	/* Counted where it ends, one call no matter how often it was suspended */
+	uint64_t cycles = coroutine->active_cycles;
+	int id = coroutine->id;
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, total_cycles), cycles);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, calls), 1);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, suspended_cycles), coroutine->suspended_cycles);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+#else
+	struct profiler_thread_node* node = &profiler_thread_get()->nodes[id];
+
+	profiler_counter_add(&node->total_cycles, cycles);
+	profiler_counter_add(&node->calls, 1);
+	profiler_counter_add(&node->suspended_cycles, coroutine->suspended_cycles);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_counter_add(&node->histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+}
+
+void _profiler_async_begin(struct profiler_async* async, int id, const char* name)
+{
+	async->id = id;
+	async->flow = 0;
+
+	/* Counted when it ends */
+	if (id >= PROFILER_NODES_MAX)
+		return;
+
+	/* The parent is the scope open where it begins, it never becomes a parent itself */
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+		_profiler_node_setup(id, name);
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_async))
+		profiler_atomic_store_int(&profiler_nodes[id].is_async, 1);
+
+	struct profiler_thread* thread = profiler_thread_get();
+	async->cycles_start = get_cycles();
+
+#ifdef PROFILER_TRACE
+	if (profiler_atomic_load_int(&profiler_trace_session))
+	{
+		async->flow = (uint64_t)profiler_atomic_add_u64(&profiler_async_flows, 1) + 1;
+		profiler_trace_record(thread, id, async->cycles_start, PROFILER_TRACE_EVENT_ASYNC_BEGIN, async->flow);
+	}
+#else
+	(void)thread;
+#endif
+}
+
+void _profiler_async_end(struct profiler_async* async)
+{
+	int id = async->id;
+	if (id >= PROFILER_NODES_MAX)
+	{
+		_profiler_scope_dropped();
+		return;
+	}
+
+	/* Wall clock from begin to end, whatever ran on either thread in between */
+	uint64_t cycles_end = get_cycles();
+	uint64_t cycles = cycles_end - async->cycles_start;
+	struct profiler_thread* thread = profiler_thread_get();
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, total_cycles), cycles);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, calls), 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+#else
+	struct profiler_thread_node* node = &thread->nodes[id];
+
+	profiler_counter_add(&node->total_cycles, cycles);
+	profiler_counter_add(&node->calls, 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_counter_add(&node->histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+
+#ifdef PROFILER_TRACE
+	/* Only begins recorded in a trace have a flow to end */
+	if (async->flow)
+		profiler_trace_record(thread, id, cycles_end, PROFILER_TRACE_EVENT_ASYNC_END, async->flow);
+#else
+	(void)thread;
+#endif
+}
+
+void _profiler_task_enqueue(struct profiler_task* task, int id, const char* name)
+{
+	task->id = id;
+	task->name = name;
+	task->thread = profiler_thread_get();
+	task->cycles_enqueued = get_cycles();
+}
+
+/* Counts the time the task was queued, the execution is a scope of its own that starts right after */
+void _profiler_task_wait(struct profiler_task* task)
+{
+	int id = task->id;
+	if (id >= PROFILER_NODES_MAX)
+		return;
+
+	/* The parent is the scope open on the worker, where the task runs */
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+		_profiler_node_setup(id, task->name);
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_task))
+		profiler_atomic_store_int(&profiler_nodes[id].is_task, 1);
+
+	struct profiler_thread* thread = profiler_thread_get();
+	uint64_t cycles = get_cycles() - task->cycles_enqueued;
+	int stolen = task->thread != thread;
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, wait_cycles), cycles);
+	if (stolen)
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, steals), 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, wait_histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+#else
+	struct profiler_thread_node* node = &thread->nodes[id];
+
+	profiler_counter_add(&node->wait_cycles, cycles);
+	if (stolen)
+		profiler_counter_add(&node->steals, 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_counter_add(&node->wait_histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+}
+
+/* Add time the thread was blocked to the open scope and every scope above it, the nodes nest like the scopes */
+static void profiler_blocked_add(struct profiler_thread* thread, uint64_t cycles)
+{
+	int id = thread->current_parent;
+	int depth;
+#ifdef PROFILER_PER_CPU
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+#endif
+
+	for (depth = 0; id >= 0 && id < PROFILER_NODES_MAX && depth < PROFILER_NODES_MAX; depth++)
+	{
+#ifdef PROFILER_PER_CPU
+		profiler_cpu_counter_add(table, (size_t)id * sizeof(struct profiler_thread_node) + offsetof(struct profiler_thread_node, blocked_cycles), cycles);
+#else
+		profiler_counter_add(&thread->nodes[id].blocked_cycles, cycles);
+#endif
+		id = profiler_nodes[id].parent_id;
+	}
+}
+
+/* With fibers, on the clock of the fiber like its scopes, so a wait it was switched out in only counts while it ran */
+static uint64_t profiler_blocked_cycles(struct profiler_thread* thread)
+{
+#ifdef PROFILER_FIBERS
+	return get_cycles() - thread->fiber_paused;
+#else
+	(void)thread;
+	return get_cycles();
+#endif
+}
+
+void _profiler_wait_begin()
+{
+	struct profiler_thread* thread = profiler_thread_get();
+
+	if (thread->blocked_depth++ == 0)
+		thread->blocked_start = profiler_blocked_cycles(thread);
+}
+
+void _profiler_wait_end()
+{
+	struct profiler_thread* thread = profiler_thread_get();
+
+	if (thread->blocked_depth > 0 && --thread->blocked_depth == 0)
+		profiler_blocked_add(thread, profiler_blocked_cycles(thread) - thread->blocked_start);
+}
+
+/* An I/O call that began at `cycles_start`, counted for the open scope and blocked for it and the scopes above it */
+void _profiler_io_end(uint64_t cycles_start, uint64_t bytes, int sync)
+{
+	struct profiler_thread* thread = profiler_thread_get();
+	uint64_t cycles = get_cycles() - cycles_start;
+
+	if (!thread->blocked_depth)
+		profiler_blocked_add(thread, cycles);
+
+	/* Outside of any scope the call is only blocked time */
+	int id = thread->current_parent;
+	if (id < 0 || id >= PROFILER_NODES_MAX)
+		return;
+
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	if (sync)
+	{
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, syncs), 1);
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, sync_cycles), cycles);
+		return;
+	}
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, io_calls), 1);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, io_bytes), bytes);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, io_cycles), cycles);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, io_histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+#else
+	struct profiler_thread_node* node = &thread->nodes[id];
+
+	if (sync)
+	{
+		profiler_counter_add(&node->syncs, 1);
+		profiler_counter_add(&node->sync_cycles, cycles);
+		return;
+	}
+
+	profiler_counter_add(&node->io_calls, 1);
+	profiler_counter_add(&node->io_bytes, bytes);
+	profiler_counter_add(&node->io_cycles, cycles);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_counter_add(&node->io_histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+}
+
+/* Locks are nodes of their own at the root, whichever scope takes them. Called with profiler_setup_lock held */
+static void profiler_lock_node_setup(int id, const char* name)
+{
+	if (profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+		return;
+
+	strncpy(profiler_nodes[id].name, name, PROFILER_NAME_MAXLEN - 1);
+	profiler_nodes[id].name[PROFILER_NAME_MAXLEN - 1] = '\0';
+	profiler_nodes[id].parent_id = -1;
+	profiler_nodes[id].is_lock = 1;
+	profiler_atomic_store_int(&profiler_nodes[id].is_setup, 1);
+
+	if (id >= profiler_nodes_used)
+		profiler_atomic_store_int(&profiler_nodes_used, id + 1);
+}
+
+void _profiler_lock_init(struct profiler_lock* lock, const char* name)
+{
+	while (!profiler_atomic_cas_int(&profiler_setup_lock, 0, 1))
+		;
+
+	/* Locks of the same name share their node */
+	int nodes_used = profiler_atomic_load_int(&profiler_nodes_used);
+	int id = -1;
+
+	int i;
+	for (i = 0; i < nodes_used && id < 0; i++)
+	{
+		if (profiler_atomic_load_int(&profiler_nodes[i].is_setup) && profiler_nodes[i].is_lock &&
+			strncmp(profiler_nodes[i].name, name, PROFILER_NAME_MAXLEN - 1) == 0)
 		{
-			return;
+			id = i;
 		}
 	}
+
+	if (id < 0)
+		id = profiler_atomic_add_int(&profiler_current_id, 1);
+	if (id < PROFILER_NODES_MAX)
+		profiler_lock_node_setup(id, name);
+
+	profiler_atomic_store_int(&profiler_setup_lock, 0);
+
+	lock->id = id;
+	lock->name = name;
+	lock->holder = -1;
+	lock->cycles_acquired = 0;
 }
 
-void _profiler_get_results(char* buffer)
+/* `cycles_wait` is where a wait began after the lock could not be taken right away, 0 if it could */
+void _profiler_lock_acquired(struct profiler_lock* lock, uint64_t cycles_wait, int shared)
 {
-	sprintf(buffer, 
-			"%-40s%s : %s : %-8s : %s\n", 
-			"Name",
-			"\%-total",
-			"\%-local",
-			"Seconds", 
-			"CPU Cycles");
+	int id = lock->id;
+	if (id >= PROFILER_NODES_MAX)
+		return;
+
+	/* Set up again after profiler_reset */
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+	{
+		while (!profiler_atomic_cas_int(&profiler_setup_lock, 0, 1))
+			;
+		profiler_lock_node_setup(id, lock->name);
+		profiler_atomic_store_int(&profiler_setup_lock, 0);
+	}
+
+	struct profiler_thread* thread = profiler_thread_get();
+	uint64_t cycles = get_cycles();
+
+	if (cycles_wait)
+	{
+		/* The lock is ours, so its holder is still whoever had it last */
+		uint64_t waited = cycles - cycles_wait;
+		int holder = profiler_atomic_load_int(&lock->holder);
+#ifdef PROFILER_PER_CPU
+		size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+		struct profiler_cpu* table = profiler_cpu_counter_table();
+
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, wait_cycles), waited);
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, contentions), 1);
+#ifdef PROFILER_HISTOGRAMS
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, wait_histogram) + (size_t)profiler_log2(waited) * sizeof(uint64_t), 1);
+#endif
+		if (holder >= 0)
+			profiler_cpu_counter_add(table, (size_t)holder * sizeof(struct profiler_thread_node) + offsetof(struct profiler_thread_node, blocking_cycles), waited);
+#else
+		struct profiler_thread_node* node = &thread->nodes[id];
+
+		profiler_counter_add(&node->wait_cycles, waited);
+		profiler_counter_add(&node->contentions, 1);
+#ifdef PROFILER_HISTOGRAMS
+		profiler_counter_add(&node->wait_histogram[profiler_log2(waited)], 1);
+#endif
+		if (holder >= 0)
+			profiler_counter_add(&thread->nodes[holder].blocking_cycles, waited);
+#endif
+
+		/* Unless it already counts as blocked inside a profiler_wait_begin */
+		if (!thread->blocked_depth)
+			profiler_blocked_add(thread, waited);
+	}
+
+	/* Readers hold it together, only exclusive holds are timed and blamed */
+	if (shared)
+	{
+		profiler_atomic_store_int(&lock->holder, -1);
+		return;
+	}
 
-	sprintf(buffer + strlen(buffer), "----------------------------------------------------------------------------------\n");
-	profiler_get_results_sorted(buffer, -1, 0.0f, 0);
+	profiler_atomic_store_int(&lock->holder, thread->current_parent);
+	lock->cycles_acquired = cycles;
 }
 
-void _profiler_dump_console()
+void _profiler_lock_release(struct profiler_lock* lock)
+{
+	int id = lock->id;
+	if (id >= PROFILER_NODES_MAX)
+	{
+		_profiler_scope_dropped();
+		return;
+	}
+
+	uint64_t cycles = get_cycles() - lock->cycles_acquired;
+	struct profiler_thread* thread = profiler_thread_get();
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, total_cycles), cycles);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, calls), 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+	(void)thread;
+#else
+	struct profiler_thread_node* node = &thread->nodes[id];
+
+	profiler_counter_add(&node->total_cycles, cycles);
+	profiler_counter_add(&node->calls, 1);
+#ifdef PROFILER_HISTOGRAMS
+	profiler_counter_add(&node->histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+}
+
+#ifdef PROFILER_FIBERS
+/* A fiber that runs for the first time starts at the root and on a new track */
+static void profiler_fiber_setup(struct profiler_fiber* fiber, uint64_t cycles)
 {
-	profiler_get_results(buffer);
-	printf("%s", buffer);
+	fiber->is_setup = 1;
+	fiber->current_parent = -1;
+	fiber->paused_cycles = 0;
+	fiber->cycles_switched = cycles;
+	fiber->blocked_start = 0;
+	fiber->blocked_depth = 0;
+#ifdef PROFILER_TRACE
+	fiber->trace_block = NULL;
+	fiber->trace_session = 0;
+	fiber->trace_sequence = 0;
+	fiber->trace_cycles = 0;
+	fiber->trace_dictionary_count = 0;
+	profiler_trace_fiber_add(fiber);
+#endif
 }
 
-void _profiler_node_setup(int id, const char* name)
+/* Keep what the scopes of the fiber that leaves the thread need in `fiber` */
+static void profiler_fiber_save(struct profiler_thread* thread, struct profiler_fiber* fiber, uint64_t cycles)
+{
+	fiber->current_parent = thread->current_parent;
+	fiber->paused_cycles = thread->fiber_paused;
+	fiber->cycles_switched = cycles;
+	fiber->blocked_start = thread->blocked_start;
+	fiber->blocked_depth = thread->blocked_depth;
+#ifdef PROFILER_TRACE
+	struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_load_ptr((void* const volatile*)&thread->trace_block);
+
+	fiber->trace_index = thread->trace_index;
+	fiber->trace_session = thread->trace_session;
+	fiber->trace_sequence = thread->trace_sequence;
+	fiber->trace_cycles = thread->trace_cycles;
+	fiber->trace_dictionary_count = thread->trace_dictionary_count;
+
+	/* A new block starts a new dictionary, only one being filled is worth keeping */
+	if (block)
+		memcpy(fiber->trace_dictionary, thread->trace_dictionary, sizeof(fiber->trace_dictionary));
+
+	/* In one place at a time, profiler_trace_end may miss it in between but never writes it twice */
+	profiler_atomic_store_ptr((void* volatile*)&thread->trace_block, NULL);
+	profiler_atomic_store_ptr((void* volatile*)&fiber->trace_block, block);
+#endif
+}
+
+/* Give the thread what the scopes of the fiber that enters it need, the time since it left is paused */
+static void profiler_fiber_load(struct profiler_thread* thread, struct profiler_fiber* fiber, uint64_t cycles)
+{
+	thread->current_parent = fiber->current_parent;
+	thread->fiber_paused = fiber->paused_cycles + (cycles - fiber->cycles_switched);
+	thread->blocked_start = fiber->blocked_start;
+	thread->blocked_depth = fiber->blocked_depth;
+#ifdef PROFILER_TRACE
+	struct profiler_trace_block* block = (struct profiler_trace_block*)profiler_atomic_exchange_ptr((void* volatile*)&fiber->trace_block, NULL);
+
+	thread->trace_index = fiber->trace_index;
+	thread->trace_session = fiber->trace_session;
+	thread->trace_sequence = fiber->trace_sequence;
+	thread->trace_cycles = fiber->trace_cycles;
+	thread->trace_dictionary_count = fiber->trace_dictionary_count;
+
+	if (block)
+		memcpy(thread->trace_dictionary, fiber->trace_dictionary, sizeof(thread->trace_dictionary));
+
+	profiler_atomic_store_ptr((void* volatile*)&thread->trace_block, block);
+#endif
+}
+
+void PROFILER_NOINLINE _profiler_fiber_switch(struct profiler_fiber* from, struct profiler_fiber* to)
+{
+	uint64_t cycles = get_cycles();
+	struct profiler_thread* thread = profiler_thread_get();
+
+	/* Threads over the budget share one state, there is nothing of theirs to keep */
+	if (thread == &profiler_thread_dropped)
+		return;
+
+	if (!from)
+		from = &thread->fiber_thread;
+	if (!to)
+		to = &thread->fiber_thread;
+	if (from == to)
+		return;
+
+	/* A context that was running before its first switch keeps the track it recorded on */
+	if (!from->is_setup)
+		profiler_fiber_setup(from, cycles);
+	if (!to->is_setup)
+	{
+		profiler_fiber_setup(to, cycles);
+#ifdef PROFILER_TRACE
+		to->trace_index = profiler_atomic_add_int(&profiler_trace_thread_count, 1);
+#endif
+	}
+
+	profiler_fiber_save(thread, from, cycles);
+	profiler_fiber_load(thread, to, cycles);
+}
+
+void PROFILER_NOINLINE _profiler_fiber_end(struct profiler_fiber* fiber)
 {
-	strncpy(profiler_nodes[id].name, name, strlen(name) + 1);
-	profiler_nodes[id].parent_id = profiler_current_parent;
-	profiler_nodes[id].is_setup = 1;
+	if (!fiber->is_setup)
+		return;
+
+	fiber->is_setup = 0;
+#ifdef PROFILER_TRACE
+	profiler_trace_fiber_remove(fiber);
+	profiler_trace_block_abandon(profiler_thread_get(), (struct profiler_trace_block*)profiler_atomic_exchange_ptr((void* volatile*)&fiber->trace_block, NULL));
+#endif
 }
+#endif
 
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
 
-#else
-extern int profiler_current_id;
-extern int profiler_current_parent;
-extern uint64_t profiler_cycles_measure;
-extern profiler_node profiler_nodes[PROFILER_NODES_MAX];
 #endif // PROFILER_DEFINE
 
 #ifdef PROFILER_DISABLE
 #define profiler_start(NAME)
 #define profiler_stop(NAME)
+#define profiler_async_begin(NAME, async) ((void)(async))
+#define profiler_async_end(async) ((void)(async))
+#define profiler_task_enqueue(NAME, task) ((void)(task))
+#define profiler_task_dequeue(task) ((void)(task))
+#define profiler_task_complete(task) ((void)(task))
 #else
 
 #ifdef __cplusplus
-#define PROFILER_CREATE_ID profiler_current_id++
+#define PROFILER_CREATE_ID profiler_atomic_add_int(&profiler_current_id, 1)
 #else
 #define PROFILER_CREATE_ID __COUNTER__
 #endif
 
+#ifdef PROFILER_RDTSCP
+/* Also returns the CPU the scope begins on in `cpu` */
+static inline uint64_t _profiler_scope_enter(int id, const char* name, uint32_t* cpu)
+#else
+static inline uint64_t _profiler_scope_enter(int id, const char* name)
+#endif
+{
+	/* Counted when it ends */
+	if (id >= PROFILER_NODES_MAX)
+	{
+#ifdef PROFILER_RDTSCP
+		*cpu = 0;
+#endif
+		return 0;
+	}
+
+	if (!profiler_atomic_load_int(&profiler_nodes[id].is_setup))
+		_profiler_node_setup(id, name);
+
+	struct profiler_thread* thread = profiler_thread_get();
+	thread->current_parent = id;
+
+#ifdef PROFILER_RDTSCP
+	uint64_t cycles = get_cycles_cpu(cpu);
+#else
+	uint64_t cycles = get_cycles();
+#endif
+#ifdef PROFILER_TRACE
+	profiler_trace_record(thread, id, cycles, PROFILER_TRACE_EVENT_BEGIN, 0);
+#endif
+#ifdef PROFILER_FIBERS
+	/* On the clock of the fiber, which stands still while it is switched out */
+	return cycles - thread->fiber_paused;
+#else
+	return cycles;
+#endif
+}
+
+#ifdef PROFILER_RDTSCP
+static inline void _profiler_scope_exit(int id, uint64_t cycles_start, uint32_t cpu_start)
+#else
+static inline void _profiler_scope_exit(int id, uint64_t cycles_start)
+#endif
+{
+	if (id >= PROFILER_NODES_MAX)
+	{
+		_profiler_scope_dropped();
+		return;
+	}
+
+#ifdef PROFILER_RDTSCP
+	uint32_t cpu_end;
+	uint64_t cycles_end = get_cycles_cpu(&cpu_end);
+	int migrated = cpu_end != cpu_start;
+#else
+	uint64_t cycles_end = get_cycles();
+#endif
+	struct profiler_thread* thread = profiler_thread_get();
+#ifdef PROFILER_FIBERS
+	uint64_t cycles = cycles_end - thread->fiber_paused - cycles_start;
+#else
+	uint64_t cycles = cycles_end - cycles_start;
+#endif
+#ifdef PROFILER_PER_CPU
+	size_t node = (size_t)id * sizeof(struct profiler_thread_node);
+	struct profiler_cpu* table = profiler_cpu_counter_table();
+
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, total_cycles), cycles);
+	profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, calls), 1);
+#ifdef PROFILER_RDTSCP
+	if (migrated)
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, migrations), 1);
+#endif
+#ifdef PROFILER_HISTOGRAMS
+#ifdef PROFILER_HISTOGRAMS_SKIP_MIGRATED
+	if (!migrated)
+#endif
+		profiler_cpu_counter_add(table, node + offsetof(struct profiler_thread_node, histogram) + (size_t)profiler_log2(cycles) * sizeof(uint64_t), 1);
+#endif
+#else
+	struct profiler_thread_node* node = &thread->nodes[id];
+
+	profiler_counter_add(&node->total_cycles, cycles);
+	profiler_counter_add(&node->calls, 1);
+#ifdef PROFILER_RDTSCP
+	if (migrated)
+		profiler_counter_add(&node->migrations, 1);
+#endif
+#ifdef PROFILER_HISTOGRAMS
+#ifdef PROFILER_HISTOGRAMS_SKIP_MIGRATED
+	if (!migrated)
+#endif
+		profiler_counter_add(&node->histogram[profiler_log2(cycles)], 1);
+#endif
+#endif
+	thread->current_parent = profiler_nodes[id].parent_id;
+
+#ifdef PROFILER_TRACE
+	profiler_trace_record(thread, id, cycles_end, PROFILER_TRACE_EVENT_END, 0);
+#endif
+}
+
+/* The task runs as a scope on the worker from here until profiler_task_complete */
+static inline void _profiler_task_dequeue(struct profiler_task* task)
+{
+	_profiler_task_wait(task);
+#ifdef PROFILER_RDTSCP
+	task->cycles_start = _profiler_scope_enter(task->id, task->name, &task->cpu);
+#else
+	task->cycles_start = _profiler_scope_enter(task->id, task->name);
+#endif
+}
+
+static inline void _profiler_task_complete(struct profiler_task* task)
+{
+#ifdef PROFILER_RDTSCP
+	_profiler_scope_exit(task->id, task->cycles_start, task->cpu);
+#else
+	_profiler_scope_exit(task->id, task->cycles_start);
+#endif
+}
+
+#ifdef PROFILER_RDTSCP
+#define profiler_start(NAME) \
+	static int __profiler_id_##NAME = PROFILER_CREATE_ID; \
+	uint32_t __profiler_cpu_##NAME; \
+	uint64_t __profiler_start_##NAME = _profiler_scope_enter( __profiler_id_##NAME, #NAME, &__profiler_cpu_##NAME ); \
+
+#define profiler_stop(NAME) \
+	_profiler_scope_exit( __profiler_id_##NAME, __profiler_start_##NAME, __profiler_cpu_##NAME ); \
+
+#else
 #define profiler_start(NAME) \
 	static int __profiler_id_##NAME = PROFILER_CREATE_ID; \
-	if( !profiler_nodes[__profiler_id_##NAME].is_setup ) \
-		_profiler_node_setup( __profiler_id_##NAME, #NAME ); \
-	profiler_current_parent = __profiler_id_##NAME; \
-	uint64_t __profiler_start_##NAME = get_cycles(); \
+	uint64_t __profiler_start_##NAME = _profiler_scope_enter( __profiler_id_##NAME, #NAME ); \
 
 #define profiler_stop(NAME) \
-	profiler_nodes[__profiler_id_##NAME].total_cycles += get_cycles() - __profiler_start_##NAME; \
-	profiler_current_parent = profiler_nodes[__profiler_id_##NAME].parent_id; \
+	_profiler_scope_exit( __profiler_id_##NAME, __profiler_start_##NAME ); \
+
+#endif
+
+#define profiler_async_begin(NAME, async) \
+	static int __profiler_id_##NAME = PROFILER_CREATE_ID; \
+	_profiler_async_begin( async, __profiler_id_##NAME, #NAME ); \
+
+#define profiler_async_end(async) \
+	_profiler_async_end( async ); \
 
+#define profiler_task_enqueue(NAME, task) \
+	static int __profiler_id_##NAME = PROFILER_CREATE_ID; \
+	_profiler_task_enqueue( task, __profiler_id_##NAME, #NAME ); \
+
+#define profiler_task_dequeue(task) \
+	_profiler_task_dequeue( task ); \
+
+#define profiler_task_complete(task) \
+	_profiler_task_complete( task ); \
+
+#endif
+
+#ifdef __cplusplus
+}
 #endif
 
 #endif //_PROFILER_
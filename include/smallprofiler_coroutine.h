@@ -0,0 +1,212 @@
+/*
+*	C++20 coroutine scopes for smallprofiler
+*
+*	Copyright (c) 2016-2021, Johan Yngman
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights to
+*	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+*	the Software, and to permit persons to whom the Software is furnished to do so,
+*	subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in all
+*	copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+*	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+*	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+*	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+*	WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Usage:
+*
+*	#include "smallprofiler_coroutine.h"
+*
+*	Derive the promise type of a coroutine type from profiler_coroutine_promise
+*	and begin the body of a coroutine with profiler_co_start(name):
+*
+*	struct task
+*	{
+*		struct promise_type : profiler_coroutine_promise
+*		{
+*			...
+*		};
+*	};
+*
+*	task handle_request(connection& client)
+*	{
+*		profiler_co_start(handle_request);
+*		auto request = co_await client.read();
+*		...
+*	}
+*
+*	The scope ends when the body returns or throws, like profiler_stop at the
+*	end of a block. In between it is only timed while the coroutine runs: the
+*	promise wraps every co_await in the body, so the scope pauses when the
+*	coroutine suspends and goes on when it resumes, on whichever thread resumes
+*	it. Its node gets the running time as its cycles and the time spent
+*	suspended apart, and one call however often it was suspended.
+*
+*	While the coroutine runs, the scope is the parent of the scopes started in
+*	it on the thread it runs on, and when it suspends that thread gets back
+*	the parent it had when the coroutine resumed. The parent of the scope
+*	itself is the scope that was open where it started.
+*
+*	Only one profiler_co_start per coroutine. A promise type that has an
+*	await_transform of its own can wrap its awaiters in
+*	profiler_coroutine_awaiter, with &profiler_scope, to get the same.
+*/
+
+#ifndef _PROFILER_COROUTINE_
+#define _PROFILER_COROUTINE_
+
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+#include "smallprofiler.h"
+
+/* The awaiter that `co_await awaitable` uses, a reference to `awaitable` itself if it has no operator co_await */
+template <typename Awaitable>
+decltype(auto) profiler_coroutine_get_awaiter(Awaitable&& awaitable)
+{
+	if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); })
+		return std::forward<Awaitable>(awaitable).operator co_await();
+	else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); })
+		return operator co_await(std::forward<Awaitable>(awaitable));
+	else
+		return std::forward<Awaitable>(awaitable);
+}
+
+/* Pauses the scope of the coroutine around an awaiter that suspends it */
+template <typename Awaiter>
+class profiler_coroutine_awaiter
+{
+public:
+	profiler_coroutine_awaiter(Awaiter&& awaiter, struct profiler_coroutine* coroutine)
+		: awaiter(std::forward<Awaiter>(awaiter)), coroutine(coroutine)
+	{
+	}
+
+	bool await_ready()
+	{
+		return awaiter.await_ready();
+	}
+
+	template <typename Promise>
+	auto await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		/* Paused first, another thread may resume the coroutine as soon as the awaiter has the handle */
+		profiler_coroutine_suspend(coroutine);
+		return awaiter.await_suspend(handle);
+	}
+
+	decltype(auto) await_resume()
+	{
+		profiler_coroutine_resume(coroutine);
+		return awaiter.await_resume();
+	}
+
+private:
+	Awaiter awaiter;
+	struct profiler_coroutine* coroutine;
+};
+
+/* Ends the scope of the coroutine when the body leaves the block it was started in */
+class profiler_coroutine_scope
+{
+public:
+	explicit profiler_coroutine_scope(struct profiler_coroutine* coroutine)
+		: coroutine(coroutine)
+	{
+	}
+
+	profiler_coroutine_scope(profiler_coroutine_scope&& other) noexcept
+		: coroutine(std::exchange(other.coroutine, nullptr))
+	{
+	}
+
+	profiler_coroutine_scope(const profiler_coroutine_scope&) = delete;
+	profiler_coroutine_scope& operator=(const profiler_coroutine_scope&) = delete;
+
+	~profiler_coroutine_scope()
+	{
+		if (coroutine)
+			profiler_coroutine_end(coroutine);
+	}
+
+private:
+	struct profiler_coroutine* coroutine;
+};
+
+/* Awaited by profiler_co_start, never suspends: it only finds the scope in the promise and begins it */
+class profiler_coroutine_start
+{
+public:
+	profiler_coroutine_start(int id, const char* name)
+		: id(id), name(name), coroutine(nullptr)
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	template <typename Promise>
+	bool await_suspend(std::coroutine_handle<Promise> handle) noexcept;
+
+	profiler_coroutine_scope await_resume()
+	{
+		profiler_coroutine_begin(coroutine, id, name);
+		return profiler_coroutine_scope(coroutine);
+	}
+
+private:
+	int id;
+	const char* name;
+	struct profiler_coroutine* coroutine;
+};
+
+/* Base of promise types whose coroutines use profiler_co_start */
+class profiler_coroutine_promise
+{
+public:
+	template <typename Awaitable>
+	auto await_transform(Awaitable&& awaitable)
+	{
+		using awaiter_type = decltype(profiler_coroutine_get_awaiter(std::forward<Awaitable>(awaitable)));
+		return profiler_coroutine_awaiter<awaiter_type>(profiler_coroutine_get_awaiter(std::forward<Awaitable>(awaitable)), &profiler_scope);
+	}
+
+	profiler_coroutine_start await_transform(profiler_coroutine_start start)
+	{
+		return start;
+	}
+
+	struct profiler_coroutine profiler_scope = {};
+};
+
+template <typename Promise>
+bool profiler_coroutine_start::await_suspend(std::coroutine_handle<Promise> handle) noexcept
+{
+	static_assert(std::is_base_of<profiler_coroutine_promise, Promise>::value, "profiler_co_start needs a promise type derived from profiler_coroutine_promise");
+
+	coroutine = &handle.promise().profiler_scope;
+	return false;
+}
+
+#ifdef PROFILER_DISABLE
+#define profiler_co_start(NAME)
+#else
+#define profiler_co_start(NAME) \
+	static int __profiler_id_##NAME = PROFILER_CREATE_ID; \
+	profiler_coroutine_scope __profiler_scope_##NAME = co_await profiler_coroutine_start( __profiler_id_##NAME, #NAME ); \
+
+#endif
+
+#endif //_PROFILER_COROUTINE_
@@ -0,0 +1,123 @@
+/*
+*	Profiled I/O calls for smallprofiler
+*
+*	Copyright (c) 2016-2021, Johan Yngman
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights to
+*	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+*	the Software, and to permit persons to whom the Software is furnished to do so,
+*	subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in all
+*	copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+*	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+*	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+*	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+*	WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/*
+* Usage:
+*
+*	#include "smallprofiler_io.h"
+*
+*	Call profiler_read, profiler_write, profiler_pread, profiler_pwrite,
+*	profiler_send, profiler_recv and profiler_fsync in place of the system
+*	calls they are named after, with the same arguments and results:
+*
+*	profiler_start(flush_log);
+*	ssize_t written = profiler_write(fd, buffer, size);
+*	profiler_fsync(fd);
+*	profiler_stop(flush_log);
+*
+*	Every call is counted for the scope open on the thread, with the bytes it
+*	moved and its latency: reports show the I/O calls of a scope, the bytes
+*	per call, which are few for small unbatched I/O, the throughput while the
+*	calls ran and the p99 latency with PROFILER_HISTOGRAMS (the mean without).
+*	fsync is counted apart, as syncs and their mean latency. The time in the
+*	calls is also blocked time of the scope and the scopes above it, like
+*	profiler_wait_begin/end. Calls outside of any scope only count as blocked.
+*
+*	Other calls, like readv or io_uring completions, are timed the same way
+*	with profiler_io_begin() before them and profiler_io_end(cycles, bytes),
+*	or profiler_io_sync_end(cycles), after them.
+*/
+
+#ifndef _PROFILER_IO_
+#define _PROFILER_IO_
+
+#include "smallprofiler.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Failed calls moved no bytes but took their time. The first call of a thread sets up its state, which must not change the errno of the call */
+static inline ssize_t profiler_io_result(uint64_t cycles_start, ssize_t result)
+{
+	int error = errno;
+
+	profiler_io_end(cycles_start, result > 0 ? (uint64_t)result : 0);
+
+	errno = error;
+	return result;
+}
+
+static inline ssize_t profiler_read(int fd, void* buffer, size_t size)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, read(fd, buffer, size));
+}
+
+static inline ssize_t profiler_write(int fd, const void* buffer, size_t size)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, write(fd, buffer, size));
+}
+
+static inline ssize_t profiler_pread(int fd, void* buffer, size_t size, off_t offset)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, pread(fd, buffer, size, offset));
+}
+
+static inline ssize_t profiler_pwrite(int fd, const void* buffer, size_t size, off_t offset)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, pwrite(fd, buffer, size, offset));
+}
+
+static inline ssize_t profiler_send(int socket, const void* buffer, size_t size, int flags)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, send(socket, buffer, size, flags));
+}
+
+static inline ssize_t profiler_recv(int socket, void* buffer, size_t size, int flags)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	return profiler_io_result(cycles_start, recv(socket, buffer, size, flags));
+}
+
+static inline int profiler_fsync(int fd)
+{
+	uint64_t cycles_start = profiler_io_begin();
+	int result = fsync(fd);
+	int error = errno;
+
+	profiler_io_sync_end(cycles_start);
+
+	errno = error;
+	return result;
+}
+#endif
+
+#endif //_PROFILER_IO_
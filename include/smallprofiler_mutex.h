@@ -0,0 +1,226 @@
+/*
+*	Profiled locks and blocking waits for smallprofiler
+*
+*	Copyright (c) 2016-2021, Johan Yngman
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights to
+*	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+*	the Software, and to permit persons to whom the Software is furnished to do so,
+*	subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in all
+*	copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+*	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+*	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+*	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+*	WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Usage:
+*
+*	#include "smallprofiler_mutex.h"
+*
+*	In C++, wrap a lock type in profiler_mutex, or profiler_shared_mutex for
+*	reader/writer locks, and give it a name:
+*
+*	profiler_mutex<std::mutex> queue_mutex("queue_mutex");
+*	profiler_shared_mutex<std::shared_mutex> cache_mutex("cache_mutex");
+*
+*	std::lock_guard<profiler_mutex<std::mutex>> guard(queue_mutex);
+*
+*	Both have the members of the lock they wrap, so std::lock_guard,
+*	std::unique_lock and std::shared_lock take them as they are. In C, keep a
+*	struct profiler_lock next to a pthread mutex, set it up once with
+*	profiler_lock_init(&lock, "name") and lock and unlock the mutex with
+*	profiler_pthread_mutex_lock/unlock(&mutex, &lock).
+*
+*	Every lock first tries to take the lock without waiting, and only when that
+*	fails the wait is timed: the lock counts the contended acquisition and its
+*	cycles, and the scope that held the lock last counts the same cycles as
+*	blocking. Every exclusive hold is timed from acquisition to release. Locks
+*	are nodes at the root of the reports, named by the lock (locks with the same
+*	name share one), with the time they were held as their cycles, the
+*	contended acquisitions per second since profiler_reset, and the p99 of the
+*	waits and holds with PROFILER_HISTOGRAMS.
+*
+*	Shared holds are not timed, readers hold the lock together; a shared
+*	acquisition that had to wait is counted like an exclusive one. The name
+*	must stay valid for as long as the lock is used.
+*
+*	Waits for condition variables, futures, poll and the like are marked as
+*	blocked with profiler_blocked, or a profiler_wait_scope around them, in C++:
+*
+*	profiler_blocked([&] { ready.wait(guard); });
+*	auto result = profiler_blocked([&] { return future.get(); });
+*
+*	and with profiler_wait_begin()/profiler_wait_end() around them in C, or
+*	profiler_pthread_cond_wait(&cond, &mutex, &lock) for a condition variable
+*	on a profiled pthread mutex, which also ends the hold while it waits. The
+*	blocked time, and the contended waits for profiled locks, count for every
+*	open scope of the thread apart from its running time.
+*/
+
+#ifndef _PROFILER_MUTEX_
+#define _PROFILER_MUTEX_
+
+#include "smallprofiler.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+
+static inline int profiler_pthread_mutex_lock(pthread_mutex_t* mutex, struct profiler_lock* lock)
+{
+	if (pthread_mutex_trylock(mutex) == 0)
+	{
+		profiler_lock_acquired(lock, 0);
+		return 0;
+	}
+
+	uint64_t cycles_wait = profiler_lock_wait_begin();
+	int result = pthread_mutex_lock(mutex);
+
+	if (result == 0)
+		profiler_lock_acquired(lock, cycles_wait);
+
+	return result;
+}
+
+static inline int profiler_pthread_mutex_unlock(pthread_mutex_t* mutex, struct profiler_lock* lock)
+{
+	profiler_lock_release(lock);
+	return pthread_mutex_unlock(mutex);
+}
+
+/* The mutex is not held while the thread waits, so neither is the lock */
+static inline int profiler_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, struct profiler_lock* lock)
+{
+	profiler_lock_release(lock);
+	profiler_wait_begin();
+
+	int result = pthread_cond_wait(cond, mutex);
+
+	profiler_wait_end();
+	profiler_lock_acquired(lock, 0);
+	return result;
+}
+#endif
+
+#ifdef __cplusplus
+/* A lock with lock, try_lock and unlock, timed under `name` */
+template <typename Mutex>
+class profiler_mutex
+{
+public:
+	explicit profiler_mutex(const char* name)
+	{
+		profiler_lock_init(&profiler, name);
+	}
+
+	profiler_mutex(const profiler_mutex&) = delete;
+	profiler_mutex& operator=(const profiler_mutex&) = delete;
+
+	void lock()
+	{
+		if (mutex.try_lock())
+		{
+			profiler_lock_acquired(&profiler, 0);
+			return;
+		}
+
+		uint64_t cycles_wait = profiler_lock_wait_begin();
+		mutex.lock();
+		profiler_lock_acquired(&profiler, cycles_wait);
+	}
+
+	bool try_lock()
+	{
+		if (!mutex.try_lock())
+			return false;
+
+		profiler_lock_acquired(&profiler, 0);
+		return true;
+	}
+
+	void unlock()
+	{
+		profiler_lock_release(&profiler);
+		mutex.unlock();
+	}
+
+protected:
+	Mutex mutex;
+	struct profiler_lock profiler;
+};
+
+/* A reader/writer lock that also has lock_shared, try_lock_shared and unlock_shared */
+template <typename SharedMutex>
+class profiler_shared_mutex : public profiler_mutex<SharedMutex>
+{
+public:
+	explicit profiler_shared_mutex(const char* name)
+		: profiler_mutex<SharedMutex>(name)
+	{
+	}
+
+	void lock_shared()
+	{
+		if (this->mutex.try_lock_shared())
+		{
+			profiler_lock_acquired_shared(&this->profiler, 0);
+			return;
+		}
+
+		uint64_t cycles_wait = profiler_lock_wait_begin();
+		this->mutex.lock_shared();
+		profiler_lock_acquired_shared(&this->profiler, cycles_wait);
+	}
+
+	bool try_lock_shared()
+	{
+		if (!this->mutex.try_lock_shared())
+			return false;
+
+		profiler_lock_acquired_shared(&this->profiler, 0);
+		return true;
+	}
+
+	void unlock_shared()
+	{
+		this->mutex.unlock_shared();
+	}
+};
+
+/* Marks the thread as blocked for as long as it lives */
+class profiler_wait_scope
+{
+public:
+	profiler_wait_scope()
+	{
+		profiler_wait_begin();
+	}
+
+	~profiler_wait_scope()
+	{
+		profiler_wait_end();
+	}
+
+	profiler_wait_scope(const profiler_wait_scope&) = delete;
+	profiler_wait_scope& operator=(const profiler_wait_scope&) = delete;
+};
+
+/* Calls `function`, a wait, with the thread marked as blocked and returns what it returns */
+template <typename Function>
+auto profiler_blocked(Function&& function) -> decltype(function())
+{
+	profiler_wait_scope scope;
+	return function();
+}
+#endif
+
+#endif //_PROFILER_MUTEX_
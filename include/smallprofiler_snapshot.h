@@ -0,0 +1,465 @@
+/*
+*	Binary snapshot format and reader for smallprofiler
+*
+*	Copyright (c) 2016-2021, Johan Yngman
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights to
+*	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+*	the Software, and to permit persons to whom the Software is furnished to do so,
+*	subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in all
+*	copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+*	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+*	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+*	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+*	WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Usage:
+*
+*	A snapshot is written with profiler_dump_snapshot(filename) from smallprofiler.h.
+*	To read snapshots:
+*
+*	#define PROFILER_SNAPSHOT_DEFINE
+*	#include "smallprofiler_snapshot.h"
+*
+*	struct profiler_snapshot snapshot;
+*	if (profiler_snapshot_open(&snapshot, "profile.spsnap"))
+*	{
+*		...
+*		profiler_snapshot_close(&snapshot);
+*	}
+*
+*	The file is memory mapped and queried in place, nothing is parsed or copied
+*	when it is opened.
+*
+*	Layout (little-endian, every section 8-byte aligned):
+*
+*		profiler_snapshot_header
+*		node table			node_count records of node_size bytes
+*		string table		NUL-terminated node names
+*		histograms			node_count * histogram_buckets uint64_t, optional
+*
+*	Nodes are stored depth-first with siblings sorted by total_cycles, largest
+*	first, so a node's subtree is the range [index, subtree_end). Bucket b of a
+*	histogram counts the calls that took [2^b, 2^(b+1)) cycles.
+*
+*	From version 2 the header ends with what the profiler could not record
+*	within its memory budget: calls of scopes beyond PROFILER_NODES_MAX, threads
+*	that got no node table and trace events (see profiler_initialize_budget).
+*
+*	From version 3 every node also has the number of its calls that ended on
+*	another CPU than they began on, with clock_source PROFILER_CLOCK_RDTSCP
+*	(zero with PROFILER_CLOCK_RDTSC, which can not tell).
+*
+*	From version 4 every node also has the cycles its calls spent suspended,
+*	for scopes around coroutines that are only timed while they run.
+*
+*	From version 5 every node also has the cycles of total_cycles its thread
+*	was blocked, in profiler_wait_begin/end or waiting for a profiled lock.
+*
+*	From version 6 every node also has the I/O calls made in it, with the bytes
+*	they moved and their cycles, and the syncs and their cycles apart.
+*
+*	Readers must use header_size and node_size to step over the header and node
+*	records, fields added in later versions are appended to the end of them.
+*/
+
+#ifndef _PROFILER_SNAPSHOT_
+#define _PROFILER_SNAPSHOT_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILER_SNAPSHOT_MAGIC "SPSNAP\0"
+#define PROFILER_SNAPSHOT_VERSION 6
+
+#define PROFILER_CLOCK_RDTSC 1
+#define PROFILER_CLOCK_RDTSCP 2
+
+struct profiler_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t clock_source;
+	uint32_t node_size;
+	uint64_t cycles_per_second;
+	uint32_t node_count;
+	uint32_t histogram_buckets;
+	uint32_t thread_count;
+	uint32_t reserved;
+	uint64_t node_table_offset;
+	uint64_t string_table_offset;
+	uint64_t string_table_size;
+	uint64_t histogram_offset;
+	uint64_t size;
+	uint64_t dropped_calls;
+	uint64_t dropped_threads;
+	uint64_t dropped_events;
+};
+
+struct profiler_snapshot_node
+{
+	uint64_t total_cycles;
+	uint64_t calls;
+	int32_t parent;
+	uint32_t name_offset;
+	uint32_t depth;
+	uint32_t subtree_end;
+	uint64_t migrations;
+	uint64_t suspended_cycles;
+	uint64_t blocked_cycles;
+	uint64_t io_calls;
+	uint64_t io_bytes;
+	uint64_t io_cycles;
+	uint64_t syncs;
+	uint64_t sync_cycles;
+};
+
+struct profiler_snapshot
+{
+	const uint8_t* data;
+	uint64_t size;
+	const struct profiler_snapshot_header* header;
+	const char* strings;
+	const uint64_t* histograms;
+	void* mapping;
+#ifdef _WIN32
+	void* file;
+#endif
+};
+
+/* Open and memory map a snapshot file, returns 0 if it can't be opened or is not a snapshot. Sections and nodes are checked once here, so the queries below stay within the snapshot whatever the file holds */
+int profiler_snapshot_open(struct profiler_snapshot* snapshot, const char* filename);
+
+/* Use a snapshot that is already in memory, the data must outlive the snapshot */
+int profiler_snapshot_open_memory(struct profiler_snapshot* snapshot, const void* data, uint64_t size);
+
+void profiler_snapshot_close(struct profiler_snapshot* snapshot);
+
+/* Copy of the header, fields the file is too old to contain are zero */
+struct profiler_snapshot_header profiler_snapshot_get_header(const struct profiler_snapshot* snapshot);
+
+uint32_t profiler_snapshot_node_count(const struct profiler_snapshot* snapshot);
+
+/* Copy of node `index`, fields the file is too old to contain are zero */
+struct profiler_snapshot_node profiler_snapshot_get_node(const struct profiler_snapshot* snapshot, uint32_t index);
+
+const char* profiler_snapshot_name(const struct profiler_snapshot* snapshot, uint32_t index);
+
+/* Histogram of node `index`, NULL if the snapshot has no histograms */
+const uint64_t* profiler_snapshot_histogram(const struct profiler_snapshot* snapshot, uint32_t index);
+
+/* Cycles spent in the node itself, not in its children */
+uint64_t profiler_snapshot_self_cycles(const struct profiler_snapshot* snapshot, uint32_t index);
+
+double profiler_snapshot_seconds(const struct profiler_snapshot* snapshot, uint64_t cycles);
+
+/* Index of the node with the call path `path` ("outer;inner;leaf"), -1 if there is none */
+int64_t profiler_snapshot_find(const struct profiler_snapshot* snapshot, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef PROFILER_SNAPSHOT_DEFINE
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Whether `count` elements of `element_size` bytes at `offset` end within `size` bytes, without overflowing */
+static int profiler_snapshot_fits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t size)
+{
+	if (offset > size)
+		return 0;
+
+	return !element_size || count <= (size - offset) / element_size;
+}
+
+/* Every node must only point at later nodes in its subtree, earlier parents and names in the string table, and be one level below its parent, so the queries never leave the snapshot */
+static int profiler_snapshot_nodes_valid(const struct profiler_snapshot* snapshot)
+{
+	const struct profiler_snapshot_header* header = snapshot->header;
+
+	/* Names end at the NUL after them, the last one at the end of the table */
+	if (header->node_count && (!header->string_table_size || snapshot->strings[header->string_table_size - 1] != '\0'))
+		return 0;
+
+	uint32_t i;
+	for (i = 0; i < header->node_count; i++)
+	{
+		struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, i);
+
+		if (node.subtree_end <= i || node.subtree_end > header->node_count ||
+			node.parent < -1 || node.parent >= (int64_t)i ||
+			node.name_offset >= header->string_table_size)
+		{
+			return 0;
+		}
+
+		if (node.depth != (node.parent < 0 ? 0 : profiler_snapshot_get_node(snapshot, (uint32_t)node.parent).depth + 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+int profiler_snapshot_open_memory(struct profiler_snapshot* snapshot, const void* data, uint64_t size)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+
+	const struct profiler_snapshot_header* header = (const struct profiler_snapshot_header*)data;
+
+	if (size < offsetof(struct profiler_snapshot_header, dropped_calls) ||
+		memcmp(header->magic, PROFILER_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version < 1 ||
+		header->header_size < offsetof(struct profiler_snapshot_header, dropped_calls) ||
+		header->node_size < 32 ||
+		header->size > size ||
+		!profiler_snapshot_fits(header->node_table_offset, header->node_count, header->node_size, header->size) ||
+		!profiler_snapshot_fits(header->string_table_offset, header->string_table_size, 1, header->size) ||
+		!profiler_snapshot_fits(header->histogram_offset, (uint64_t)header->node_count * header->histogram_buckets, sizeof(uint64_t), header->size))
+	{
+		return 0;
+	}
+
+	snapshot->data = (const uint8_t*)data;
+	snapshot->size = size;
+	snapshot->header = header;
+	snapshot->strings = (const char*)data + header->string_table_offset;
+	snapshot->histograms = header->histogram_buckets ? (const uint64_t*)((const uint8_t*)data + header->histogram_offset) : NULL;
+
+	if (!profiler_snapshot_nodes_valid(snapshot))
+	{
+		memset(snapshot, 0, sizeof(*snapshot));
+		return 0;
+	}
+
+	return 1;
+}
+
+#ifdef _WIN32
+int profiler_snapshot_open(struct profiler_snapshot* snapshot, const char* filename)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	const void* data = NULL;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mapping)
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (!data || !profiler_snapshot_open_memory(snapshot, data, (uint64_t)size.QuadPart))
+	{
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+
+		CloseHandle(file);
+		return 0;
+	}
+
+	snapshot->mapping = mapping;
+	snapshot->file = file;
+	return 1;
+}
+
+void profiler_snapshot_close(struct profiler_snapshot* snapshot)
+{
+	if (snapshot->mapping)
+	{
+		UnmapViewOfFile(snapshot->data);
+		CloseHandle((HANDLE)snapshot->mapping);
+		CloseHandle((HANDLE)snapshot->file);
+	}
+
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+#else
+int profiler_snapshot_open(struct profiler_snapshot* snapshot, const char* filename)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+
+	int file = open(filename, O_RDONLY);
+	if (file < 0)
+		return 0;
+
+	struct stat status;
+	void* data = MAP_FAILED;
+
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+		data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+	close(file);
+
+	if (data == MAP_FAILED)
+		return 0;
+
+	if (!profiler_snapshot_open_memory(snapshot, data, (uint64_t)status.st_size))
+	{
+		munmap(data, (size_t)status.st_size);
+		return 0;
+	}
+
+	snapshot->mapping = data;
+	return 1;
+}
+
+void profiler_snapshot_close(struct profiler_snapshot* snapshot)
+{
+	if (snapshot->mapping)
+		munmap(snapshot->mapping, (size_t)snapshot->size);
+
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+#endif
+
+struct profiler_snapshot_header profiler_snapshot_get_header(const struct profiler_snapshot* snapshot)
+{
+	struct profiler_snapshot_header header;
+	size_t size = snapshot->header->header_size < sizeof(header) ? snapshot->header->header_size : sizeof(header);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, snapshot->header, size);
+	return header;
+}
+
+uint32_t profiler_snapshot_node_count(const struct profiler_snapshot* snapshot)
+{
+	return snapshot->header->node_count;
+}
+
+struct profiler_snapshot_node profiler_snapshot_get_node(const struct profiler_snapshot* snapshot, uint32_t index)
+{
+	struct profiler_snapshot_node node;
+	uint32_t size = snapshot->header->node_size < sizeof(node) ? snapshot->header->node_size : (uint32_t)sizeof(node);
+
+	memset(&node, 0, sizeof(node));
+	memcpy(&node, snapshot->data + snapshot->header->node_table_offset + (uint64_t)index * snapshot->header->node_size, size);
+
+	return node;
+}
+
+const char* profiler_snapshot_name(const struct profiler_snapshot* snapshot, uint32_t index)
+{
+	struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, index);
+
+	if (node.name_offset >= snapshot->header->string_table_size)
+		return "";
+
+	return snapshot->strings + node.name_offset;
+}
+
+const uint64_t* profiler_snapshot_histogram(const struct profiler_snapshot* snapshot, uint32_t index)
+{
+	if (!snapshot->histograms)
+		return NULL;
+
+	return snapshot->histograms + (uint64_t)index * snapshot->header->histogram_buckets;
+}
+
+uint64_t profiler_snapshot_self_cycles(const struct profiler_snapshot* snapshot, uint32_t index)
+{
+	struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, index);
+	uint64_t cycles = node.total_cycles;
+
+	uint32_t child = index + 1;
+	while (child < node.subtree_end)
+	{
+		struct profiler_snapshot_node child_node = profiler_snapshot_get_node(snapshot, child);
+		cycles -= child_node.total_cycles;
+		child = child_node.subtree_end;
+	}
+
+	return cycles;
+}
+
+double profiler_snapshot_seconds(const struct profiler_snapshot* snapshot, uint64_t cycles)
+{
+	if (!snapshot->header->cycles_per_second)
+		return 0.0;
+
+	return (double)cycles / (double)snapshot->header->cycles_per_second;
+}
+
+int64_t profiler_snapshot_find(const struct profiler_snapshot* snapshot, const char* path)
+{
+	uint32_t begin = 0;
+	uint32_t end = snapshot->header->node_count;
+	int64_t found = -1;
+
+	while (*path)
+	{
+		const char* separator = strchr(path, ';');
+		size_t length = separator ? (size_t)(separator - path) : strlen(path);
+
+		found = -1;
+
+		uint32_t child = begin;
+		while (child < end)
+		{
+			struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, child);
+			const char* name = profiler_snapshot_name(snapshot, child);
+
+			if (strncmp(name, path, length) == 0 && name[length] == '\0')
+			{
+				found = child;
+				begin = child + 1;
+				end = node.subtree_end;
+				break;
+			}
+
+			child = node.subtree_end;
+		}
+
+		if (found == -1)
+			return -1;
+
+		path += length;
+		if (*path == ';')
+			path++;
+	}
+
+	return found;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROFILER_SNAPSHOT_DEFINE
+
+#endif //_PROFILER_SNAPSHOT_
@@ -0,0 +1,1025 @@
+/*
+*	Event trace format and reader for smallprofiler
+*
+*	Copyright (c) 2016-2021, Johan Yngman
+*
+*	Permission is hereby granted, free of charge, to any person obtaining a copy
+*	of this software and associated documentation files (the "Software"), to deal
+*	in the Software without restriction, including without limitation the rights to
+*	use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+*	the Software, and to permit persons to whom the Software is furnished to do so,
+*	subject to the following conditions:
+*
+*	The above copyright notice and this permission notice shall be included in all
+*	copies or substantial portions of the Software.
+*
+*	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+*	FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+*	COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+*	IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+*	WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+* Usage:
+*
+*	A trace is written between profiler_trace_begin(filename) and
+*	profiler_trace_end() from smallprofiler.h when PROFILER_TRACE is defined.
+*	To read traces:
+*
+*	#define PROFILER_TRACE_DEFINE
+*	#include "smallprofiler_trace.h"
+*
+*	struct profiler_trace trace;
+*	if (profiler_trace_open(&trace, "profile.sptrace"))
+*	{
+*		uint64_t offset = profiler_trace_first_chunk(&trace);
+*		const struct profiler_trace_chunk* chunk;
+*
+*		while ((chunk = profiler_trace_chunk_at(&trace, offset)) != NULL)
+*		{
+*			if (profiler_trace_chunk_is_events(chunk))
+*			{
+*				struct profiler_trace_event event;
+*
+*				profiler_trace_chunk_decoder(&trace, chunk, &decoder);
+*				while (profiler_trace_decoder_next(&decoder, &event))
+*					...
+*			}
+*
+*			offset = profiler_trace_chunk_next(&trace, chunk, offset);
+*		}
+*
+*		profiler_trace_close(&trace);
+*	}
+*
+*	where `decoder` is a struct profiler_trace_decoder set up once with
+*	profiler_trace_decoder_create and released with profiler_trace_decoder_free.
+*	It holds the buffer that compressed chunks are decompressed into.
+*
+*	Like snapshots, the file is memory mapped and read in place.
+*
+*	Layout (little-endian, every chunk 8-byte aligned):
+*
+*		profiler_trace_header
+*		chunks				profiler_trace_chunk followed by `size` bytes of payload
+*
+*	Every events chunk is one block of events of one thread, in the order the
+*	thread recorded them; `sequence` counts the blocks of a thread so gaps can
+*	be detected. With PROFILER_FIBERS every fiber counts as a thread of its
+*	own. Version 1 and 2 traces store profiler_trace_event records
+*	(PROFILER_TRACE_CHUNK_EVENTS), version 3 packs them (PROFILER_TRACE_CHUNK_PACKED),
+*	one event being:
+*
+*		varint		zigzag(cycles - previous cycles) << 2 | tag, the first event of
+*					a chunk is relative to first_cycles
+*		varint		the type, only if tag is 3, otherwise tag is the type
+*		varint		index into the dictionary of the chunk
+*		varint		the scope id, only if the index is the size of the dictionary,
+*					which appends the id to it
+*		varint		the flow, only for the async events of version 7
+*
+*	Varints are LEB128, 7 bits per byte with the high bit set on every byte but
+*	the last. The dictionary starts empty in every chunk, so chunks decode
+*	independently. A begin or end a few hundred cycles after the previous event
+*	of a scope seen before in the chunk takes 3 bytes instead of 16.
+*
+*	From version 4 the payload of an events chunk may be compressed: `codec`
+*	says how and `raw_size` is the size of the payload decompressed. Only
+*	events chunks are compressed. PROFILER_TRACE_CODEC_LZ is a byte-oriented
+*	LZ77 of sequences:
+*
+*		token		literal count in the high 4 bits, match length - 4 in the low 4
+*		...			255 bytes added to a count of 15 until a byte below 255
+*		literals
+*		offset		2 bytes, how far back the match starts, absent after the last literals
+*		...			the extension of a match length of 19, as for the literal count
+*
+*	Chunks of different threads are interleaved in the order they were
+*	flushed. A trace written with profiler_trace_begin_ring (version 5) is a
+*	fixed number of equal slots right after the header, each one chunk of
+*	chunk_header_size + size bytes. A PROFILER_TRACE_CHUNK_RING slot holds a
+*	profiler_trace_ring_block followed by the packed events of one block, of
+*	which only the first `size` bytes were written, and a
+*	PROFILER_TRACE_CHUNK_FREE slot holds nothing. Slots are reused oldest
+*	first, so sequences have gaps, and count and last_cycles are only filled
+*	in when the trace is ended: 0 means the events run until the end of the
+*	written bytes. The slot type is written last, so a process that crashes
+*	leaves a trace that reads up to its last event.
+*
+*	The names chunk maps scope ids to names and parents, it is written last
+*	by profiler_trace_end and found through names_offset, which is 0 in a
+*	trace that was never ended.
+*
+*	The index chunk (version 2, found through index_offset) is a sparse time
+*	index: for every thread, one entry per events chunk with its time range,
+*	its file offset and the scopes that were open when the chunk began, with
+*	their begin timestamps. profiler_trace_index_find binary searches the
+*	entries of a thread for a timestamp, so a time window is found in
+*	O(log n) and decoded from there with the correct nesting:
+*
+*		uint32_t slot, entry;
+*		for (slot = 0; slot < profiler_trace_index_thread_count(&trace); slot++)
+*		{
+*			const struct profiler_trace_index_thread* thread = profiler_trace_index_thread(&trace, slot);
+*			const struct profiler_trace_index_entry* entries = profiler_trace_index_entries(&trace, thread);
+*
+*			for (entry = profiler_trace_index_find(&trace, thread, begin); entry < thread->entry_count && entries[entry].first_cycles < end; entry++)
+*				... profiler_trace_index_stack(&trace, &entries[entry]) and the chunk at entries[entry].chunk_offset
+*		}
+*
+*	From version 6 the header counts the events that were dropped because the
+*	trace blocks were over the memory budget (see profiler_initialize_budget).
+*	A ring overwrites its oldest slots by design, which shows as gaps in the
+*	sequences rather than in that count.
+*
+*	From version 7 a scope begun with profiler_async_begin records a
+*	PROFILER_TRACE_EVENT_ASYNC_BEGIN on the thread it begins on and a
+*	PROFILER_TRACE_EVENT_ASYNC_END on the thread it ends on, which may be
+*	another one. Both carry the same `flow`, unique in the trace, and do not
+*	nest with the other scopes of their threads.
+*
+*	Readers must use header_size and chunk_header_size to step over headers,
+*	fields added in later versions are appended to the end of them.
+*/
+
+#ifndef _PROFILER_TRACE_
+#define _PROFILER_TRACE_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILER_TRACE_MAGIC "SPTRACE"
+#define PROFILER_TRACE_VERSION 7
+
+#define PROFILER_TRACE_CHUNK_EVENTS 1
+#define PROFILER_TRACE_CHUNK_NAMES 2
+#define PROFILER_TRACE_CHUNK_INDEX 3
+#define PROFILER_TRACE_CHUNK_PACKED 4
+#define PROFILER_TRACE_CHUNK_RING 5
+#define PROFILER_TRACE_CHUNK_FREE 6
+
+/* Scopes one packed chunk can name, dictionary indices up to this take at most two bytes */
+#define PROFILER_TRACE_DICTIONARY_MAX 16384
+
+#define PROFILER_TRACE_CODEC_NONE 0
+#define PROFILER_TRACE_CODEC_LZ 1
+
+/* Entries of the match finder of the LZ compressor */
+#define PROFILER_TRACE_LZ_HASH_BITS 12
+
+#define PROFILER_TRACE_EVENT_BEGIN 0
+#define PROFILER_TRACE_EVENT_END 1
+#define PROFILER_TRACE_EVENT_ASYNC_BEGIN 2
+#define PROFILER_TRACE_EVENT_ASYNC_END 3
+
+/* Bytes of a profiler_trace_event in version 1 and 2 traces, which have no flow */
+#define PROFILER_TRACE_EVENT_RECORD_SIZE 16
+
+struct profiler_trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t clock_source;
+	uint32_t chunk_header_size;
+	uint64_t cycles_per_second;
+	uint64_t start_cycles;
+	uint64_t names_offset;
+	uint32_t thread_count;
+	uint32_t reserved;
+	uint64_t index_offset;
+	uint64_t dropped_events;
+};
+
+struct profiler_trace_chunk
+{
+	uint32_t type;
+	uint32_t thread;
+	uint32_t sequence;
+	uint32_t count;
+	uint64_t size;
+	uint64_t first_cycles;
+	uint64_t last_cycles;
+	uint32_t codec;
+	uint32_t raw_size;
+};
+
+struct profiler_trace_event
+{
+	uint64_t cycles;
+	uint32_t id;
+	uint32_t type;
+
+	/* Pairs an async begin with its end, 0 for other events */
+	uint64_t flow;
+};
+
+/* Start of the payload of a ring slot, the packed events follow */
+struct profiler_trace_ring_block
+{
+	uint64_t reserved;
+	uint32_t session;
+	uint32_t thread;
+	uint32_t sequence;
+	uint32_t size;
+	uint64_t first_cycles;
+};
+
+/* Payload of the names chunk: a count, then count records, then the NUL-terminated names */
+struct profiler_trace_names
+{
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct profiler_trace_name
+{
+	int32_t parent;
+	uint32_t name_offset;
+};
+
+/* Payload of the index chunk, offsets are relative to the start of the payload */
+struct profiler_trace_index
+{
+	uint32_t thread_count;
+	uint32_t stack_count;
+	uint64_t stacks_offset;
+};
+
+struct profiler_trace_index_thread
+{
+	uint32_t thread;
+	uint32_t entry_count;
+	uint64_t entries_offset;
+};
+
+struct profiler_trace_index_entry
+{
+	uint64_t first_cycles;
+	uint64_t last_cycles;
+	uint64_t chunk_offset;
+	uint32_t stack_index;
+	uint32_t stack_depth;
+};
+
+/* A scope that was open when a chunk began, outermost first */
+struct profiler_trace_open_scope
+{
+	uint64_t cycles;
+	uint32_t id;
+	uint32_t reserved;
+};
+
+/* Reads the events of an events or packed chunk in order */
+struct profiler_trace_decoder
+{
+	const uint8_t* data;
+	const uint8_t* end;
+	uint64_t cycles;
+	uint32_t remaining;
+	uint32_t packed;
+	uint32_t dictionary_count;
+	uint32_t dictionary[PROFILER_TRACE_DICTIONARY_MAX];
+
+	/* Decompressed payload of the current chunk */
+	uint8_t* buffer;
+	uint64_t buffer_size;
+};
+
+struct profiler_trace
+{
+	const uint8_t* data;
+	uint64_t size;
+	const struct profiler_trace_header* header;
+	const struct profiler_trace_names* names;
+	const struct profiler_trace_index* index;
+	void* mapping;
+#ifdef _WIN32
+	void* file;
+#endif
+};
+
+/* Open and memory map a trace file, returns 0 if it can't be opened or is not a trace */
+int profiler_trace_open(struct profiler_trace* trace, const char* filename);
+
+/* Use a trace that is already in memory, the data must outlive the trace */
+int profiler_trace_open_memory(struct profiler_trace* trace, const void* data, uint64_t size);
+
+void profiler_trace_close(struct profiler_trace* trace);
+
+uint64_t profiler_trace_first_chunk(const struct profiler_trace* trace);
+
+/* The chunk at `offset`, NULL at the end of the trace or if the rest of the file is truncated */
+const struct profiler_trace_chunk* profiler_trace_chunk_at(const struct profiler_trace* trace, uint64_t offset);
+
+uint64_t profiler_trace_chunk_next(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk, uint64_t offset);
+
+/* Events of a PROFILER_TRACE_CHUNK_EVENTS chunk, `chunk->count` of them, use a decoder to read packed chunks too */
+const struct profiler_trace_event* profiler_trace_chunk_events(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk);
+
+void profiler_trace_decoder_create(struct profiler_trace_decoder* decoder);
+
+void profiler_trace_decoder_free(struct profiler_trace_decoder* decoder);
+
+/*
+*	Start decoding the events of `chunk`, which must be an events, packed or
+*	ring chunk. Returns 0 if it can not be decompressed, the decoder then has no events.
+*/
+int profiler_trace_chunk_decoder(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk, struct profiler_trace_decoder* decoder);
+
+/* Number of scope ids with a name, 0 if the trace was never ended */
+uint32_t profiler_trace_name_count(const struct profiler_trace* trace);
+
+/* Name of scope `id`, NULL if it has none */
+const char* profiler_trace_name(const struct profiler_trace* trace, uint32_t id);
+
+/* Parent id of scope `id`, -1 for roots and unknown ids */
+int32_t profiler_trace_parent(const struct profiler_trace* trace, uint32_t id);
+
+double profiler_trace_seconds(const struct profiler_trace* trace, uint64_t cycles);
+
+/* Events the writer dropped to stay within its memory budget, 0 before version 6 */
+uint64_t profiler_trace_dropped_events(const struct profiler_trace* trace);
+
+/* Threads in the time index, 0 if the trace has no index */
+uint32_t profiler_trace_index_thread_count(const struct profiler_trace* trace);
+
+const struct profiler_trace_index_thread* profiler_trace_index_thread(const struct profiler_trace* trace, uint32_t slot);
+
+/* The entries of a thread, ordered by time */
+const struct profiler_trace_index_entry* profiler_trace_index_entries(const struct profiler_trace* trace, const struct profiler_trace_index_thread* thread);
+
+/* First entry of `thread` whose chunk ends at or after `cycles`, entry_count if there is none */
+uint32_t profiler_trace_index_find(const struct profiler_trace* trace, const struct profiler_trace_index_thread* thread, uint64_t cycles);
+
+/* The scopes open when the chunk of `entry` began, stack_depth of them, NULL if the index is damaged */
+const struct profiler_trace_open_scope* profiler_trace_index_stack(const struct profiler_trace* trace, const struct profiler_trace_index_entry* entry);
+
+static inline int profiler_trace_chunk_is_events(const struct profiler_trace_chunk* chunk)
+{
+	return chunk->type == PROFILER_TRACE_CHUNK_EVENTS || chunk->type == PROFILER_TRACE_CHUNK_PACKED || chunk->type == PROFILER_TRACE_CHUNK_RING;
+}
+
+static inline void profiler_trace_decoder_init(struct profiler_trace_decoder* decoder, uint32_t type, const void* data, uint64_t size, uint32_t count, uint64_t first_cycles)
+{
+	decoder->data = (const uint8_t*)data;
+	decoder->end = (const uint8_t*)data + size;
+	decoder->cycles = first_cycles;
+	decoder->remaining = count;
+	decoder->packed = type == PROFILER_TRACE_CHUNK_PACKED;
+	decoder->dictionary_count = 0;
+}
+
+static inline int profiler_trace_decoder_varint(struct profiler_trace_decoder* decoder, uint64_t* value)
+{
+	uint64_t result = 0;
+	int shift;
+
+	for (shift = 0; shift < 64 && decoder->data < decoder->end; shift += 7)
+	{
+		uint8_t byte = *decoder->data++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80))
+		{
+			*value = result;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* The next event, 0 after the last one or if the rest of the chunk is damaged */
+static inline int profiler_trace_decoder_next(struct profiler_trace_decoder* decoder, struct profiler_trace_event* event)
+{
+	if (!decoder->remaining || decoder->data >= decoder->end)
+		return 0;
+
+	if (!decoder->packed)
+	{
+		if ((uint64_t)(decoder->end - decoder->data) < PROFILER_TRACE_EVENT_RECORD_SIZE)
+			return 0;
+
+		memcpy(event, decoder->data, PROFILER_TRACE_EVENT_RECORD_SIZE);
+		event->flow = 0;
+		decoder->data += PROFILER_TRACE_EVENT_RECORD_SIZE;
+		decoder->remaining--;
+		return 1;
+	}
+
+	uint64_t tag, type, index, id, flow = 0;
+	if (!profiler_trace_decoder_varint(decoder, &tag))
+		return 0;
+
+	type = tag & 3;
+	if (type == 3 && !profiler_trace_decoder_varint(decoder, &type))
+		return 0;
+
+	if (!profiler_trace_decoder_varint(decoder, &index) || index > decoder->dictionary_count)
+		return 0;
+
+	if (index == decoder->dictionary_count)
+	{
+		if (index == PROFILER_TRACE_DICTIONARY_MAX || !profiler_trace_decoder_varint(decoder, &id))
+			return 0;
+
+		decoder->dictionary[decoder->dictionary_count++] = (uint32_t)id;
+	}
+
+	if ((type == PROFILER_TRACE_EVENT_ASYNC_BEGIN || type == PROFILER_TRACE_EVENT_ASYNC_END) && !profiler_trace_decoder_varint(decoder, &flow))
+		return 0;
+
+	uint64_t zigzag = tag >> 2;
+	decoder->cycles += (zigzag >> 1) ^ (0 - (zigzag & 1));
+
+	event->cycles = decoder->cycles;
+	event->id = decoder->dictionary[index];
+	event->type = (uint32_t)type;
+	event->flow = flow;
+	decoder->remaining--;
+	return 1;
+}
+
+/* Largest output of profiler_trace_lz_compress for `size` bytes */
+#define PROFILER_TRACE_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+static inline uint32_t profiler_trace_lz_read32(const uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint64_t profiler_trace_lz_read64(const uint8_t* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/* Number of equal bytes at the start of two 8 byte words that differ */
+static inline uint64_t profiler_trace_lz_common(uint64_t difference)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, difference);
+	return index >> 3;
+#else
+	return (uint64_t)__builtin_ctzll(difference) >> 3;
+#endif
+}
+
+static inline uint8_t* profiler_trace_lz_length(uint8_t* out, uint64_t length)
+{
+	for (; length >= 255; length -= 255)
+		*out++ = 255;
+
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+static inline uint8_t* profiler_trace_lz_sequence(uint8_t* out, const uint8_t* literals, uint64_t literal_count, uint32_t offset, uint64_t match_length)
+{
+	uint8_t* token = out++;
+	*token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4);
+
+	if (literal_count >= 15)
+		out = profiler_trace_lz_length(out, literal_count - 15);
+
+	memcpy(out, literals, (size_t)literal_count);
+	out += literal_count;
+
+	/* The last sequence is only literals */
+	if (!match_length)
+		return out;
+
+	out[0] = (uint8_t)offset;
+	out[1] = (uint8_t)(offset >> 8);
+	out += 2;
+
+	match_length -= 4;
+	*token |= (uint8_t)(match_length < 15 ? match_length : 15);
+
+	if (match_length >= 15)
+		out = profiler_trace_lz_length(out, match_length - 15);
+
+	return out;
+}
+
+/*
+*	Compress `size` bytes into `out`, which must hold PROFILER_TRACE_LZ_BOUND(size)
+*	bytes. `table` is scratch space of 1 << PROFILER_TRACE_LZ_HASH_BITS entries.
+*	Greedy, one hash probe per position, and positions are skipped faster the
+*	longer no match is found, so data that does not compress costs little.
+*/
+static inline uint64_t profiler_trace_lz_compress(const uint8_t* in, uint64_t size, uint8_t* out, uint32_t* table)
+{
+	const uint8_t* out_begin = out;
+	uint64_t anchor = 0;
+	uint64_t position = 1;
+
+	memset(table, 0, sizeof(uint32_t) << PROFILER_TRACE_LZ_HASH_BITS);
+
+	/* Matches end before the last bytes, so the compressor can read 4 bytes anywhere it looks */
+	while (size >= 12 && position + 4 <= size - 4)
+	{
+		uint32_t sequence = profiler_trace_lz_read32(in + position);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - PROFILER_TRACE_LZ_HASH_BITS);
+		uint64_t candidate = table[hash];
+		table[hash] = (uint32_t)position;
+
+		if (candidate && position - candidate <= 0xffff && profiler_trace_lz_read32(in + candidate) == sequence)
+		{
+			uint64_t length = 4;
+			while (position + length + 8 <= size)
+			{
+				uint64_t difference = profiler_trace_lz_read64(in + candidate + length) ^ profiler_trace_lz_read64(in + position + length);
+				if (difference)
+				{
+					length += profiler_trace_lz_common(difference);
+					break;
+				}
+
+				length += 8;
+			}
+
+			while (position + length + 8 > size && position + length < size && in[candidate + length] == in[position + length])
+				length++;
+
+			out = profiler_trace_lz_sequence(out, in + anchor, position - anchor, (uint32_t)(position - candidate), length);
+			position += length;
+			anchor = position;
+		}
+		else
+		{
+			position += 1 + ((position - anchor) >> 6);
+		}
+	}
+
+	out = profiler_trace_lz_sequence(out, in + anchor, size - anchor, 0, 0);
+	return (uint64_t)(out - out_begin);
+}
+
+static inline int profiler_trace_lz_read_length(const uint8_t** in, const uint8_t* end, uint64_t* length)
+{
+	uint8_t byte;
+
+	do
+	{
+		if (*in >= end)
+			return 0;
+
+		byte = *(*in)++;
+		*length += byte;
+	}
+	while (byte == 255);
+
+	return 1;
+}
+
+/* Decompress into exactly `out_size` bytes, returns 0 if the input is damaged */
+static inline int profiler_trace_lz_decompress(const uint8_t* in, uint64_t size, uint8_t* out, uint64_t out_size)
+{
+	const uint8_t* end = in + size;
+	uint8_t* out_begin = out;
+	uint8_t* out_end = out + out_size;
+
+	while (in < end)
+	{
+		uint8_t token = *in++;
+		uint64_t literal_count = token >> 4;
+
+		/* Short runs far from both ends are copied 16 bytes at a time, whatever their length */
+		if (literal_count < 15 && end - in >= 16 && out_end - out >= 16)
+		{
+			memcpy(out, in, 16);
+		}
+		else
+		{
+			if (literal_count == 15 && !profiler_trace_lz_read_length(&in, end, &literal_count))
+				return 0;
+
+			if (literal_count > (uint64_t)(end - in) || literal_count > (uint64_t)(out_end - out))
+				return 0;
+
+			memcpy(out, in, (size_t)literal_count);
+		}
+
+		in += literal_count;
+		out += literal_count;
+
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return 0;
+
+		uint64_t offset = (uint64_t)in[0] | (uint64_t)in[1] << 8;
+		uint64_t length = (token & 15) + 4;
+		in += 2;
+
+		if ((token & 15) == 15 && !profiler_trace_lz_read_length(&in, end, &length))
+			return 0;
+
+		if (!offset || offset > (uint64_t)(out - out_begin) || length > (uint64_t)(out_end - out))
+			return 0;
+
+		const uint8_t* match = out - offset;
+
+		if (offset >= 8 && length <= 24 && out_end - out >= 24)
+		{
+			/* Each 8 byte copy reads bytes before the ones it writes */
+			memcpy(out, match, 8);
+			memcpy(out + 8, match + 8, 8);
+			memcpy(out + 16, match + 16, 8);
+			out += length;
+		}
+		else if (offset >= length)
+		{
+			memcpy(out, match, (size_t)length);
+			out += length;
+		}
+		else
+		{
+			/* Overlapping, a run repeating the last `offset` bytes */
+			uint8_t* match_end = out + length;
+			while (out < match_end)
+				*out++ = *match++;
+		}
+	}
+
+	return out == out_end;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef PROFILER_TRACE_DEFINE
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int profiler_trace_open_memory(struct profiler_trace* trace, const void* data, uint64_t size)
+{
+	memset(trace, 0, sizeof(*trace));
+
+	const struct profiler_trace_header* header = (const struct profiler_trace_header*)data;
+
+	if (size < sizeof(struct profiler_trace_header) ||
+		memcmp(header->magic, PROFILER_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version < 1 ||
+		header->header_size < offsetof(struct profiler_trace_header, dropped_events) ||
+		header->chunk_header_size < sizeof(struct profiler_trace_chunk) ||
+		header->header_size > size)
+	{
+		return 0;
+	}
+
+	trace->data = (const uint8_t*)data;
+	trace->size = size;
+	trace->header = header;
+
+	const struct profiler_trace_chunk* names = header->names_offset ? profiler_trace_chunk_at(trace, header->names_offset) : NULL;
+	if (names && names->type == PROFILER_TRACE_CHUNK_NAMES && names->size >= sizeof(struct profiler_trace_names))
+	{
+		const struct profiler_trace_names* table = (const struct profiler_trace_names*)((const uint8_t*)names + header->chunk_header_size);
+
+		if (sizeof(struct profiler_trace_names) + (uint64_t)table->count * sizeof(struct profiler_trace_name) <= names->size)
+			trace->names = table;
+	}
+
+	/* Version 1 headers end before index_offset */
+	uint64_t index_offset = header->header_size >= offsetof(struct profiler_trace_header, index_offset) + sizeof(uint64_t) ? header->index_offset : 0;
+
+	const struct profiler_trace_chunk* index = index_offset ? profiler_trace_chunk_at(trace, index_offset) : NULL;
+	if (index && index->type == PROFILER_TRACE_CHUNK_INDEX && index->size >= sizeof(struct profiler_trace_index))
+	{
+		const struct profiler_trace_index* table = (const struct profiler_trace_index*)((const uint8_t*)index + header->chunk_header_size);
+		const struct profiler_trace_index_thread* threads = (const struct profiler_trace_index_thread*)(table + 1);
+		int valid = sizeof(struct profiler_trace_index) + (uint64_t)table->thread_count * sizeof(struct profiler_trace_index_thread) <= index->size &&
+					table->stacks_offset + (uint64_t)table->stack_count * sizeof(struct profiler_trace_open_scope) <= index->size;
+
+		uint32_t i;
+		for (i = 0; valid && i < table->thread_count; i++)
+			valid = threads[i].entries_offset + (uint64_t)threads[i].entry_count * sizeof(struct profiler_trace_index_entry) <= index->size;
+
+		if (valid)
+			trace->index = table;
+	}
+
+	return 1;
+}
+
+#ifdef _WIN32
+int profiler_trace_open(struct profiler_trace* trace, const char* filename)
+{
+	memset(trace, 0, sizeof(*trace));
+
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	const void* data = NULL;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mapping)
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	if (!data || !profiler_trace_open_memory(trace, data, (uint64_t)size.QuadPart))
+	{
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+
+		CloseHandle(file);
+		return 0;
+	}
+
+	trace->mapping = mapping;
+	trace->file = file;
+	return 1;
+}
+
+void profiler_trace_close(struct profiler_trace* trace)
+{
+	if (trace->mapping)
+	{
+		UnmapViewOfFile(trace->data);
+		CloseHandle((HANDLE)trace->mapping);
+		CloseHandle((HANDLE)trace->file);
+	}
+
+	memset(trace, 0, sizeof(*trace));
+}
+#else
+int profiler_trace_open(struct profiler_trace* trace, const char* filename)
+{
+	memset(trace, 0, sizeof(*trace));
+
+	int file = open(filename, O_RDONLY);
+	if (file < 0)
+		return 0;
+
+	struct stat status;
+	void* data = MAP_FAILED;
+
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+		data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+	close(file);
+
+	if (data == MAP_FAILED)
+		return 0;
+
+	if (!profiler_trace_open_memory(trace, data, (uint64_t)status.st_size))
+	{
+		munmap(data, (size_t)status.st_size);
+		return 0;
+	}
+
+	trace->mapping = data;
+	return 1;
+}
+
+void profiler_trace_close(struct profiler_trace* trace)
+{
+	if (trace->mapping)
+		munmap(trace->mapping, (size_t)trace->size);
+
+	memset(trace, 0, sizeof(*trace));
+}
+#endif
+
+uint64_t profiler_trace_first_chunk(const struct profiler_trace* trace)
+{
+	return (trace->header->header_size + 7) & ~(uint64_t)7;
+}
+
+/* Chunk headers before version 4 end before codec and raw_size */
+static uint32_t profiler_trace_chunk_codec(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk)
+{
+	if (trace->header->chunk_header_size < offsetof(struct profiler_trace_chunk, raw_size) + sizeof(uint32_t))
+		return PROFILER_TRACE_CODEC_NONE;
+
+	return chunk->codec;
+}
+
+static uint64_t profiler_trace_chunk_raw_size(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk)
+{
+	return profiler_trace_chunk_codec(trace, chunk) == PROFILER_TRACE_CODEC_NONE ? chunk->size : chunk->raw_size;
+}
+
+const struct profiler_trace_chunk* profiler_trace_chunk_at(const struct profiler_trace* trace, uint64_t offset)
+{
+	if (offset + trace->header->chunk_header_size > trace->size)
+		return NULL;
+
+	const struct profiler_trace_chunk* chunk = (const struct profiler_trace_chunk*)(trace->data + offset);
+
+	/* A zero type is the unwritten end of a trace that was not closed */
+	if (chunk->type == 0 || chunk->size > trace->size - offset - trace->header->chunk_header_size)
+		return NULL;
+
+	if (chunk->type == PROFILER_TRACE_CHUNK_EVENTS && (uint64_t)chunk->count * PROFILER_TRACE_EVENT_RECORD_SIZE > chunk->size)
+		return NULL;
+
+	/* A packed event takes at least two bytes */
+	if (chunk->type == PROFILER_TRACE_CHUNK_PACKED && (uint64_t)chunk->count * 2 > profiler_trace_chunk_raw_size(trace, chunk))
+		return NULL;
+
+	if (chunk->type == PROFILER_TRACE_CHUNK_RING && chunk->size < sizeof(struct profiler_trace_ring_block))
+		return NULL;
+
+	return chunk;
+}
+
+uint64_t profiler_trace_chunk_next(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk, uint64_t offset)
+{
+	return offset + ((trace->header->chunk_header_size + chunk->size + 7) & ~(uint64_t)7);
+}
+
+const struct profiler_trace_event* profiler_trace_chunk_events(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk)
+{
+	return (const struct profiler_trace_event*)((const uint8_t*)chunk + trace->header->chunk_header_size);
+}
+
+void profiler_trace_decoder_create(struct profiler_trace_decoder* decoder)
+{
+	profiler_trace_decoder_init(decoder, PROFILER_TRACE_CHUNK_PACKED, NULL, 0, 0, 0);
+	decoder->buffer = NULL;
+	decoder->buffer_size = 0;
+}
+
+void profiler_trace_decoder_free(struct profiler_trace_decoder* decoder)
+{
+	free(decoder->buffer);
+	decoder->buffer = NULL;
+	decoder->buffer_size = 0;
+}
+
+int profiler_trace_chunk_decoder(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk, struct profiler_trace_decoder* decoder)
+{
+	const uint8_t* payload = (const uint8_t*)chunk + trace->header->chunk_header_size;
+	uint32_t codec = profiler_trace_chunk_codec(trace, chunk);
+
+	profiler_trace_decoder_init(decoder, chunk->type, NULL, 0, 0, 0);
+
+	if (chunk->type == PROFILER_TRACE_CHUNK_RING)
+	{
+		const struct profiler_trace_ring_block* block = (const struct profiler_trace_ring_block*)payload;
+		uint64_t size = block->size < chunk->size - sizeof(*block) ? block->size : chunk->size - sizeof(*block);
+
+		profiler_trace_decoder_init(decoder, PROFILER_TRACE_CHUNK_PACKED, block + 1, size, chunk->count ? chunk->count : UINT32_MAX, chunk->first_cycles);
+		return 1;
+	}
+
+	if (codec == PROFILER_TRACE_CODEC_NONE)
+	{
+		profiler_trace_decoder_init(decoder, chunk->type, payload, chunk->size, chunk->count, chunk->first_cycles);
+		return 1;
+	}
+
+	if (codec != PROFILER_TRACE_CODEC_LZ)
+		return 0;
+
+	if (decoder->buffer_size < chunk->raw_size)
+	{
+		uint8_t* buffer = (uint8_t*)realloc(decoder->buffer, chunk->raw_size);
+		if (!buffer)
+			return 0;
+
+		decoder->buffer = buffer;
+		decoder->buffer_size = chunk->raw_size;
+	}
+
+	if (!profiler_trace_lz_decompress(payload, chunk->size, decoder->buffer, chunk->raw_size))
+		return 0;
+
+	profiler_trace_decoder_init(decoder, chunk->type, decoder->buffer, chunk->raw_size, chunk->count, chunk->first_cycles);
+	return 1;
+}
+
+uint32_t profiler_trace_name_count(const struct profiler_trace* trace)
+{
+	return trace->names ? trace->names->count : 0;
+}
+
+const char* profiler_trace_name(const struct profiler_trace* trace, uint32_t id)
+{
+	if (!trace->names || id >= trace->names->count)
+		return NULL;
+
+	const struct profiler_trace_chunk* chunk = (const struct profiler_trace_chunk*)((const uint8_t*)trace->names - trace->header->chunk_header_size);
+	const struct profiler_trace_name* records = (const struct profiler_trace_name*)(trace->names + 1);
+	uint64_t strings_offset = sizeof(struct profiler_trace_names) + (uint64_t)trace->names->count * sizeof(struct profiler_trace_name);
+
+	if (records[id].name_offset == UINT32_MAX || strings_offset + records[id].name_offset >= chunk->size)
+		return NULL;
+
+	return (const char*)trace->names + strings_offset + records[id].name_offset;
+}
+
+int32_t profiler_trace_parent(const struct profiler_trace* trace, uint32_t id)
+{
+	if (!trace->names || id >= trace->names->count)
+		return -1;
+
+	const struct profiler_trace_name* records = (const struct profiler_trace_name*)(trace->names + 1);
+	return records[id].parent;
+}
+
+double profiler_trace_seconds(const struct profiler_trace* trace, uint64_t cycles)
+{
+	if (!trace->header->cycles_per_second)
+		return 0.0;
+
+	return (double)cycles / (double)trace->header->cycles_per_second;
+}
+
+uint64_t profiler_trace_dropped_events(const struct profiler_trace* trace)
+{
+	if (trace->header->header_size < offsetof(struct profiler_trace_header, dropped_events) + sizeof(uint64_t))
+		return 0;
+
+	return trace->header->dropped_events;
+}
+
+uint32_t profiler_trace_index_thread_count(const struct profiler_trace* trace)
+{
+	return trace->index ? trace->index->thread_count : 0;
+}
+
+const struct profiler_trace_index_thread* profiler_trace_index_thread(const struct profiler_trace* trace, uint32_t slot)
+{
+	return (const struct profiler_trace_index_thread*)(trace->index + 1) + slot;
+}
+
+const struct profiler_trace_index_entry* profiler_trace_index_entries(const struct profiler_trace* trace, const struct profiler_trace_index_thread* thread)
+{
+	return (const struct profiler_trace_index_entry*)((const uint8_t*)trace->index + thread->entries_offset);
+}
+
+uint32_t profiler_trace_index_find(const struct profiler_trace* trace, const struct profiler_trace_index_thread* thread, uint64_t cycles)
+{
+	const struct profiler_trace_index_entry* entries = profiler_trace_index_entries(trace, thread);
+	uint32_t low = 0;
+	uint32_t high = thread->entry_count;
+
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+
+		if (entries[middle].last_cycles < cycles)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+const struct profiler_trace_open_scope* profiler_trace_index_stack(const struct profiler_trace* trace, const struct profiler_trace_index_entry* entry)
+{
+	if ((uint64_t)entry->stack_index + entry->stack_depth > trace->index->stack_count)
+		return NULL;
+
+	return (const struct profiler_trace_open_scope*)((const uint8_t*)trace->index + trace->index->stacks_offset) + entry->stack_index;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROFILER_TRACE_DEFINE
+
+#endif //_PROFILER_TRACE_
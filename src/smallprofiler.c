@@ -0,0 +1,8 @@
+/*
+*	Implementation of smallprofiler for the compiled library build
+*	(CMake option SMALLPROFILER_BUILD_LIBRARY). Everything else is in
+*	smallprofiler.h, this file only instantiates it.
+*/
+
+#define PROFILER_DEFINE
+#include "smallprofiler.h"
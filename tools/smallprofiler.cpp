@@ -0,0 +1,1194 @@
+/*
+*	smallprofiler
+*
+*	Merges, filters and converts snapshots written with profiler_dump_snapshot
+*	and traces written with profiler_trace_begin/profiler_trace_end:
+*
+*		smallprofiler [options] input.spsnap|input.sptrace...
+*
+*		--format F			output format, one of
+*								text		the table printed by profiler_dump_console
+*								json		the call tree as nested objects
+*								folded		"a;b;c self_us" lines for flamegraph.pl
+*								chrome		Chrome trace event JSON (chrome://tracing, Perfetto)
+*								pprof		uncompressed profile.proto for `go tool pprof`
+*								snapshot	a new binary snapshot
+*							default text
+*		--output, -o file	write to file instead of stdout
+*		--root path			keep only the subtree at "outer;inner", it becomes the root
+*		--max-depth N		drop scopes nested deeper than N levels below the root
+*		--min-percent X		drop scopes (and their subtrees) below X% of the total time
+*		--jobs N			number of threads that load inputs and aggregate traces,
+*							default all cores
+*		--window S:E		only the part of every trace from S to E seconds after
+*							the trace began, either side may be left out
+*
+*	Inputs are merged by call path: cycles and calls are summed and histograms
+*	added bucket by bucket. Every input is converted with its own calibration,
+*	the merged profile uses the calibration of the first input and histogram
+*	buckets of the other inputs are shifted to it. Migrations (calls that ended
+*	on another CPU, recorded with PROFILER_RDTSCP) are summed too, the text
+*	table flags paths where TOOL_MIGRATIONS_PERCENT percent of the calls or
+*	more migrated and JSON has them where there are any. The time coroutine
+*	scopes spent suspended is summed the same way and shown after the cycles,
+*	and so is the time scopes were blocked in profiler_wait_begin/end. The I/O
+*	calls of a scope, their bytes and seconds, and its syncs are summed too and
+*	shown as calls, bytes per call and throughput.
+*
+*	Snapshots are memory mapped and split over --jobs threads, each building
+*	its own merged tree, and the partial trees are merged at the end. Traces
+*	are aggregated one at a time with all --jobs threads working on the chunks
+*	of the trace (see smallprofiler_aggregate.h), which also gives every scope
+*	a histogram. Output is streamed, no format is built in memory before it is
+*	written.
+*
+*	Aggregated profiles have no timeline, so the Chrome trace lays every scope
+*	out as one span per call path, children back to back from the start of
+*	their parent, which shows up as a flame chart. When every input is a trace
+*	the Chrome trace is the real timeline instead, one span per call on the
+*	thread that made it (--max-depth applies, --root and --min-percent do not).
+*	Async scopes are async spans there, with a flow arrow from the thread that
+*	began them to the thread that ended them.
+*	pprof gets one sample per call path with the calls and self time of that
+*	path.
+*
+*	With --window, traces are decoded through their time index, from the
+*	first chunk that reaches the window to the first chunk after it. Calls
+*	that cross the window edges are clipped to the window.
+*/
+
+#define PROFILER_SNAPSHOT_DEFINE
+#include "smallprofiler_snapshot.h"
+#define PROFILER_TRACE_DEFINE
+#include "smallprofiler_trace.h"
+#include "smallprofiler_aggregate.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TOOL_OUTPUT_BUFFER_SIZE (1 << 20)
+#define TOOL_MIGRATIONS_PERCENT 1
+
+struct tool_node
+{
+	std::string name;
+	uint32_t parent;
+	uint32_t depth;
+	double seconds;
+	uint64_t calls;
+	uint64_t migrations;
+	double suspended_seconds;
+	double blocked_seconds;
+	uint64_t io_calls;
+	uint64_t io_bytes;
+	double io_seconds;
+	uint64_t syncs;
+	double sync_seconds;
+	std::vector<uint64_t> histogram;
+};
+
+/* Node 0 is an unnamed root above the real roots, every other node has a lower index than its children */
+struct tool_tree
+{
+	std::vector<tool_node> nodes;
+	std::unordered_map<std::string, uint32_t> index;
+	uint64_t cycles_per_second;
+	uint32_t histogram_buckets;
+	uint32_t thread_count;
+
+	/* What the profiled programs dropped to stay within their budget */
+	uint64_t dropped_calls;
+	uint64_t dropped_threads;
+	uint64_t dropped_events;
+};
+
+enum tool_format
+{
+	TOOL_FORMAT_TEXT,
+	TOOL_FORMAT_JSON,
+	TOOL_FORMAT_FOLDED,
+	TOOL_FORMAT_CHROME,
+	TOOL_FORMAT_PPROF,
+	TOOL_FORMAT_SNAPSHOT,
+};
+
+static void tool_tree_init(tool_tree& tree, uint64_t cycles_per_second, uint32_t histogram_buckets)
+{
+	tree.nodes.assign(1, tool_node());
+	tree.nodes[0].parent = 0;
+	tree.nodes[0].depth = 0;
+	tree.nodes[0].seconds = 0.0;
+	tree.nodes[0].calls = 0;
+	tree.nodes[0].migrations = 0;
+	tree.nodes[0].suspended_seconds = 0.0;
+	tree.nodes[0].blocked_seconds = 0.0;
+	tree.nodes[0].io_calls = 0;
+	tree.nodes[0].io_bytes = 0;
+	tree.nodes[0].io_seconds = 0.0;
+	tree.nodes[0].syncs = 0;
+	tree.nodes[0].sync_seconds = 0.0;
+	tree.index.clear();
+	tree.cycles_per_second = cycles_per_second;
+	tree.histogram_buckets = histogram_buckets;
+	tree.thread_count = 0;
+	tree.dropped_calls = 0;
+	tree.dropped_threads = 0;
+	tree.dropped_events = 0;
+}
+
+/* Child `name` of `parent`, created if it doesn't exist yet */
+static uint32_t tool_tree_child(tool_tree& tree, uint32_t parent, const std::string& name)
+{
+	std::string key((const char*)&parent, sizeof(parent));
+	key += name;
+
+	std::unordered_map<std::string, uint32_t>::iterator it = tree.index.find(key);
+	if (it != tree.index.end())
+		return it->second;
+
+	uint32_t child = (uint32_t)tree.nodes.size();
+	tree.index.emplace(key, child);
+
+	tool_node node;
+	node.name = name;
+	node.parent = parent;
+	node.depth = parent ? tree.nodes[parent].depth + 1 : 0;
+	node.seconds = 0.0;
+	node.calls = 0;
+	node.migrations = 0;
+	node.suspended_seconds = 0.0;
+	node.blocked_seconds = 0.0;
+	node.io_calls = 0;
+	node.io_bytes = 0;
+	node.io_seconds = 0.0;
+	node.syncs = 0;
+	node.sync_seconds = 0.0;
+	tree.nodes.push_back(node);
+
+	return child;
+}
+
+/* Add `histogram`, recorded with a clock of `cycles_per_second`, to a node of the tree */
+static void tool_histogram_add(tool_tree& tree, tool_node& node, const uint64_t* histogram, uint32_t buckets, uint64_t cycles_per_second)
+{
+	if (!tree.histogram_buckets)
+		return;
+
+	if (node.histogram.empty())
+		node.histogram.assign(tree.histogram_buckets, 0);
+
+	int shift = (int)lround(log2((double)tree.cycles_per_second / (double)cycles_per_second));
+
+	uint32_t bucket;
+	for (bucket = 0; bucket < buckets; bucket++)
+	{
+		if (!histogram[bucket])
+			continue;
+
+		int target = std::min(std::max((int)bucket + shift, 0), (int)tree.histogram_buckets - 1);
+		node.histogram[target] += histogram[bucket];
+	}
+}
+
+static void tool_tree_add_snapshot(tool_tree& tree, const struct profiler_snapshot* snapshot)
+{
+	uint32_t node_count = profiler_snapshot_node_count(snapshot);
+	std::vector<uint32_t> mapped(node_count);
+
+	uint32_t i;
+	for (i = 0; i < node_count; i++)
+	{
+		struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, i);
+		uint32_t parent = node.parent >= 0 ? mapped[node.parent] : 0;
+
+		mapped[i] = tool_tree_child(tree, parent, profiler_snapshot_name(snapshot, i));
+
+		tool_node& target = tree.nodes[mapped[i]];
+		target.seconds += profiler_snapshot_seconds(snapshot, node.total_cycles);
+		target.calls += node.calls;
+		target.migrations += node.migrations;
+		target.suspended_seconds += profiler_snapshot_seconds(snapshot, node.suspended_cycles);
+		target.blocked_seconds += profiler_snapshot_seconds(snapshot, node.blocked_cycles);
+		target.io_calls += node.io_calls;
+		target.io_bytes += node.io_bytes;
+		target.io_seconds += profiler_snapshot_seconds(snapshot, node.io_cycles);
+		target.syncs += node.syncs;
+		target.sync_seconds += profiler_snapshot_seconds(snapshot, node.sync_cycles);
+
+		const uint64_t* histogram = profiler_snapshot_histogram(snapshot, i);
+		if (histogram)
+			tool_histogram_add(tree, target, histogram, snapshot->header->histogram_buckets, snapshot->header->cycles_per_second);
+	}
+
+	tree.thread_count += snapshot->header->thread_count;
+
+	struct profiler_snapshot_header header = profiler_snapshot_get_header(snapshot);
+	tree.dropped_calls += header.dropped_calls;
+	tree.dropped_threads += header.dropped_threads;
+	tree.dropped_events += header.dropped_events;
+}
+
+static void tool_tree_add_trace(tool_tree& tree, const struct profiler_trace* trace, const aggregate_result& result)
+{
+	std::vector<uint32_t> mapped(std::max<size_t>(result.scopes.size(), profiler_trace_name_count(trace)), UINT32_MAX);
+	std::vector<uint32_t> chain;
+
+	uint32_t id;
+	for (id = 0; id < result.scopes.size(); id++)
+	{
+		const aggregate_scope& scope = result.scopes[id];
+		if (!scope.calls)
+			continue;
+
+		/* Map the ancestors that are not mapped yet, outermost first */
+		chain.clear();
+
+		int32_t ancestor;
+		for (ancestor = (int32_t)id; ancestor >= 0 && (size_t)ancestor < mapped.size() && mapped[ancestor] == UINT32_MAX; ancestor = profiler_trace_parent(trace, (uint32_t)ancestor))
+			chain.push_back((uint32_t)ancestor);
+
+		uint32_t parent = ancestor >= 0 && (size_t)ancestor < mapped.size() ? mapped[ancestor] : 0;
+
+		for (std::vector<uint32_t>::reverse_iterator it = chain.rbegin(); it != chain.rend(); ++it)
+		{
+			const char* name = profiler_trace_name(trace, *it);
+			parent = mapped[*it] = tool_tree_child(tree, parent, name ? name : "scope_" + std::to_string(*it));
+		}
+
+		tool_node& target = tree.nodes[mapped[id]];
+		target.seconds += profiler_trace_seconds(trace, scope.total_cycles);
+		target.calls += scope.calls;
+		tool_histogram_add(tree, target, scope.histogram, AGGREGATE_HISTOGRAM_BUCKETS, trace->header->cycles_per_second);
+	}
+
+	tree.thread_count += trace->header->thread_count;
+	tree.dropped_events += profiler_trace_dropped_events(trace);
+}
+
+static void tool_tree_merge(tool_tree& tree, const tool_tree& other)
+{
+	std::vector<uint32_t> mapped(other.nodes.size(), 0);
+
+	size_t i;
+	for (i = 1; i < other.nodes.size(); i++)
+	{
+		const tool_node& node = other.nodes[i];
+		mapped[i] = tool_tree_child(tree, mapped[node.parent], node.name);
+
+		tool_node& target = tree.nodes[mapped[i]];
+		target.seconds += node.seconds;
+		target.calls += node.calls;
+		target.migrations += node.migrations;
+		target.suspended_seconds += node.suspended_seconds;
+		target.blocked_seconds += node.blocked_seconds;
+		target.io_calls += node.io_calls;
+		target.io_bytes += node.io_bytes;
+		target.io_seconds += node.io_seconds;
+		target.syncs += node.syncs;
+		target.sync_seconds += node.sync_seconds;
+
+		if (!node.histogram.empty())
+			tool_histogram_add(tree, target, node.histogram.data(), other.histogram_buckets, other.cycles_per_second);
+	}
+
+	tree.thread_count += other.thread_count;
+	tree.dropped_calls += other.dropped_calls;
+	tree.dropped_threads += other.dropped_threads;
+	tree.dropped_events += other.dropped_events;
+}
+
+/* Depth-first order with siblings sorted by time, largest first, without recursion */
+static std::vector<uint32_t> tool_tree_order(const tool_tree& tree)
+{
+	std::vector<uint32_t> child_begin(tree.nodes.size() + 1, 0);
+	std::vector<uint32_t> children(tree.nodes.size());
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+		child_begin[tree.nodes[i].parent + 1]++;
+
+	for (i = 0; i < tree.nodes.size(); i++)
+		child_begin[i + 1] += child_begin[i];
+
+	std::vector<uint32_t> fill(child_begin.begin(), child_begin.end() - 1);
+	for (i = 1; i < tree.nodes.size(); i++)
+		children[fill[tree.nodes[i].parent]++] = (uint32_t)i;
+
+	for (i = 0; i < tree.nodes.size(); i++)
+	{
+		std::sort(children.begin() + child_begin[i], children.begin() + child_begin[i + 1], [&tree](uint32_t a, uint32_t b)
+		{
+			if (tree.nodes[a].seconds != tree.nodes[b].seconds)
+				return tree.nodes[a].seconds > tree.nodes[b].seconds;
+
+			return tree.nodes[a].name < tree.nodes[b].name;
+		});
+	}
+
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> stack;
+	order.reserve(tree.nodes.size());
+	stack.push_back(0);
+
+	while (!stack.empty())
+	{
+		uint32_t node = stack.back();
+		stack.pop_back();
+		order.push_back(node);
+
+		uint32_t j;
+		for (j = child_begin[node + 1]; j > child_begin[node]; j--)
+			stack.push_back(children[j - 1]);
+	}
+
+	return order;
+}
+
+/*
+*	The tree restricted to the subtree at `root_path` (empty for all of it), at
+*	most `max_depth` levels deep and without scopes under `min_percent` of the
+*	total. The result is in depth-first order: node i + 1 is the first child of
+*	node i if it has any.
+*/
+static bool tool_tree_filter(const tool_tree& tree, tool_tree& result, const char* root_path, int max_depth, double min_percent)
+{
+	uint32_t root = 0;
+
+	if (root_path)
+	{
+		std::string path = root_path;
+		size_t begin = 0;
+
+		while (begin <= path.size())
+		{
+			size_t end = path.find(';', begin);
+			if (end == std::string::npos)
+				end = path.size();
+
+			std::string key((const char*)&root, sizeof(root));
+			key += path.substr(begin, end - begin);
+
+			std::unordered_map<std::string, uint32_t>::const_iterator it = tree.index.find(key);
+			if (it == tree.index.end())
+				return false;
+
+			root = it->second;
+			begin = end + 1;
+		}
+	}
+
+	double total = 0.0;
+
+	if (root)
+	{
+		total = tree.nodes[root].seconds;
+	}
+	else
+	{
+		size_t i;
+		for (i = 1; i < tree.nodes.size(); i++)
+		{
+			if (tree.nodes[i].parent == 0)
+				total += tree.nodes[i].seconds;
+		}
+	}
+
+	tool_tree_init(result, tree.cycles_per_second, tree.histogram_buckets);
+	result.thread_count = tree.thread_count;
+	result.dropped_calls = tree.dropped_calls;
+	result.dropped_threads = tree.dropped_threads;
+	result.dropped_events = tree.dropped_events;
+
+	/* Outside of the subtree nothing is mapped, so the walk only copies the subtree */
+	std::vector<uint32_t> mapped(tree.nodes.size(), UINT32_MAX);
+	mapped[0] = root ? UINT32_MAX : 0;
+
+	for (uint32_t id : tool_tree_order(tree))
+	{
+		const tool_node& node = tree.nodes[id];
+		uint32_t parent;
+
+		if (id == 0)
+			continue;
+		else if (id == root)
+			parent = 0;
+		else if (mapped[node.parent] != UINT32_MAX)
+			parent = mapped[node.parent];
+		else
+			continue;
+
+		uint32_t depth = parent ? result.nodes[parent].depth + 1 : 0;
+
+		if (max_depth >= 0 && (int)depth > max_depth)
+			continue;
+
+		if (total > 0.0 && 100.0 * node.seconds / total < min_percent)
+			continue;
+
+		mapped[id] = tool_tree_child(result, parent, node.name);
+		result.nodes[mapped[id]].seconds = node.seconds;
+		result.nodes[mapped[id]].calls = node.calls;
+		result.nodes[mapped[id]].migrations = node.migrations;
+		result.nodes[mapped[id]].suspended_seconds = node.suspended_seconds;
+		result.nodes[mapped[id]].blocked_seconds = node.blocked_seconds;
+		result.nodes[mapped[id]].io_calls = node.io_calls;
+		result.nodes[mapped[id]].io_bytes = node.io_bytes;
+		result.nodes[mapped[id]].io_seconds = node.io_seconds;
+		result.nodes[mapped[id]].syncs = node.syncs;
+		result.nodes[mapped[id]].sync_seconds = node.sync_seconds;
+		result.nodes[mapped[id]].histogram = node.histogram;
+	}
+
+	return true;
+}
+
+static double tool_self_seconds(const tool_tree& tree, const std::vector<double>& children_seconds, uint32_t id)
+{
+	return std::max(tree.nodes[id].seconds - children_seconds[id], 0.0);
+}
+
+static std::vector<double> tool_children_seconds(const tool_tree& tree)
+{
+	std::vector<double> seconds(tree.nodes.size(), 0.0);
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+		seconds[tree.nodes[i].parent] += tree.nodes[i].seconds;
+
+	return seconds;
+}
+
+static void tool_json_string(FILE* file, const std::string& string)
+{
+	fputc('"', file);
+
+	for (unsigned char c : string)
+	{
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+
+	fputc('"', file);
+}
+
+static void tool_write_text(FILE* file, const tool_tree& tree)
+{
+	fprintf(file, "Dropped: %" PRIu64 " calls of scopes beyond PROFILER_NODES_MAX, %" PRIu64 " threads, %" PRIu64 " trace events\n",
+			tree.dropped_calls, tree.dropped_threads, tree.dropped_events);
+
+	fprintf(file, "%-40s%s : %s : %-8s : %s\n", "Name", "%-total", "%-local", "Seconds", "CPU Cycles");
+	fprintf(file, "----------------------------------------------------------------------------------\n");
+
+	std::vector<double> root_seconds(tree.nodes.size(), 0.0);
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		const tool_node& node = tree.nodes[i];
+		root_seconds[i] = node.parent ? root_seconds[node.parent] : node.seconds;
+
+		double seconds_parent = node.parent ? tree.nodes[node.parent].seconds : node.seconds;
+		std::string name(std::min<size_t>(node.depth * 4, 255), ' ');
+		name += node.name;
+
+		fprintf(file, "%-40s%-7.2f : %-7.2f : %f : %" PRIu64,
+				name.c_str(),
+				root_seconds[i] > 0.0 ? 100.0 * node.seconds / root_seconds[i] : 0.0,
+				seconds_parent > 0.0 ? 100.0 * node.seconds / seconds_parent : 0.0,
+				node.seconds,
+				(uint64_t)(node.seconds * (double)tree.cycles_per_second));
+
+		if (node.suspended_seconds > 0.0)
+			fprintf(file, " : suspended %f", node.suspended_seconds);
+
+		if (node.blocked_seconds > 0.0)
+			fprintf(file, " : blocked %f", node.blocked_seconds);
+
+		if (node.io_calls)
+		{
+			fprintf(file, " : io calls %" PRIu64 " : io bytes/call %.0f", node.io_calls, (double)node.io_bytes / (double)node.io_calls);
+			if (node.io_seconds > 0.0)
+				fprintf(file, " : io %.1f MB/s", (double)node.io_bytes / node.io_seconds / 1e6);
+		}
+
+		if (node.syncs)
+			fprintf(file, " : syncs %" PRIu64 " : sync %f", node.syncs, node.sync_seconds / (double)node.syncs);
+
+		if (node.migrations && node.migrations * 100 >= node.calls * TOOL_MIGRATIONS_PERCENT)
+			fprintf(file, " : migrated %.1f%%", 100.0 * (double)node.migrations / (double)node.calls);
+
+		fputc('\n', file);
+	}
+}
+
+static void tool_write_json(FILE* file, const tool_tree& tree)
+{
+	std::vector<double> children_seconds = tool_children_seconds(tree);
+
+	fprintf(file, "{\"cycles_per_second\":%" PRIu64 ",\"threads\":%u,\"histogram_buckets\":%u,"
+			"\"dropped_calls\":%" PRIu64 ",\"dropped_threads\":%" PRIu64 ",\"dropped_events\":%" PRIu64 ",\"children\":[",
+			tree.cycles_per_second, tree.thread_count, tree.histogram_buckets,
+			tree.dropped_calls, tree.dropped_threads, tree.dropped_events);
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		const tool_node& node = tree.nodes[i];
+
+		if (i > 1 && tree.nodes[i - 1].depth >= node.depth)
+			fputc(',', file);
+
+		fputs("{\"name\":", file);
+		tool_json_string(file, node.name);
+		fprintf(file, ",\"seconds\":%.9f,\"self_seconds\":%.9f,\"calls\":%" PRIu64,
+				node.seconds, tool_self_seconds(tree, children_seconds, (uint32_t)i), node.calls);
+
+		if (node.suspended_seconds > 0.0)
+			fprintf(file, ",\"suspended_seconds\":%.9f", node.suspended_seconds);
+
+		if (node.blocked_seconds > 0.0)
+			fprintf(file, ",\"blocked_seconds\":%.9f", node.blocked_seconds);
+
+		if (node.io_calls)
+			fprintf(file, ",\"io_calls\":%" PRIu64 ",\"io_bytes\":%" PRIu64 ",\"io_seconds\":%.9f", node.io_calls, node.io_bytes, node.io_seconds);
+
+		if (node.syncs)
+			fprintf(file, ",\"syncs\":%" PRIu64 ",\"sync_seconds\":%.9f", node.syncs, node.sync_seconds);
+
+		if (node.migrations)
+			fprintf(file, ",\"migrations\":%" PRIu64, node.migrations);
+
+		if (!node.histogram.empty())
+		{
+			size_t used = node.histogram.size();
+			while (used > 0 && node.histogram[used - 1] == 0)
+				used--;
+
+			fputs(",\"histogram\":[", file);
+
+			size_t bucket;
+			for (bucket = 0; bucket < used; bucket++)
+				fprintf(file, bucket ? ",%" PRIu64 : "%" PRIu64, node.histogram[bucket]);
+
+			fputc(']', file);
+		}
+
+		fputs(",\"children\":[", file);
+
+		/* Close this node and every parent whose last child this is */
+		uint32_t closes = 0;
+		if (i + 1 == tree.nodes.size())
+			closes = node.depth + 1;
+		else if (tree.nodes[i + 1].depth <= node.depth)
+			closes = node.depth - tree.nodes[i + 1].depth + 1;
+
+		for (; closes > 0; closes--)
+			fputs("]}", file);
+	}
+
+	fputs("]}\n", file);
+}
+
+static void tool_write_folded(FILE* file, const tool_tree& tree)
+{
+	std::vector<double> children_seconds = tool_children_seconds(tree);
+	std::vector<std::string> prefix;
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		const tool_node& node = tree.nodes[i];
+
+		prefix.resize(node.depth + 1);
+		prefix[node.depth] = node.depth ? prefix[node.depth - 1] + ";" + node.name : node.name;
+
+		double self_us = tool_self_seconds(tree, children_seconds, (uint32_t)i) * 1e6;
+		if (self_us >= 0.5)
+			fprintf(file, "%s %.0f\n", prefix[node.depth].c_str(), self_us);
+	}
+}
+
+static void tool_write_chrome(FILE* file, const tool_tree& tree)
+{
+	/* Start of every node and the end of its last child so far, in microseconds */
+	std::vector<double> start(tree.nodes.size(), 0.0);
+	std::vector<double> cursor(tree.nodes.size(), 0.0);
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+	fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"smallprofiler\"}}", file);
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		const tool_node& node = tree.nodes[i];
+		double duration = node.seconds * 1e6;
+
+		start[i] = cursor[node.parent];
+		cursor[i] = start[i];
+		cursor[node.parent] += duration;
+
+		fputs(",\n{\"name\":", file);
+		tool_json_string(file, node.name);
+		fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"calls\":%" PRIu64 "}}",
+				start[i], duration, node.calls);
+	}
+
+	fputs("\n]}\n", file);
+}
+
+/* Timestamp `seconds` after the trace began, an infinite time never comes */
+static uint64_t tool_window_cycles(const struct profiler_trace* trace, double seconds)
+{
+	if (seconds == INFINITY)
+		return UINT64_MAX;
+
+	return trace->header->start_cycles + (uint64_t)(std::max(seconds, 0.0) * (double)trace->header->cycles_per_second);
+}
+
+/* Every call in the window as a span on its thread, every trace is its own process */
+static void tool_write_chrome_timeline(FILE* file, const std::vector<struct profiler_trace>& traces, const std::vector<const char*>& names,
+									   double window_begin, double window_end, int max_depth)
+{
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+
+	size_t t;
+	for (t = 0; t < traces.size(); t++)
+	{
+		const struct profiler_trace* trace = &traces[t];
+		uint64_t begin = tool_window_cycles(trace, window_begin);
+		uint64_t end = tool_window_cycles(trace, window_end);
+
+		fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%zu,\"args\":{\"name\":", t ? ",\n" : "", t + 1);
+		tool_json_string(file, names[t]);
+		fputs("}}", file);
+
+		aggregate_window(trace, begin, end, [&](const aggregate_span& span)
+		{
+			if (max_depth >= 0 && (int)span.depth > max_depth)
+				return;
+
+			const char* name = profiler_trace_name(trace, span.id);
+
+			fputs(",\n{\"name\":", file);
+			tool_json_string(file, name ? name : "scope_" + std::to_string(span.id));
+			fprintf(file, ",\"ph\":\"X\",\"pid\":%zu,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+					t + 1, span.thread,
+					profiler_trace_seconds(trace, span.begin - std::min(span.begin, trace->header->start_cycles)) * 1e6,
+					profiler_trace_seconds(trace, span.end - span.begin) * 1e6);
+		},
+		[&](const aggregate_flow& flow)
+		{
+			const char* name = profiler_trace_name(trace, flow.id);
+			bool begins = flow.type == PROFILER_TRACE_EVENT_ASYNC_BEGIN;
+			double ts = profiler_trace_seconds(trace, flow.cycles - std::min(flow.cycles, trace->header->start_cycles)) * 1e6;
+
+			/* The latency as an async span, and an arrow from the call it began in to the one it ended in */
+			fputs(",\n{\"name\":", file);
+			tool_json_string(file, name ? name : "scope_" + std::to_string(flow.id));
+			fprintf(file, ",\"cat\":\"async\",\"ph\":\"%s\",\"id\":\"%zu.%" PRIu64 "\",\"pid\":%zu,\"tid\":%u,\"ts\":%.3f}",
+					begins ? "b" : "e", t + 1, flow.flow, t + 1, flow.thread, ts);
+
+			fputs(",\n{\"name\":", file);
+			tool_json_string(file, name ? name : "scope_" + std::to_string(flow.id));
+			fprintf(file, ",\"cat\":\"flow\",\"ph\":\"%s\",%s\"id\":\"%zu.%" PRIu64 "\",\"pid\":%zu,\"tid\":%u,\"ts\":%.3f}",
+					begins ? "s" : "f", begins ? "" : "\"bp\":\"e\",", t + 1, flow.flow, t + 1, flow.thread, ts);
+		});
+	}
+
+	fputs("\n]}\n", file);
+}
+
+static void tool_pb_varint(std::string& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out += (char)(value | 0x80);
+		value >>= 7;
+	}
+
+	out += (char)value;
+}
+
+static void tool_pb_uint(std::string& out, int field, uint64_t value)
+{
+	tool_pb_varint(out, (uint64_t)field << 3);
+	tool_pb_varint(out, value);
+}
+
+static void tool_pb_bytes(std::string& out, int field, const std::string& bytes)
+{
+	tool_pb_varint(out, ((uint64_t)field << 3) | 2);
+	tool_pb_varint(out, bytes.size());
+	out += bytes;
+}
+
+/* One field of the top-level Profile message, written as soon as it is built */
+static void tool_pb_write(FILE* file, int field, const std::string& message)
+{
+	std::string bytes;
+	tool_pb_bytes(bytes, field, message);
+	fwrite(bytes.data(), 1, bytes.size(), file);
+}
+
+static void tool_write_pprof(FILE* file, const tool_tree& tree)
+{
+	/* profile.proto field numbers */
+	enum { PROFILE_SAMPLE_TYPE = 1, PROFILE_SAMPLE = 2, PROFILE_LOCATION = 4, PROFILE_FUNCTION = 5, PROFILE_STRING_TABLE = 6, PROFILE_PERIOD_TYPE = 11, PROFILE_PERIOD = 12 };
+
+	std::vector<std::string> strings = { "", "calls", "count", "time", "nanoseconds" };
+	std::unordered_map<std::string, uint64_t> function_ids;
+	std::vector<uint64_t> node_function(tree.nodes.size(), 0);
+
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		std::unordered_map<std::string, uint64_t>::iterator it = function_ids.find(tree.nodes[i].name);
+		if (it == function_ids.end())
+		{
+			it = function_ids.emplace(tree.nodes[i].name, function_ids.size() + 1).first;
+			strings.push_back(tree.nodes[i].name);
+		}
+
+		node_function[i] = it->second;
+	}
+
+	std::string message;
+
+	tool_pb_uint(message, 1, 1);
+	tool_pb_uint(message, 2, 2);
+	tool_pb_write(file, PROFILE_SAMPLE_TYPE, message);
+
+	message.clear();
+	tool_pb_uint(message, 1, 3);
+	tool_pb_uint(message, 2, 4);
+	tool_pb_write(file, PROFILE_SAMPLE_TYPE, message);
+	tool_pb_write(file, PROFILE_PERIOD_TYPE, message);
+
+	message.clear();
+	tool_pb_uint(message, PROFILE_PERIOD, 1);
+	fwrite(message.data(), 1, message.size(), file);
+
+	std::vector<double> children_seconds = tool_children_seconds(tree);
+
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		/* Sample { repeated uint64 location_id = 1; repeated int64 value = 2; }, leaf first */
+		std::string locations;
+		uint32_t id;
+		for (id = (uint32_t)i; id; id = tree.nodes[id].parent)
+			tool_pb_varint(locations, node_function[id]);
+
+		std::string values;
+		tool_pb_varint(values, tree.nodes[i].calls);
+		tool_pb_varint(values, (uint64_t)(tool_self_seconds(tree, children_seconds, (uint32_t)i) * 1e9));
+
+		message.clear();
+		tool_pb_bytes(message, 1, locations);
+		tool_pb_bytes(message, 2, values);
+		tool_pb_write(file, PROFILE_SAMPLE, message);
+	}
+
+	/* One function and one location with the same id per scope name */
+	for (i = 5; i < strings.size(); i++)
+	{
+		uint64_t function_id = i - 4;
+
+		message.clear();
+		tool_pb_uint(message, 1, function_id);
+		tool_pb_uint(message, 2, i);
+		tool_pb_uint(message, 3, i);
+		tool_pb_write(file, PROFILE_FUNCTION, message);
+
+		std::string line;
+		tool_pb_uint(line, 1, function_id);
+
+		message.clear();
+		tool_pb_uint(message, 1, function_id);
+		tool_pb_bytes(message, 4, line);
+		tool_pb_write(file, PROFILE_LOCATION, message);
+	}
+
+	for (const std::string& string : strings)
+		tool_pb_write(file, PROFILE_STRING_TABLE, string);
+}
+
+static size_t tool_align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static void tool_write_zeros(FILE* file, size_t count)
+{
+	static const char zeros[8] = { 0 };
+	fwrite(zeros, 1, count, file);
+}
+
+static void tool_write_snapshot(FILE* file, const tool_tree& tree)
+{
+	uint32_t node_count = (uint32_t)tree.nodes.size() - 1;
+
+	size_t strings_size = 0;
+	size_t i;
+	for (i = 1; i < tree.nodes.size(); i++)
+		strings_size += tree.nodes[i].name.size() + 1;
+
+	size_t node_table_offset = tool_align8(sizeof(struct profiler_snapshot_header));
+	size_t string_table_offset = node_table_offset + (size_t)node_count * sizeof(struct profiler_snapshot_node);
+	size_t histogram_offset = tool_align8(string_table_offset + strings_size);
+
+	struct profiler_snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PROFILER_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = PROFILER_SNAPSHOT_VERSION;
+	header.header_size = sizeof(struct profiler_snapshot_header);
+	header.clock_source = PROFILER_CLOCK_RDTSC;
+	header.node_size = sizeof(struct profiler_snapshot_node);
+	header.cycles_per_second = tree.cycles_per_second;
+	header.node_count = node_count;
+	header.histogram_buckets = tree.histogram_buckets;
+	header.thread_count = tree.thread_count;
+	header.node_table_offset = node_table_offset;
+	header.string_table_offset = string_table_offset;
+	header.string_table_size = strings_size;
+	header.histogram_offset = histogram_offset;
+	header.size = histogram_offset + (size_t)node_count * tree.histogram_buckets * sizeof(uint64_t);
+	header.dropped_calls = tree.dropped_calls;
+	header.dropped_threads = tree.dropped_threads;
+	header.dropped_events = tree.dropped_events;
+
+	fwrite(&header, sizeof(header), 1, file);
+	tool_write_zeros(file, node_table_offset - sizeof(header));
+
+	/* The tree is in depth-first order, so subtree ends follow from the depths */
+	std::vector<uint32_t> subtree_end(tree.nodes.size(), node_count);
+	std::vector<uint32_t> open;
+
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		while (!open.empty() && tree.nodes[open.back()].depth >= tree.nodes[i].depth)
+		{
+			subtree_end[open.back()] = (uint32_t)i - 1;
+			open.pop_back();
+		}
+
+		open.push_back((uint32_t)i);
+	}
+
+	uint32_t name_offset = 0;
+
+	for (i = 1; i < tree.nodes.size(); i++)
+	{
+		const tool_node& node = tree.nodes[i];
+
+		struct profiler_snapshot_node record;
+		record.total_cycles = (uint64_t)(node.seconds * (double)tree.cycles_per_second);
+		record.calls = node.calls;
+		record.parent = (int32_t)node.parent - 1;
+		record.name_offset = name_offset;
+		record.depth = node.depth;
+		record.subtree_end = subtree_end[i];
+		record.migrations = node.migrations;
+		record.suspended_cycles = (uint64_t)(node.suspended_seconds * (double)tree.cycles_per_second);
+		record.blocked_cycles = (uint64_t)(node.blocked_seconds * (double)tree.cycles_per_second);
+		record.io_calls = node.io_calls;
+		record.io_bytes = node.io_bytes;
+		record.io_cycles = (uint64_t)(node.io_seconds * (double)tree.cycles_per_second);
+		record.syncs = node.syncs;
+		record.sync_cycles = (uint64_t)(node.sync_seconds * (double)tree.cycles_per_second);
+
+		fwrite(&record, sizeof(record), 1, file);
+		name_offset += (uint32_t)node.name.size() + 1;
+	}
+
+	for (i = 1; i < tree.nodes.size(); i++)
+		fwrite(tree.nodes[i].name.c_str(), 1, tree.nodes[i].name.size() + 1, file);
+
+	tool_write_zeros(file, histogram_offset - string_table_offset - strings_size);
+
+	if (tree.histogram_buckets)
+	{
+		std::vector<uint64_t> empty(tree.histogram_buckets, 0);
+
+		for (i = 1; i < tree.nodes.size(); i++)
+		{
+			const std::vector<uint64_t>& histogram = tree.nodes[i].histogram.empty() ? empty : tree.nodes[i].histogram;
+			fwrite(histogram.data(), sizeof(uint64_t), tree.histogram_buckets, file);
+		}
+	}
+}
+
+static void tool_usage()
+{
+	fprintf(stderr,
+			"usage: smallprofiler [--format text|json|folded|chrome|pprof|snapshot] [-o file]\n"
+			"                     [--root path] [--max-depth N] [--min-percent X] [--jobs N]\n"
+			"                     [--window start:end]\n"
+			"                     input.spsnap|input.sptrace...\n");
+}
+
+int main(int argc, char** argv)
+{
+	tool_format format = TOOL_FORMAT_TEXT;
+	const char* output = NULL;
+	const char* root = NULL;
+	int max_depth = -1;
+	double min_percent = 0.0;
+	int jobs = (int)std::thread::hardware_concurrency();
+	const char* window = NULL;
+	double window_begin = 0.0;
+	double window_end = INFINITY;
+	std::vector<const char*> inputs;
+
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+		{
+			const char* formats[] = { "text", "json", "folded", "chrome", "pprof", "snapshot" };
+			const char* name = argv[++i];
+
+			int f;
+			for (f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++)
+			{
+				if (strcmp(name, formats[f]) == 0)
+					break;
+			}
+
+			if (f == (int)(sizeof(formats) / sizeof(formats[0])))
+			{
+				tool_usage();
+				return 1;
+			}
+
+			format = (tool_format)f;
+		}
+		else if ((strcmp(argv[i], "--output") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc)
+			output = argv[++i];
+		else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc)
+			root = argv[++i];
+		else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+			max_depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--min-percent") == 0 && i + 1 < argc)
+			min_percent = atof(argv[++i]);
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc && strchr(argv[i + 1], ':'))
+		{
+			window = argv[++i];
+
+			const char* separator = strchr(window, ':');
+			if (separator != window)
+				window_begin = atof(window);
+			if (separator[1])
+				window_end = atof(separator + 1);
+		}
+		else if (argv[i][0] != '-')
+			inputs.push_back(argv[i]);
+		else
+		{
+			tool_usage();
+			return 1;
+		}
+	}
+
+	if (inputs.empty())
+	{
+		tool_usage();
+		return 1;
+	}
+
+	std::vector<struct profiler_snapshot> snapshots;
+	std::vector<struct profiler_trace> traces;
+	std::vector<const char*> trace_inputs;
+	uint64_t cycles_per_second = 0;
+	uint32_t histogram_buckets = 0;
+
+	for (const char* input : inputs)
+	{
+		struct profiler_snapshot snapshot;
+		struct profiler_trace trace;
+
+		if (profiler_snapshot_open(&snapshot, input))
+		{
+			snapshots.push_back(snapshot);
+			histogram_buckets = std::max(histogram_buckets, snapshot.header->histogram_buckets);
+
+			if (!cycles_per_second)
+				cycles_per_second = snapshot.header->cycles_per_second;
+		}
+		else if (profiler_trace_open(&trace, input))
+		{
+			traces.push_back(trace);
+			trace_inputs.push_back(input);
+			histogram_buckets = AGGREGATE_HISTOGRAM_BUCKETS;
+
+			if (!cycles_per_second)
+				cycles_per_second = trace.header->cycles_per_second;
+		}
+		else
+		{
+			fprintf(stderr, "smallprofiler: %s is not a readable snapshot or trace\n", input);
+			return 1;
+		}
+	}
+
+	if (window && !snapshots.empty())
+	{
+		fprintf(stderr, "smallprofiler: --window needs traces, snapshots have no timeline\n");
+		return 1;
+	}
+
+	if (format == TOOL_FORMAT_CHROME && snapshots.empty())
+	{
+		FILE* file = output ? fopen(output, "wb") : stdout;
+		if (!file)
+		{
+			fprintf(stderr, "smallprofiler: could not write %s\n", output);
+			return 1;
+		}
+
+		setvbuf(file, NULL, _IOFBF, TOOL_OUTPUT_BUFFER_SIZE);
+		tool_write_chrome_timeline(file, traces, trace_inputs, window_begin, window_end, max_depth);
+
+		int failed = ferror(file);
+		failed |= output ? fclose(file) : fflush(file);
+
+		for (struct profiler_trace& trace : traces)
+			profiler_trace_close(&trace);
+
+		if (failed)
+		{
+			fprintf(stderr, "smallprofiler: could not write %s\n", output ? output : "output");
+			return 1;
+		}
+
+		return 0;
+	}
+
+	jobs = std::max(jobs, 1);
+	int snapshot_jobs = std::max(1, std::min(jobs, (int)snapshots.size()));
+
+	std::vector<tool_tree> trees(snapshot_jobs);
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next_input(0);
+
+	for (i = 0; i < snapshot_jobs; i++)
+	{
+		tool_tree_init(trees[i], cycles_per_second, histogram_buckets);
+
+		workers.emplace_back([&, i]()
+		{
+			size_t input;
+			while ((input = next_input.fetch_add(1)) < snapshots.size())
+				tool_tree_add_snapshot(trees[i], &snapshots[input]);
+		});
+	}
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	for (i = 1; i < snapshot_jobs; i++)
+		tool_tree_merge(trees[0], trees[i]);
+
+	for (struct profiler_snapshot& snapshot : snapshots)
+		profiler_snapshot_close(&snapshot);
+
+	size_t t;
+	for (t = 0; t < traces.size(); t++)
+	{
+		aggregate_result result;
+
+		if (window)
+		{
+			const struct profiler_trace* trace = &traces[t];
+			uint64_t begin = tool_window_cycles(trace, window_begin);
+			uint64_t end = tool_window_cycles(trace, window_end);
+
+			aggregate_trace_window(trace, begin, end, result);
+
+			if (!profiler_trace_index_thread_count(trace))
+				fprintf(stderr, "smallprofiler: %s has no time index, it was decoded from the start\n", trace_inputs[t]);
+		}
+		else
+			aggregate_trace(&traces[t], jobs, result);
+		tool_tree_add_trace(trees[0], &traces[t], result);
+
+		if (!traces[t].names)
+			fprintf(stderr, "smallprofiler: %s was not ended, scopes have no names\n", trace_inputs[t]);
+
+		if (result.damaged)
+			fprintf(stderr, "smallprofiler: %s: %" PRIu64 " chunks could not be decompressed\n", trace_inputs[t], result.damaged);
+
+		if (result.unmatched)
+			fprintf(stderr, "smallprofiler: %s: %" PRIu64 " scopes without a begin or end were skipped\n", trace_inputs[t], result.unmatched);
+
+		profiler_trace_close(&traces[t]);
+	}
+
+	tool_tree filtered;
+	if (!tool_tree_filter(trees[0], filtered, root, max_depth, min_percent))
+	{
+		fprintf(stderr, "smallprofiler: no scope with the path %s\n", root);
+		return 1;
+	}
+
+	FILE* file = output ? fopen(output, "wb") : stdout;
+	if (!file)
+	{
+		fprintf(stderr, "smallprofiler: could not write %s\n", output);
+		return 1;
+	}
+
+	setvbuf(file, NULL, _IOFBF, TOOL_OUTPUT_BUFFER_SIZE);
+
+	switch (format)
+	{
+	case TOOL_FORMAT_TEXT:
+		tool_write_text(file, filtered);
+		break;
+	case TOOL_FORMAT_JSON:
+		tool_write_json(file, filtered);
+		break;
+	case TOOL_FORMAT_FOLDED:
+		tool_write_folded(file, filtered);
+		break;
+	case TOOL_FORMAT_CHROME:
+		tool_write_chrome(file, filtered);
+		break;
+	case TOOL_FORMAT_PPROF:
+		tool_write_pprof(file, filtered);
+		break;
+	case TOOL_FORMAT_SNAPSHOT:
+		tool_write_snapshot(file, filtered);
+		break;
+	}
+
+	int failed = ferror(file);
+
+	if (output)
+		failed |= fclose(file);
+	else
+		failed |= fflush(file);
+
+	if (failed)
+	{
+		fprintf(stderr, "smallprofiler: could not write %s\n", output ? output : "output");
+		return 1;
+	}
+
+	return 0;
+}
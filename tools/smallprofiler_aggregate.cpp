@@ -0,0 +1,545 @@
+#include "smallprofiler_aggregate.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct aggregate_open
+{
+	uint32_t id;
+	uint64_t cycles;
+};
+
+struct aggregate_chunk
+{
+	uint64_t offset;
+	uint32_t thread;
+	uint32_t sequence;
+
+	/* Ends of scopes opened in an earlier chunk, in order, and scopes still open at the end */
+	std::vector<aggregate_open> leading_ends;
+	std::vector<aggregate_open> trailing_begins;
+
+	/* Async begins and ends, paired with those of every other chunk at the end */
+	std::vector<aggregate_flow> flows;
+};
+
+struct aggregate_worker
+{
+	std::mutex lock;
+	std::deque<size_t> tasks;
+	std::vector<aggregate_scope> scopes;
+	uint64_t unmatched;
+	uint64_t damaged;
+};
+
+static int aggregate_log2(uint64_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value | 1);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value | 1);
+#endif
+}
+
+static void aggregate_add(std::vector<aggregate_scope>& scopes, uint32_t id, uint64_t cycles)
+{
+	if (id >= scopes.size())
+		scopes.resize((size_t)id + 1, aggregate_scope());
+
+	aggregate_scope& scope = scopes[id];
+	scope.total_cycles += cycles;
+	scope.calls++;
+	scope.histogram[aggregate_log2(cycles)]++;
+}
+
+/*
+*	Pair an end event with the innermost open scope of the same id. Scopes
+*	above it lost their end event and are dropped. Returns false if no open
+*	scope matches.
+*/
+static bool aggregate_close(std::vector<aggregate_open>& stack, std::vector<aggregate_scope>& scopes, uint32_t id, uint64_t cycles, uint64_t& unmatched)
+{
+	size_t depth = stack.size();
+	while (depth > 0 && stack[depth - 1].id != id)
+		depth--;
+
+	if (depth == 0)
+		return false;
+
+	unmatched += stack.size() - depth;
+	aggregate_add(scopes, id, cycles - stack[depth - 1].cycles);
+	stack.resize(depth - 1);
+
+	return true;
+}
+
+#ifdef _WIN32
+static void aggregate_release(const struct profiler_trace*, const struct profiler_trace_chunk*)
+{
+}
+#else
+/* Drop the pages of an aggregated chunk from the mapping, so the resident set stays bounded */
+static void aggregate_release(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk)
+{
+	if (!trace->mapping)
+		return;
+
+	static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+	uintptr_t begin = ((uintptr_t)chunk + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)chunk + trace->header->chunk_header_size + chunk->size) & ~(page - 1);
+
+	if (end > begin)
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+}
+#endif
+
+/* Add every async scope whose begin and end are both in `flows`, the halves without the other are unmatched */
+static void aggregate_pair_flows(std::vector<aggregate_flow>& flows, aggregate_result& result)
+{
+	std::sort(flows.begin(), flows.end(), [](const aggregate_flow& a, const aggregate_flow& b)
+	{
+		if (a.flow != b.flow)
+			return a.flow < b.flow;
+
+		return a.type < b.type;
+	});
+
+	size_t i;
+	for (i = 0; i < flows.size(); i++)
+	{
+		if (i + 1 < flows.size() && flows[i].flow == flows[i + 1].flow && flows[i].type == PROFILER_TRACE_EVENT_ASYNC_BEGIN &&
+			flows[i + 1].type == PROFILER_TRACE_EVENT_ASYNC_END && flows[i + 1].cycles >= flows[i].cycles)
+		{
+			aggregate_add(result.scopes, flows[i + 1].id, flows[i + 1].cycles - flows[i].cycles);
+			i++;
+		}
+		else
+		{
+			result.unmatched++;
+		}
+	}
+}
+
+static void aggregate_chunk_run(const struct profiler_trace* trace, aggregate_chunk& task, aggregate_worker& worker,
+								struct profiler_trace_decoder& decoder, std::atomic<uint64_t>& events)
+{
+	const struct profiler_trace_chunk* chunk = profiler_trace_chunk_at(trace, task.offset);
+	std::vector<aggregate_open> stack;
+
+	struct profiler_trace_event event;
+	uint64_t count = 0;
+
+	if (!profiler_trace_chunk_decoder(trace, chunk, &decoder))
+		worker.damaged++;
+
+	/* Ring slots of a trace that was never ended do not know their count */
+	for (; profiler_trace_decoder_next(&decoder, &event); count++)
+	{
+		if (event.type == PROFILER_TRACE_EVENT_BEGIN)
+		{
+			aggregate_open open = { event.id, event.cycles };
+			stack.push_back(open);
+		}
+		else if (event.type == PROFILER_TRACE_EVENT_END && !aggregate_close(stack, worker.scopes, event.id, event.cycles, worker.unmatched))
+		{
+			/* Opened before this chunk, everything open here was dropped */
+			worker.unmatched += stack.size();
+			stack.clear();
+
+			aggregate_open end = { event.id, event.cycles };
+			task.leading_ends.push_back(end);
+		}
+		else if (event.type == PROFILER_TRACE_EVENT_ASYNC_BEGIN || event.type == PROFILER_TRACE_EVENT_ASYNC_END)
+		{
+			aggregate_flow flow = { chunk->thread, event.id, event.type, event.flow, event.cycles };
+			task.flows.push_back(flow);
+		}
+	}
+
+	task.trailing_begins = stack;
+	events += count;
+
+	aggregate_release(trace, chunk);
+}
+
+static void aggregate_worker_run(const struct profiler_trace* trace, std::vector<aggregate_chunk>& tasks,
+								 std::vector<aggregate_worker>& workers, size_t self, std::atomic<uint64_t>& events)
+{
+	std::unique_ptr<struct profiler_trace_decoder> decoder(new struct profiler_trace_decoder);
+	profiler_trace_decoder_create(decoder.get());
+
+	for (;;)
+	{
+		size_t task = SIZE_MAX;
+
+		{
+			std::lock_guard<std::mutex> guard(workers[self].lock);
+			if (!workers[self].tasks.empty())
+			{
+				task = workers[self].tasks.back();
+				workers[self].tasks.pop_back();
+			}
+		}
+
+		/* Steal the oldest task of another worker, no tasks are ever added so an empty round means done */
+		size_t victim;
+		for (victim = 1; task == SIZE_MAX && victim < workers.size(); victim++)
+		{
+			aggregate_worker& other = workers[(self + victim) % workers.size()];
+			std::lock_guard<std::mutex> guard(other.lock);
+
+			if (!other.tasks.empty())
+			{
+				task = other.tasks.front();
+				other.tasks.pop_front();
+			}
+		}
+
+		if (task == SIZE_MAX)
+			break;
+
+		aggregate_chunk_run(trace, tasks[task], workers[self], *decoder, events);
+	}
+
+	profiler_trace_decoder_free(decoder.get());
+}
+
+void aggregate_trace(const struct profiler_trace* trace, int jobs, aggregate_result& result)
+{
+	std::vector<aggregate_chunk> tasks;
+
+	uint64_t offset = profiler_trace_first_chunk(trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while ((chunk = profiler_trace_chunk_at(trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			aggregate_chunk task;
+			task.offset = offset;
+			task.thread = chunk->thread;
+			task.sequence = chunk->sequence;
+			tasks.push_back(task);
+		}
+
+		offset = profiler_trace_chunk_next(trace, chunk, offset);
+	}
+
+	std::vector<aggregate_worker> workers(std::max(jobs, 1));
+	std::atomic<uint64_t> events(0);
+
+	/* Consecutive chunks go to the same worker, so its deque is mostly in file order */
+	size_t i;
+	for (i = 0; i < tasks.size(); i++)
+		workers[i * workers.size() / tasks.size()].tasks.push_back(i);
+
+	for (aggregate_worker& worker : workers)
+	{
+		worker.unmatched = 0;
+		worker.damaged = 0;
+		std::reverse(worker.tasks.begin(), worker.tasks.end());
+	}
+
+	std::vector<std::thread> threads;
+	for (i = 1; i < workers.size(); i++)
+		threads.emplace_back(aggregate_worker_run, trace, std::ref(tasks), std::ref(workers), i, std::ref(events));
+
+	aggregate_worker_run(trace, tasks, workers, 0, events);
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	result.scopes.assign(profiler_trace_name_count(trace), aggregate_scope());
+	result.chunks = tasks.size();
+	result.events = events;
+	result.unmatched = 0;
+	result.damaged = 0;
+
+	for (aggregate_worker& worker : workers)
+	{
+		if (worker.scopes.size() > result.scopes.size())
+			result.scopes.resize(worker.scopes.size(), aggregate_scope());
+
+		size_t id;
+		for (id = 0; id < worker.scopes.size(); id++)
+		{
+			aggregate_scope& scope = result.scopes[id];
+			scope.total_cycles += worker.scopes[id].total_cycles;
+			scope.calls += worker.scopes[id].calls;
+
+			int bucket;
+			for (bucket = 0; bucket < AGGREGATE_HISTOGRAM_BUCKETS; bucket++)
+				scope.histogram[bucket] += worker.scopes[id].histogram[bucket];
+		}
+
+		result.unmatched += worker.unmatched;
+		result.damaged += worker.damaged;
+	}
+
+	/* Pair the scopes that span chunks, walking every thread's chunks in sequence */
+	std::vector<size_t> order(tasks.size());
+	for (i = 0; i < tasks.size(); i++)
+		order[i] = i;
+
+	std::sort(order.begin(), order.end(), [&tasks](size_t a, size_t b)
+	{
+		if (tasks[a].thread != tasks[b].thread)
+			return tasks[a].thread < tasks[b].thread;
+
+		return tasks[a].sequence < tasks[b].sequence;
+	});
+
+	std::vector<aggregate_open> stack;
+
+	for (i = 0; i < order.size(); i++)
+	{
+		const aggregate_chunk& task = tasks[order[i]];
+		bool continues = i > 0 && tasks[order[i - 1]].thread == task.thread && tasks[order[i - 1]].sequence + 1 == task.sequence;
+
+		if (!continues)
+		{
+			result.unmatched += stack.size();
+			stack.clear();
+		}
+
+		for (const aggregate_open& end : task.leading_ends)
+		{
+			if (!aggregate_close(stack, result.scopes, end.id, end.cycles, result.unmatched))
+				result.unmatched++;
+		}
+
+		stack.insert(stack.end(), task.trailing_begins.begin(), task.trailing_begins.end());
+	}
+
+	result.unmatched += stack.size();
+
+	/* Pair the async scopes by flow, wherever their begin and end were recorded */
+	std::vector<aggregate_flow> flows;
+	for (aggregate_chunk& task : tasks)
+	{
+		flows.insert(flows.end(), task.flows.begin(), task.flows.end());
+		std::vector<aggregate_flow>().swap(task.flows);
+	}
+
+	aggregate_pair_flows(flows, result);
+}
+
+/* Decode one chunk of a window, returns false once the window is passed */
+static bool aggregate_window_chunk(const struct profiler_trace* trace, const struct profiler_trace_chunk* chunk, struct profiler_trace_decoder& decoder,
+								   std::vector<aggregate_open>& stack, uint64_t begin, uint64_t end, uint64_t& last_cycles,
+								   const std::function<void(const aggregate_span&)>& emit, const std::function<void(const aggregate_flow&)>& emit_flow)
+{
+	struct profiler_trace_event event;
+	profiler_trace_chunk_decoder(trace, chunk, &decoder);
+
+	while (profiler_trace_decoder_next(&decoder, &event))
+	{
+		if (event.cycles >= end)
+			return false;
+
+		last_cycles = event.cycles;
+
+		if (event.type == PROFILER_TRACE_EVENT_BEGIN)
+		{
+			aggregate_open open = { event.id, event.cycles };
+			stack.push_back(open);
+			continue;
+		}
+
+		if (event.type == PROFILER_TRACE_EVENT_ASYNC_BEGIN || event.type == PROFILER_TRACE_EVENT_ASYNC_END)
+		{
+			if (emit_flow && event.cycles >= begin)
+			{
+				aggregate_flow flow = { chunk->thread, event.id, event.type, event.flow, event.cycles };
+				emit_flow(flow);
+			}
+
+			continue;
+		}
+
+		if (event.type != PROFILER_TRACE_EVENT_END)
+			continue;
+
+		size_t depth = stack.size();
+		while (depth > 0 && stack[depth - 1].id != event.id)
+			depth--;
+
+		/* Dropped scopes above the match have no end, nothing is emitted for them */
+		if (depth == 0 || event.cycles < begin)
+		{
+			stack.resize(depth ? depth - 1 : 0);
+			continue;
+		}
+
+		aggregate_span span = { chunk->thread, event.id, (uint32_t)(depth - 1), std::max(stack[depth - 1].cycles, begin), event.cycles };
+		emit(span);
+		stack.resize(depth - 1);
+	}
+
+	return true;
+}
+
+/* Emit the scopes still open at `stop`, innermost first as if they ended there */
+static void aggregate_window_close(uint32_t thread, std::vector<aggregate_open>& stack, uint64_t begin, uint64_t stop, const std::function<void(const aggregate_span&)>& emit)
+{
+	while (!stack.empty())
+	{
+		const aggregate_open& open = stack.back();
+
+		if (stop >= begin)
+		{
+			aggregate_span span = { thread, open.id, (uint32_t)(stack.size() - 1), std::max(open.cycles, begin), stop };
+			emit(span);
+		}
+
+		stack.pop_back();
+	}
+}
+
+uint64_t aggregate_window(const struct profiler_trace* trace, uint64_t begin, uint64_t end, const std::function<void(const aggregate_span&)>& emit,
+						  const std::function<void(const aggregate_flow&)>& emit_flow)
+{
+	std::vector<aggregate_open> stack;
+	uint64_t chunks = 0;
+
+	std::unique_ptr<struct profiler_trace_decoder> decoder(new struct profiler_trace_decoder);
+	profiler_trace_decoder_create(decoder.get());
+
+	if (profiler_trace_index_thread_count(trace))
+	{
+		uint32_t slot;
+		for (slot = 0; slot < profiler_trace_index_thread_count(trace); slot++)
+		{
+			const struct profiler_trace_index_thread* thread = profiler_trace_index_thread(trace, slot);
+			const struct profiler_trace_index_entry* entries = profiler_trace_index_entries(trace, thread);
+
+			uint32_t entry = profiler_trace_index_find(trace, thread, begin);
+			if (entry == thread->entry_count || entries[entry].first_cycles >= end)
+				continue;
+
+			const struct profiler_trace_open_scope* open = profiler_trace_index_stack(trace, &entries[entry]);
+
+			stack.clear();
+			uint32_t depth;
+			for (depth = 0; open && depth < entries[entry].stack_depth; depth++)
+			{
+				aggregate_open scope = { open[depth].id, open[depth].cycles };
+				stack.push_back(scope);
+			}
+
+			uint64_t last_cycles = begin;
+			bool inside = true;
+
+			for (; inside && entry < thread->entry_count && entries[entry].first_cycles < end; entry++)
+			{
+				const struct profiler_trace_chunk* chunk = profiler_trace_chunk_at(trace, entries[entry].chunk_offset);
+				if (!chunk || !profiler_trace_chunk_is_events(chunk))
+					break;
+
+				inside = aggregate_window_chunk(trace, chunk, *decoder, stack, begin, end, last_cycles, emit, emit_flow);
+				chunks++;
+			}
+
+			/* Scopes continue past the window unless the thread's events ran out */
+			bool ran_out = entry == thread->entry_count && inside;
+			aggregate_window_close(thread->thread, stack, begin, ran_out ? std::min(end, last_cycles) : end, emit);
+		}
+
+		profiler_trace_decoder_free(decoder.get());
+		return chunks;
+	}
+
+	/* No index, decode every thread's chunks in sequence from the start */
+	std::vector<aggregate_chunk> tasks;
+
+	uint64_t offset = profiler_trace_first_chunk(trace);
+	const struct profiler_trace_chunk* chunk;
+
+	while ((chunk = profiler_trace_chunk_at(trace, offset)) != NULL)
+	{
+		if (profiler_trace_chunk_is_events(chunk))
+		{
+			aggregate_chunk task;
+			task.offset = offset;
+			task.thread = chunk->thread;
+			task.sequence = chunk->sequence;
+			tasks.push_back(task);
+		}
+
+		offset = profiler_trace_chunk_next(trace, chunk, offset);
+	}
+
+	std::stable_sort(tasks.begin(), tasks.end(), [](const aggregate_chunk& a, const aggregate_chunk& b)
+	{
+		if (a.thread != b.thread)
+			return a.thread < b.thread;
+
+		return a.sequence < b.sequence;
+	});
+
+	size_t i = 0;
+	while (i < tasks.size())
+	{
+		uint32_t thread = tasks[i].thread;
+		uint64_t last_cycles = begin;
+		bool inside = true;
+
+		stack.clear();
+
+		for (; i < tasks.size() && tasks[i].thread == thread; i++)
+		{
+			if (inside)
+			{
+				inside = aggregate_window_chunk(trace, profiler_trace_chunk_at(trace, tasks[i].offset), *decoder, stack, begin, end, last_cycles, emit, emit_flow);
+				chunks++;
+			}
+		}
+
+		aggregate_window_close(thread, stack, begin, inside ? std::min(end, last_cycles) : end, emit);
+	}
+
+	profiler_trace_decoder_free(decoder.get());
+	return chunks;
+}
+
+void aggregate_trace_window(const struct profiler_trace* trace, uint64_t begin, uint64_t end, aggregate_result& result)
+{
+	result.scopes.assign(profiler_trace_name_count(trace), aggregate_scope());
+	result.events = 0;
+	result.unmatched = 0;
+	result.damaged = 0;
+
+	/* Async scopes only count when they begin and end inside the window */
+	std::vector<aggregate_flow> flows;
+
+	result.chunks = aggregate_window(trace, begin, end, [&result](const aggregate_span& span)
+	{
+		aggregate_add(result.scopes, span.id, span.end - span.begin);
+		result.events += 2;
+	},
+	[&result, &flows](const aggregate_flow& flow)
+	{
+		flows.push_back(flow);
+		result.events++;
+	});
+
+	aggregate_pair_flows(flows, result);
+}
@@ -0,0 +1,97 @@
+/*
+*	Aggregation of event traces into per-scope statistics
+*
+*	A trace is a sequence of chunks, each holding one block of events of one
+*	thread. Chunks are aggregated independently on a work-stealing thread pool:
+*	every worker pairs the begin and end events inside a chunk with a local
+*	stack and adds the durations to its own per-scope table. Ends whose begin
+*	lies in an earlier chunk of the same thread, and begins that are still
+*	open at the end of a chunk, are kept per chunk (at most the nesting depth)
+*	and paired in a short sequential pass over every thread's chunks at the end.
+*	The two halves of async scopes, which may be on different threads, are
+*	kept per chunk too and paired by their flow in that pass.
+*
+*	Memory use is bounded by the number of scopes times the number of workers
+*	plus the open scopes of every chunk and the async events, whatever the
+*	size of the trace. Pages
+*	of the memory mapped trace are released once their chunk is aggregated.
+*
+*	A time window is decoded through the time index of the trace: every thread
+*	seeks to the first chunk that reaches the window, starts from the scopes the
+*	index says were open there and stops at the first chunk after the window,
+*	so the cost depends on the size of the window rather than of the trace.
+*	Traces without an index are decoded from the start.
+*/
+
+#ifndef _SMALLPROFILER_AGGREGATE_
+#define _SMALLPROFILER_AGGREGATE_
+
+#include "smallprofiler_trace.h"
+
+#include <functional>
+#include <vector>
+
+#define AGGREGATE_HISTOGRAM_BUCKETS 64
+
+struct aggregate_scope
+{
+	uint64_t total_cycles;
+	uint64_t calls;
+	uint64_t histogram[AGGREGATE_HISTOGRAM_BUCKETS];
+};
+
+struct aggregate_result
+{
+	/* Indexed by scope id */
+	std::vector<aggregate_scope> scopes;
+
+	uint64_t chunks;
+	uint64_t events;
+
+	/* Ends without a begin and begins without an end, e.g. scopes that were open when the trace began or ended */
+	uint64_t unmatched;
+
+	/* Chunks that could not be decompressed */
+	uint64_t damaged;
+};
+
+/* One call of a scope, clipped to the window it was decoded for */
+struct aggregate_span
+{
+	uint32_t thread;
+	uint32_t id;
+
+	/* Number of enclosing scopes on the same thread */
+	uint32_t depth;
+
+	uint64_t begin;
+	uint64_t end;
+};
+
+/* The begin or the end of an async scope, the two have the same flow */
+struct aggregate_flow
+{
+	uint32_t thread;
+	uint32_t id;
+	uint32_t type;
+	uint64_t flow;
+	uint64_t cycles;
+};
+
+/* Aggregate every events chunk of `trace` on `jobs` threads */
+void aggregate_trace(const struct profiler_trace* trace, int jobs, aggregate_result& result);
+
+/*
+*	Call `emit` for every scope that overlaps the cycles [begin, end), thread by
+*	thread in the order the scopes end. Scopes still open when their thread's
+*	events run out end at its last event. `emit_flow`, if set, is called for
+*	every async begin and end inside the window. Returns the number of chunks
+*	decoded.
+*/
+uint64_t aggregate_window(const struct profiler_trace* trace, uint64_t begin, uint64_t end, const std::function<void(const aggregate_span&)>& emit,
+						  const std::function<void(const aggregate_flow&)>& emit_flow = nullptr);
+
+/* Aggregate the part of `trace` inside [begin, end), a call counts if it overlaps the window */
+void aggregate_trace_window(const struct profiler_trace* trace, uint64_t begin, uint64_t end, aggregate_result& result);
+
+#endif //_SMALLPROFILER_AGGREGATE_
@@ -0,0 +1,346 @@
+/*
+*	smallprofiler-diff
+*
+*	Compares two snapshots written with profiler_dump_snapshot and lists the
+*	scopes whose time changed the most:
+*
+*		smallprofiler-diff [options] before.spsnap after.spsnap
+*
+*		--sort self|inclusive|calls	what "impact" means, default self
+*		--limit N					print at most N rows, default 50
+*		--min-percent X				hide rows that changed less than X% (relative)
+*		--sigma K					with histograms, hide rows whose inclusive change is
+*									within K standard deviations of noise, whatever
+*									--sort is, default 3
+*		--show-noise				print the rows hidden by --sigma, marked with '~'
+*		--folded file				write a differential folded-stack file
+*
+*	Nodes are matched by call path, so scopes that moved in the tree show up as
+*	removed from one path and added to another. Times are converted to seconds
+*	with the calibration stored in each snapshot, so snapshots taken on
+*	different machines can be compared.
+*
+*	The folded file has one "path self_before self_after" line per path with the
+*	self times in microseconds, the input format of flamegraph.pl for
+*	differential flame graphs.
+*/
+
+#define PROFILER_SNAPSHOT_DEFINE
+#include "smallprofiler_snapshot.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct diff_side
+{
+	double self_seconds;
+	double inclusive_seconds;
+	uint64_t calls;
+
+	/* Seconds per call from the histograms, summed over every node of the path */
+	int has_histogram;
+	double histogram_calls;
+	double histogram_sum;
+	double histogram_sum_squares;
+};
+
+struct diff_row
+{
+	std::string path;
+	diff_side before;
+	diff_side after;
+	int noise;
+};
+
+enum diff_sort
+{
+	DIFF_SORT_SELF,
+	DIFF_SORT_INCLUSIVE,
+	DIFF_SORT_CALLS,
+};
+
+static void diff_histogram_stats(const struct profiler_snapshot* snapshot, uint32_t index, diff_side* side)
+{
+	const uint64_t* histogram = profiler_snapshot_histogram(snapshot, index);
+	if (!histogram)
+		return;
+
+	uint32_t bucket;
+	for (bucket = 0; bucket < snapshot->header->histogram_buckets; bucket++)
+	{
+		if (!histogram[bucket])
+			continue;
+
+		/* Middle of [2^b, 2^(b+1)), the spread inside a bucket is ignored */
+		double seconds = profiler_snapshot_seconds(snapshot, 1) * ldexp(1.5, (int)bucket);
+
+		side->has_histogram = 1;
+		side->histogram_calls += (double)histogram[bucket];
+		side->histogram_sum += (double)histogram[bucket] * seconds;
+		side->histogram_sum_squares += (double)histogram[bucket] * seconds * seconds;
+	}
+}
+
+/* Variance of the seconds per call over all the calls of the path */
+static double diff_call_variance(const diff_side& side)
+{
+	if (side.histogram_calls == 0.0)
+		return 0.0;
+
+	double mean = side.histogram_sum / side.histogram_calls;
+	return std::max(side.histogram_sum_squares / side.histogram_calls - mean * mean, 0.0);
+}
+
+static void diff_load(const struct profiler_snapshot* snapshot, int is_after, std::unordered_map<std::string, diff_row>& rows)
+{
+	/* Parents come before their children, so the path of the parent is always known */
+	std::vector<std::string> paths(profiler_snapshot_node_count(snapshot));
+
+	uint32_t index;
+	for (index = 0; index < profiler_snapshot_node_count(snapshot); index++)
+	{
+		struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, index);
+
+		paths[index] = node.parent >= 0 ? paths[(size_t)node.parent] + ";" : std::string();
+		paths[index] += profiler_snapshot_name(snapshot, index);
+
+		diff_row& row = rows[paths[index]];
+		diff_side& side = is_after ? row.after : row.before;
+
+		row.path = paths[index];
+		side.self_seconds += profiler_snapshot_seconds(snapshot, profiler_snapshot_self_cycles(snapshot, index));
+		side.inclusive_seconds += profiler_snapshot_seconds(snapshot, node.total_cycles);
+		side.calls += node.calls;
+		diff_histogram_stats(snapshot, index, &side);
+	}
+}
+
+/* Standard deviation of the difference in inclusive time that is expected from call-to-call variation alone */
+static double diff_noise(const diff_row& row)
+{
+	return sqrt((double)row.before.calls * diff_call_variance(row.before) + (double)row.after.calls * diff_call_variance(row.after));
+}
+
+static double diff_delta(const diff_row& row, diff_sort sort)
+{
+	switch (sort)
+	{
+	case DIFF_SORT_INCLUSIVE:
+		return row.after.inclusive_seconds - row.before.inclusive_seconds;
+	case DIFF_SORT_CALLS:
+		return (double)row.after.calls - (double)row.before.calls;
+	default:
+		return row.after.self_seconds - row.before.self_seconds;
+	}
+}
+
+static double diff_relative(double before, double after)
+{
+	if (before == 0.0)
+		return after == 0.0 ? 0.0 : INFINITY;
+
+	return 100.0 * (after - before) / before;
+}
+
+static int diff_write_folded(const char* filename, const std::vector<diff_row>& rows)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return 0;
+
+	for (const diff_row& row : rows)
+	{
+		fprintf(file, "%s %.0f %.0f\n",
+				row.path.c_str(),
+				row.before.self_seconds * 1e6,
+				row.after.self_seconds * 1e6);
+	}
+
+	fclose(file);
+	return 1;
+}
+
+static double diff_total(const struct profiler_snapshot* snapshot)
+{
+	double seconds = 0.0;
+
+	uint32_t index = 0;
+	while (index < profiler_snapshot_node_count(snapshot))
+	{
+		struct profiler_snapshot_node node = profiler_snapshot_get_node(snapshot, index);
+		seconds += profiler_snapshot_seconds(snapshot, node.total_cycles);
+		index = node.subtree_end;
+	}
+
+	return seconds;
+}
+
+static void diff_usage()
+{
+	fprintf(stderr,
+			"usage: smallprofiler-diff [--sort self|inclusive|calls] [--limit N] [--min-percent X]\n"
+			"                          [--sigma K] [--show-noise] [--folded file] before after\n");
+}
+
+int main(int argc, char** argv)
+{
+	diff_sort sort = DIFF_SORT_SELF;
+	size_t limit = 50;
+	double min_percent = 0.0;
+	double sigma = 3.0;
+	int show_noise = 0;
+	const char* folded = NULL;
+	const char* filenames[2] = { NULL, NULL };
+	int filename_count = 0;
+
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp(argv[i], "self") == 0)
+				sort = DIFF_SORT_SELF;
+			else if (strcmp(argv[i], "inclusive") == 0)
+				sort = DIFF_SORT_INCLUSIVE;
+			else if (strcmp(argv[i], "calls") == 0)
+				sort = DIFF_SORT_CALLS;
+			else
+			{
+				diff_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+			limit = (size_t)atol(argv[++i]);
+		else if (strcmp(argv[i], "--min-percent") == 0 && i + 1 < argc)
+			min_percent = atof(argv[++i]);
+		else if (strcmp(argv[i], "--sigma") == 0 && i + 1 < argc)
+			sigma = atof(argv[++i]);
+		else if (strcmp(argv[i], "--show-noise") == 0)
+			show_noise = 1;
+		else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc)
+			folded = argv[++i];
+		else if (argv[i][0] != '-' && filename_count < 2)
+			filenames[filename_count++] = argv[i];
+		else
+		{
+			diff_usage();
+			return 1;
+		}
+	}
+
+	if (filename_count != 2)
+	{
+		diff_usage();
+		return 1;
+	}
+
+	struct profiler_snapshot snapshots[2];
+	for (i = 0; i < 2; i++)
+	{
+		if (!profiler_snapshot_open(&snapshots[i], filenames[i]))
+		{
+			fprintf(stderr, "smallprofiler-diff: %s is not a readable snapshot\n", filenames[i]);
+			return 1;
+		}
+	}
+
+	std::unordered_map<std::string, diff_row> row_map;
+	diff_load(&snapshots[0], 0, row_map);
+	diff_load(&snapshots[1], 1, row_map);
+
+	std::vector<diff_row> rows;
+	rows.reserve(row_map.size());
+
+	for (std::pair<const std::string, diff_row>& entry : row_map)
+	{
+		diff_row& row = entry.second;
+		row.noise = 0;
+
+		/* The histograms hold inclusive times per call, so only the inclusive change can be told from noise */
+		if (row.before.has_histogram && row.after.has_histogram)
+		{
+			double delta = fabs(row.after.inclusive_seconds - row.before.inclusive_seconds);
+			row.noise = delta < sigma * diff_noise(row);
+		}
+
+		rows.push_back(row);
+	}
+
+	std::sort(rows.begin(), rows.end(), [sort](const diff_row& a, const diff_row& b)
+	{
+		double delta_a = fabs(diff_delta(a, sort));
+		double delta_b = fabs(diff_delta(b, sort));
+
+		if (delta_a != delta_b)
+			return delta_a > delta_b;
+
+		return a.path < b.path;
+	});
+
+	if (folded && !diff_write_folded(folded, rows))
+	{
+		fprintf(stderr, "smallprofiler-diff: could not write %s\n", folded);
+		return 1;
+	}
+
+	printf("before: %s, %u nodes, %.6f s\n", filenames[0], profiler_snapshot_node_count(&snapshots[0]), diff_total(&snapshots[0]));
+	printf("after:  %s, %u nodes, %.6f s\n\n", filenames[1], profiler_snapshot_node_count(&snapshots[1]), diff_total(&snapshots[1]));
+
+	printf("  %-12s %-9s %-12s %-9s %-11s %-9s %-12s %-12s %s\n",
+		   "Self delta", "Self %", "Incl delta", "Incl %", "Calls delta", "Calls %", "Self after", "Incl after", "Path");
+	printf("------------------------------------------------------------------------------------------------------------\n");
+
+	size_t printed = 0;
+	size_t hidden = 0;
+
+	for (const diff_row& row : rows)
+	{
+		if (printed >= limit)
+			break;
+
+		double delta = diff_delta(row, sort);
+		if (delta == 0.0)
+			continue;
+
+		double before = sort == DIFF_SORT_SELF ? row.before.self_seconds : sort == DIFF_SORT_INCLUSIVE ? row.before.inclusive_seconds : (double)row.before.calls;
+		double after = sort == DIFF_SORT_SELF ? row.after.self_seconds : sort == DIFF_SORT_INCLUSIVE ? row.after.inclusive_seconds : (double)row.after.calls;
+
+		if (fabs(diff_relative(before, after)) < min_percent || (row.noise && !show_noise))
+		{
+			hidden++;
+			continue;
+		}
+
+		printf("%c %+-12.6f %+-9.1f %+-12.6f %+-9.1f %+-11" PRId64 " %+-9.1f %-12.6f %-12.6f %s\n",
+			   row.noise ? '~' : ' ',
+			   row.after.self_seconds - row.before.self_seconds,
+			   diff_relative(row.before.self_seconds, row.after.self_seconds),
+			   row.after.inclusive_seconds - row.before.inclusive_seconds,
+			   diff_relative(row.before.inclusive_seconds, row.after.inclusive_seconds),
+			   (int64_t)(row.after.calls - row.before.calls),
+			   diff_relative((double)row.before.calls, (double)row.after.calls),
+			   row.after.self_seconds,
+			   row.after.inclusive_seconds,
+			   row.path.c_str());
+
+		printed++;
+	}
+
+	if (hidden)
+		printf("\n%zu rows hidden by --min-percent or as noise\n", hidden);
+
+	profiler_snapshot_close(&snapshots[0]);
+	profiler_snapshot_close(&snapshots[1]);
+
+	return 0;
+}